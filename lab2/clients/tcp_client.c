@@ -1,11 +1,51 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+
+#include "../histogram.h"
+#include "../tcp_log.h"
 
 #define MAXLINE 1024
 
+#define MAX_CONNECTIONS 10000
+#define MAX_SIZE_CLASSES 16
+#define MAX_MESSAGE_SIZE 65536
+#define MAX_BACKLOG_BYTES (1 << 20)
+#define DRAIN_MS 2000
+#define EPOLL_BATCH 256
+
+/* Output buffers are chains of segments; with MSG_ZEROCOPY a segment is reused only after the kernel is done with it. */
+#define SEGMENT_BYTES (128 * 1024)
+#define FREE_SEGMENTS 2
+/* Below this, pinning pages and the completion costs more than copying. */
+#define ZEROCOPY_MIN_SEND (16 * 1024)
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
 int send_all(int sockfd, const char *buf, size_t len) {
     size_t total = 0;
     while (total < len) {
@@ -16,31 +56,15 @@ int send_all(int sockfd, const char *buf, size_t len) {
     return 0;
 }
 
-int main(int argc, char **argv) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <server_ip> <port>\n", argv[0]);
-        return 1;
-    }
-
-    const char *server_ip = argv[1];
-    int port = atoi(argv[2]);
-
+/* The original mode: repeat one line from stdin on one connection every interval_ms. */
+static int repeat_line(const struct sockaddr_in *servaddr, int interval_ms) {
     int sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd < 0) {
         perror("socket");
         return 1;
     }
 
-    struct sockaddr_in servaddr = {0};
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_port = htons(port);
-    if (inet_pton(AF_INET, server_ip, &servaddr.sin_addr) <= 0) {
-        perror("inet_pton");
-        close(sockfd);
-        return 1;
-    }
-
-    if (connect(sockfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) {
+    if (connect(sockfd, (const struct sockaddr *)servaddr, sizeof(*servaddr)) < 0) {
         perror("connect");
         close(sockfd);
         return 1;
@@ -50,6 +74,8 @@ int main(int argc, char **argv) {
 
     if (fgets(line, sizeof(line), stdin) == NULL) {
         fprintf(stderr, "No input\n");
+        close(sockfd);
+        return 1;
     }
 
     size_t len = strlen(line);
@@ -58,17 +84,813 @@ int main(int argc, char **argv) {
         len--;
     }
 
-    int interval_ms = 1;
-
     while (1) {
         if (send_all(sockfd, line, len) < 0) {
             perror("send");
             break;
         }
-        usleep(interval_ms * 1000000);
+        usleep((useconds_t)interval_ms * 1000);
     }
 
     close(sockfd);
     printf("Disconnected.\n");
     return 0;
 }
+
+/*
+ * Load generator. Messages are scheduled open-loop: message k is due at
+ * a fixed time derived from the target rate (and the ramp), whatever
+ * happened to earlier messages. Lag is measured from that due time, not
+ * from when the generator got round to the message, so a stalled
+ * connection shows up in the latency instead of silently lowering the
+ * offered load (no coordinated omission).
+ */
+
+struct size_class {
+    unsigned min;
+    unsigned max;
+    unsigned weight;
+};
+
+struct load_config {
+    int connections;
+    double rate;
+    double duration;
+    double ramp;
+    unsigned seed;
+    const char *ack_mode;
+    int class_count;
+    struct size_class classes[MAX_SIZE_CLASSES];
+    unsigned total_weight;
+};
+
+/* A message still (partly) in a connection's output buffer, or written and waiting for its ack. */
+struct pending {
+    uint64_t end;
+    uint64_t due_ns;
+};
+
+struct segment {
+    struct segment *next;
+    size_t len;
+    size_t sent;
+    int zerocopy;
+    uint32_t zerocopy_last;
+    char data[SEGMENT_BYTES];
+};
+
+struct conn {
+    int fd;
+    int connected;
+    int dead;
+    int dirty;
+    struct segment *head;
+    struct segment *tail;
+    struct segment *free_segments;
+    int free_count;
+    /* Fully sent segments whose zerocopy sends have not all completed, oldest first. */
+    struct segment *zc_head;
+    struct segment *zc_tail;
+    uint32_t zc_next;
+    uint32_t zc_done;
+    uint64_t written;
+    uint64_t queued;
+    struct pending *msgs;
+    size_t msg_head;
+    size_t msg_count;
+    size_t msg_cap;
+    size_t msg_written;
+    char ack_buf[64];
+    size_t ack_len;
+};
+
+struct load_stats {
+    uint64_t scheduled;
+    uint64_t sent;
+    uint64_t bytes;
+    uint64_t connect_errors;
+    uint64_t send_errors;
+    uint64_t disconnects;
+    uint64_t backlog_drops;
+    uint64_t unsent;
+    uint64_t acked;
+    uint64_t unacked;
+    uint64_t send_calls;
+    uint64_t zc_sends;
+    uint64_t zc_completed;
+    uint64_t zc_copied;
+    uint64_t last_write_ns;
+    int last_errno;
+    struct histogram lag;
+    struct histogram ack;
+};
+
+static struct load_stats load;
+static int acked_mode;
+static int zerocopy;
+static int nodelay;
+static int cork;
+
+static uint64_t monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static uint64_t xorshift64(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+/*
+ * Parses a size distribution: comma-separated classes, each a size or a
+ * MIN-MAX range (uniform), optionally weighted with *W. "100*9,4000" sends
+ * 100-byte messages nine times out of ten and 4000-byte ones otherwise.
+ */
+static int parse_sizes(const char *spec, struct load_config *cfg) {
+    char copy[256];
+    snprintf(copy, sizeof(copy), "%s", spec);
+    cfg->class_count = 0;
+    cfg->total_weight = 0;
+
+    for (char *save = NULL, *tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        struct size_class c = {0, 0, 1};
+        char extra;
+        int n = sscanf(tok, "%u-%u*%u%c", &c.min, &c.max, &c.weight, &extra);
+        if (n < 2) {
+            c.weight = 1;
+            n = sscanf(tok, "%u*%u%c", &c.min, &c.weight, &extra);
+            if (n < 1 || n > 2) return -1;
+            c.max = c.min;
+        } else if (n > 3) {
+            return -1;
+        }
+        if (cfg->class_count == MAX_SIZE_CLASSES || c.min < 2 || c.max < c.min || c.max > MAX_MESSAGE_SIZE
+            || c.weight == 0) {
+            return -1;
+        }
+        cfg->classes[cfg->class_count++] = c;
+        cfg->total_weight += c.weight;
+    }
+    return cfg->class_count ? 0 : -1;
+}
+
+static unsigned pick_size(const struct load_config *cfg, uint64_t *rng) {
+    unsigned w = (unsigned)(xorshift64(rng) % cfg->total_weight);
+    const struct size_class *c = cfg->classes;
+    while (w >= c->weight) {
+        w -= c->weight;
+        c++;
+    }
+    return c->min + (unsigned)(xorshift64(rng) % (c->max - c->min + 1));
+}
+
+/* Square root without libm, for the ramp schedule. */
+static double newton_sqrt(double x) {
+    if (x <= 0) return 0;
+    double r = x > 1 ? x : 1;
+    for (int i = 0; i < 200; i++) {
+        double next = 0.5 * (r + x / r);
+        if (next >= r) break;
+        r = next;
+    }
+    return r;
+}
+
+/*
+ * Due time of message k, relative to the start. During the ramp the rate
+ * grows linearly from 0 to the target, so k messages have been due by
+ * t = sqrt(2 * ramp * k / rate); after it they are 1 / rate apart.
+ */
+static uint64_t due_ns(const struct load_config *cfg, uint64_t k) {
+    double ramp_msgs = cfg->rate * cfg->ramp / 2;
+    double t;
+    if ((double)k < ramp_msgs) {
+        t = newton_sqrt(2 * cfg->ramp * (double)k / cfg->rate);
+    } else {
+        t = cfg->ramp + ((double)k - ramp_msgs) / cfg->rate;
+    }
+    return (uint64_t)(t * 1e9);
+}
+
+static void conn_close(int epfd, struct conn *c) {
+    if (c->dead) return;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->dead = 1;
+    load.unsent += c->msg_count - c->msg_written;
+    load.unacked += c->msg_written;
+    c->msg_count = 0;
+    c->msg_written = 0;
+}
+
+static void free_chain(struct segment *seg) {
+    while (seg) {
+        struct segment *next = seg->next;
+        free(seg);
+        seg = next;
+    }
+}
+
+static void conn_free(struct conn *c) {
+    free_chain(c->head);
+    free_chain(c->free_segments);
+    free_chain(c->zc_head);
+    free(c->msgs);
+}
+
+static void segment_release(struct conn *c, struct segment *seg) {
+    if (c->free_count < FREE_SEGMENTS) {
+        seg->next = c->free_segments;
+        c->free_segments = seg;
+        c->free_count++;
+    } else {
+        free(seg);
+    }
+}
+
+static int zerocopy_pending(const struct conn *c, const struct segment *seg) {
+    return seg->zerocopy && (int32_t)(seg->zerocopy_last - c->zc_done) >= 0;
+}
+
+/* A fully sent segment is reused at once unless the kernel may still read it. */
+static void segment_retire(struct conn *c, struct segment *seg) {
+    seg->next = NULL;
+    if (!zerocopy_pending(c, seg)) {
+        segment_release(c, seg);
+    } else if (c->zc_tail) {
+        c->zc_tail->next = seg;
+        c->zc_tail = seg;
+    } else {
+        c->zc_head = c->zc_tail = seg;
+    }
+}
+
+/*
+ * Zerocopy completions arrive on the socket's error queue as ranges of
+ * send numbers. TCP completes them in order, so one counter is enough.
+ */
+static void drain_zerocopy(struct conn *c) {
+    char control[128];
+
+    while (1) {
+        struct msghdr msg = {0};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(c->fd, &msg, MSG_ERRQUEUE) < 0) break;
+
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+                && !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            struct sock_extended_err serr;
+            memcpy(&serr, CMSG_DATA(cmsg), sizeof(serr));
+            if (serr.ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr.ee_errno != 0) continue;
+            uint32_t n = serr.ee_data - serr.ee_info + 1;
+            load.zc_completed += n;
+            if (serr.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) load.zc_copied += n;
+            c->zc_done = serr.ee_data + 1;
+        }
+    }
+
+    while (c->zc_head && !zerocopy_pending(c, c->zc_head)) {
+        struct segment *seg = c->zc_head;
+        c->zc_head = seg->next;
+        if (!c->zc_head) c->zc_tail = NULL;
+        segment_release(c, seg);
+    }
+}
+
+static void set_cork(struct conn *c, int on) {
+    if (setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on)) < 0) perror("setsockopt TCP_CORK");
+}
+
+/*
+ * Writes as much of the backlog as the socket takes, a segment per send;
+ * lag is recorded when a message's last byte is written. In acknowledged
+ * mode the message then stays queued until its ack arrives. With -K the
+ * socket is corked for the whole flush so small records leave in full
+ * segments, and uncorking pushes out the remainder.
+ */
+static void conn_flush(int epfd, struct conn *c) {
+    c->dirty = 0;
+    if (c->dead || !c->connected) return;
+
+    if (cork) set_cork(c, 1);
+    int use_zerocopy = zerocopy;
+    struct segment *seg;
+    while ((seg = c->head)) {
+        /*
+         * A tail that was fully sent while the kernel still held it stays
+         * in place; once conn_append has chained more behind it, retire it.
+         */
+        if (seg->sent == seg->len) {
+            if (!seg->next) break;
+            c->head = seg->next;
+            segment_retire(c, seg);
+            continue;
+        }
+        size_t len = seg->len - seg->sent;
+        int flags = MSG_NOSIGNAL | (use_zerocopy && len >= ZEROCOPY_MIN_SEND ? MSG_ZEROCOPY : 0);
+        ssize_t n = send(c->fd, seg->data + seg->sent, len, flags);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            if (errno == EINTR) continue;
+            /* Too many completions outstanding: copy until some are reaped. */
+            if (errno == ENOBUFS && (flags & MSG_ZEROCOPY)) {
+                use_zerocopy = 0;
+                continue;
+            }
+            load.send_errors++;
+            load.last_errno = errno;
+            conn_close(epfd, c);
+            return;
+        }
+        load.send_calls++;
+        if (flags & MSG_ZEROCOPY) {
+            seg->zerocopy = 1;
+            seg->zerocopy_last = c->zc_next++;
+            load.zc_sends++;
+        }
+        seg->sent += (size_t)n;
+        c->written += (uint64_t)n;
+        load.bytes += (uint64_t)n;
+
+        if (seg->sent == seg->len) {
+            if (seg != c->tail) {
+                c->head = seg->next;
+                segment_retire(c, seg);
+            } else if (!zerocopy_pending(c, seg)) {
+                seg->len = seg->sent = 0;
+            }
+        }
+    }
+    if (cork) set_cork(c, 0);
+
+    uint64_t now = monotonic_ns();
+    while (c->msg_written < c->msg_count) {
+        const struct pending *p = &c->msgs[(c->msg_head + c->msg_written) % c->msg_cap];
+        if (p->end > c->written) break;
+        hist_record(&load.lag, now > p->due_ns ? now - p->due_ns : 0);
+        load.sent++;
+        load.last_write_ns = now;
+        if (acked_mode) {
+            c->msg_written++;
+        } else {
+            c->msg_head = (c->msg_head + 1) % c->msg_cap;
+            c->msg_count--;
+        }
+    }
+
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | (c->written < c->queued ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+/* Copies bytes to the end of the segment chain. */
+static int conn_append(struct conn *c, const char *data, size_t len) {
+    while (len > 0) {
+        struct segment *seg = c->tail;
+        if (!seg || seg->len == SEGMENT_BYTES) {
+            if (c->free_segments) {
+                seg = c->free_segments;
+                c->free_segments = seg->next;
+                c->free_count--;
+            } else if (!(seg = malloc(sizeof(*seg)))) {
+                return -1;
+            }
+            seg->next = NULL;
+            seg->len = seg->sent = 0;
+            seg->zerocopy = 0;
+            if (c->tail) {
+                c->tail->next = seg;
+            } else {
+                c->head = seg;
+            }
+            c->tail = seg;
+        }
+        size_t n = SEGMENT_BYTES - seg->len;
+        if (n > len) n = len;
+        memcpy(seg->data + seg->len, data, n);
+        seg->len += n;
+        c->queued += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int conn_queue(struct conn *c, const char *msg, size_t len, uint64_t due) {
+    if (c->queued - c->written + len > MAX_BACKLOG_BYTES) {
+        load.backlog_drops++;
+        return 0;
+    }
+    if (c->msg_count == c->msg_cap) {
+        size_t cap = c->msg_cap ? c->msg_cap * 2 : 64;
+        struct pending *msgs = malloc(cap * sizeof(*msgs));
+        if (!msgs) return -1;
+        for (size_t i = 0; i < c->msg_count; i++) {
+            msgs[i] = c->msgs[(c->msg_head + i) % c->msg_cap];
+        }
+        free(c->msgs);
+        c->msgs = msgs;
+        c->msg_head = 0;
+        c->msg_cap = cap;
+    }
+
+    if (conn_append(c, msg, len) < 0) return -1;
+    struct pending *p = &c->msgs[(c->msg_head + c->msg_count++) % c->msg_cap];
+    p->end = c->queued;
+    p->due_ns = due;
+    return 0;
+}
+
+/* Message body: connection and sequence number, padded with 'x' and ended by a newline. */
+static size_t build_message(char *msg, unsigned size, int conn_id, uint64_t k) {
+    int n = snprintf(msg, size, "c%d m%llu ", conn_id, (unsigned long long)k);
+    if (n < 0 || (unsigned)n > size - 1) n = (int)size - 1;
+    memset(msg + n, 'x', size - 1 - (unsigned)n);
+    msg[size - 1] = '\n';
+    return size;
+}
+
+static int start_connection(int epfd, struct conn *c, const struct sockaddr_in *servaddr, const char *ack_mode) {
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd < 0) return -1;
+    if (connect(c->fd, (const struct sockaddr *)servaddr, sizeof(*servaddr)) < 0 && errno != EINPROGRESS) {
+        close(c->fd);
+        return -1;
+    }
+    struct epoll_event ev = {0};
+    ev.events = EPOLLIN | EPOLLOUT;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+        close(c->fd);
+        return -1;
+    }
+    int on = 1;
+    if (nodelay && setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0) {
+        perror("setsockopt TCP_NODELAY");
+    }
+    if (zerocopy && setsockopt(c->fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) < 0) {
+        perror("MSG_ZEROCOPY unavailable, copying instead");
+        zerocopy = 0;
+    }
+    if (ack_mode) {
+        /* The hello goes first in the backlog but is not a message of its own. */
+        char hello[32];
+        int len = snprintf(hello, sizeof(hello), TCP_ACK_HELLO "%s\n", ack_mode);
+        if (conn_append(c, hello, (size_t)len) < 0) return -1;
+    }
+    return 0;
+}
+
+/* Every "A <n>" line acknowledges the next n written messages. */
+static int handle_acks(struct conn *c, const char *data, size_t len) {
+    uint64_t now = monotonic_ns();
+
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] != '\n') {
+            if (c->ack_len == sizeof(c->ack_buf) - 1) return -1;
+            c->ack_buf[c->ack_len++] = data[i];
+            continue;
+        }
+        c->ack_buf[c->ack_len] = '\0';
+        c->ack_len = 0;
+
+        unsigned long long n;
+        if (sscanf(c->ack_buf, "A %llu", &n) != 1 || n > c->msg_written) return -1;
+        while (n-- > 0) {
+            uint64_t due = c->msgs[c->msg_head].due_ns;
+            hist_record(&load.ack, now > due ? now - due : 0);
+            load.acked++;
+            c->msg_head = (c->msg_head + 1) % c->msg_cap;
+            c->msg_count--;
+            c->msg_written--;
+        }
+    }
+    return 0;
+}
+
+static void handle_conn_event(int epfd, struct conn *c, uint32_t events) {
+    char sink[4096];
+
+    if (c->dead) return;
+    if (!c->connected && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err) {
+            load.connect_errors++;
+            load.last_errno = err;
+            conn_close(epfd, c);
+            return;
+        }
+        c->connected = 1;
+    }
+    /* Completions alone raise EPOLLERR; a real socket error shows up in the recv below. */
+    if ((events & EPOLLERR) && c->zc_next) drain_zerocopy(c);
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        ssize_t n;
+        while ((n = recv(c->fd, sink, sizeof(sink), MSG_DONTWAIT)) > 0) {
+            if (acked_mode && handle_acks(c, sink, (size_t)n) < 0) {
+                fprintf(stderr, "Malformed or unexpected ack, closing connection\n");
+                load.disconnects++;
+                conn_close(epfd, c);
+                return;
+            }
+        }
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            load.disconnects++;
+            if (n < 0) load.last_errno = errno;
+            conn_close(epfd, c);
+            return;
+        }
+    }
+    conn_flush(epfd, c);
+}
+
+static void arm_timer(int tfd, uint64_t at_ns) {
+    struct itimerspec its = {{0, 0}, {(time_t)(at_ns / 1000000000ULL), (long)(at_ns % 1000000000ULL)}};
+    if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) its.it_value.tv_nsec = 1;
+    timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void print_sizes(const struct load_config *cfg) {
+    for (int i = 0; i < cfg->class_count; i++) {
+        const struct size_class *c = &cfg->classes[i];
+        if (c->min == c->max) {
+            printf("%s%u", i ? ", " : "", c->min);
+        } else {
+            printf("%s%u-%u", i ? ", " : "", c->min, c->max);
+        }
+        if (cfg->class_count > 1) printf(" (%u/%u)", c->weight, cfg->total_weight);
+    }
+}
+
+static void print_load_summary(double elapsed) {
+    printf("Sent %llu of %llu scheduled messages (%.1f MB) in %.2f s: %.1f msg/s, %.2f MB/s\n",
+           (unsigned long long)load.sent, (unsigned long long)load.scheduled, load.bytes / 1e6, elapsed,
+           load.sent / elapsed, load.bytes / 1e6 / elapsed);
+    printf("Errors: %llu connect, %llu send, %llu disconnects, %llu dropped (backlog full), %llu unsent at exit\n",
+           (unsigned long long)load.connect_errors, (unsigned long long)load.send_errors,
+           (unsigned long long)load.disconnects, (unsigned long long)load.backlog_drops,
+           (unsigned long long)load.unsent);
+    if (acked_mode) {
+        printf("Acked %llu messages, %llu written but unacknowledged at exit\n", (unsigned long long)load.acked,
+               (unsigned long long)load.unacked);
+    }
+    if (load.last_errno) printf("Last socket error: %s\n", strerror(load.last_errno));
+    if (load.lag.count) {
+        printf("Lag from due time to written: p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+               hist_percentile(&load.lag, 0.50) / 1e3, hist_percentile(&load.lag, 0.99) / 1e3,
+               hist_percentile(&load.lag, 0.999) / 1e3, load.lag.max / 1e3);
+    }
+
+    /* Sender cost: the point of -Z and -K is fewer CPU seconds per byte. */
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    double user = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+    double sys = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    printf("CPU: %.2f s user, %.2f s system, %.2f s per GB; %llu sends, %.0f bytes per send\n", user, sys,
+           load.bytes ? (user + sys) / (load.bytes / 1e9) : 0.0, (unsigned long long)load.send_calls,
+           load.send_calls ? (double)load.bytes / load.send_calls : 0.0);
+    if (load.zc_sends) {
+        printf("Zerocopy: %llu sends, %llu completed, %llu of them copied by the kernel anyway\n",
+               (unsigned long long)load.zc_sends, (unsigned long long)load.zc_completed,
+               (unsigned long long)load.zc_copied);
+    }
+    if (load.ack.count) {
+        printf("Submit to ack: p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+               hist_percentile(&load.ack, 0.50) / 1e3, hist_percentile(&load.ack, 0.99) / 1e3,
+               hist_percentile(&load.ack, 0.999) / 1e3, load.ack.max / 1e3);
+    }
+}
+
+static int run_load(const struct sockaddr_in *servaddr, struct load_config *cfg) {
+    static char msg[MAX_MESSAGE_SIZE];
+    struct conn *conns = calloc((size_t)cfg->connections, sizeof(*conns));
+    struct conn **dirty = calloc((size_t)cfg->connections, sizeof(*dirty));
+    int epfd = epoll_create1(0);
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (!conns || !dirty || epfd < 0 || tfd < 0) {
+        perror("load setup");
+        return 1;
+    }
+
+    struct epoll_event tev = {0};
+    tev.events = EPOLLIN;
+    tev.data.ptr = NULL;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &tev);
+
+    for (int i = 0; i < cfg->connections; i++) {
+        if (start_connection(epfd, &conns[i], servaddr, cfg->ack_mode) < 0) {
+            load.connect_errors++;
+            load.last_errno = errno;
+            conns[i].dead = 1;
+        }
+    }
+
+    printf("Load: %d connections, %.0f msg/s for %.1f s", cfg->connections, cfg->rate, cfg->duration);
+    if (cfg->ramp > 0) printf(" (ramp %.1f s)", cfg->ramp);
+    printf(", sizes ");
+    print_sizes(cfg);
+    printf(", seed %u", cfg->seed);
+    if (cfg->ack_mode) printf(", acked after %s", cfg->ack_mode);
+    printf("\n");
+    fflush(stdout);
+
+    uint64_t rng = cfg->seed ? cfg->seed : 1;
+    uint64_t start = monotonic_ns();
+    uint64_t end = start + (uint64_t)(cfg->duration * 1e9);
+    uint64_t next_due = start + due_ns(cfg, 0);
+    int next_conn = 0, live = cfg->connections;
+    int generating = 1;
+    arm_timer(tfd, next_due);
+
+    while (1) {
+        uint64_t now = monotonic_ns();
+        if (generating) {
+            /*
+             * Everything due by now is queued, each with its own due time,
+             * and each connection is flushed once for the lot.
+             */
+            int dirty_count = 0;
+            while (next_due <= now && next_due < end) {
+                int tries = 0;
+                while (conns[next_conn].dead && tries++ < cfg->connections) {
+                    next_conn = (next_conn + 1) % cfg->connections;
+                }
+                if (conns[next_conn].dead) {
+                    live = 0;
+                    break;
+                }
+                struct conn *c = &conns[next_conn];
+                size_t len = build_message(msg, pick_size(cfg, &rng), next_conn, load.scheduled);
+                if (conn_queue(c, msg, len, next_due) < 0) {
+                    perror("malloc");
+                    return 1;
+                }
+                load.scheduled++;
+                if (!c->dirty) {
+                    c->dirty = 1;
+                    dirty[dirty_count++] = c;
+                }
+                next_conn = (next_conn + 1) % cfg->connections;
+                next_due = start + due_ns(cfg, load.scheduled);
+            }
+            for (int i = 0; i < dirty_count; i++) {
+                conn_flush(epfd, dirty[i]);
+            }
+            if (next_due >= end || !live) {
+                generating = 0;
+                end = now + DRAIN_MS * 1000000ULL;
+                arm_timer(tfd, end);
+            } else {
+                arm_timer(tfd, next_due);
+            }
+        }
+        if (!generating) {
+            int backlog = 0;
+            for (int i = 0; i < cfg->connections; i++) {
+                if (!conns[i].dead && conns[i].msg_count) backlog = 1;
+            }
+            if (!backlog || now >= end) break;
+        }
+
+        struct epoll_event events[EPOLL_BATCH];
+        int n = epoll_wait(epfd, events, EPOLL_BATCH, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            if (!events[i].data.ptr) {
+                uint64_t expirations;
+                if (read(tfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) perror("read timerfd");
+                continue;
+            }
+            handle_conn_event(epfd, events[i].data.ptr, events[i].events);
+        }
+    }
+
+    /* The rate covers the scheduled run, or longer if the backlog took longer to write out. */
+    uint64_t finished = start + (uint64_t)(cfg->duration * 1e9);
+    if (load.last_write_ns > finished) finished = load.last_write_ns;
+    double elapsed = (finished - start) / 1e9;
+    for (int i = 0; i < cfg->connections; i++) {
+        conn_close(epfd, &conns[i]);
+        conn_free(&conns[i]);
+    }
+    free(conns);
+    free(dirty);
+    close(tfd);
+    close(epfd);
+    print_load_summary(elapsed);
+    return load.connect_errors || load.send_errors || load.disconnects ? 2 : 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-i interval_ms] <server_ip> <port>\n"
+                    "       %s -c connections [-r rate] [-t seconds] [-R ramp_seconds] [-s sizes] [-S seed] [-a write|fsync] [-Z] [-D] [-K]\n"
+                    "       %*s <server_ip> <port>\n"
+                    "  -i  repeat one line from stdin every interval_ms (default 1000)\n"
+                    "  -c  load generator: number of concurrent connections (1..%d)\n"
+                    "  -r  target rate in messages per second over all connections (default 1000)\n"
+                    "  -t  duration in seconds (default 10)\n"
+                    "  -R  ramp the rate up linearly from 0 over this many seconds\n"
+                    "  -s  message sizes in bytes: N, MIN-MAX, optionally *WEIGHT, comma-separated (default 100)\n"
+                    "  -S  random seed for message sizes (default 1)\n"
+                    "  -a  have the server ack each batch once written (or fsynced) and report submit-to-ack latency\n"
+                    "  -Z  send with MSG_ZEROCOPY when at least %d KiB are queued\n"
+                    "  -D  set TCP_NODELAY, so small records are not held back by Nagle\n"
+                    "  -K  cork the socket while flushing, so small records leave in full segments\n"
+                    "Example: %s -c 64 -r 50000 -t 30 -R 5 -s '100*9,1000-4000' 127.0.0.1 port\n",
+            prog, prog, (int)strlen(prog), "", MAX_CONNECTIONS, ZEROCOPY_MIN_SEND / 1024, prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    struct load_config cfg = {0};
+    int interval_ms = 1000;
+    int opt;
+
+    cfg.rate = 1000;
+    cfg.duration = 10;
+    cfg.seed = 1;
+    parse_sizes("100", &cfg);
+
+    while ((opt = getopt(argc, argv, "i:c:r:t:R:s:S:a:ZDK")) != -1) {
+        switch (opt) {
+        case 'i':
+            interval_ms = atoi(optarg);
+            if (interval_ms < 0) usage(argv[0]);
+            break;
+        case 'c':
+            cfg.connections = atoi(optarg);
+            if (cfg.connections < 1 || cfg.connections > MAX_CONNECTIONS) usage(argv[0]);
+            break;
+        case 'r':
+            cfg.rate = strtod(optarg, NULL);
+            if (cfg.rate <= 0) usage(argv[0]);
+            break;
+        case 't':
+            cfg.duration = strtod(optarg, NULL);
+            if (cfg.duration <= 0) usage(argv[0]);
+            break;
+        case 'R':
+            cfg.ramp = strtod(optarg, NULL);
+            if (cfg.ramp < 0) usage(argv[0]);
+            break;
+        case 's':
+            if (parse_sizes(optarg, &cfg) < 0) usage(argv[0]);
+            break;
+        case 'S':
+            cfg.seed = (unsigned)strtoul(optarg, NULL, 10);
+            break;
+        case 'a':
+            if (strcmp(optarg, "write") != 0 && strcmp(optarg, "fsync") != 0) usage(argv[0]);
+            cfg.ack_mode = optarg;
+            acked_mode = 1;
+            break;
+        case 'Z':
+            zerocopy = 1;
+            break;
+        case 'D':
+            nodelay = 1;
+            break;
+        case 'K':
+            cork = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (argc - optind != 2) {
+        usage(argv[0]);
+    }
+
+    const char *server_ip = argv[optind];
+    int port = atoi(argv[optind + 1]);
+
+    struct sockaddr_in servaddr = {0};
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_port = htons(port);
+    if (inet_pton(AF_INET, server_ip, &servaddr.sin_addr) <= 0) {
+        perror("inet_pton");
+        return 1;
+    }
+
+    if (cfg.connections == 0) {
+        return repeat_line(&servaddr, interval_ms);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    return run_load(&servaddr, &cfg);
+}
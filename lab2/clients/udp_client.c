@@ -1,10 +1,20 @@
+#define _FILE_OFFSET_BITS 64
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
 #include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <time.h>
+#include <linux/net_tstamp.h>
+
+#include "../udp_proto.h"
 
 static const char *ACK = "ACK";
 
@@ -23,47 +33,1076 @@ typedef struct {
     int packet_number;
 } buffer;
 
-static void send_with_ack(int sockfd, struct sockaddr_in *servaddr, socklen_t addr_len, const char* data, size_t data_len, const char *desc) {
-    char recv_buffer[16];
+#define ACK_REPLY_MAX 128
+#define COMPRESS_SAMPLE_CHUNKS 8
+#define COMPRESS_MIN_SAVING 10
+#define FIN_TIMEOUT_MS 200
+#define CDC_READ_SIZE (1 << 16)
+#define GET_DALLY_MS 1000
+#define GET_GIVE_UP_MS 10000
+#define STREAM_BATCH 16
+#define GSO_MAX_SEGMENTS 64
+#define GSO_MAX_BYTES 65000
+#define PACE_BURST_NS 1000000ULL
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef SO_TXTIME
+#define SO_TXTIME 61
+#define SCM_TXTIME SO_TXTIME
+#endif
+
+static unsigned long timeouts = 0;
+
+/*
+ * UDP GSO: a run of equal-sized datagrams (the last one may be shorter)
+ * is handed to the kernel in one sendmsg with a UDP_SEGMENT control
+ * message, and the kernel or NIC cuts it into datagrams. A kernel without
+ * UDP_SEGMENT would send the run as one huge datagram, so gso_probe
+ * checks for it first; if a GSO send fails anyway, GSO is turned off and
+ * the run goes out one datagram at a time.
+ */
+static int gso_enabled = 0;
+static unsigned long gso_sends = 0;
+static unsigned long gso_datagrams = 0;
+
+static void gso_probe(int sockfd) {
+    int size;
+    socklen_t len = sizeof(size);
+    gso_enabled = getsockopt(sockfd, SOL_UDP, UDP_SEGMENT, &size, &len) == 0;
+}
+
+/*
+ * Upload pacing (-r): a token bucket kept as the time the next byte may
+ * leave. After an idle spell the sender may catch up by PACE_BURST_NS worth
+ * of data, no more, so a window goes out spread over its share of time
+ * instead of back to back into the server's receive buffer. With SO_TXTIME
+ * every datagram also carries its departure time; an fq qdisc on the route
+ * holds it until then, which spaces datagrams exactly, and the client only
+ * sleeps to stay within PACE_BURST_NS of the schedule. Without fq the
+ * timestamp is ignored and bursts stay within that bound. GSO runs are cut
+ * to a burst, as the kernel sends a run as a whole.
+ */
+struct pacer {
+    uint64_t rate;
+    uint64_t next;
+    int txtime;
+    unsigned long sleeps;
+};
+
+static struct pacer pacer;
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void pace_setup(int sockfd, uint64_t rate) {
+    struct sock_txtime txtime = {CLOCK_MONOTONIC, 0};
+    pacer.rate = rate;
+    pacer.next = monotonic_ns();
+    pacer.txtime = setsockopt(sockfd, SOL_SOCKET, SO_TXTIME, &txtime, sizeof(txtime)) == 0;
+}
+
+/* Waits until len bytes fit the rate; returns their departure time, or 0 when not pacing. */
+static uint64_t pace(size_t len) {
+    if (!pacer.rate) return 0;
+    uint64_t now = monotonic_ns();
+    uint64_t ahead = 0;
+    if (pacer.txtime) {
+        if (pacer.next < now) pacer.next = now;
+        ahead = PACE_BURST_NS;
+    } else if (pacer.next + PACE_BURST_NS < now) {
+        pacer.next = now - PACE_BURST_NS;
+    }
+    if (pacer.next > now + ahead) {
+        uint64_t wait = pacer.next - now - ahead;
+        struct timespec ts = {(time_t)(wait / 1000000000ULL), (long)(wait % 1000000000ULL)};
+        nanosleep(&ts, NULL);
+        pacer.sleeps++;
+    }
+    uint64_t departure = pacer.next;
+    pacer.next += (uint64_t)len * 1000000000ULL / pacer.rate;
+    return departure;
+}
+
+/* Puts the SCM_TXTIME message for departure at cm, the last message in msg's control buffer. */
+static void add_txtime(struct msghdr *msg, struct cmsghdr *cm, uint64_t departure) {
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_TXTIME;
+    cm->cmsg_len = CMSG_LEN(sizeof(departure));
+    memcpy(CMSG_DATA(cm), &departure, sizeof(departure));
+    msg->msg_controllen = (size_t)((char *)cm - (char *)msg->msg_control) + CMSG_SPACE(sizeof(departure));
+}
+
+/* Sends one datagram at its paced departure time (0: now). */
+static ssize_t send_datagram(int sockfd, struct sockaddr_in *servaddr, socklen_t addr_len, const void *data,
+                             size_t len, uint64_t departure) {
+    if (!departure || !pacer.txtime) {
+        return sendto(sockfd, data, len, 0, (struct sockaddr *)servaddr, addr_len);
+    }
+    char control[CMSG_SPACE(sizeof(uint64_t))];
+    struct iovec iov = {(void *)data, len};
+    struct msghdr msg = {0};
+    msg.msg_name = servaddr;
+    msg.msg_namelen = addr_len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    memset(control, 0, sizeof(control));
+    add_txtime(&msg, CMSG_FIRSTHDR(&msg), departure);
+    return sendmsg(sockfd, &msg, 0);
+}
+
+/* Paces and sends one datagram on its own (retransmits, FIN). */
+static ssize_t send_paced(int sockfd, struct sockaddr_in *servaddr, socklen_t addr_len, const void *data, size_t len) {
+    return send_datagram(sockfd, servaddr, addr_len, data, len, pace(len));
+}
+
+static int send_gso(int sockfd, struct sockaddr_in *servaddr, socklen_t addr_len,
+                    uint8_t *const *packets, const size_t *lens, int count, uint64_t departure) {
+    struct iovec iov[GSO_MAX_SEGMENTS];
+    char control[CMSG_SPACE(sizeof(uint16_t)) + CMSG_SPACE(sizeof(uint64_t))];
+    size_t total = 0;
+
+    for (int i = 0; i < count; i++) {
+        iov[i].iov_base = packets[i];
+        iov[i].iov_len = lens[i];
+        total += lens[i];
+    }
+    struct msghdr msg = {0};
+    msg.msg_name = servaddr;
+    msg.msg_namelen = addr_len;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    memset(control, 0, sizeof(control));
+
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    uint16_t segment = (uint16_t)lens[0];
+    cm->cmsg_level = SOL_UDP;
+    cm->cmsg_type = UDP_SEGMENT;
+    cm->cmsg_len = CMSG_LEN(sizeof(segment));
+    memcpy(CMSG_DATA(cm), &segment, sizeof(segment));
+    /* Found while msg_controllen still spans the whole buffer. */
+    struct cmsghdr *next = CMSG_NXTHDR(&msg, cm);
+    msg.msg_controllen = CMSG_SPACE(sizeof(segment));
+    if (departure && pacer.txtime) add_txtime(&msg, next, departure);
+
+    return sendmsg(sockfd, &msg, 0) == (ssize_t)total ? 0 : -1;
+}
+
+static void send_packets(int sockfd, struct sockaddr_in *servaddr, socklen_t addr_len,
+                         uint8_t *const *packets, const size_t *lens, int count) {
+    size_t max_run = GSO_MAX_BYTES;
+    if (pacer.rate && pacer.rate * PACE_BURST_NS / 1000000000ULL < max_run) {
+        max_run = (size_t)(pacer.rate * PACE_BURST_NS / 1000000000ULL);
+    }
+    int i = 0;
+    while (i < count) {
+        int run = 1;
+        size_t total = lens[i];
+        while (gso_enabled && i + run < count && run < GSO_MAX_SEGMENTS && lens[i + run - 1] == lens[i]
+               && lens[i + run] <= lens[i] && total + lens[i + run] <= max_run) {
+            total += lens[i + run++];
+        }
+
+        uint64_t departure = pace(total);
+        if (run > 1) {
+            if (send_gso(sockfd, servaddr, addr_len, packets + i, lens + i, run, departure) == 0) {
+                gso_sends++;
+                gso_datagrams += (unsigned long)run;
+                i += run;
+                continue;
+            }
+            if (errno != EINVAL && errno != EIO && errno != EOPNOTSUPP && errno != ENOPROTOOPT) {
+                fail("sendmsg", NULL, sockfd);
+            }
+            printf("UDP GSO unavailable (%s), sending datagrams one by one\n", strerror(errno));
+            gso_enabled = 0;
+        }
+        for (int end = i + run; i < end; i++) {
+            if (send_datagram(sockfd, servaddr, addr_len, packets[i], lens[i], departure) != (ssize_t)lens[i]) {
+                fail("sendto", NULL, sockfd);
+            }
+        }
+    }
+}
+
+/*
+ * Sends every packet of a burst, then waits for a reply of reply_len bytes
+ * starting with expect. Stale replies to earlier packets are ignored.
+ */
+static ssize_t send_burst_with_ack(int sockfd, struct sockaddr_in *servaddr, socklen_t addr_len,
+                                   uint8_t *const *packets, const size_t *lens, int count,
+                                   const char *expect, size_t expect_len, size_t reply_len,
+                                   char *recv_buffer, const char *desc) {
+    while (1) {
+        send_packets(sockfd, servaddr, addr_len, packets, lens, count);
+
+        while (1) {
+            ssize_t recvd = recvfrom(sockfd, recv_buffer, ACK_REPLY_MAX - 1, 0, NULL, NULL);
+            if (recvd < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    printf("Timeout waiting for ACK of %s, resending\n", desc);
+                    timeouts++;
+                    break;
+                } else {
+                    fail("recvfrom", NULL, sockfd);
+                }
+            }
+
+            recv_buffer[recvd] = '\0';
+
+            if (recvd >= 3 && memcmp(recv_buffer, PROTO_ERROR, 3) == 0) {
+                fprintf(stderr, "Server refused %s: %s\n", desc, recv_buffer + 3);
+                close(sockfd);
+                exit(EXIT_FAILURE);
+            }
+            if ((size_t)recvd == reply_len && memcmp(recv_buffer, expect, expect_len) == 0) {
+                printf("Received ACK for %s\n", desc);
+                return recvd;
+            }
+            printf("Received unexpected response: %s, still waiting for %s\n", recv_buffer, desc);
+        }
+    }
+}
+
+static ssize_t send_with_ack(int sockfd, struct sockaddr_in *servaddr, socklen_t addr_len, const char* data, size_t data_len,
+                             const char *expect, size_t expect_len, char *recv_buffer, const char *desc) {
+    uint8_t *packet = (uint8_t *)data;
+    return send_burst_with_ack(sockfd, servaddr, addr_len, &packet, &data_len, 1, expect, expect_len, expect_len, recv_buffer, desc);
+}
+
+static void send_legacy(int sockfd, struct sockaddr_in *servaddr, socklen_t addr_len, FILE *file) {
+    char reply[ACK_REPLY_MAX];
+    buffer send_buffer;
+    int packet_num = 0;
+
+    while (1) {
+        int c = fgetc(file);
+        if (c == EOF) {
+            printf("File sent successfully\n");
+            break;
+        }
+
+        send_buffer.packet_number = packet_num;
+        send_buffer.data = c;
+        send_buffer.check1 = 255;
+        send_buffer.check2 = 255;
+        send_buffer.check3 = 255;
+
+        char bytes[32];
+        snprintf(bytes, sizeof(bytes), "packet %d", packet_num);
+        send_with_ack(sockfd, servaddr, addr_len, (char *)&send_buffer, sizeof(send_buffer), ACK, strlen(ACK), reply, bytes);
+
+        packet_num++;
+    }
+}
+
+/* Compresses the first few chunks and keeps compression only if they shrink noticeably. */
+static int sample_compressible(FILE *file, uint16_t chunk_size) {
+    uint8_t raw[MAX_CHUNK_SIZE];
+    uint8_t packed[MAX_CHUNK_SIZE];
+    size_t raw_total = 0, packed_total = 0;
+
+    for (int i = 0; i < COMPRESS_SAMPLE_CHUNKS; i++) {
+        size_t n = fread(raw, 1, chunk_size, file);
+        if (n == 0) break;
+        size_t c = lz_compress(raw, n, packed, n);
+        raw_total += n;
+        packed_total += c ? c : n;
+    }
+    rewind(file);
+
+    return raw_total > 0 && packed_total * 100 <= raw_total * (100 - COMPRESS_MIN_SAVING);
+}
+
+/* A content-defined chunk of a dedup upload. */
+struct cdc_chunk {
+    off_t offset;
+    uint16_t len;
+    uint8_t need;
+    uint8_t hash[SHA256_LEN];
+};
+
+static uint64_t gear[256];
+
+/* The gear table is fixed (splitmix64 from a constant seed): chunk boundaries must not change between runs. */
+static void gear_init(void) {
+    uint64_t x = 0x6c62272e07bb0142ULL;
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+static int cdc_add(struct cdc_chunk **chunks, uint64_t *n, uint64_t *cap, const uint8_t *data, size_t len,
+                   off_t *offset) {
+    if (*n == *cap) {
+        uint64_t grown_cap = *cap ? *cap * 2 : 1024;
+        struct cdc_chunk *grown = realloc(*chunks, grown_cap * sizeof(**chunks));
+        if (!grown) return -1;
+        *chunks = grown;
+        *cap = grown_cap;
+    }
+    struct cdc_chunk *c = &(*chunks)[(*n)++];
+    c->offset = *offset;
+    c->len = (uint16_t)len;
+    c->need = 1;
+    sha256(data, len, c->hash);
+    *offset += (off_t)len;
+    return 0;
+}
+
+/*
+ * Splits the file into chunks with a gear rolling hash: a boundary falls
+ * where the top bits of the hash are zero, which depends only on the last
+ * 64 bytes, so an edit moves only the boundaries next to it. Chunks are
+ * between max_len / 4 and max_len bytes, max_len / 2 on average.
+ */
+static struct cdc_chunk *cdc_split(FILE *file, uint16_t max_len, uint64_t *count) {
+    uint8_t chunk[MAX_CHUNK_SIZE];
+    struct cdc_chunk *chunks = calloc(1, sizeof(*chunks));
+    uint8_t *buf = malloc(CDC_READ_SIZE);
+    uint64_t n = 0, cap = 1;
+    size_t min_len = max_len / 4 ? max_len / 4 : 1;
+    size_t len = 0, got;
+    uint64_t h = 0;
+    off_t offset = 0;
+    int bits = 0;
+
+    while (((size_t)2 << bits) <= min_len) bits++;
+    uint64_t mask = bits ? ~0ULL << (64 - bits) : 0;
+
+    if (!chunks || !buf) goto fail;
+    gear_init();
+    rewind(file);
+    while ((got = fread(buf, 1, CDC_READ_SIZE, file)) > 0) {
+        for (size_t i = 0; i < got; i++) {
+            chunk[len++] = buf[i];
+            h = (h << 1) + gear[buf[i]];
+            if (len == max_len || (len >= min_len && !(h & mask))) {
+                if (cdc_add(&chunks, &n, &cap, chunk, len, &offset) < 0) goto fail;
+                len = 0;
+                h = 0;
+            }
+        }
+    }
+    if (ferror(file) || (len > 0 && cdc_add(&chunks, &n, &cap, chunk, len, &offset) < 0)) goto fail;
+
+    free(buf);
+    rewind(file);
+    *count = n;
+    return chunks;
+
+fail:
+    free(chunks);
+    free(buf);
+    return NULL;
+}
+
+/* Reads the next chunk of want bytes and frames it as a DATA packet; returns the packet length, 0 at end of file. */
+static size_t build_chunk(FILE *file, uint16_t want, uint8_t flags, uint64_t seq, uint64_t total_chunks,
+                          uint8_t *packet, size_t *raw_len) {
+    uint8_t raw[MAX_CHUNK_SIZE];
+    uint8_t packed[MAX_CHUNK_SIZE];
+    size_t n = fread(raw, 1, want, file);
+    *raw_len = n;
+    if (n == 0) return 0;
+
+    size_t payload_len = 0;
+    uint8_t chunk_flags = 0;
+    if (flags & SESSION_COMPRESS) {
+        payload_len = lz_compress(raw, n, packed, n - 1);
+        if (payload_len) chunk_flags = CHUNK_COMPRESSED;
+    }
+    if (seq + 1 == total_chunks) chunk_flags |= CHUNK_LAST;
+
+    size_t hdr_len = encode_data_header(packet, chunk_flags, seq, (uint16_t)n);
+    if (payload_len) {
+        memcpy(packet + hdr_len, packed, payload_len);
+    } else {
+        memcpy(packet + hdr_len, raw, n);
+        payload_len = n;
+    }
+    return hdr_len + payload_len;
+}
+
+/*
+ * Builds chunk seq out of order without disturbing the sequential read
+ * position. With a dedup index the chunk's place and size come from it.
+ */
+static size_t build_chunk_at(FILE *file, uint16_t chunk_size, uint8_t flags, uint64_t seq, uint64_t total_chunks,
+                             const struct cdc_chunk *index, uint8_t *packet, size_t *raw_len) {
+    off_t pos = ftello(file);
+    off_t offset = index ? index[seq].offset : (off_t)seq * chunk_size;
+    uint16_t want = index ? index[seq].len : chunk_size;
+    if (fseeko(file, offset, SEEK_SET) != 0) return 0;
+    size_t len = build_chunk(file, want, flags, seq, total_chunks, packet, raw_len);
+    fseeko(file, pos, SEEK_SET);
+    return len;
+}
+
+static void chunk_to_symbol(const uint8_t *packet, size_t packet_len, uint8_t *sym, size_t symbol_size) {
+    struct data_header hdr = {0};
+    decode_data_header(packet, packet_len, &hdr);
+    size_t payload_len = packet_len - hdr.len;
+    sym[0] = hdr.flags;
+    put_u16(sym + 1, hdr.raw_len);
+    put_u16(sym + 3, (uint16_t)payload_len);
+    memcpy(sym + FEC_SYMBOL_HDR_LEN, packet + hdr.len, payload_len);
+    memset(sym + FEC_SYMBOL_HDR_LEN + payload_len, 0, symbol_size - FEC_SYMBOL_HDR_LEN - payload_len);
+}
+
+struct nack_stats {
+    unsigned long nacks;
+    unsigned long retransmits;
+};
+
+/*
+ * Handles replies in NACK mode: retransmits every range the server asks
+ * for. Waits up to wait_ms for the first reply, then drains whatever else is
+ * queued. Returns 1 once the server has confirmed the whole file, 0 if
+ * anything arrived and -1 on timeout.
+ */
+static int service_nacks(int sockfd, struct sockaddr_in *servaddr, socklen_t addr_len, FILE *file,
+                         uint16_t chunk_size, uint8_t flags, uint64_t total_chunks, const struct cdc_chunk *index,
+                         int wait_ms, struct nack_stats *ns) {
+    uint8_t reply[PROTO_NACK_HDR_LEN + NACK_MAX_RANGES * 2 * VARINT_MAX_LEN];
+    uint8_t packet[PROTO_DATA_HDR_MAX + MAX_CHUNK_SIZE];
+    uint8_t fin_ack[PROTO_REPLY_MAX];
+    size_t fin_ack_len = encode_reply(fin_ack, FIN_ACK, total_chunks);
+    struct pollfd pfd = {sockfd, POLLIN, 0};
+    int result = -1;
+
+    if (wait_ms > 0 && poll(&pfd, 1, wait_ms) <= 0) return -1;
+
+    while (1) {
+        ssize_t n = recvfrom(sockfd, reply, sizeof(reply), MSG_DONTWAIT, NULL, NULL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return result;
+            fail("recvfrom", file, sockfd);
+        }
+        if (result < 0) result = 0;
+
+        if ((size_t)n == fin_ack_len && memcmp(reply, fin_ack, fin_ack_len) == 0) {
+            return 1;
+        }
+        if (n < PROTO_NACK_HDR_LEN || reply[0] != PROTO_MAGIC || reply[1] != PROTO_NACK) continue;
+        ns->nacks++;
+
+        size_t off = PROTO_NACK_HDR_LEN;
+        for (int r = 0; r < reply[2]; r++) {
+            uint64_t start, count;
+            size_t used = get_varint(reply + off, (size_t)n - off, &start);
+            if (!used) break;
+            off += used;
+            if (!(used = get_varint(reply + off, (size_t)n - off, &count))) break;
+            off += used;
+            for (uint64_t seq = start; seq - start < count && seq < total_chunks; seq++) {
+                size_t raw_len;
+                size_t len = build_chunk_at(file, chunk_size, flags, seq, total_chunks, index, packet, &raw_len);
+                if (len == 0) fail("fread", file, sockfd);
+                if (send_paced(sockfd, servaddr, addr_len, packet, len) != (ssize_t)len) {
+                    fail("sendto", file, sockfd);
+                }
+                ns->retransmits++;
+            }
+        }
+    }
+}
+
+/* Sends FIN until the server confirms it has every chunk, retransmitting whatever it NACKs meanwhile. */
+static void finish_stream(int sockfd, struct sockaddr_in *servaddr, socklen_t addr_len, FILE *file,
+                          uint16_t chunk_size, uint8_t flags, uint64_t total_chunks, const struct cdc_chunk *index,
+                          struct nack_stats *ns) {
+    uint8_t fin[PROTO_FIN_MAX];
+    fin[0] = PROTO_MAGIC;
+    fin[1] = PROTO_FIN;
+    size_t fin_len = 2 + put_varint(fin + 2, total_chunks);
+
+    while (1) {
+        if (send_paced(sockfd, servaddr, addr_len, fin, fin_len) != (ssize_t)fin_len) {
+            fail("sendto", file, sockfd);
+        }
+
+        int r;
+        while ((r = service_nacks(sockfd, servaddr, addr_len, file, chunk_size, flags, total_chunks, index,
+                                  FIN_TIMEOUT_MS, ns)) == 0) {
+        }
+        if (r > 0) {
+            printf("Server confirmed all %llu chunks\n", (unsigned long long)total_chunks);
+            return;
+        }
+        printf("Timeout waiting for confirmation of %llu chunks, resending FIN\n", (unsigned long long)total_chunks);
+        timeouts++;
+    }
+}
+
+/*
+ * Sends the dedup index INDEX_MAX_ENTRIES chunks at a time and clears
+ * need for every chunk the server already holds. Returns the number of
+ * chunks it had.
+ */
+static uint64_t send_index(int sockfd, struct sockaddr_in *servaddr, socklen_t addr_len,
+                           struct cdc_chunk *index, uint64_t count, size_t *wire_total) {
+    uint8_t packet[PROTO_INDEX_HDR_MAX + INDEX_MAX_ENTRIES * (VARINT_MAX_LEN + SHA256_LEN)];
+    char expect[ACK_REPLY_MAX];
+    char reply[ACK_REPLY_MAX];
+    uint64_t held = 0;
+
+    for (uint64_t first = 0; first < count; first += INDEX_MAX_ENTRIES) {
+        int n = count - first < INDEX_MAX_ENTRIES ? (int)(count - first) : INDEX_MAX_ENTRIES;
+        size_t len = encode_index_header(packet, PROTO_INDEX, first, n);
+        for (int i = 0; i < n; i++) {
+            len += put_varint(packet + len, index[first + i].len);
+            memcpy(packet + len, index[first + i].hash, SHA256_LEN);
+            len += SHA256_LEN;
+        }
+
+        *wire_total += len;
+        uint8_t *index_packet = packet;
+        size_t expect_len = encode_index_header((uint8_t *)expect, PROTO_WANT, first, n);
+        char desc[48];
+        snprintf(desc, sizeof(desc), "index of chunks %llu-%llu", (unsigned long long)first,
+                 (unsigned long long)(first + n - 1));
+        send_burst_with_ack(sockfd, servaddr, addr_len, &index_packet, &len, 1, expect, expect_len,
+                            expect_len + (size_t)(n + 7) / 8, reply, desc);
+
+        const uint8_t *want = (const uint8_t *)reply + expect_len;
+        for (int i = 0; i < n; i++) {
+            index[first + i].need = (want[i / 8] >> (i % 8)) & 1;
+            held += !index[first + i].need;
+        }
+    }
+    return held;
+}
+
+static void send_session(int sockfd, struct sockaddr_in *servaddr, socklen_t addr_len, FILE *file,
+                         uint16_t chunk_size, uint8_t flags, int fec_k, int fec_m) {
+    char reply[ACK_REPLY_MAX];
+    char expect[ACK_REPLY_MAX];
+    uint8_t hello[PROTO_HELLO_MAX];
+
+    if ((flags & SESSION_DEDUP) && (flags & SESSION_FEC)) {
+        printf("FEC is not used with dedup\n");
+        flags &= ~SESSION_FEC;
+    }
+    if ((flags & SESSION_COMPRESS) && !sample_compressible(file, chunk_size)) {
+        printf("File looks incompressible, sending uncompressed\n");
+        flags &= ~SESSION_COMPRESS;
+    }
+
+    if (fseeko(file, 0, SEEK_END) != 0) {
+        fail("fseeko", file, sockfd);
+    }
+    off_t file_size = ftello(file);
+    rewind(file);
+    uint64_t total_chunks = (uint64_t)((file_size + chunk_size - 1) / chunk_size);
+
+    hello[0] = PROTO_MAGIC;
+    hello[1] = PROTO_HELLO;
+    hello[2] = PROTO_VERSION;
+    hello[3] = flags;
+    size_t hello_len = 4 + put_varint(hello + 4, chunk_size);
+    if (flags & SESSION_FEC) {
+        hello[hello_len++] = (uint8_t)fec_k;
+        hello[hello_len++] = (uint8_t)fec_m;
+    }
+    uint8_t *hello_packet = hello;
+    memcpy(expect, ACK, strlen(ACK));
+    expect[strlen(ACK)] = PROTO_VERSION;
+    send_burst_with_ack(sockfd, servaddr, addr_len, &hello_packet, &hello_len, 1, expect, strlen(ACK) + 1,
+                        PROTO_HELLO_REPLY_LEN, reply, "session start");
+    flags &= (uint8_t)reply[strlen(ACK) + 1];
+    if (!(flags & SESSION_FEC)) fec_k = fec_m = 0;
+    printf("Session started: chunk size %u, compression %s, FEC %s %d+%d, dedup %s, %s\n", chunk_size,
+           (flags & SESSION_COMPRESS) ? "on" : "off",
+           (flags & SESSION_FEC_RS) ? "rs" : (flags & SESSION_FEC_XOR) ? "xor" : "off", fec_k, fec_m,
+           (flags & SESSION_DEDUP) ? "on" : "off",
+           (flags & SESSION_NACK) ? "streaming with NACKs" : "stop-and-wait");
+
+    size_t raw_total = 0, wire_total = 0;
+    struct cdc_chunk *index = NULL;
+    uint64_t held = 0;
+    if (flags & SESSION_DEDUP) {
+        index = cdc_split(file, chunk_size, &total_chunks);
+        if (!index) {
+            fail("cdc_split", file, sockfd);
+        }
+        held = send_index(sockfd, servaddr, addr_len, index, total_chunks, &wire_total);
+        off_t held_bytes = 0;
+        for (uint64_t i = 0; i < total_chunks; i++) {
+            if (!index[i].need) held_bytes += index[i].len;
+        }
+        printf("Server already holds %llu of %llu chunks (%lld of %lld bytes)\n", (unsigned long long)held,
+               (unsigned long long)total_chunks, (long long)held_bytes, (long long)file_size);
+    }
+
+    /* Streamed chunks go out STREAM_BATCH at a time so that GSO can send them together. */
+    int group_size = fec_k ? fec_k : (flags & SESSION_NACK) ? STREAM_BATCH : 1;
+    size_t symbol_size = fec_symbol_size(chunk_size);
+    size_t slot_size = PROTO_DATA_HDR_MAX + symbol_size;
+    uint8_t *storage = malloc((size_t)(group_size + fec_m) * slot_size + (size_t)group_size * symbol_size);
+    if (!storage) {
+        fail("malloc", file, sockfd);
+    }
+    uint8_t *packets[FEC_MAX_SYMBOLS];
+    uint8_t *symbols[FEC_MAX_SYMBOLS];
+    size_t lens[FEC_MAX_SYMBOLS];
+    for (int i = 0; i < group_size + fec_m; i++) {
+        packets[i] = storage + (size_t)i * slot_size;
+    }
+    for (int i = 0; i < group_size; i++) {
+        symbols[i] = storage + (size_t)(group_size + fec_m) * slot_size + (size_t)i * symbol_size;
+    }
+
+    uint64_t seq = 0;
+    struct nack_stats ns = {0, 0};
+
+    while (seq < total_chunks) {
+        uint64_t group = seq / (uint64_t)group_size;
+        int count = 0;
+
+        for (; count < group_size && seq < total_chunks; seq++) {
+            if (index && !index[seq].need) continue;
+            size_t raw_len;
+            lens[count] = index ? build_chunk_at(file, chunk_size, flags, seq, total_chunks, index, packets[count], &raw_len)
+                                : build_chunk(file, chunk_size, flags, seq, total_chunks, packets[count], &raw_len);
+            if (lens[count] == 0) {
+                fail("fread", file, sockfd);
+            }
+            raw_total += raw_len;
+            wire_total += lens[count++];
+        }
+        if (count == 0) break;
+
+        char desc[32];
+        if (!fec_k && (flags & SESSION_NACK)) {
+            send_packets(sockfd, servaddr, addr_len, packets, lens, count);
+            service_nacks(sockfd, servaddr, addr_len, file, chunk_size, flags, total_chunks, index, 0, &ns);
+            continue;
+        }
+        if (!fec_k) {
+            size_t expect_len = encode_reply((uint8_t *)expect, ACK, seq - 1);
+            snprintf(desc, sizeof(desc), "chunk %llu", (unsigned long long)(seq - 1));
+            send_with_ack(sockfd, servaddr, addr_len, (char *)packets[0], lens[0], expect, expect_len, reply, desc);
+            continue;
+        }
+
+        uint8_t *parity_symbols[FEC_MAX_SYMBOLS];
+        for (int i = 0; i < count; i++) {
+            chunk_to_symbol(packets[i], lens[i], symbols[i], symbol_size);
+        }
+        for (int j = 0; j < fec_m; j++) {
+            uint8_t *p = packets[count + j];
+            size_t hdr_len = encode_parity_header(p, group, j, count);
+            parity_symbols[j] = p + hdr_len;
+            lens[count + j] = hdr_len + symbol_size;
+            wire_total += lens[count + j];
+        }
+        fec_encode(flags, fec_k, fec_m, count, symbols, parity_symbols, symbol_size);
+
+        if (flags & SESSION_NACK) {
+            send_packets(sockfd, servaddr, addr_len, packets, lens, count + fec_m);
+            service_nacks(sockfd, servaddr, addr_len, file, chunk_size, flags, total_chunks, NULL, 0, &ns);
+            continue;
+        }
+
+        size_t expect_len = encode_reply((uint8_t *)expect, GROUP_ACK, group);
+        snprintf(desc, sizeof(desc), "group %llu", (unsigned long long)group);
+        send_burst_with_ack(sockfd, servaddr, addr_len, packets, lens, count + fec_m,
+                            expect, expect_len, expect_len, reply, desc);
+    }
+
+    if (flags & SESSION_NACK) {
+        finish_stream(sockfd, servaddr, addr_len, file, chunk_size, flags, total_chunks, index, &ns);
+        printf("%lu NACKs received, %lu chunks retransmitted\n", ns.nacks, ns.retransmits);
+    }
+    if (gso_sends) {
+        printf("UDP GSO: %lu datagrams in %lu sends\n", gso_datagrams, gso_sends);
+    }
+    if (pacer.rate) {
+        printf("Paced to %llu KiB/s with %s, %lu sleeps\n", (unsigned long long)(pacer.rate / 1024),
+               pacer.txtime ? "SO_TXTIME" : "a timer", pacer.sleeps);
+    }
+    printf("File sent successfully (%zu bytes, %zu on the wire, %lu timeouts)\n", raw_total, wire_total, timeouts);
+    free(storage);
+    free(index);
+}
+
+/* Download state: which chunks have arrived and how far they are contiguous. */
+struct get_state {
+    int fd;
+    uint16_t chunk_size;
+    uint8_t flags;
+    uint64_t size;
+    uint64_t total_chunks;
+    uint8_t *have;
+    uint64_t low;
+    uint64_t high;
+    uint64_t nack_mark;
+    uint64_t reported;
+    uint64_t ack_every;
+    struct timespec last_nack;
+    unsigned long nacks;
+    unsigned long duplicates;
+    size_t wire_total;
+};
+
+static long elapsed_ms(const struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+static int get_has(const struct get_state *g, uint64_t seq) {
+    return (g->have[seq >> 3] >> (seq & 7)) & 1;
+}
+
+static void get_send(int sockfd, const uint8_t *pkt, size_t len) {
+    if (send(sockfd, pkt, len, 0) != (ssize_t)len) {
+        fail("send", NULL, sockfd);
+    }
+}
+
+/* Tells the server that every chunk below low has arrived. */
+static void get_report(int sockfd, struct get_state *g) {
+    uint8_t ack[PROTO_REPLY_MAX];
+    get_send(sockfd, ack, encode_reply(ack, ACK, g->low));
+    g->reported = g->low;
+}
+
+/* NACKs the chunks missing from [from, to), in the format the server uses for uploads. */
+static void get_nack(int sockfd, struct get_state *g, uint64_t from, uint64_t to) {
+    uint8_t pkt[PROTO_NACK_HDR_LEN + NACK_MAX_RANGES * 2 * VARINT_MAX_LEN];
+    size_t pkt_len = PROTO_NACK_HDR_LEN;
+    int ranges = 0;
+
+    for (uint64_t seq = from; seq < to && ranges < NACK_MAX_RANGES; seq++) {
+        if (get_has(g, seq)) continue;
+        uint64_t start = seq;
+        while (seq < to && !get_has(g, seq)) seq++;
+        pkt_len += put_varint(pkt + pkt_len, start);
+        pkt_len += put_varint(pkt + pkt_len, seq - start);
+        ranges++;
+    }
+    if (ranges == 0) return;
+
+    pkt[0] = PROTO_MAGIC;
+    pkt[1] = PROTO_NACK;
+    pkt[2] = (uint8_t)ranges;
+    get_send(sockfd, pkt, pkt_len);
+    clock_gettime(CLOCK_MONOTONIC, &g->last_nack);
+    g->nacks++;
+}
+
+/* Gap detection and progress reports after every new chunk, mirroring the server's nack_check. */
+static void get_check(int sockfd, struct get_state *g) {
+    if (g->high > g->nack_mark) {
+        uint64_t from = g->nack_mark > g->low ? g->nack_mark : g->low;
+        g->nack_mark = g->high;
+        get_nack(sockfd, g, from, g->high);
+    } else if (g->low < g->nack_mark && elapsed_ms(&g->last_nack) >= NACK_RETRY_MS) {
+        get_nack(sockfd, g, g->low, g->nack_mark);
+    }
+    if (g->low >= g->reported + g->ack_every) get_report(sockfd, g);
+}
+
+/* Writes a DATA packet into place; returns 1 for a new chunk, 0 for a duplicate or malformed one. */
+static int get_store(int sockfd, struct get_state *g, const uint8_t *pkt, size_t n) {
+    uint8_t raw[MAX_CHUNK_SIZE];
+    struct data_header hdr;
+
+    if (!decode_data_header(pkt, n, &hdr) || hdr.seq >= g->total_chunks) return 0;
+    if (get_has(g, hdr.seq)) {
+        g->duplicates++;
+        get_report(sockfd, g);
+        return 0;
+    }
+
+    uint64_t offset = hdr.seq * g->chunk_size;
+    size_t raw_len = g->size - offset < g->chunk_size ? (size_t)(g->size - offset) : g->chunk_size;
+    const uint8_t *payload = pkt + hdr.len;
+    size_t payload_len = n - hdr.len;
+    if (hdr.raw_len != raw_len) return 0;
+    if (hdr.flags & CHUNK_COMPRESSED) {
+        if (lz_decompress(payload, payload_len, raw, raw_len) != (long)raw_len) return 0;
+        payload = raw;
+    } else if (payload_len != raw_len) {
+        return 0;
+    }
+    if (pwrite(g->fd, payload, raw_len, (off_t)offset) != (ssize_t)raw_len) {
+        fail("pwrite", NULL, sockfd);
+    }
+
+    g->have[hdr.seq >> 3] |= (uint8_t)(1 << (hdr.seq & 7));
+    if (hdr.seq >= g->high) g->high = hdr.seq + 1;
+    while (g->low < g->total_chunks && get_has(g, g->low)) g->low++;
+    g->wire_total += n;
+    return 1;
+}
+
+/*
+ * Sends GET until the server answers, then connects the socket to the
+ * port serving this download. Returns the file size.
+ */
+static uint64_t get_start(int sockfd, struct sockaddr_in *servaddr, socklen_t addr_len, const char *remote,
+                          uint16_t chunk_size, uint8_t *flags, unsigned long rate) {
+    uint8_t req[PROTO_GET_HDR_MAX + NAME_MAX];
+    char reply[128];
+
+    req[0] = PROTO_MAGIC;
+    req[1] = PROTO_GET;
+    req[2] = PROTO_VERSION;
+    req[3] = *flags;
+    size_t req_len = 4 + put_varint(req + 4, chunk_size);
+    req_len += put_varint(req + req_len, rate);
+    memcpy(req + req_len, remote, strlen(remote));
+    req_len += strlen(remote);
+
     while (1) {
-        ssize_t sent = sendto(sockfd, data, data_len, 0, (struct sockaddr *)servaddr, addr_len);
-        if (sent != (ssize_t)data_len) {
+        if (sendto(sockfd, req, req_len, 0, (struct sockaddr *)servaddr, addr_len) != (ssize_t)req_len) {
             fail("sendto", NULL, sockfd);
         }
 
-        ssize_t recvd = recvfrom(sockfd, recv_buffer, sizeof(recv_buffer) - 1, 0, NULL, NULL);
-        if (recvd < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                printf("Timeout waiting for ACK of %s, resending\n", desc);
-                continue;
+        while (1) {
+            struct sockaddr_in from;
+            socklen_t from_len = sizeof(from);
+            uint64_t size;
+            ssize_t n = recvfrom(sockfd, reply, sizeof(reply) - 1, 0, (struct sockaddr *)&from, &from_len);
+            if (n < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) fail("recvfrom", NULL, sockfd);
+                printf("Timeout waiting for ACK of GET %s, resending\n", remote);
+                timeouts++;
+                break;
+            }
+            reply[n] = '\0';
+            if (from.sin_addr.s_addr != servaddr->sin_addr.s_addr) continue;
+
+            if (n >= 3 && memcmp(reply, PROTO_ERROR, 3) == 0) {
+                fprintf(stderr, "Server refused to send %s: %s\n", remote, reply + 3);
+                close(sockfd);
+                exit(EXIT_FAILURE);
+            }
+            if (n > 5 && memcmp(reply, ACK, 3) == 0 && reply[3] == PROTO_VERSION
+                && get_varint((const uint8_t *)reply + 5, (size_t)n - 5, &size)) {
+                *flags &= (uint8_t)reply[4];
+                if (connect(sockfd, (struct sockaddr *)&from, from_len) < 0) {
+                    fail("connect", NULL, sockfd);
+                }
+                return size;
+            }
+            printf("Received unexpected response: %s, still waiting for GET %s\n", reply, remote);
+        }
+    }
+}
+
+/*
+ * Downloads remote into local. The server streams the file; this side
+ * reports its progress, NACKs gaps and sends ACKF as soon as every chunk
+ * is in. It then lingers a moment to repeat ACKF should the server send
+ * FIN again.
+ */
+static void receive_session(int sockfd, struct sockaddr_in *servaddr, socklen_t addr_len, const char *remote,
+                            const char *local, uint16_t chunk_size, uint8_t flags, unsigned long rate) {
+    uint8_t pkt[PROTO_DATA_HDR_MAX + MAX_CHUNK_SIZE + 1];
+    uint8_t fin_ack[PROTO_REPLY_MAX];
+    struct get_state g = {0};
+    struct timespec start;
+
+    int rcvbuf = 2 * GET_WINDOW_BYTES;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    g.chunk_size = chunk_size;
+    g.flags = flags;
+    g.size = get_start(sockfd, servaddr, addr_len, remote, chunk_size, &g.flags, rate);
+    g.total_chunks = (g.size + chunk_size - 1) / chunk_size;
+    g.ack_every = GET_WINDOW_BYTES / chunk_size / 4;
+    if (g.ack_every == 0) g.ack_every = 1;
+    g.have = calloc(g.total_chunks / 8 + 1, 1);
+    FILE *file = fopen(local, "wb");
+    if (!g.have || !file) {
+        fail(file ? "calloc" : "fopen", file, sockfd);
+    }
+    g.fd = fileno(file);
+    if (ftruncate(g.fd, (off_t)g.size) < 0) {
+        fail("ftruncate", file, sockfd);
+    }
+    printf("Download started: %llu bytes in %llu chunks of %u, compression %s, rate %s\n",
+           (unsigned long long)g.size, (unsigned long long)g.total_chunks, chunk_size,
+           (g.flags & SESSION_COMPRESS) ? "on" : "off", rate ? "paced" : "unlimited");
+    size_t fin_ack_len = encode_reply(fin_ack, FIN_ACK, g.total_chunks);
+    get_report(sockfd, &g);
+
+    long silent_ms = 0;
+    int complete = 0;
+    while (!complete) {
+        struct pollfd pfd = {sockfd, POLLIN, 0};
+        int r = poll(&pfd, 1, NACK_RETRY_MS);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            fail("poll", file, sockfd);
+        }
+        if (r == 0) {
+            silent_ms += NACK_RETRY_MS;
+            timeouts++;
+            if (silent_ms >= GET_GIVE_UP_MS) {
+                fprintf(stderr, "Server stopped sending %s after %llu of %llu chunks\n", remote,
+                        (unsigned long long)g.low, (unsigned long long)g.total_chunks);
+                fclose(file);
+                close(sockfd);
+                exit(EXIT_FAILURE);
+            }
+            if (g.low < g.nack_mark) {
+                get_nack(sockfd, &g, g.low, g.nack_mark);
             } else {
-                fail("recvfrom", NULL, sockfd);
+                get_report(sockfd, &g);
             }
+            continue;
         }
 
-        recv_buffer[recvd] = '\0';
+        ssize_t n = recv(sockfd, pkt, sizeof(pkt) - 1, 0);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) continue;
+            fail("recv", file, sockfd);
+        }
+        silent_ms = 0;
 
-        if (strcmp(recv_buffer, ACK) == 0) {
-            printf("Received ACK for %s\n", desc);
-            break;
-        } else {
-            printf("Received unexpected response: %s, resending %s\n", recv_buffer, desc);
+        uint64_t total;
+        if (n >= 2 && pkt[0] == PROTO_MAGIC && pkt[1] == PROTO_DATA) {
+            if (!get_store(sockfd, &g, pkt, (size_t)n)) continue;
+            if (g.low >= g.total_chunks) {
+                get_send(sockfd, fin_ack, fin_ack_len);
+                complete = 1;
+            } else {
+                get_check(sockfd, &g);
+            }
+        } else if (n > 2 && pkt[0] == PROTO_MAGIC && pkt[1] == PROTO_FIN
+                   && get_varint(pkt + 2, (size_t)n - 2, &total) && total == g.total_chunks) {
+            if (g.low >= g.total_chunks) {
+                get_send(sockfd, fin_ack, fin_ack_len);
+                complete = 1;
+            } else {
+                g.nack_mark = g.total_chunks;
+                get_nack(sockfd, &g, g.low, g.total_chunks);
+            }
+        } else if (n > 5 && memcmp(pkt, ACK, 3) == 0 && pkt[3] == PROTO_VERSION) {
+            get_report(sockfd, &g);
         }
     }
+
+    long ms = elapsed_ms(&start);
+    struct pollfd pfd = {sockfd, POLLIN, 0};
+    while (poll(&pfd, 1, GET_DALLY_MS) > 0) {
+        ssize_t n = recv(sockfd, pkt, sizeof(pkt), 0);
+        if (n < 0) break;
+        if (n > 2 && pkt[0] == PROTO_MAGIC && pkt[1] == PROTO_FIN) get_send(sockfd, fin_ack, fin_ack_len);
+    }
+
+    printf("%lu NACKs sent, %lu duplicate chunks\n", g.nacks, g.duplicates);
+    printf("File received successfully (%llu bytes, %zu on the wire, %ld ms, %lu timeouts)\n",
+           (unsigned long long)g.size, g.wire_total, ms, timeouts);
+    free(g.have);
+    if (fclose(file) != 0) {
+        fail("fclose", NULL, sockfd);
+    }
+}
+
+/* Accepts xor:K (K data chunks + 1 parity) or rs:K+M. */
+static int parse_fec(const char *spec, uint8_t *flags, int *k, int *m) {
+    char extra;
+    if (sscanf(spec, "xor:%d%c", k, &extra) == 1) {
+        *m = 1;
+        *flags |= SESSION_FEC_XOR;
+    } else if (sscanf(spec, "rs:%d+%d%c", k, m, &extra) == 2) {
+        *flags |= SESSION_FEC_RS;
+    } else {
+        return -1;
+    }
+    return fec_params_valid(*flags, *k, *m) ? 0 : -1;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-l] [-z] [-n] [-d] [-c chunk_size] [-f xor:K|rs:K+M] [-r rate] server_ip server_port filename\n"
+                    "       %s -g [-z] [-c chunk_size] [-r rate] server_ip server_port filename [local_name]\n"
+                    "  -l  legacy one-byte-per-packet mode (Lab1 server)\n"
+                    "  -z  compress chunks (skipped automatically if the file is incompressible)\n"
+                    "  -n  stream chunks without waiting and retransmit only what the server NACKs\n"
+                    "  -d  dedup: content-defined chunks, only those the server does not hold are sent\n"
+                    "  -c  chunk size in bytes, 1..%d (default %d; with -d the largest chunk and with -g, default %d)\n"
+                    "  -f  forward error correction: K data chunks plus 1 XOR or M Reed-Solomon parity chunks, K+M <= %d\n"
+                    "  -g  download filename from the server instead of uploading it\n"
+                    "  -r  pace the transfer to rate KiB/s (uploads here, downloads by the server)\n",
+            prog, prog, MAX_CHUNK_SIZE, DEFAULT_CHUNK_SIZE, MAX_CHUNK_SIZE, FEC_MAX_SYMBOLS);
+    exit(EXIT_FAILURE);
 }
 
 int main(int argc, char **argv) {
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s server_ip server_port filename\n", argv[0]);
-        exit(EXIT_FAILURE);
+    int legacy = 0;
+    int download = 0;
+    unsigned long rate = 0;
+    uint8_t flags = 0;
+    long chunk_size = 0;
+    int fec_k = 0, fec_m = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "lzndgc:f:r:")) != -1) {
+        switch (opt) {
+        case 'l':
+            legacy = 1;
+            break;
+        case 'z':
+            flags |= SESSION_COMPRESS;
+            break;
+        case 'n':
+            flags |= SESSION_NACK;
+            break;
+        case 'd':
+            flags |= SESSION_DEDUP;
+            break;
+        case 'c':
+            chunk_size = strtol(optarg, NULL, 10);
+            if (chunk_size < 1 || chunk_size > MAX_CHUNK_SIZE) usage(argv[0]);
+            break;
+        case 'f':
+            if (parse_fec(optarg, &flags, &fec_k, &fec_m) < 0) usage(argv[0]);
+            break;
+        case 'g':
+            download = 1;
+            break;
+        case 'r':
+            rate = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+        }
     }
 
-    const char *server_ip = argv[1];
-    int server_port = atoi(argv[2]);
-    const char *filename = argv[3];
+    if (argc - optind != 3 && !(download && argc - optind == 4)) {
+        usage(argv[0]);
+    }
+    if (download && (legacy || (flags & ~SESSION_COMPRESS) || strlen(argv[optind + 2]) > NAME_MAX)) {
+        usage(argv[0]);
+    }
+    if (chunk_size == 0) {
+        chunk_size = (flags & SESSION_DEDUP) || download ? MAX_CHUNK_SIZE : DEFAULT_CHUNK_SIZE;
+    }
 
-    FILE *file = fopen(filename, "rb");
-    if (!file) {
+    const char *server_ip = argv[optind];
+    int server_port = atoi(argv[optind + 1]);
+    const char *filename = argv[optind + 2];
+
+    FILE *file = NULL;
+    if (!download && !(file = fopen(filename, "rb"))) {
         perror("fopen");
         exit(EXIT_FAILURE);
     }
@@ -71,7 +1110,7 @@ int main(int argc, char **argv) {
     int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
     if (sockfd < 0) {
         perror("socket");
-        fclose(file);
+        if (file) fclose(file);
         exit(EXIT_FAILURE);
     }
 
@@ -82,37 +1121,31 @@ int main(int argc, char **argv) {
         fail("inet_pton", file, sockfd);
     }
 
+    gso_probe(sockfd);
+
     struct timeval timeout = {3, 0};
     if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
         fail("setsockopt", file, sockfd);
     }
 
     socklen_t addr_len = sizeof(servaddr);
-    buffer send_buffer;
-    int packet_num = 0;
-
-    while (1) {
-        int c = fgetc(file);
-        if (c == EOF) {
-            printf("File sent successfully\n");
-            break;
-        }
+    char reply[ACK_REPLY_MAX];
 
-        send_buffer.packet_number = packet_num;
-        send_buffer.data = c;
-        send_buffer.check1 = 255;
-        send_buffer.check2 = 255;
-        send_buffer.check3 = 255;
-
-        char bytes[32];
-        snprintf(bytes, sizeof(bytes), "packet %d", packet_num);
-        send_with_ack(sockfd, &servaddr, addr_len, (char *)&send_buffer, sizeof(send_buffer), bytes);
-
-        packet_num++;
+    if (download) {
+        const char *local = argc - optind == 4 ? argv[optind + 3] : filename;
+        receive_session(sockfd, &servaddr, addr_len, filename, local, (uint16_t)chunk_size, flags, rate);
+        close(sockfd);
+        exit(EXIT_SUCCESS);
     }
-    send_with_ack(sockfd, &servaddr, addr_len, filename, strlen(filename), "filename");
+    if (legacy) {
+        send_legacy(sockfd, &servaddr, addr_len, file);
+    } else {
+        if (rate) pace_setup(sockfd, (uint64_t)rate * 1024);
+        send_session(sockfd, &servaddr, addr_len, file, (uint16_t)chunk_size, flags, fec_k, fec_m);
+    }
+    send_with_ack(sockfd, &servaddr, addr_len, filename, strlen(filename), ACK, strlen(ACK), reply, "filename");
 
     fclose(file);
     close(sockfd);
     exit(EXIT_SUCCESS);
-}
\ No newline at end of file
+}
@@ -0,0 +1,62 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+/*
+ * Log-linear histogram for latencies (nanoseconds, cycles, ...). Every
+ * power of two is split into HIST_SUB_BUCKETS equal steps, so a reported
+ * percentile is within 1 / HIST_SUB_BUCKETS of the true value at any
+ * scale, and recording a sample is a couple of instructions.
+ */
+
+#define HIST_SUB_BITS 3
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+};
+
+static inline int hist_bucket(uint64_t v) {
+    if (v < HIST_SUB_BUCKETS) return (int)v;
+    int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB_BUCKETS + (int)((v >> shift) & (HIST_SUB_BUCKETS - 1));
+}
+
+/* The largest value that lands in bucket b. */
+static inline uint64_t hist_bucket_max(int b) {
+    if (b < HIST_SUB_BUCKETS) return (uint64_t)b;
+    int shift = b / HIST_SUB_BUCKETS - 1;
+    uint64_t base = (uint64_t)(HIST_SUB_BUCKETS + b % HIST_SUB_BUCKETS) << shift;
+    return base + ((1ULL << shift) - 1);
+}
+
+static inline void hist_record(struct histogram *h, uint64_t v) {
+    h->buckets[hist_bucket(v)]++;
+    h->count++;
+    h->sum += v;
+    if (v > h->max) h->max = v;
+}
+
+/* The value below which a fraction p of the samples fall, rounded up to its bucket. */
+static inline uint64_t hist_percentile(const struct histogram *h, double p) {
+    if (h->count == 0) return 0;
+    uint64_t rank = (uint64_t)(p * (double)h->count);
+    if (rank >= h->count) rank = h->count - 1;
+
+    uint64_t seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen > rank) {
+            uint64_t v = hist_bucket_max(b);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+#endif
@@ -0,0 +1,170 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "tcp_log.h"
+
+/*
+ * Merges sharded TCP logs (server -S K) into one time-ordered stream.
+ * Every shard is already ordered, so a k-way merge reads each file once,
+ * front to back. With -f only one source is printed, and when the shard
+ * holding it can be worked out from the routing, only that file is read.
+ */
+
+struct input {
+    FILE *file;
+    char *line;
+    size_t cap;
+    ssize_t len;
+    struct tcp_log_record rec;
+};
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-f ip[:port]] [-k addr|peer] [-s shards] [file...]\n"
+                    "  -f  only records from this client address, or address and port\n"
+                    "  -k  how the server routed records (its -S setting, default addr)\n"
+                    "  -s  number of shards, when reading tcp_messages.N.log from the current directory\n"
+                    "      (default: as many as exist)\n"
+                    "Example: %s -f 10.0.0.7 > 10.0.0.7.log\n", prog, prog);
+    exit(1);
+}
+
+/* Reads the next line of an input; lines without a header keep the previous one's time. */
+static int input_next(struct input *in) {
+    in->len = getline(&in->line, &in->cap, in->file);
+    if (in->len < 0) return 0;
+
+    struct tcp_log_record rec;
+    if (tcp_log_parse(in->line, &rec) == 0) {
+        in->rec = rec;
+    } else {
+        in->rec.source = "";
+        in->rec.source_len = 0;
+    }
+    return 1;
+}
+
+static int source_matches(const struct tcp_log_record *rec, const char *filter) {
+    size_t len = strlen(filter);
+    if (strchr(filter, ':')) {
+        return rec->source_len == len && memcmp(rec->source, filter, len) == 0;
+    }
+    return rec->source_len > len && memcmp(rec->source, filter, len) == 0 && rec->source[len] == ':';
+}
+
+static int record_before(const struct tcp_log_record *a, const struct tcp_log_record *b) {
+    return a->sec < b->sec || (a->sec == b->sec && a->nsec < b->nsec);
+}
+
+int main(int argc, char **argv) {
+    const char *filter = NULL;
+    int by_peer = 0;
+    int shards = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:k:s:")) != -1) {
+        switch (opt) {
+        case 'f':
+            filter = optarg;
+            break;
+        case 'k':
+            if (strcmp(optarg, "peer") == 0) {
+                by_peer = 1;
+            } else if (strcmp(optarg, "addr") != 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 's':
+            shards = atoi(optarg);
+            if (shards < 1 || shards > TCP_MAX_SHARDS) usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    static char paths[TCP_MAX_SHARDS][64];
+    const char *names[TCP_MAX_SHARDS];
+    int count = 0;
+
+    if (optind < argc) {
+        if (argc - optind > TCP_MAX_SHARDS) {
+            fprintf(stderr, "At most %d files\n", TCP_MAX_SHARDS);
+            return 1;
+        }
+        for (int i = optind; i < argc; i++) {
+            names[count++] = argv[i];
+        }
+    } else {
+        if (shards == 0) {
+            while (shards < TCP_MAX_SHARDS) {
+                snprintf(paths[shards], sizeof(paths[shards]), TCP_SHARD_FILE, shards);
+                if (access(paths[shards], R_OK) != 0) break;
+                shards++;
+            }
+            if (shards == 0) {
+                fprintf(stderr, "No sharded logs (tcp_messages.N.log) here\n");
+                return 1;
+            }
+        }
+
+        /* The server's routing names the one shard a source can be in. */
+        struct in_addr addr;
+        char ip[INET_ADDRSTRLEN];
+        unsigned port = 0;
+        int has_port = filter && sscanf(filter, "%15[0-9.]:%u", ip, &port) == 2;
+        if (filter && !has_port) snprintf(ip, sizeof(ip), "%s", filter);
+        if (filter && (has_port || !by_peer) && inet_pton(AF_INET, ip, &addr) == 1) {
+            int shard = tcp_log_shard(addr, (uint16_t)port, by_peer, shards);
+            snprintf(paths[0], sizeof(paths[0]), TCP_SHARD_FILE, shard);
+            names[count++] = paths[0];
+        } else {
+            for (int i = 0; i < shards; i++) {
+                snprintf(paths[i], sizeof(paths[i]), TCP_SHARD_FILE, i);
+                names[count++] = paths[i];
+            }
+        }
+    }
+
+    struct input *inputs = calloc((size_t)count, sizeof(*inputs));
+    if (!inputs) {
+        perror("calloc");
+        return 1;
+    }
+    int open_count = 0;
+    for (int i = 0; i < count; i++) {
+        inputs[i].file = fopen(names[i], "r");
+        if (!inputs[i].file) {
+            perror(names[i]);
+            continue;
+        }
+        if (input_next(&inputs[i])) {
+            open_count++;
+        }
+    }
+
+    /* Shard counts are small, so the oldest head is found by a linear scan. */
+    static char out_buf[1 << 20];
+    setvbuf(stdout, out_buf, _IOFBF, sizeof(out_buf));
+    while (open_count > 0) {
+        struct input *oldest = NULL;
+        for (int i = 0; i < count; i++) {
+            if (inputs[i].len < 0 || !inputs[i].file) continue;
+            if (!oldest || record_before(&inputs[i].rec, &oldest->rec)) oldest = &inputs[i];
+        }
+
+        if (!filter || source_matches(&oldest->rec, filter)) {
+            fwrite(oldest->line, 1, (size_t)oldest->len, stdout);
+        }
+        if (!input_next(oldest)) open_count--;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (inputs[i].file) fclose(inputs[i].file);
+        free(inputs[i].line);
+    }
+    free(inputs);
+    return 0;
+}
@@ -0,0 +1,98 @@
+#ifndef PROBE_H
+#define PROBE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "histogram.h"
+
+/*
+ * Stage probes for the UDP packet path, compiled in only with -DPROBES.
+ * Without it every macro below expands to nothing, so the hot path is
+ * unchanged. With it each stage records its duration into a histogram:
+ * TSC cycles on x86, nanoseconds elsewhere. The probes keep no locks and
+ * must only be used on the UDP loop thread.
+ *
+ *   PROBE_START(t);              starts timing; t names the start point
+ *   PROBE_STOP(PROBE_WRITE, t);  records the time since t
+ *   PROBE_STOP_SELF(stage, t);   same, minus the stages timed inside it
+ */
+
+enum probe_stage {
+    PROBE_RECV,
+    PROBE_PARSE,
+    PROBE_IMPAIR,
+    PROBE_DECODE,
+    PROBE_WRITE,
+    PROBE_REPLY,
+    PROBE_TOTAL,
+    PROBE_STAGES
+};
+
+#ifdef PROBES
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROBE_UNIT "cycles"
+static inline uint64_t probe_now(void) {
+    return __rdtsc();
+}
+#else
+#define PROBE_UNIT "ns"
+static inline uint64_t probe_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+#endif
+
+static const char *const probe_names[PROBE_STAGES] = {"recv", "parse", "impair", "decode", "write", "reply", "total"};
+static struct histogram probe_hist[PROBE_STAGES];
+/* Running sum of everything recorded, so an outer stage can leave out its inner ones. */
+static uint64_t probe_inner;
+
+static inline void probe_stop(int stage, uint64_t start) {
+    uint64_t d = probe_now() - start;
+    hist_record(&probe_hist[stage], d);
+    probe_inner += d;
+}
+
+static inline void probe_stop_self(int stage, uint64_t start, uint64_t inner_at_start) {
+    uint64_t d = probe_now() - start - (probe_inner - inner_at_start);
+    hist_record(&probe_hist[stage], d);
+    probe_inner += d;
+}
+
+/* Prints each stage's share of a packet's cost, then its distribution per call. */
+static void probe_print(unsigned long long packets) {
+    if (packets == 0) return;
+    printf("Probes (%s per packet over %llu packets):", PROBE_UNIT, packets);
+    for (int i = 0; i < PROBE_STAGES; i++) {
+        printf(" %s %llu", probe_names[i], (unsigned long long)(probe_hist[i].sum / packets));
+    }
+    printf("\n");
+    for (int i = 0; i < PROBE_STAGES; i++) {
+        const struct histogram *h = &probe_hist[i];
+        if (h->count == 0) continue;
+        printf("Probe %s: %llu calls, p50 %llu, p99 %llu, max %llu %s\n", probe_names[i],
+               (unsigned long long)h->count, (unsigned long long)hist_percentile(h, 0.50),
+               (unsigned long long)hist_percentile(h, 0.99), (unsigned long long)h->max, PROBE_UNIT);
+    }
+}
+
+#define PROBE_START(t) uint64_t t = probe_now(), t##_inner = probe_inner
+#define PROBE_STOP(stage, t) (probe_stop((stage), (t)), (void)t##_inner)
+#define PROBE_STOP_SELF(stage, t) probe_stop_self((stage), (t), t##_inner)
+#define PROBE_PRINT(packets) probe_print(packets)
+
+#else
+
+#define PROBE_START(t) do {} while (0)
+#define PROBE_STOP(stage, t) do {} while (0)
+#define PROBE_STOP_SELF(stage, t) do {} while (0)
+#define PROBE_PRINT(packets) do {} while (0)
+
+#endif
+
+#endif
@@ -1,3 +1,6 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -8,10 +11,36 @@
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <sched.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/uio.h>
+
+#include "trace.h"
+#include "udp_proto.h"
+#include "histogram.h"
+#include "tcp_log.h"
+#include "probe.h"
 
-#define MAX_UDP_PACKET_SIZE 1024
+#define MAX_UDP_PACKET_SIZE 65536
 #define TCP_BACKLOG 10
 
+#define SPIN_MAX_PACKETS 1024
+
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#define RCVBUF_AUTO_MAX (64 << 20)
+
 static const char *ACK = "ACK";
 static pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
 static FILE *common_tcp_log_file = NULL;
@@ -90,28 +119,457 @@ static int* parse_packet_positions(const char *str, int *outSize) {
     return result;
 }
 
+/*
+ * Low-latency mode. The UDP loop and the log writers (trace flusher and
+ * TCP log threads) can be pinned to CPUs of their own, so they neither
+ * migrate nor compete with each other; downloads keep the CPUs the server
+ * started with.
+ */
+static int udp_cpu = -1;
+static int log_cpu = -1;
+static cpu_set_t default_cpus;
+
+static void pin_thread(int cpu) {
+    cpu_set_t set;
+    if (cpu < 0) return;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err) {
+        fprintf(stderr, "Cannot pin thread to CPU %d: %s\n", cpu, strerror(err));
+    }
+}
+
+/* Log threads are started by the pinned UDP loop; without a log CPU they go back to the default set. */
+static void pin_log_thread(void) {
+    if (log_cpu >= 0) {
+        pin_thread(log_cpu);
+    } else if (udp_cpu >= 0) {
+        pthread_setaffinity_np(pthread_self(), sizeof(default_cpus), &default_cpus);
+    }
+}
+
+/*
+ * Acknowledged log mode (see tcp_log.h). A client that starts its
+ * connection with "ACKMODE write" or "ACKMODE fsync" gets "A <n>\n" back
+ * for every batch of n records once they are written or on disk. Acks are
+ * cumulative in order, so the client matches them against its own queue.
+ * Other clients keep the old fire-and-forget behaviour.
+ */
+#define TCP_RECORD_MAX 65536
+#define SHARD_MAX_QUEUED (16 << 20)
+
+enum tcp_ack_mode { TCP_ACK_NONE, TCP_ACK_WRITE, TCP_ACK_FSYNC };
+
+struct tcp_peer {
+    int fd;
+    int shard;
+    char name[INET_ADDRSTRLEN + 6];
+};
+
+struct tcp_log_stats {
+    _Atomic unsigned long long records;
+    _Atomic unsigned long long acks;
+    _Atomic unsigned long long syncs;
+    _Atomic unsigned long long synced_batches;
+};
+
+static struct tcp_log_stats tcp_log_stats;
+
+/*
+ * Group commit: batches are numbered as they are written, and one
+ * fdatasync covers every batch written before it started, so threads that
+ * queue up behind a sync usually find their batch already on disk.
+ */
+static pthread_mutex_t sync_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long long log_batches_written;
+static unsigned long long log_batches_synced;
+
+/*
+ * Sharded log (-S K): records go to one of K files by client address, and
+ * each file has a writer thread of its own that appends everything queued
+ * with writev. Connection threads only format and queue; in acknowledged
+ * mode they wait until the writer is past their batch. Syncs group-commit
+ * the same way: one fdatasync per pass covers all batches in it.
+ */
+struct log_item {
+    struct log_item *next;
+    size_t len;
+    char data[];
+};
+
+struct log_shard {
+    int fd;
+    pthread_mutex_t mutex;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    struct log_item *head;
+    struct log_item *tail;
+    size_t queued_bytes;
+    unsigned long long queued;
+    unsigned long long written;
+    unsigned long long synced;
+    unsigned long long sync_wanted;
+    int error;
+    unsigned long long writes;
+    unsigned long long bytes;
+};
+
+static struct log_shard *log_shards;
+static int shard_count;
+static int shard_by_peer;
+
+static int writev_all(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t n = writev(fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+    return 0;
+}
+
+static void *shard_writer(void *arg) {
+    struct log_shard *sh = arg;
+    struct iovec iov[IOV_MAX];
+    pin_log_thread();
+
+    pthread_mutex_lock(&sh->mutex);
+    while (1) {
+        while (!sh->head) {
+            pthread_cond_wait(&sh->work, &sh->mutex);
+        }
+        struct log_item *items = sh->head;
+        unsigned long long last = sh->queued;
+        int sync = sh->sync_wanted > sh->synced;
+        sh->head = sh->tail = NULL;
+        pthread_mutex_unlock(&sh->mutex);
+
+        int err = 0;
+        unsigned long long writes = 0;
+        size_t bytes = 0;
+        struct log_item *it = items;
+        while (it && !err) {
+            int count = 0;
+            for (; it && count < IOV_MAX; it = it->next) {
+                iov[count].iov_base = it->data;
+                iov[count].iov_len = it->len;
+                bytes += it->len;
+                count++;
+            }
+            err = writev_all(sh->fd, iov, count);
+            writes++;
+        }
+        if (!err && sync) {
+            if (fdatasync(sh->fd) < 0) err = errno;
+            atomic_fetch_add(&tcp_log_stats.syncs, 1);
+        }
+        if (err) fprintf(stderr, "Shard write failed: %s\n", strerror(err));
+
+        size_t freed = 0;
+        while (items) {
+            struct log_item *next = items->next;
+            freed += items->len;
+            free(items);
+            items = next;
+        }
+
+        pthread_mutex_lock(&sh->mutex);
+        sh->queued_bytes -= freed;
+        sh->written = last;
+        if (sync && !err) sh->synced = last;
+        if (err) sh->error = err;
+        sh->writes += writes;
+        sh->bytes += bytes;
+        pthread_cond_broadcast(&sh->done);
+    }
+    return NULL;
+}
+
+/* Queues data (complete lines, plus an unterminated one if add_newline) with a header on every line. */
+static int shard_append(struct log_shard *sh, const char *source, const char *data, size_t len, int add_newline,
+                        int wait, int sync) {
+    size_t lines = add_newline ? 1 : 0;
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] == '\n') lines++;
+    }
+
+    pthread_mutex_lock(&sh->mutex);
+    while (sh->queued_bytes > SHARD_MAX_QUEUED && !sh->error) {
+        pthread_cond_wait(&sh->done, &sh->mutex);
+    }
+
+    /* Stamped under the shard lock, so the times in a file never go backwards. */
+    char header[64];
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    size_t header_len = (size_t)snprintf(header, sizeof(header), "%lld.%09ld %s ", (long long)now.tv_sec,
+                                         now.tv_nsec, source);
+    struct log_item *item = malloc(sizeof(*item) + len + (add_newline ? 1 : 0) + lines * header_len);
+    if (!item) {
+        pthread_mutex_unlock(&sh->mutex);
+        perror("malloc");
+        return -1;
+    }
+    char *out = item->data;
+    size_t start = 0;
+    while (start < len) {
+        const char *nl = memchr(data + start, '\n', len - start);
+        size_t end = nl ? (size_t)(nl - data) + 1 : len;
+        memcpy(out, header, header_len);
+        memcpy(out + header_len, data + start, end - start);
+        out += header_len + end - start;
+        start = end;
+    }
+    if (add_newline) *out++ = '\n';
+    item->len = (size_t)(out - item->data);
+    item->next = NULL;
+
+    if (sh->tail) {
+        sh->tail->next = item;
+    } else {
+        sh->head = item;
+    }
+    sh->tail = item;
+    sh->queued_bytes += item->len;
+    unsigned long long batch = ++sh->queued;
+    if (sync) sh->sync_wanted = batch;
+    pthread_cond_signal(&sh->work);
+
+    while (wait && !sh->error && (sh->written < batch || (sync && sh->synced < batch))) {
+        pthread_cond_wait(&sh->done, &sh->mutex);
+    }
+    int err = sh->error;
+    pthread_mutex_unlock(&sh->mutex);
+    return err ? -1 : 0;
+}
+
+static int open_log_shards(void) {
+    log_shards = calloc((size_t)shard_count, sizeof(*log_shards));
+    if (!log_shards) return -1;
+
+    for (int i = 0; i < shard_count; i++) {
+        struct log_shard *sh = &log_shards[i];
+        char path[64];
+        snprintf(path, sizeof(path), TCP_SHARD_FILE, i);
+        sh->fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        if (sh->fd < 0) {
+            perror(path);
+            return -1;
+        }
+        pthread_mutex_init(&sh->mutex, NULL);
+        pthread_cond_init(&sh->work, NULL);
+        pthread_cond_init(&sh->done, NULL);
+
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, shard_writer, sh) != 0) {
+            perror("pthread_create");
+            return -1;
+        }
+        pthread_detach(tid);
+    }
+    return 0;
+}
+
+static int tcp_log_append(const struct tcp_peer *peer, const char *data, size_t len, int add_newline, int mode) {
+    int sync = mode == TCP_ACK_FSYNC;
+    if (log_shards) {
+        if (sync) atomic_fetch_add(&tcp_log_stats.synced_batches, 1);
+        return shard_append(&log_shards[peer->shard], peer->name, data, len, add_newline, mode != TCP_ACK_NONE,
+                            sync);
+    }
+
+    int ok = 0;
+    unsigned long long batch = 0;
+
+    pthread_mutex_lock(&file_mutex);
+    if (common_tcp_log_file) {
+        fwrite(data, 1, len, common_tcp_log_file);
+        if (add_newline) fputc('\n', common_tcp_log_file);
+        ok = fflush(common_tcp_log_file) == 0;
+        batch = ++log_batches_written;
+    }
+    pthread_mutex_unlock(&file_mutex);
+    if (!ok || !sync) return ok ? 0 : -1;
+
+    atomic_fetch_add(&tcp_log_stats.synced_batches, 1);
+    pthread_mutex_lock(&sync_mutex);
+    if (log_batches_synced < batch) {
+        pthread_mutex_lock(&file_mutex);
+        unsigned long long covered = log_batches_written;
+        int fd = fileno(common_tcp_log_file);
+        pthread_mutex_unlock(&file_mutex);
+
+        if (fdatasync(fd) < 0) {
+            perror("fdatasync tcp_messages.log");
+            ok = 0;
+        } else {
+            log_batches_synced = covered;
+        }
+        atomic_fetch_add(&tcp_log_stats.syncs, 1);
+    }
+    pthread_mutex_unlock(&sync_mutex);
+    return ok ? 0 : -1;
+}
+
+/*
+ * Reads until the connection's first bytes either are an ACKMODE line,
+ * which is consumed, or cannot be one. Whatever else was read stays in
+ * buffer. Returns -1 if the client closed first.
+ */
+static int tcp_read_mode(int sockfd, char *buffer, size_t size, size_t *len) {
+    const size_t hello_len = strlen(TCP_ACK_HELLO);
+
+    while (1) {
+        size_t cmp = *len < hello_len ? *len : hello_len;
+        if (memcmp(buffer, TCP_ACK_HELLO, cmp) != 0) return TCP_ACK_NONE;
+
+        char *nl = *len > hello_len ? memchr(buffer, '\n', *len) : NULL;
+        if (nl) {
+            const char *word = buffer + hello_len;
+            size_t word_len = (size_t)(nl - word);
+            int mode = TCP_ACK_NONE;
+            if (word_len == 5 && memcmp(word, "write", 5) == 0) mode = TCP_ACK_WRITE;
+            if (word_len == 5 && memcmp(word, "fsync", 5) == 0) mode = TCP_ACK_FSYNC;
+            if (mode == TCP_ACK_NONE) return TCP_ACK_NONE;
+            *len -= (size_t)(nl + 1 - buffer);
+            memmove(buffer, nl + 1, *len);
+            return mode;
+        }
+        if (*len >= 64) return TCP_ACK_NONE;
+
+        ssize_t n = read(sockfd, buffer + *len, size - *len);
+        if (n <= 0) return -1;
+        *len += (size_t)n;
+    }
+}
+
+static void tcp_acked_loop(const struct tcp_peer *peer, char *buffer, size_t len, int mode) {
+    int sockfd = peer->fd;
+
+    while (1) {
+        /* Complete records go out as one batch; a record that fills the buffer is cut there. */
+        size_t end = 0, count = 0;
+        for (size_t i = 0; i < len; i++) {
+            if (buffer[i] == '\n') {
+                end = i + 1;
+                count++;
+            }
+        }
+        int cut = count == 0 && len == TCP_RECORD_MAX;
+        if (cut) {
+            end = len;
+            count = 1;
+        }
+
+        if (count) {
+            char ack[32];
+            int ack_len = snprintf(ack, sizeof(ack), "A %zu\n", count);
+            if (tcp_log_append(peer, buffer, end, cut, mode) < 0) return;
+            atomic_fetch_add(&tcp_log_stats.records, count);
+            if (send(sockfd, ack, (size_t)ack_len, MSG_NOSIGNAL) != ack_len) return;
+            atomic_fetch_add(&tcp_log_stats.acks, 1);
+            len -= end;
+            memmove(buffer, buffer + end, len);
+        }
+
+        ssize_t n = read(sockfd, buffer + len, TCP_RECORD_MAX - len);
+        if (n <= 0) break;
+        len += (size_t)n;
+    }
+    /* An unterminated tail is still logged, but never acknowledged. */
+    if (len > 0) tcp_log_append(peer, buffer, len, 1, TCP_ACK_NONE);
+}
+
+/* Without acks every read is a record, as it always was; shards only add a newline where one is missing. */
+static void tcp_log_read(const struct tcp_peer *peer, const char *buffer, size_t len) {
+    tcp_log_append(peer, buffer, len, !log_shards || buffer[len - 1] != '\n', TCP_ACK_NONE);
+    atomic_fetch_add(&tcp_log_stats.records, 1);
+}
+
 void *tcp_client_handler(void *arg) {
-    int sockfd = *(int*)arg;
-    free(arg);
+    struct tcp_peer *peer = arg;
+    int sockfd = peer->fd;
+    pin_log_thread();
 
-    char buffer[1024];
+    char buffer[TCP_RECORD_MAX];
+    size_t len = 0;
     ssize_t n;
 
-    while ((n = read(sockfd, buffer, sizeof(buffer) - 1)) > 0) {
-        buffer[n] = '\0';
-        pthread_mutex_lock(&file_mutex);
-        if (common_tcp_log_file) {
-            fprintf(common_tcp_log_file, "%s\n", buffer);
-            fflush(common_tcp_log_file);
+    int mode = tcp_read_mode(sockfd, buffer, sizeof(buffer) - 1, &len);
+    if (mode == TCP_ACK_WRITE || mode == TCP_ACK_FSYNC) {
+        tcp_acked_loop(peer, buffer, len, mode);
+    } else {
+        if (len > 0) tcp_log_read(peer, buffer, len);
+        while (mode >= 0 && (n = read(sockfd, buffer, 1024 - 1)) > 0) {
+            tcp_log_read(peer, buffer, (size_t)n);
         }
-        pthread_mutex_unlock(&file_mutex);
     }
     close(sockfd);
+    free(peer);
     pthread_exit(NULL);
     return NULL;
 }
 
-static int setup_udp_socket(const char *server_ip, struct sockaddr_in *servaddr) {
+/*
+ * The UDP socket's receive buffer (-R) and the kernel's count of datagrams
+ * dropped because it was full. SO_RXQ_OVFL attaches that count, which is
+ * cumulative for the socket, to every receive, so drops are noticed with
+ * the first datagram after them. In auto mode each new drop doubles the
+ * buffer, up to RCVBUF_AUTO_MAX.
+ */
+struct rcvbuf_state {
+    int size;
+    int autotune;
+    int overflow_counted;
+    unsigned grown;
+    uint32_t drops;
+    unsigned long long drop_bursts;
+};
+
+static struct rcvbuf_state rcvbuf;
+
+/* Asks for bytes of buffer, past net.core.rmem_max when allowed (CAP_NET_ADMIN); returns what the kernel granted. */
+static int set_rcvbuf(int udp_sock, int bytes) {
+    if (setsockopt(udp_sock, SOL_SOCKET, SO_RCVBUFFORCE, &bytes, sizeof(bytes)) < 0
+        && setsockopt(udp_sock, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes)) < 0) {
+        perror("setsockopt SO_RCVBUF");
+    }
+    int size = 0;
+    socklen_t len = sizeof(size);
+    getsockopt(udp_sock, SOL_SOCKET, SO_RCVBUF, &size, &len);
+    return size;
+}
+
+static void rcvbuf_note_drops(int udp_sock, uint32_t drops) {
+    if (drops == rcvbuf.drops) return;
+    rcvbuf.drops = drops;
+    rcvbuf.drop_bursts++;
+    if (!rcvbuf.autotune || rcvbuf.size >= RCVBUF_AUTO_MAX) return;
+
+    /* The kernel reports twice the size it was asked for, so asking for the current size doubles it. */
+    int size = set_rcvbuf(udp_sock, rcvbuf.size);
+    if (size > rcvbuf.size) {
+        rcvbuf.size = size;
+        rcvbuf.grown++;
+        TRACE2(TEV_RCVBUF_GROWN, size, drops, NULL);
+    } else {
+        rcvbuf.autotune = 0;
+        TRACE1(TEV_RCVBUF_LIMIT, size, NULL);
+    }
+}
+
+static int setup_udp_socket(const char *server_ip, struct sockaddr_in *servaddr, int rcvbuf_kib) {
     int udp_sock = socket(AF_INET, SOCK_DGRAM, 0);
     if (udp_sock < 0) {
         perror("socket udp");
@@ -134,6 +592,30 @@ static int setup_udp_socket(const char *server_ip, struct sockaddr_in *servaddr)
         return -1;
     }
 
+    int stamp = 1;
+    if (setsockopt(udp_sock, SOL_SOCKET, SO_TIMESTAMPNS, &stamp, sizeof(stamp)) < 0) {
+        perror("setsockopt SO_TIMESTAMPNS");
+    }
+
+    int ovfl = 1;
+    if (setsockopt(udp_sock, SOL_SOCKET, SO_RXQ_OVFL, &ovfl, sizeof(ovfl)) == 0) {
+        rcvbuf.overflow_counted = 1;
+    } else {
+        perror("setsockopt SO_RXQ_OVFL");
+    }
+    if (rcvbuf_kib > 0) {
+        rcvbuf.size = set_rcvbuf(udp_sock, rcvbuf_kib * 1024);
+    } else {
+        socklen_t len = sizeof(rcvbuf.size);
+        getsockopt(udp_sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf.size, &len);
+    }
+
+    /* Without GRO support every receive simply carries one datagram. */
+    int on = 1;
+    if (setsockopt(udp_sock, SOL_UDP, UDP_GRO, &on, sizeof(on)) < 0) {
+        printf("UDP GRO unavailable, receiving datagrams one by one\n");
+    }
+
     return udp_sock;
 }
 
@@ -159,207 +641,1678 @@ static int setup_tcp_socket(const struct sockaddr_in *servaddr) {
     return tcp_sock;
 }
 
-static void cleanup_resources(FILE *client_files[], int size, int *lostPositions, int *rejectCount, int udp_sock, int tcp_sock) {
-    for (int i = 0; i < size; i++) {
-        if (client_files[i]) fclose(client_files[i]);
-    }
-    if (common_tcp_log_file) fclose(common_tcp_log_file);
-    free(lostPositions);
-    free(rejectCount);
-    close(udp_sock);
-    close(tcp_sock);
-}
+#define FEC_WINDOW 16
+/*
+ * An upload is written to a hidden file named after the client port and
+ * renamed into place by the closing filename packet, so a download of the
+ * same name never sees it half written, and GET refuses hidden names.
+ */
+#define SESSION_TEMP_NAME ".%d.bin"
+/* How far past the first missing chunk a session accepts data, 8 GiB at the largest chunk size. */
+#define RX_WINDOW_CHUNKS (1ULL << 20)
 
-static int handle_udp_packet(int udp_sock, FILE *client_files[], int *lostPositions, int lostSize, int *rejectCount) {
-    char buffer[MAX_UDP_PACKET_SIZE];
-    struct sockaddr_in clientaddr;
-    socklen_t len = sizeof(clientaddr);
+struct fec_group {
+    int active;
+    int done;
+    uint64_t id;
+    int count;
+    int received;
+    uint8_t present[FEC_MAX_SYMBOLS];
+    uint8_t *symbols;
+};
 
-    ssize_t n = recvfrom(udp_sock, buffer, sizeof(buffer) - 1, 0, (struct sockaddr *)&clientaddr, &len);
-    if (n < 0) {
-        perror("recvfrom");
-        return -1;
-    }
-    buffer[n] = '\0';
+/* One chunk of a dedup upload, as described by the client's INDEX packets. */
+struct dedup_entry {
+    uint64_t offset;
+    uint16_t len;
+    uint8_t hash[SHA256_LEN];
+};
 
-    if (n < 1) {
-        fprintf(stderr, "Received empty packet\n");
-        return 0;
-    }
+struct udp_session {
+    FILE *file;
+    uint8_t flags;
+    uint16_t chunk_size;
+    int fec_k;
+    int fec_m;
+    size_t symbol_size;
+    uint64_t groups_done_below;
+    uint64_t fec_high_group;
+    struct fec_group groups[FEC_WINDOW];
+    uint8_t *rx_bitmap;
+    uint64_t rx_bits;
+    uint64_t rx_low;
+    uint64_t rx_high;
+    uint64_t nack_mark;
+    uint64_t total_chunks;
+    int fin_received;
+    struct timespec last_nack;
+    struct dedup_entry *index;
+    uint64_t index_count;
+    uint64_t index_cap;
+};
 
-    int client_port = ntohs(clientaddr.sin_port);
-    char temp_filename[32];
-    snprintf(temp_filename, sizeof(temp_filename), "%d.bin", client_port);
+struct impairment {
+    int *lostPositions;
+    int lostSize;
+    int *rejectCount;
+    unsigned loss_percent;
+    unsigned seed;
+};
 
-    FILE *f = client_files[client_port];
+struct server_stats {
+    unsigned long long udp_receives;
+    unsigned long long udp_packets;
+    unsigned long long udp_bytes;
+    unsigned long long chunks_stored;
+    unsigned long long chunks_recovered;
+    unsigned long long parity_received;
+    unsigned long long groups_completed;
+    unsigned long long packets_rejected;
+    unsigned long long duplicates;
+    unsigned long long nacks_sent;
+    unsigned long long chunks_nacked;
+    unsigned long long chunks_indexed;
+    unsigned long long chunks_deduped;
+    unsigned long long bytes_deduped;
+};
 
-    unsigned char check1 = (unsigned char)buffer[0];
-    unsigned char check2 = (unsigned char)buffer[1];
-    unsigned char check3 = (unsigned char)buffer[2];
+static struct server_stats stats;
 
-    if (check1 != 255 || check2 != 255 || check3 != 255) {
-        if (f) {
-            fclose(f);
-            client_files[client_port] = NULL;
-        }
-        if (rename(temp_filename, buffer) == 0) {
-            printf("File for client port %d renamed to %s\n", client_port, buffer);
-        } else {
-            perror("rename");
-        }
-        if (sendto(udp_sock, ACK, strlen(ACK), 0, (struct sockaddr *)&clientaddr, len) < 0) {
-            perror("sendto");
-            return -1;
-        }
-        return 0;
-    }
+/*
+ * Turnaround of every receive, from the kernel's timestamp to the end of
+ * its handling (replies included), split by whether the loop caught the
+ * packet while spinning or had to be woken from select.
+ */
+static struct histogram latency_spin;
+static struct histogram latency_sleep;
 
-    if (!f) {
-        f = fopen(temp_filename, "wb");
-        if (!f) {
-            perror("fopen");
-            return 0;
-        }
-        client_files[client_port] = f;
-        printf("Opened file %s for client port %d\n", temp_filename, client_port);
-    }
+/* Downloads run in their own threads, so their counters are atomic. */
+struct get_stats {
+    _Atomic unsigned long long started;
+    _Atomic unsigned long long completed;
+    _Atomic unsigned long long failed;
+    _Atomic unsigned long long chunks_sent;
+    _Atomic unsigned long long chunks_resent;
+    _Atomic unsigned long long chunks_dropped;
+};
 
-    if (n < 8) {
-        fprintf(stderr, "Packet too small\n");
-        return 0;
-    }
+static struct get_stats get_stats;
+static const char *dedup_dir = NULL;
+static volatile sig_atomic_t stats_requested = 0;
 
-    unsigned char data_byte = (unsigned char)buffer[3];
-    int packet_num = (unsigned char)buffer[4] 
-                    | ((unsigned char)buffer[5] << 8) 
-                    | ((unsigned char)buffer[6] << 16) 
-                    | ((unsigned char)buffer[7] << 24);
+static void request_stats(int sig) {
+    (void)sig;
+    stats_requested = 1;
+}
 
-    if (packet_num < lostSize && rejectCount[packet_num] < lostPositions[packet_num]) {
-        rejectCount[packet_num]++;
-        printf("Rejecting packet number %d (%d/%d)\n", packet_num, rejectCount[packet_num], lostPositions[packet_num]);
-        return 0;
+static void print_latency(const char *how, const struct histogram *h) {
+    if (h->count == 0) return;
+    printf("Latency %s: %llu receives, p50 %.1f us, p99 %.1f us, max %.1f us\n", how,
+           (unsigned long long)h->count, hist_percentile(h, 0.50) / 1e3, hist_percentile(h, 0.99) / 1e3,
+           h->max / 1e3);
+}
+
+static void print_stats(void) {
+    printf("UDP stats: %llu packets in %llu receives, %llu bytes, %llu chunks stored, %llu rejected by impairment\n"
+           "FEC stats: %llu parity packets, %llu groups completed, %llu chunks recovered\n"
+           "NACK stats: %llu NACKs sent for %llu chunks, %llu duplicate chunks\n"
+           "Dedup stats: %llu chunks indexed, %llu (%llu bytes) taken from the store\n"
+           "GET stats: %llu started, %llu completed, %llu failed, %llu chunks sent, %llu retransmitted, "
+           "%llu rejected by impairment\n"
+           "TCP log stats: %llu records, %llu acks, %llu fsyncs for %llu synced batches\n",
+           stats.udp_packets, stats.udp_receives, stats.udp_bytes, stats.chunks_stored, stats.packets_rejected,
+           stats.parity_received, stats.groups_completed, stats.chunks_recovered,
+           stats.nacks_sent, stats.chunks_nacked, stats.duplicates,
+           stats.chunks_indexed, stats.chunks_deduped, stats.bytes_deduped,
+           atomic_load(&get_stats.started), atomic_load(&get_stats.completed), atomic_load(&get_stats.failed),
+           atomic_load(&get_stats.chunks_sent), atomic_load(&get_stats.chunks_resent),
+           atomic_load(&get_stats.chunks_dropped),
+           atomic_load(&tcp_log_stats.records), atomic_load(&tcp_log_stats.acks),
+           atomic_load(&tcp_log_stats.syncs), atomic_load(&tcp_log_stats.synced_batches));
+    if (log_shards) {
+        unsigned long long batches = 0, writes = 0, bytes = 0;
+        for (int i = 0; i < shard_count; i++) {
+            pthread_mutex_lock(&log_shards[i].mutex);
+            batches += log_shards[i].written;
+            writes += log_shards[i].writes;
+            bytes += log_shards[i].bytes;
+            pthread_mutex_unlock(&log_shards[i].mutex);
+        }
+        printf("Log shards: %d files, %llu batches in %llu writev calls, %llu bytes\n", shard_count, batches, writes,
+               bytes);
+    }
+    printf("Receive buffer: %d bytes%s, grown %u times, ", rcvbuf.size, rcvbuf.autotune ? " (auto)" : "",
+           rcvbuf.grown);
+    if (rcvbuf.overflow_counted) {
+        printf("%u datagrams dropped by the kernel in %llu bursts\n", rcvbuf.drops, rcvbuf.drop_bursts);
+    } else {
+        printf("kernel drops not reported\n");
     }
+    print_latency("spinning", &latency_spin);
+    print_latency("after select", &latency_sleep);
+    PROBE_PRINT(stats.udp_packets);
+    fflush(stdout);
+}
 
-    if (fwrite(&data_byte, 1, 1, f) != 1) {
-        perror("fwrite");
-        return -1;
+static void close_session(struct udp_session *sessions[], int port) {
+    struct udp_session *s = sessions[port];
+    if (!s) return;
+    if (s->file) fclose(s->file);
+    for (int i = 0; i < FEC_WINDOW; i++) {
+        free(s->groups[i].symbols);
     }
+    free(s->rx_bitmap);
+    free(s->index);
+    free(s);
+    sessions[port] = NULL;
+}
 
-    if (sendto(udp_sock, ACK, strlen(ACK), 0, (struct sockaddr *)&clientaddr, len) < 0) {
-        perror("sendto");
-        return -1;
-    } else {
-        printf("Sent ACK for packet number %d\n", packet_num);
+static struct udp_session *open_session(struct udp_session *sessions[], int port) {
+    struct udp_session *s = sessions[port];
+    if (s) return s;
+
+    s = calloc(1, sizeof(*s));
+    if (!s) {
+        perror("calloc");
+        return NULL;
     }
+    sessions[port] = s;
+    return s;
+}
+
+/*
+ * Takes a session handler's result. An error (the file cannot be written
+ * because the disk is full or the offset is past the file size limit, or
+ * a reply cannot be sent) drops only that session and its partial file;
+ * the other sessions and the server keep going.
+ */
+static int fail_session(struct udp_session *sessions[], int port, int r) {
+    if (r >= 0 || !sessions[port]) return r;
 
+    char temp_filename[32];
+    snprintf(temp_filename, sizeof(temp_filename), SESSION_TEMP_NAME, port);
+    close_session(sessions, port);
+    unlink(temp_filename);
+    TRACE1(TEV_SESSION_FAILED, port, NULL);
     return 0;
 }
 
-static int handle_tcp_connection(int tcp_sock) {
-    struct sockaddr_in clientaddr;
-    socklen_t len = sizeof(clientaddr);
+static FILE *session_file(struct udp_session *s, int port) {
+    if (s->file) return s->file;
 
-    int client_fd = accept(tcp_sock, (struct sockaddr*)&clientaddr, &len);
-    if (client_fd < 0) {
-        perror("accept");
-        return -1;
+    char temp_filename[32];
+    snprintf(temp_filename, sizeof(temp_filename), SESSION_TEMP_NAME, port);
+    s->file = fopen(temp_filename, "wb");
+    if (!s->file) {
+        perror("fopen");
+        return NULL;
     }
+    TRACE2(TEV_FILE_OPENED, port, port, NULL);
+    return s->file;
+}
 
-    char client_ip[INET_ADDRSTRLEN];
-    if (inet_ntop(AF_INET, &clientaddr.sin_addr, client_ip, sizeof(client_ip)) != NULL) {
-        printf("New TCP connection from %s:%d\n", client_ip, ntohs(clientaddr.sin_port));
+static int session_setup_fec(struct udp_session *s, int k, int m) {
+    if (s->fec_k == k && s->fec_m == m && s->groups[0].symbols) return 0;
+
+    s->fec_k = k;
+    s->fec_m = m;
+    s->symbol_size = fec_symbol_size(s->chunk_size);
+    s->groups_done_below = 0;
+    for (int i = 0; i < FEC_WINDOW; i++) {
+        free(s->groups[i].symbols);
+        memset(&s->groups[i], 0, sizeof(s->groups[i]));
+        s->groups[i].symbols = malloc((size_t)(k + m) * s->symbol_size);
+        if (!s->groups[i].symbols) {
+            perror("malloc");
+            return -1;
+        }
     }
+    return 0;
+}
 
-    int *arg = malloc(sizeof(int));
-    if (!arg) {
-        perror("malloc");
-        close(client_fd);
-        return -1;
+static void cleanup_resources(struct udp_session *sessions[], int size, struct impairment *imp, int udp_sock, int tcp_sock) {
+    for (int i = 0; i < size; i++) {
+        close_session(sessions, i);
+    }
+    if (common_tcp_log_file) fclose(common_tcp_log_file);
+    trace_shutdown();
+    free(imp->lostPositions);
+    free(imp->rejectCount);
+    close(udp_sock);
+    close(tcp_sock);
+}
+
+/* packet_num < 0 exempts a packet from the position list but not from random loss. */
+static int packet_rejected(long packet_num, struct impairment *imp) {
+    PROBE_START(t);
+    int rejected = 0;
+    if (packet_num >= 0 && packet_num < imp->lostSize && imp->rejectCount[packet_num] < imp->lostPositions[packet_num]) {
+        imp->rejectCount[packet_num]++;
+        stats.packets_rejected++;
+        TRACE3(TEV_PACKET_REJECTED, packet_num, imp->rejectCount[packet_num], imp->lostPositions[packet_num], NULL);
+        rejected = 1;
+    } else if (imp->loss_percent && (unsigned)rand_r(&imp->seed) % 100 < imp->loss_percent) {
+        stats.packets_rejected++;
+        TRACE1(TEV_PACKET_DROPPED, packet_num, NULL);
+        rejected = 1;
     }
-    *arg = client_fd;
+    PROBE_STOP(PROBE_IMPAIR, t);
+    return rejected;
+}
 
-    pthread_t tid;
-    if (pthread_create(&tid, NULL, tcp_client_handler, arg) != 0) {
-        perror("pthread_create");
-        close(client_fd);
-        free(arg);
+static int send_reply(int udp_sock, const uint8_t *reply, size_t reply_len, struct sockaddr_in *clientaddr, socklen_t len) {
+    PROBE_START(t);
+    ssize_t sent = sendto(udp_sock, reply, reply_len, 0, (struct sockaddr *)clientaddr, len);
+    PROBE_STOP(PROBE_REPLY, t);
+    if (sent < 0) {
+        perror("sendto");
         return -1;
     }
-    pthread_detach(tid);
     return 0;
 }
 
-int main(int argc, char **argv) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s server_ip [packet_positions]\nExample: %s 127.0.0.1 [1,5,6]\n", argv[0], argv[0]);
-        exit(EXIT_FAILURE);
-    }
+/* Refuses a request with "ERR" and the reason, so the client can stop instead of retrying. */
+static int send_error(int udp_sock, const char *reason, struct sockaddr_in *clientaddr, socklen_t len) {
+    char reply[128];
+    int n = snprintf(reply, sizeof(reply), "%s%s", PROTO_ERROR, reason);
+    if (n >= (int)sizeof(reply)) n = sizeof(reply) - 1;
+    return send_reply(udp_sock, (const uint8_t *)reply, (size_t)n, clientaddr, len);
+}
 
-    int lostSize = 0;
-    int *lostPositions = parse_packet_positions(argv[2], &lostSize);
-    if (!lostPositions && lostSize != 0) {
-        fprintf(stderr, "Failed to parse lost positions\n");
-        exit(EXIT_FAILURE);
+/* Checks the version and chunk size that HELLO and GET start with; otherwise gives the client the reason. */
+static int session_params_valid(uint8_t version, size_t used, uint64_t chunk_size, char *reason, size_t size) {
+    if (version != PROTO_VERSION) {
+        snprintf(reason, size, "protocol version %d not supported, server speaks %d", version, PROTO_VERSION);
+        return 0;
     }
-
-    struct sockaddr_in servaddr;
-    int udp_sock = setup_udp_socket(argv[1], &servaddr);
-    if (udp_sock < 0) {
-        free(lostPositions);
-        exit(EXIT_FAILURE);
+    if (!used || chunk_size == 0 || chunk_size > MAX_CHUNK_SIZE) {
+        snprintf(reason, size, "chunk size must be 1..%d", MAX_CHUNK_SIZE);
+        return 0;
     }
+    return 1;
+}
 
-    socklen_t servLen = sizeof(servaddr);
-    if (getsockname(udp_sock, (struct sockaddr*)&servaddr, &servLen) == -1) {
-        perror("getsockname");
-        close(udp_sock);
-        free(lostPositions);
-        exit(EXIT_FAILURE);
-    }
+static int handle_hello(int udp_sock, struct udp_session *sessions[], const uint8_t *pkt, ssize_t n,
+                        struct sockaddr_in *clientaddr, socklen_t len) {
+    int client_port = ntohs(clientaddr->sin_port);
 
-    int tcp_sock = setup_tcp_socket(&servaddr);
-    if (tcp_sock < 0) {
-        close(udp_sock);
-        free(lostPositions);
-        exit(EXIT_FAILURE);
+    if (n < 5) {
+        TRACE1(TEV_SHORT_PACKET, n, NULL);
+        return 0;
     }
 
-    int server_port = ntohs(servaddr.sin_port);
-    printf("Server running on port %d (TCP+UDP)\n", server_port);
-
-    int *rejectCount = calloc(lostSize, sizeof(int));
-    if (!rejectCount) {
-        perror("calloc");
-        cleanup_resources(NULL, 0, lostPositions, NULL, udp_sock, tcp_sock);
-        exit(EXIT_FAILURE);
+    uint8_t flags = pkt[3] & SESSION_FLAGS_SUPPORTED;
+    if (!dedup_dir) flags &= ~SESSION_DEDUP;
+    if (flags & SESSION_DEDUP) flags &= ~SESSION_FEC;
+    uint64_t chunk_size = 0;
+    size_t used = get_varint(pkt + 4, (size_t)n - 4, &chunk_size);
+    char reason[64];
+    if (!session_params_valid(pkt[2], used, chunk_size, reason, sizeof(reason))) {
+        TRACE3(TEV_BAD_HELLO, client_port, pkt[2], chunk_size, NULL);
+        return send_error(udp_sock, reason, clientaddr, len);
     }
 
-    FILE *client_files[65536] = {NULL};
+    const uint8_t *fec = pkt + 4 + used;
+    int fec_k = 0, fec_m = 0;
+    if (flags & SESSION_FEC) {
+        if ((size_t)n >= 4 + used + 2 && fec_params_valid(flags, fec[0], fec[1])) {
+            fec_k = fec[0];
+            fec_m = fec[1];
+        } else {
+            flags &= ~SESSION_FEC;
+        }
+    }
 
-    common_tcp_log_file = fopen("tcp_messages.log", "a");
-    if (!common_tcp_log_file) {
-        perror("open tcp_messages.log");
-        cleanup_resources(client_files, 65536, lostPositions, rejectCount, udp_sock, tcp_sock);
-        exit(EXIT_FAILURE);
+    struct udp_session *s = open_session(sessions, client_port);
+    if (!s) return 0;
+    s->flags = flags;
+    s->chunk_size = (uint16_t)chunk_size;
+    if (!session_file(s, client_port)) return 0;
+    if ((flags & SESSION_FEC) && session_setup_fec(s, fec_k, fec_m) < 0) {
+        close_session(sessions, client_port);
+        return 0;
     }
+    TRACE3(TEV_SESSION_STARTED, client_port, s->flags, s->chunk_size, NULL);
 
-    fd_set readfds;
-    int maxfd = udp_sock > tcp_sock ? udp_sock : tcp_sock;
+    uint8_t reply[PROTO_HELLO_REPLY_LEN];
+    memcpy(reply, ACK, strlen(ACK));
+    reply[3] = PROTO_VERSION;
+    reply[4] = s->flags;
+    return send_reply(udp_sock, reply, sizeof(reply), clientaddr, len);
+}
+
+static int rx_has(const struct udp_session *s, uint64_t seq) {
+    return seq < s->rx_bits && (s->rx_bitmap[seq >> 3] >> (seq & 7)) & 1;
+}
+
+static int rx_mark(struct udp_session *s, uint64_t seq) {
+    if (seq >= s->rx_bits) {
+        uint64_t bits = s->rx_bits ? s->rx_bits : 8192;
+        while (bits <= seq) bits *= 2;
+        uint8_t *bitmap = realloc(s->rx_bitmap, bits / 8 + 1);
+        if (!bitmap) {
+            perror("realloc");
+            return -1;
+        }
+        memset(bitmap + s->rx_bits / 8, 0, bits / 8 + 1 - s->rx_bits / 8);
+        s->rx_bitmap = bitmap;
+        s->rx_bits = bits;
+    }
+    s->rx_bitmap[seq >> 3] |= (uint8_t)(1 << (seq & 7));
+    if (seq >= s->rx_high) s->rx_high = seq + 1;
+    while (rx_has(s, s->rx_low)) s->rx_low++;
+    return 0;
+}
+
+/*
+ * Whether seq lies in the session's receive window, so a forged sequence
+ * number cannot grow the file, the bitmap or a NACK scan without bound.
+ * Dedup chunks are bounded by the index instead; stop-and-wait chunks
+ * arrive in order, so there the highest one stored is the first missing.
+ */
+static int rx_in_window(const struct udp_session *s, uint64_t seq) {
+    uint64_t base = s->rx_low;
+    if (s->flags & SESSION_DEDUP) return seq < s->index_count;
+    if ((s->flags & SESSION_FEC) && !(s->flags & SESSION_NACK)) base = s->groups_done_below * (uint64_t)s->fec_k;
+    else if (!(s->flags & SESSION_NACK)) base = s->rx_high;
+    return seq < base + RX_WINDOW_CHUNKS;
+}
+
+static void dedup_path(char *path, size_t size, const uint8_t *hash) {
+    int n = snprintf(path, size, "%s/", dedup_dir);
+    for (int i = 0; i < SHA256_LEN && n + 2 < (int)size; i++) {
+        n += snprintf(path + n, size - n, "%02x", hash[i]);
+    }
+}
+
+/* Reads a chunk from the store; returns 1 only if it is there intact. */
+static int dedup_load(const struct dedup_entry *e, uint8_t *buf) {
+    char path[4096];
+    uint8_t hash[SHA256_LEN];
+
+    dedup_path(path, sizeof(path), e->hash);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 0;
+    ssize_t n = read(fd, buf, (size_t)e->len + 1);
+    close(fd);
+    if (n != e->len) return 0;
+    sha256(buf, e->len, hash);
+    return memcmp(hash, e->hash, SHA256_LEN) == 0;
+}
+
+/* Adds a verified chunk to the store. It is renamed into place, so readers never see half of it. */
+static void dedup_save(const struct dedup_entry *e, const uint8_t *data) {
+    char path[4096], tmp[4100];
+
+    dedup_path(path, sizeof(path), e->hash);
+    if (access(path, F_OK) == 0) return;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("open dedup chunk");
+        return;
+    }
+    if (write(fd, data, e->len) != e->len || close(fd) < 0 || rename(tmp, path) < 0) {
+        perror("write dedup chunk");
+        unlink(tmp);
+    }
+}
+
+/* Returns 1 if the chunk was written, 0 if it was malformed, -1 on a write error. */
+static int store_chunk(struct udp_session *s, int client_port, uint64_t seq, uint8_t chunk_flags, uint16_t raw_len,
+                       const uint8_t *payload, size_t payload_len) {
+    PROBE_START(t_decode);
+    uint8_t raw[MAX_CHUNK_SIZE];
+    off_t offset = (off_t)seq * s->chunk_size;
+    struct dedup_entry *e = NULL;
+
+    if (!rx_in_window(s, seq)) {
+        TRACE2(TEV_BAD_CHUNK, client_port, seq, NULL);
+        return 0;
+    }
+    if (s->flags & SESSION_DEDUP) {
+        if (s->index[seq].len != raw_len) {
+            TRACE2(TEV_BAD_CHUNK, client_port, seq, NULL);
+            return 0;
+        }
+        e = &s->index[seq];
+        offset = (off_t)e->offset;
+    }
+    if (raw_len > s->chunk_size) {
+        TRACE2(TEV_BAD_CHUNK, client_port, seq, NULL);
+        return 0;
+    }
+    if (chunk_flags & CHUNK_COMPRESSED) {
+        if (!(s->flags & SESSION_COMPRESS)
+            || lz_decompress(payload, payload_len, raw, raw_len) != (long)raw_len) {
+            TRACE2(TEV_BAD_CHUNK, client_port, seq, NULL);
+            return 0;
+        }
+        payload = raw;
+    } else if (payload_len != raw_len) {
+        TRACE2(TEV_BAD_CHUNK, client_port, seq, NULL);
+        return 0;
+    }
+    if (e) {
+        uint8_t hash[SHA256_LEN];
+        sha256(payload, raw_len, hash);
+        if (memcmp(hash, e->hash, SHA256_LEN) != 0) {
+            TRACE2(TEV_BAD_CHUNK, client_port, seq, NULL);
+            return 0;
+        }
+    }
+
+    PROBE_STOP(PROBE_DECODE, t_decode);
+
+    PROBE_START(t_write);
+    FILE *f = session_file(s, client_port);
+    if (!f) return 0;
+
+    if (fseeko(f, offset, SEEK_SET) != 0
+        || fwrite(payload, 1, raw_len, f) != raw_len) {
+        perror("fwrite");
+        return -1;
+    }
+    if (s->flags & (SESSION_NACK | SESSION_DEDUP)) {
+        if (rx_mark(s, seq) < 0) return -1;
+    } else if (seq >= s->rx_high) {
+        s->rx_high = seq + 1;
+    }
+    if (e) dedup_save(e, payload);
+    PROBE_STOP(PROBE_WRITE, t_write);
+    stats.chunks_stored++;
+    return 1;
+}
+
+static int fec_group_done(struct udp_session *s, uint64_t group) {
+    if (group < s->groups_done_below) return 1;
+    struct fec_group *g = &s->groups[group % FEC_WINDOW];
+    return g->active && g->id == group && g->done;
+}
+
+static struct fec_group *fec_group_reset(struct fec_group *g, uint64_t group) {
+    uint8_t *symbols = g->symbols;
+    memset(g, 0, sizeof(*g));
+    g->symbols = symbols;
+    g->active = 1;
+    g->id = group;
+    return g;
+}
+
+static struct fec_group *fec_group_get(struct udp_session *s, uint64_t group) {
+    struct fec_group *g = &s->groups[group % FEC_WINDOW];
+
+    /* In NACK mode FEC is best effort: a newer group evicts an unfinished one and NACKs cover the rest. */
+    if (s->flags & SESSION_NACK) {
+        if (g->active && g->id == group) return g;
+        if (g->active && g->id > group) return NULL;
+        return fec_group_reset(g, group);
+    }
+
+    if (group < s->groups_done_below || group >= s->groups_done_below + FEC_WINDOW) return NULL;
+    if (!g->active) fec_group_reset(g, group);
+    return g->id == group ? g : NULL;
+}
+
+static void fec_group_add(struct udp_session *s, struct fec_group *g, int index, uint8_t chunk_flags, uint16_t raw_len,
+                          const uint8_t *payload, size_t payload_len) {
+    uint8_t *sym = g->symbols + (size_t)index * s->symbol_size;
+    sym[0] = chunk_flags;
+    put_u16(sym + 1, raw_len);
+    put_u16(sym + 3, (uint16_t)payload_len);
+    memcpy(sym + FEC_SYMBOL_HDR_LEN, payload, payload_len);
+    memset(sym + FEC_SYMBOL_HDR_LEN + payload_len, 0, s->symbol_size - FEC_SYMBOL_HDR_LEN - payload_len);
+    g->present[index] = 1;
+    g->received++;
+    if (chunk_flags & CHUNK_LAST) g->count = index + 1;
+}
+
+static int send_group_ack(int udp_sock, uint64_t group, struct sockaddr_in *clientaddr, socklen_t len) {
+    uint8_t reply[PROTO_REPLY_MAX];
+    return send_reply(udp_sock, reply, encode_reply(reply, GROUP_ACK, group), clientaddr, len);
+}
+
+/*
+ * Rebuilds missing chunks once enough parity has arrived. Returns 1 when
+ * every data chunk of the group is in, 0 if it is not yet, -1 on a write
+ * error.
+ */
+static int fec_group_recover(struct udp_session *s, struct fec_group *g, int client_port) {
+    int needed = g->count ? g->count : s->fec_k;
+
+    if (g->done) return 1;
+    if (g->received < needed) {
+        if (!g->count) return 0;
+
+        uint8_t *symbols[FEC_MAX_SYMBOLS];
+        uint8_t was_present[FEC_MAX_SYMBOLS];
+        for (int i = 0; i < s->fec_k + s->fec_m; i++) {
+            symbols[i] = g->symbols + (size_t)i * s->symbol_size;
+        }
+        memcpy(was_present, g->present, sizeof(was_present));
+
+        int recovered = fec_decode(s->flags, s->fec_k, s->fec_m, g->count, symbols, g->present, s->symbol_size);
+        if (recovered <= 0) return 0;
+
+        for (int i = 0; i < g->count; i++) {
+            if (was_present[i]) continue;
+            const uint8_t *sym = symbols[i];
+            size_t payload_len = get_u16(sym + 3);
+            if (payload_len > s->chunk_size) payload_len = s->chunk_size;
+            int r = store_chunk(s, client_port, g->id * (uint64_t)s->fec_k + (uint64_t)i, sym[0], get_u16(sym + 1),
+                                sym + FEC_SYMBOL_HDR_LEN, payload_len);
+            if (r < 0) return -1;
+            g->present[i] = 1;
+            g->received++;
+        }
+        stats.chunks_recovered += (unsigned long long)recovered;
+        TRACE3(TEV_GROUP_RECOVERED, recovered, g->id, client_port, NULL);
+    }
+
+    g->done = 1;
+    stats.groups_completed++;
+    return 1;
+}
+
+/* Acknowledges a finished group in burst mode, where the client waits for it. */
+static int fec_group_finish(int udp_sock, struct udp_session *s, struct fec_group *g, int client_port,
+                            struct sockaddr_in *clientaddr, socklen_t len) {
+    int r = fec_group_recover(s, g, client_port);
+    if (r <= 0) return r;
+
+    while (fec_group_done(s, s->groups_done_below)) {
+        s->groups[s->groups_done_below % FEC_WINDOW].active = 0;
+        s->groups_done_below++;
+    }
+
+    if (send_group_ack(udp_sock, g->id, clientaddr, len) < 0) return -1;
+    TRACE1(TEV_GROUP_ACK_SENT, g->id, NULL);
+    return 0;
+}
+
+static int handle_fec_data(int udp_sock, struct udp_session *s, int client_port, uint64_t seq, uint8_t chunk_flags,
+                           uint16_t raw_len, const uint8_t *payload, size_t payload_len,
+                           struct sockaddr_in *clientaddr, socklen_t len) {
+    uint64_t group = seq / (uint64_t)s->fec_k;
+    int index = (int)(seq % (uint64_t)s->fec_k);
+
+    if (fec_group_done(s, group)) {
+        return send_group_ack(udp_sock, group, clientaddr, len);
+    }
+    struct fec_group *g = fec_group_get(s, group);
+    if (!g || g->present[index]) return 0;
+    if (payload_len > s->chunk_size) {
+        TRACE2(TEV_BAD_CHUNK, client_port, seq, NULL);
+        return 0;
+    }
+
+    int r = store_chunk(s, client_port, seq, chunk_flags, raw_len, payload, payload_len);
+    if (r <= 0) return r;
+
+    fec_group_add(s, g, index, chunk_flags, raw_len, payload, payload_len);
+    return fec_group_finish(udp_sock, s, g, client_port, clientaddr, len);
+}
+
+static long elapsed_ms(const struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+/* Lists the chunks missing from [from, to) as ranges; returns 0 without sending if nothing is missing. */
+static int send_nack(int udp_sock, struct udp_session *s, uint64_t from, uint64_t to,
+                     struct sockaddr_in *clientaddr, socklen_t len) {
+    uint8_t pkt[PROTO_NACK_HDR_LEN + NACK_MAX_RANGES * 2 * VARINT_MAX_LEN];
+    size_t pkt_len = PROTO_NACK_HDR_LEN;
+    int ranges = 0;
+    unsigned long long chunks = 0;
+
+    for (uint64_t seq = from; seq < to && ranges < NACK_MAX_RANGES; seq++) {
+        if (rx_has(s, seq)) continue;
+        uint64_t start = seq;
+        /* Nothing past the bitmap has arrived, so a gap reaching it runs to the end. */
+        while (seq < to && !rx_has(s, seq)) seq = seq < s->rx_bits ? seq + 1 : to;
+        pkt_len += put_varint(pkt + pkt_len, start);
+        pkt_len += put_varint(pkt + pkt_len, seq - start);
+        chunks += seq - start;
+        ranges++;
+    }
+    if (ranges == 0) return 0;
+
+    pkt[0] = PROTO_MAGIC;
+    pkt[1] = PROTO_NACK;
+    pkt[2] = (uint8_t)ranges;
+    PROBE_START(t);
+    ssize_t sent = sendto(udp_sock, pkt, pkt_len, 0, (struct sockaddr *)clientaddr, len);
+    PROBE_STOP(PROBE_REPLY, t);
+    if (sent < 0) {
+        perror("sendto");
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &s->last_nack);
+    stats.nacks_sent++;
+    stats.chunks_nacked += chunks;
+    TRACE3(TEV_NACK_SENT, ranges, chunks, from, NULL);
+    return 0;
+}
+
+static int send_fin_ack(int udp_sock, struct udp_session *s, struct sockaddr_in *clientaddr, socklen_t len) {
+    uint8_t reply[PROTO_REPLY_MAX];
+    return send_reply(udp_sock, reply, encode_reply(reply, FIN_ACK, s->total_chunks), clientaddr, len);
+}
+
+/*
+ * Gap detection for NACK mode. Everything below nack_limit that is still
+ * missing is requested right away; without FEC that is everything below the
+ * highest chunk seen, with FEC only groups whose parity has already gone
+ * by. Ranges that were requested before are requested again once the
+ * retransmission is overdue.
+ */
+static int nack_check(int udp_sock, struct udp_session *s, struct sockaddr_in *clientaddr, socklen_t len) {
+    if (s->fin_received && s->rx_low >= s->total_chunks) {
+        return send_fin_ack(udp_sock, s, clientaddr, len);
+    }
+
+    uint64_t nack_limit = s->rx_high;
+    if (s->flags & SESSION_FEC) nack_limit = s->fec_high_group * (uint64_t)s->fec_k;
+
+    if (nack_limit > s->nack_mark) {
+        uint64_t from = s->nack_mark > s->rx_low ? s->nack_mark : s->rx_low;
+        s->nack_mark = nack_limit;
+        return send_nack(udp_sock, s, from, nack_limit, clientaddr, len);
+    }
+    if (s->rx_low < s->nack_mark && elapsed_ms(&s->last_nack) >= NACK_RETRY_MS) {
+        return send_nack(udp_sock, s, s->rx_low, s->nack_mark, clientaddr, len);
+    }
+    return 0;
+}
+
+static int handle_nack_data(int udp_sock, struct udp_session *s, int client_port, uint64_t seq, uint8_t chunk_flags,
+                            uint16_t raw_len, const uint8_t *payload, size_t payload_len,
+                            struct sockaddr_in *clientaddr, socklen_t len) {
+    if (rx_has(s, seq)) {
+        stats.duplicates++;
+        return 0;
+    }
+    if (payload_len > s->chunk_size) {
+        TRACE2(TEV_BAD_CHUNK, client_port, seq, NULL);
+        return 0;
+    }
+
+    int r = store_chunk(s, client_port, seq, chunk_flags, raw_len, payload, payload_len);
+    if (r <= 0) return r;
+
+    if (s->flags & SESSION_FEC) {
+        uint64_t group = seq / (uint64_t)s->fec_k;
+        struct fec_group *g = fec_group_get(s, group);
+        if (group > s->fec_high_group) s->fec_high_group = group;
+        if (g && !g->done && !g->present[seq % (uint64_t)s->fec_k]) {
+            fec_group_add(s, g, (int)(seq % (uint64_t)s->fec_k), chunk_flags, raw_len, payload, payload_len);
+            if (fec_group_recover(s, g, client_port) < 0) return -1;
+        }
+    }
+
+    return nack_check(udp_sock, s, clientaddr, len);
+}
+
+static int handle_data(int udp_sock, struct udp_session *sessions[], const uint8_t *pkt, ssize_t n,
+                       struct sockaddr_in *clientaddr, socklen_t len, struct impairment *imp) {
+    int client_port = ntohs(clientaddr->sin_port);
+    struct udp_session *s = sessions[client_port];
+
+    struct data_header hdr;
+    if (!decode_data_header(pkt, (size_t)n, &hdr)) {
+        TRACE1(TEV_SHORT_PACKET, n, NULL);
+        return 0;
+    }
+    if (!s || s->chunk_size == 0) {
+        TRACE1(TEV_NO_SESSION, client_port, NULL);
+        return 0;
+    }
+
+    uint8_t chunk_flags = hdr.flags;
+    uint64_t seq = hdr.seq;
+    uint16_t raw_len = hdr.raw_len;
+    const uint8_t *payload = pkt + hdr.len;
+    size_t payload_len = (size_t)n - hdr.len;
+
+    /* The chunk must land at an offset off_t can represent. */
+    if (seq > (uint64_t)INT64_MAX / s->chunk_size) {
+        TRACE2(TEV_BAD_CHUNK, client_port, seq, NULL);
+        return 0;
+    }
+
+    if (packet_rejected((long)seq, imp)) {
+        return 0;
+    }
+
+    if (s->flags & SESSION_NACK) {
+        return handle_nack_data(udp_sock, s, client_port, seq, chunk_flags, raw_len, payload, payload_len, clientaddr, len);
+    }
+    if (s->flags & SESSION_FEC) {
+        return handle_fec_data(udp_sock, s, client_port, seq, chunk_flags, raw_len, payload, payload_len, clientaddr, len);
+    }
+
+    int r = store_chunk(s, client_port, seq, chunk_flags, raw_len, payload, payload_len);
+    if (r <= 0) return r;
+
+    uint8_t reply[PROTO_REPLY_MAX];
+    if (send_reply(udp_sock, reply, encode_reply(reply, ACK, seq), clientaddr, len) < 0) {
+        return -1;
+    }
+    TRACE1(TEV_ACK_SENT, seq, NULL);
+    return 0;
+}
+
+static int handle_parity(int udp_sock, struct udp_session *sessions[], const uint8_t *pkt, ssize_t n,
+                         struct sockaddr_in *clientaddr, socklen_t len, struct impairment *imp) {
+    int client_port = ntohs(clientaddr->sin_port);
+    struct udp_session *s = sessions[client_port];
+
+    if (!s || !(s->flags & SESSION_FEC)) {
+        TRACE1(TEV_NO_SESSION, client_port, NULL);
+        return 0;
+    }
+    uint64_t group;
+    int index, count;
+    size_t hdr_len = decode_parity_header(pkt, (size_t)n, &group, &index, &count);
+    if (!hdr_len || (size_t)n != hdr_len + s->symbol_size) {
+        TRACE1(TEV_SHORT_PACKET, n, NULL);
+        return 0;
+    }
+    if (packet_rejected(-1, imp)) {
+        return 0;
+    }
+
+    if (index >= s->fec_m || count < 1 || count > s->fec_k || group > UINT64_MAX / (uint64_t)s->fec_k
+        || !rx_in_window(s, group * (uint64_t)s->fec_k)) {
+        TRACE2(TEV_BAD_CHUNK, client_port, group, NULL);
+        return 0;
+    }
+
+    stats.parity_received++;
+    if (!(s->flags & SESSION_NACK) && fec_group_done(s, group)) {
+        return send_group_ack(udp_sock, group, clientaddr, len);
+    }
+    struct fec_group *g = fec_group_get(s, group);
+    if (!g || g->done || g->present[s->fec_k + index]) return 0;
+
+    memcpy(g->symbols + (size_t)(s->fec_k + index) * s->symbol_size, pkt + hdr_len, s->symbol_size);
+    g->present[s->fec_k + index] = 1;
+    g->count = count;
+
+    if (s->flags & SESSION_NACK) {
+        if (group > s->fec_high_group) s->fec_high_group = group;
+        if (fec_group_recover(s, g, client_port) < 0) return -1;
+        return nack_check(udp_sock, s, clientaddr, len);
+    }
+    return fec_group_finish(udp_sock, s, g, client_port, clientaddr, len);
+}
+
+static int handle_fin(int udp_sock, struct udp_session *sessions[], const uint8_t *pkt, ssize_t n,
+                      struct sockaddr_in *clientaddr, socklen_t len) {
+    int client_port = ntohs(clientaddr->sin_port);
+    struct udp_session *s = sessions[client_port];
+
+    if (!s || !(s->flags & SESSION_NACK)) {
+        TRACE1(TEV_NO_SESSION, client_port, NULL);
+        return 0;
+    }
+    uint64_t total_chunks;
+    if (!get_varint(pkt + 2, (size_t)n - 2, &total_chunks)) {
+        TRACE1(TEV_SHORT_PACKET, n, NULL);
+        return 0;
+    }
+
+    s->total_chunks = total_chunks;
+    s->fin_received = 1;
+    if (s->rx_low >= s->total_chunks) {
+        return send_fin_ack(udp_sock, s, clientaddr, len);
+    }
+
+    /* The sender is done, so every gap is real now. */
+    s->nack_mark = s->total_chunks;
+    return send_nack(udp_sock, s, s->rx_low, s->total_chunks, clientaddr, len);
+}
+
+/*
+ * Records the chunks of an INDEX packet, fills the ones the store already
+ * holds and answers with WANT for the rest. A repeated INDEX gets the same
+ * answer, updated with whatever has arrived since.
+ */
+static int handle_index(int udp_sock, struct udp_session *sessions[], const uint8_t *pkt, ssize_t n,
+                        struct sockaddr_in *clientaddr, socklen_t len, struct impairment *imp) {
+    int client_port = ntohs(clientaddr->sin_port);
+    struct udp_session *s = sessions[client_port];
+    uint64_t first;
+    int count;
+
+    if (!s || !(s->flags & SESSION_DEDUP)) {
+        TRACE1(TEV_NO_SESSION, client_port, NULL);
+        return 0;
+    }
+    size_t off = decode_index_header(pkt, (size_t)n, &first, &count);
+    if (!off) {
+        TRACE1(TEV_SHORT_PACKET, n, NULL);
+        return 0;
+    }
+    if (first > s->index_count) {
+        TRACE2(TEV_BAD_CHUNK, client_port, first, NULL);
+        return 0;
+    }
+    if (packet_rejected(-1, imp)) {
+        return 0;
+    }
+
+    FILE *f = session_file(s, client_port);
+    if (!f) return 0;
+
+    for (int i = 0; i < count; i++) {
+        uint64_t chunk_len;
+        size_t used = get_varint(pkt + off, (size_t)n - off, &chunk_len);
+        if (!used || (size_t)n - off - used < SHA256_LEN || chunk_len == 0 || chunk_len > s->chunk_size) {
+            TRACE2(TEV_BAD_CHUNK, client_port, first + (uint64_t)i, NULL);
+            return 0;
+        }
+        const uint8_t *hash = pkt + off + used;
+        off += used + SHA256_LEN;
+
+        uint64_t seq = first + (uint64_t)i;
+        if (seq < s->index_count) continue;
+
+        if (s->index_count == s->index_cap) {
+            uint64_t cap = s->index_cap ? s->index_cap * 2 : 1024;
+            struct dedup_entry *index = realloc(s->index, cap * sizeof(*index));
+            if (!index) {
+                perror("realloc");
+                return -1;
+            }
+            s->index = index;
+            s->index_cap = cap;
+        }
+        struct dedup_entry *e = &s->index[s->index_count];
+        e->offset = s->index_count ? s->index[s->index_count - 1].offset + s->index[s->index_count - 1].len : 0;
+        e->len = (uint16_t)chunk_len;
+        memcpy(e->hash, hash, SHA256_LEN);
+        s->index_count++;
+        stats.chunks_indexed++;
+
+        uint8_t data[MAX_CHUNK_SIZE];
+        if (!dedup_load(e, data)) continue;
+        if (fseeko(f, (off_t)e->offset, SEEK_SET) != 0 || fwrite(data, 1, e->len, f) != e->len) {
+            perror("fwrite");
+            return -1;
+        }
+        if (rx_mark(s, seq) < 0) return -1;
+        stats.chunks_deduped++;
+        stats.bytes_deduped += e->len;
+    }
+
+    uint8_t reply[PROTO_WANT_MAX];
+    size_t reply_len = encode_index_header(reply, PROTO_WANT, first, count);
+    memset(reply + reply_len, 0, (size_t)(count + 7) / 8);
+    for (int i = 0; i < count; i++) {
+        if (!rx_has(s, first + (uint64_t)i)) reply[reply_len + i / 8] |= (uint8_t)(1 << (i % 8));
+    }
+    reply_len += (size_t)(count + 7) / 8;
+    return send_reply(udp_sock, reply, reply_len, clientaddr, len);
+}
+
+/*
+ * Downloads. Every GET is served by a thread with a socket of its own,
+ * connected to the client, so a long download never holds up the upload
+ * sessions of the main loop. The file is mapped once and each chunk goes
+ * out straight from the mapping. If the file shrinks meanwhile, sendmsg
+ * fails with EFAULT on the missing pages; compression would read them from
+ * user space and take a SIGBUS, so chunks to compress are read with pread.
+ */
+
+#define GET_RETRY_MS 200
+#define GET_MAX_RETRIES 25
+#define GET_PACE_BURST_NS 1000000ULL
+
+struct get_transfer {
+    struct get_transfer *next;
+    struct sockaddr_in client;
+    int sock;
+    int fd;
+    int client_port;
+    uint8_t flags;
+    uint16_t chunk_size;
+    uint64_t rate;
+    const uint8_t *map;
+    uint64_t size;
+    uint64_t total_chunks;
+    uint64_t window;
+    unsigned long long resent;
+    unsigned loss_percent;
+    unsigned seed;
+};
+
+static pthread_mutex_t get_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Downloads in progress, so a repeated GET is left to its thread. */
+static struct get_transfer *get_running;
+
+/* Call with get_mutex held. */
+static struct get_transfer **get_find(const struct sockaddr_in *client) {
+    struct get_transfer **p = &get_running;
+    while (*p && ((*p)->client.sin_addr.s_addr != client->sin_addr.s_addr
+                  || (*p)->client.sin_port != client->sin_port)) {
+        p = &(*p)->next;
+    }
+    return p;
+}
+
+static void get_remove(struct get_transfer *t) {
+    pthread_mutex_lock(&get_mutex);
+    struct get_transfer **p = get_find(&t->client);
+    if (*p == t) *p = t->next;
+    pthread_mutex_unlock(&get_mutex);
+}
+
+static uint64_t monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+/* Sends chunk seq; returns the bytes it takes on the wire, -1 if the client is gone. */
+static ssize_t get_send_chunk(struct get_transfer *t, uint64_t seq) {
+    uint8_t hdr[PROTO_DATA_HDR_MAX];
+    uint8_t packed[MAX_CHUNK_SIZE];
+    uint64_t offset = seq * t->chunk_size;
+    size_t raw_len = t->size - offset < t->chunk_size ? (size_t)(t->size - offset) : t->chunk_size;
+    const uint8_t *raw = t->map + offset;
+    uint8_t chunk_flags = seq + 1 == t->total_chunks ? CHUNK_LAST : 0;
+    size_t payload_len = 0;
+
+    uint8_t copy[MAX_CHUNK_SIZE];
+    if (t->flags & SESSION_COMPRESS) {
+        if (pread(t->fd, copy, raw_len, (off_t)offset) != (ssize_t)raw_len) return -1;
+        raw = copy;
+        payload_len = lz_compress(raw, raw_len, packed, raw_len - 1);
+        if (payload_len) chunk_flags |= CHUNK_COMPRESSED;
+    }
+
+    struct iovec iov[2];
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = encode_data_header(hdr, chunk_flags, seq, (uint16_t)raw_len);
+    iov[1].iov_base = payload_len ? packed : (void *)raw;
+    iov[1].iov_len = payload_len ? payload_len : raw_len;
+    ssize_t wire_len = (ssize_t)(iov[0].iov_len + iov[1].iov_len);
+    atomic_fetch_add(&get_stats.chunks_sent, 1);
+
+    if (t->loss_percent && (unsigned)rand_r(&t->seed) % 100 < t->loss_percent) {
+        atomic_fetch_add(&get_stats.chunks_dropped, 1);
+        return wire_len;
+    }
+
+    struct msghdr msg = {0};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    if (sendmsg(t->sock, &msg, 0) < 0 && errno != ENOBUFS) {
+        return -1;
+    }
+    return wire_len;
+}
+
+/* Retransmits the chunks of a NACK that have already been sent once. */
+static int get_handle_nack(struct get_transfer *t, const uint8_t *pkt, size_t n, uint64_t sent_below) {
+    size_t off = PROTO_NACK_HDR_LEN;
+
+    for (int r = 0; r < pkt[2]; r++) {
+        uint64_t start, count;
+        size_t used = get_varint(pkt + off, n - off, &start);
+        if (!used) break;
+        off += used;
+        if (!(used = get_varint(pkt + off, n - off, &count))) break;
+        off += used;
+        for (uint64_t seq = start; seq - start < count && seq < sent_below; seq++) {
+            if (get_send_chunk(t, seq) < 0) return -1;
+            atomic_fetch_add(&get_stats.chunks_resent, 1);
+            t->resent++;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Streams the file while fewer than window chunks are unacknowledged and
+ * the pacing allows. Whenever the client falls silent, the retry timer
+ * repeats whatever it is expected to answer: the start reply, FIN, or the
+ * oldest unacknowledged chunk when the window is full. The download is
+ * abandoned after GET_MAX_RETRIES silent retries in a row.
+ */
+static void *get_thread(void *arg) {
+    struct get_transfer *t = arg;
+    if (udp_cpu >= 0) pthread_setaffinity_np(pthread_self(), sizeof(default_cpus), &default_cpus);
+    uint8_t pkt[PROTO_NACK_HDR_LEN + NACK_MAX_RANGES * 2 * VARINT_MAX_LEN];
+    uint8_t start[PROTO_GET_REPLY_MAX];
+    uint8_t fin[PROTO_FIN_MAX];
+    uint8_t fin_ack[PROTO_REPLY_MAX];
+
+    size_t start_len = strlen(ACK);
+    memcpy(start, ACK, start_len);
+    start[start_len++] = PROTO_VERSION;
+    start[start_len++] = t->flags;
+    start_len += put_varint(start + start_len, t->size);
+    fin[0] = PROTO_MAGIC;
+    fin[1] = PROTO_FIN;
+    size_t fin_len = 2 + put_varint(fin + 2, t->total_chunks);
+    size_t fin_ack_len = encode_reply(fin_ack, FIN_ACK, t->total_chunks);
+
+    uint64_t acked = 0, next = 0;
+    int started = 0, done = 0, failed = 0, retries = 0;
+    uint64_t now = monotonic_ns();
+    uint64_t pace = now, retry_at = now;
+
+    while (!done && !failed) {
+        now = monotonic_ns();
+        if (started) {
+            if (pace + GET_PACE_BURST_NS < now) pace = now - GET_PACE_BURST_NS;
+            while (next < t->total_chunks && next < acked + t->window && (!t->rate || pace <= now)) {
+                ssize_t sent = get_send_chunk(t, next++);
+                if (sent < 0) {
+                    failed = 1;
+                    break;
+                }
+                if (t->rate) pace += (uint64_t)sent * 1000000000ULL / t->rate;
+                if (next == t->total_chunks) retry_at = now;
+            }
+        }
+
+        if (!failed && now >= retry_at) {
+            ssize_t r = 0;
+            if (!started) {
+                r = send(t->sock, start, start_len, 0);
+            } else if (next == t->total_chunks) {
+                r = send(t->sock, fin, fin_len, 0);
+            } else if (next >= acked + t->window) {
+                r = get_send_chunk(t, acked);
+            } else {
+                retries = 0;
+            }
+            if (r < 0 || ++retries > GET_MAX_RETRIES) failed = 1;
+            retry_at = now + GET_RETRY_MS * 1000000ULL;
+        }
+        if (failed) break;
+
+        uint64_t wake = retry_at;
+        if (started && t->rate && next < t->total_chunks && next < acked + t->window && pace < wake) wake = pace;
+        int wait_ms = wake > now ? (int)((wake - now + 999999) / 1000000) : 0;
+        struct pollfd pfd = {t->sock, POLLIN, 0};
+        if (poll(&pfd, 1, wait_ms) <= 0) continue;
+
+        ssize_t n;
+        while ((n = recv(t->sock, pkt, sizeof(pkt), MSG_DONTWAIT)) >= 0) {
+            uint64_t v;
+            retries = 0;
+            if ((size_t)n == fin_ack_len && memcmp(pkt, fin_ack, fin_ack_len) == 0) {
+                if (next == t->total_chunks) done = 1;
+            } else if (n > 3 && memcmp(pkt, ACK, 3) == 0 && get_varint(pkt + 3, (size_t)n - 3, &v)) {
+                /* Only progress postpones the retry timer; a bare repeat of the same ACK must not. */
+                if (!started || (v > acked && v <= next)) {
+                    retry_at = started || t->total_chunks ? monotonic_ns() + GET_RETRY_MS * 1000000ULL : 0;
+                    started = 1;
+                }
+                if (v > acked && v <= next) acked = v;
+            } else if (n >= PROTO_NACK_HDR_LEN && pkt[0] == PROTO_MAGIC && pkt[1] == PROTO_NACK) {
+                if (get_handle_nack(t, pkt, (size_t)n, next) < 0) failed = 1;
+            }
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) failed = 1;
+    }
+
+    if (done) {
+        atomic_fetch_add(&get_stats.completed, 1);
+        TRACE2(TEV_GET_FINISHED, t->client_port, t->resent, NULL);
+    } else {
+        atomic_fetch_add(&get_stats.failed, 1);
+        TRACE3(TEV_GET_FAILED, t->client_port, acked, t->total_chunks, NULL);
+    }
+    if (t->map) munmap((void *)t->map, t->size);
+    close(t->fd);
+    close(t->sock);
+    get_remove(t);
+    free(t);
+    return NULL;
+}
+
+static int refuse_get(int udp_sock, const char *name, const char *reason, struct sockaddr_in *clientaddr,
+                      socklen_t len) {
+    TRACE1(TEV_GET_REFUSED, ntohs(clientaddr->sin_port), name);
+    return send_error(udp_sock, reason, clientaddr, len);
+}
+
+/* Only plain names in the working directory can be downloaded, never a hidden upload in progress. */
+static int get_name_valid(const char *name, size_t len) {
+    return len > 0 && strlen(name) == len && name[0] != '.' && !strchr(name, '/');
+}
+
+static int handle_get(int udp_sock, const uint8_t *pkt, ssize_t n, struct sockaddr_in *clientaddr, socklen_t len,
+                      struct impairment *imp) {
+    int client_port = ntohs(clientaddr->sin_port);
+    uint64_t chunk_size = 0, rate = 0;
+    size_t off = 4, used = 0;
+
+    if (n < 6) {
+        TRACE1(TEV_SHORT_PACKET, n, NULL);
+        return 0;
+    }
+    if (pkt[2] == PROTO_VERSION) used = get_varint(pkt + off, (size_t)n - off, &chunk_size);
+    char reason[64];
+    if (!session_params_valid(pkt[2], used, chunk_size, reason, sizeof(reason))) {
+        TRACE3(TEV_BAD_HELLO, client_port, pkt[2], chunk_size, NULL);
+        return send_error(udp_sock, reason, clientaddr, len);
+    }
+    off += used;
+    if (!(used = get_varint(pkt + off, (size_t)n - off, &rate))) {
+        TRACE1(TEV_SHORT_PACKET, n, NULL);
+        return 0;
+    }
+    off += used;
+    const char *name = (const char *)pkt + off;
+
+    /* A repeated GET of a running download is answered by its thread. */
+    pthread_mutex_lock(&get_mutex);
+    int running = *get_find(clientaddr) != NULL;
+    pthread_mutex_unlock(&get_mutex);
+    if (running) return 0;
+
+    if (!get_name_valid(name, (size_t)n - off)) {
+        return refuse_get(udp_sock, name, "bad file name", clientaddr, len);
+    }
+    int fd = open(name, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        const char *reason = fd < 0 ? strerror(errno) : "not a regular file";
+        if (fd >= 0) close(fd);
+        return refuse_get(udp_sock, name, reason, clientaddr, len);
+    }
+
+    struct get_transfer *t = calloc(1, sizeof(*t));
+    if (!t) {
+        perror("calloc");
+        close(fd);
+        return refuse_get(udp_sock, name, "out of memory", clientaddr, len);
+    }
+    t->client = *clientaddr;
+    t->client_port = client_port;
+    t->flags = pkt[3] & SESSION_COMPRESS;
+    t->chunk_size = (uint16_t)chunk_size;
+    t->rate = rate * 1024;
+    t->size = (uint64_t)st.st_size;
+    t->total_chunks = (t->size + chunk_size - 1) / chunk_size;
+    t->window = GET_WINDOW_BYTES / chunk_size;
+    t->loss_percent = imp->loss_percent;
+    t->seed = imp->seed ^ (unsigned)client_port;
+    if (t->size > 0) {
+        void *map = mmap(NULL, t->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            perror("mmap");
+            close(fd);
+            free(t);
+            return refuse_get(udp_sock, name, "cannot read file", clientaddr, len);
+        }
+        madvise(map, t->size, MADV_SEQUENTIAL);
+        t->map = map;
+    }
+    t->fd = fd;
+
+    struct sockaddr_in local;
+    socklen_t local_len = sizeof(local);
+    t->sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (t->sock < 0 || getsockname(udp_sock, (struct sockaddr *)&local, &local_len) < 0) goto fail;
+    local.sin_port = htons(0);
+    if (bind(t->sock, (struct sockaddr *)&local, sizeof(local)) < 0
+        || connect(t->sock, (struct sockaddr *)clientaddr, len) < 0) goto fail;
+
+    uint64_t total_chunks = t->total_chunks;
+    pthread_mutex_lock(&get_mutex);
+    t->next = get_running;
+    get_running = t;
+    pthread_mutex_unlock(&get_mutex);
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, get_thread, t) != 0) {
+        get_remove(t);
+        goto fail;
+    }
+    pthread_detach(tid);
+    atomic_fetch_add(&get_stats.started, 1);
+    TRACE2(TEV_GET_STARTED, client_port, total_chunks, name);
+    return 0;
+
+fail:
+    perror("download socket");
+    if (t->sock >= 0) close(t->sock);
+    if (t->map) munmap((void *)t->map, t->size);
+    close(t->fd);
+    free(t);
+    return refuse_get(udp_sock, name, "server error", clientaddr, len);
+}
+
+/* Handles one datagram; buffer[n] is a terminating NUL. */
+static int handle_datagram(int udp_sock, struct udp_session *sessions[], struct impairment *imp, char *buffer,
+                           ssize_t n, struct sockaddr_in *clientaddr, socklen_t len) {
+    stats.udp_packets++;
+    stats.udp_bytes += (unsigned long long)n;
+
+    if (n < 1) {
+        TRACE0(TEV_EMPTY_PACKET, NULL);
+        return 0;
+    }
+
+    int client_port = ntohs(clientaddr->sin_port);
+    const uint8_t *pkt = (const uint8_t *)buffer;
+
+    /* Version 2 packets never reach the legacy path below, whose filename packet ends the session. */
+    if (pkt[0] == PROTO_MAGIC) {
+        if (n < 2) {
+            TRACE1(TEV_SHORT_PACKET, n, NULL);
+            return 0;
+        }
+        switch (pkt[1]) {
+        case PROTO_HELLO:
+            return handle_hello(udp_sock, sessions, pkt, n, clientaddr, len);
+        case PROTO_DATA:
+            return fail_session(sessions, client_port,
+                                handle_data(udp_sock, sessions, pkt, n, clientaddr, len, imp));
+        case PROTO_PARITY:
+            return fail_session(sessions, client_port,
+                                handle_parity(udp_sock, sessions, pkt, n, clientaddr, len, imp));
+        case PROTO_FIN:
+            return fail_session(sessions, client_port,
+                                handle_fin(udp_sock, sessions, pkt, n, clientaddr, len));
+        case PROTO_INDEX:
+            return fail_session(sessions, client_port,
+                                handle_index(udp_sock, sessions, pkt, n, clientaddr, len, imp));
+        case PROTO_GET:
+            return handle_get(udp_sock, pkt, n, clientaddr, len, imp);
+        default:
+            TRACE2(TEV_BAD_TYPE, pkt[1], client_port, NULL);
+            return 0;
+        }
+    }
+
+    unsigned char check1 = (unsigned char)buffer[0];
+    unsigned char check2 = (unsigned char)buffer[1];
+    unsigned char check3 = (unsigned char)buffer[2];
+
+    if (check1 != 255 || check2 != 255 || check3 != 255) {
+        char temp_filename[32];
+        snprintf(temp_filename, sizeof(temp_filename), SESSION_TEMP_NAME, client_port);
+
+        close_session(sessions, client_port);
+        if (rename(temp_filename, buffer) == 0) {
+            TRACE1(TEV_FILE_RENAMED, client_port, buffer);
+        } else {
+            perror("rename");
+        }
+        return send_reply(udp_sock, (const uint8_t *)ACK, strlen(ACK), clientaddr, len);
+    }
+
+    struct udp_session *s = open_session(sessions, client_port);
+    if (!s) return 0;
+    FILE *f = session_file(s, client_port);
+    if (!f) return 0;
+
+    if (n < 8) {
+        TRACE1(TEV_SHORT_PACKET, n, NULL);
+        return 0;
+    }
+
+    unsigned char data_byte = (unsigned char)buffer[3];
+    int packet_num = (unsigned char)buffer[4] 
+                    | ((unsigned char)buffer[5] << 8) 
+                    | ((unsigned char)buffer[6] << 16) 
+                    | ((unsigned char)buffer[7] << 24);
+
+    if (packet_rejected(packet_num, imp)) {
+        return 0;
+    }
+
+    PROBE_START(t_write);
+    if (fwrite(&data_byte, 1, 1, f) != 1) {
+        perror("fwrite");
+        return fail_session(sessions, client_port, -1);
+    }
+    PROBE_STOP(PROBE_WRITE, t_write);
+
+    if (send_reply(udp_sock, (const uint8_t *)ACK, strlen(ACK), clientaddr, len) < 0) return -1;
+    TRACE1(TEV_ACK_SENT, packet_num, NULL);
+
+    return 0;
+}
+
+/*
+ * Receives whatever is queued next. With UDP GRO the kernel may coalesce
+ * a run of datagrams from one sender into a single buffer; the UDP_GRO
+ * control message then gives the datagram size and the buffer is split
+ * back into datagrams here, the last of which may be shorter.
+ *
+ * Returns 1 once a receive has been handled, 0 if recv_flags include
+ * MSG_DONTWAIT and nothing was queued, -1 on error.
+ */
+static int handle_udp_packet(int udp_sock, struct udp_session *sessions[], struct impairment *imp, int recv_flags,
+                             struct histogram *latency) {
+    char buffer[MAX_UDP_PACKET_SIZE];
+    char control[CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(sizeof(uint32_t))];
+    struct sockaddr_in clientaddr;
+    struct iovec iov = {buffer, sizeof(buffer) - 4};
+    struct msghdr msg = {0};
+
+    msg.msg_name = &clientaddr;
+    msg.msg_namelen = sizeof(clientaddr);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    PROBE_START(t_total);
+    PROBE_START(t_recv);
+    ssize_t n = recvmsg(udp_sock, &msg, recv_flags);
+    if (n < 0) {
+        if ((recv_flags & MSG_DONTWAIT) && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        perror("recvmsg");
+        return -1;
+    }
+    PROBE_STOP(PROBE_RECV, t_recv);
+    stats.udp_receives++;
+
+    ssize_t segment = n;
+    struct timespec arrived = {0, 0};
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+            int size;
+            memcpy(&size, CMSG_DATA(cm), sizeof(size));
+            if (size > 0) segment = size;
+        } else if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPNS) {
+            memcpy(&arrived, CMSG_DATA(cm), sizeof(arrived));
+        } else if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_RXQ_OVFL) {
+            uint32_t drops;
+            memcpy(&drops, CMSG_DATA(cm), sizeof(drops));
+            rcvbuf_note_drops(udp_sock, drops);
+        }
+    }
+
+    ssize_t off = 0;
+    do {
+        ssize_t seg_len = n - off < segment ? n - off : segment;
+        char *pkt = buffer + off;
+        char next = pkt[seg_len];
+        pkt[seg_len] = '\0';
+        /* Whatever the inner probes do not cover: header parsing, session lookup, bookkeeping. */
+        PROBE_START(t_parse);
+        int r = handle_datagram(udp_sock, sessions, imp, pkt, seg_len, &clientaddr, msg.msg_namelen);
+        PROBE_STOP_SELF(PROBE_PARSE, t_parse);
+        pkt[seg_len] = next;
+        if (r < 0) return -1;
+        off += seg_len;
+    } while (off < n);
+
+    if (arrived.tv_sec) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        int64_t ns = (int64_t)(now.tv_sec - arrived.tv_sec) * 1000000000LL + (now.tv_nsec - arrived.tv_nsec);
+        hist_record(latency, ns > 0 ? (uint64_t)ns : 0);
+    }
+    PROBE_STOP(PROBE_TOTAL, t_total);
+    return 1;
+}
+
+/*
+ * Polls the UDP socket without sleeping until it has been idle for
+ * spin_us, then lets the main loop block in select. After
+ * SPIN_MAX_PACKETS receives it returns anyway, so TCP connections and
+ * stats requests are not starved under constant load.
+ */
+static int spin_udp(int udp_sock, struct udp_session *sessions[], struct impairment *imp, unsigned spin_us) {
+    uint64_t idle_since = monotonic_ns();
+
+    for (int handled = 0; handled < SPIN_MAX_PACKETS && !stats_requested;) {
+        int r = handle_udp_packet(udp_sock, sessions, imp, MSG_DONTWAIT, &latency_spin);
+        if (r < 0) return -1;
+        if (r > 0) {
+            handled++;
+            idle_since = monotonic_ns();
+        } else if (monotonic_ns() - idle_since >= spin_us * 1000ULL) {
+            break;
+        }
+    }
+    return 0;
+}
+
+static int handle_tcp_connection(int tcp_sock) {
+    struct sockaddr_in clientaddr;
+    socklen_t len = sizeof(clientaddr);
+
+    int client_fd = accept(tcp_sock, (struct sockaddr*)&clientaddr, &len);
+    if (client_fd < 0) {
+        perror("accept");
+        return -1;
+    }
+
+    char client_ip[INET_ADDRSTRLEN] = "?";
+    if (inet_ntop(AF_INET, &clientaddr.sin_addr, client_ip, sizeof(client_ip)) != NULL) {
+        TRACE1(TEV_TCP_CONNECTED, ntohs(clientaddr.sin_port), client_ip);
+    }
+
+    struct tcp_peer *arg = malloc(sizeof(*arg));
+    if (!arg) {
+        perror("malloc");
+        close(client_fd);
+        return -1;
+    }
+    arg->fd = client_fd;
+    arg->shard = log_shards ? tcp_log_shard(clientaddr.sin_addr, ntohs(clientaddr.sin_port), shard_by_peer, shard_count)
+                            : 0;
+    snprintf(arg->name, sizeof(arg->name), "%s:%u", client_ip, ntohs(clientaddr.sin_port));
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, tcp_client_handler, arg) != 0) {
+        perror("pthread_create");
+        close(client_fd);
+        free(arg);
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-v off|error|info|debug] [-s sample_rate] [-L loss_percent] [-d store_dir]\n"
+                    "          [-C udp_cpu[,log_cpu]] [-b busy_poll_us] [-p spin_us] [-S shards[,addr|peer]]\n"
+                    "          [-R rcvbuf_kib|auto|rcvbuf_kib,auto]\n"
+                    "          server_ip [packet_positions]\n"
+                    "Example: %s -v debug -s 100 127.0.0.1 [1,5,6]\n"
+                    "Low latency: %s -C 2,3 -b 50 -p 200 127.0.0.1 []\n"
+                    "Sharded TCP log: %s -S 8 127.0.0.1 [] (tcp_messages.0.log ... tcp_messages.7.log)\n",
+            prog, prog, prog, prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    int trace_lvl = TRACE_INFO;
+    unsigned sample_rate = 1;
+    int busy_poll_us = 0;
+    unsigned spin_us = 0;
+    int rcvbuf_kib = 0;
+    struct impairment imp = {0};
+    int opt;
+
+    imp.seed = (unsigned)getpid();
+
+    while ((opt = getopt(argc, argv, "v:s:L:d:C:b:p:S:R:")) != -1) {
+        switch (opt) {
+        case 'v':
+            trace_lvl = trace_parse_level(optarg);
+            if (trace_lvl < 0) usage(argv[0]);
+            break;
+        case 's':
+            sample_rate = (unsigned)strtoul(optarg, NULL, 10);
+            break;
+        case 'L':
+            imp.loss_percent = (unsigned)strtoul(optarg, NULL, 10);
+            if (imp.loss_percent > 100) usage(argv[0]);
+            break;
+        case 'd':
+            dedup_dir = optarg;
+            if (mkdir(dedup_dir, 0755) < 0 && errno != EEXIST) {
+                perror("mkdir");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'C':
+            if (sscanf(optarg, "%d,%d", &udp_cpu, &log_cpu) < 1 || udp_cpu < 0 || udp_cpu >= CPU_SETSIZE
+                || log_cpu >= CPU_SETSIZE) {
+                usage(argv[0]);
+            }
+            break;
+        case 'b':
+            busy_poll_us = atoi(optarg);
+            break;
+        case 'p':
+            spin_us = (unsigned)strtoul(optarg, NULL, 10);
+            break;
+        case 'S': {
+            char key[8] = "addr";
+            if (sscanf(optarg, "%d,%7s", &shard_count, key) < 1 || shard_count < 1 || shard_count > TCP_MAX_SHARDS) {
+                usage(argv[0]);
+            }
+            if (strcmp(key, "peer") == 0) {
+                shard_by_peer = 1;
+            } else if (strcmp(key, "addr") != 0) {
+                usage(argv[0]);
+            }
+            break;
+        }
+        case 'R':
+            if (strcmp(optarg, "auto") == 0) {
+                rcvbuf.autotune = 1;
+            } else {
+                char mode[8] = "";
+                if (sscanf(optarg, "%d,%7s", &rcvbuf_kib, mode) < 1 || rcvbuf_kib < 1
+                    || rcvbuf_kib > INT_MAX / 1024 || (mode[0] && strcmp(mode, "auto") != 0)) {
+                    usage(argv[0]);
+                }
+                rcvbuf.autotune = mode[0] != '\0';
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (argc - optind != 2) {
+        usage(argv[0]);
+    }
+
+    /* The trace flusher inherits the affinity of the thread that starts it. */
+    sched_getaffinity(0, sizeof(default_cpus), &default_cpus);
+    pin_thread(log_cpu);
+    if (trace_init(trace_lvl, sample_rate, stdout) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    pin_thread(udp_cpu);
+
+    imp.lostPositions = parse_packet_positions(argv[optind + 1], &imp.lostSize);
+    if (!imp.lostPositions && imp.lostSize != 0) {
+        fprintf(stderr, "Failed to parse lost positions\n");
+        exit(EXIT_FAILURE);
+    }
+
+    struct sockaddr_in servaddr;
+    int udp_sock = setup_udp_socket(argv[optind], &servaddr, rcvbuf_kib);
+    if (udp_sock < 0) {
+        free(imp.lostPositions);
+        exit(EXIT_FAILURE);
+    }
+
+    socklen_t servLen = sizeof(servaddr);
+    if (getsockname(udp_sock, (struct sockaddr*)&servaddr, &servLen) == -1) {
+        perror("getsockname");
+        close(udp_sock);
+        free(imp.lostPositions);
+        exit(EXIT_FAILURE);
+    }
+
+    int tcp_sock = setup_tcp_socket(&servaddr);
+    if (tcp_sock < 0) {
+        close(udp_sock);
+        free(imp.lostPositions);
+        exit(EXIT_FAILURE);
+    }
+
+    if (busy_poll_us > 0) {
+        int prefer = 1;
+        if (setsockopt(udp_sock, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_us, sizeof(busy_poll_us)) < 0) {
+            perror("setsockopt SO_BUSY_POLL");
+        }
+        if (setsockopt(udp_sock, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer)) < 0) {
+            perror("setsockopt SO_PREFER_BUSY_POLL");
+        }
+    }
+
+    int server_port = ntohs(servaddr.sin_port);
+    printf("Server running on port %d (TCP+UDP)\n", server_port);
+    fflush(stdout);
+
+    imp.rejectCount = calloc(imp.lostSize, sizeof(int));
+    if (!imp.rejectCount) {
+        perror("calloc");
+        cleanup_resources(NULL, 0, &imp, udp_sock, tcp_sock);
+        exit(EXIT_FAILURE);
+    }
+
+    static struct udp_session *client_sessions[65536];
+
+    if (shard_count > 0) {
+        if (open_log_shards() < 0) {
+            cleanup_resources(client_sessions, 65536, &imp, udp_sock, tcp_sock);
+            exit(EXIT_FAILURE);
+        }
+    } else if (!(common_tcp_log_file = fopen(TCP_LOG_FILE, "a"))) {
+        perror("open " TCP_LOG_FILE);
+        cleanup_resources(client_sessions, 65536, &imp, udp_sock, tcp_sock);
+        exit(EXIT_FAILURE);
+    }
+
+    struct sigaction sa = {0};
+    sa.sa_handler = request_stats;
+    sigemptyset(&sa.sa_mask);
+    /* Any thread may take the signal; a TCP thread's read must not see EINTR and drop its client. */
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, NULL);
+
+    fd_set readfds;
+    int maxfd = udp_sock > tcp_sock ? udp_sock : tcp_sock;
+
+    while (1) {
+        if (spin_us && spin_udp(udp_sock, client_sessions, &imp, spin_us) < 0) {
+            break;
+        }
+        if (stats_requested) {
+            stats_requested = 0;
+            print_stats();
+        }
 
-    while (1) {
         FD_ZERO(&readfds);
         FD_SET(udp_sock, &readfds);
         FD_SET(tcp_sock, &readfds);
 
         int ret = select(maxfd + 1, &readfds, NULL, NULL, NULL);
+        if (stats_requested) {
+            stats_requested = 0;
+            print_stats();
+        }
         if (ret < 0) {
+            if (errno == EINTR) continue;
             perror("select");
             break;
         }
 
         if (FD_ISSET(udp_sock, &readfds)) {
-            if (handle_udp_packet(udp_sock, client_files, lostPositions, lostSize, rejectCount) < 0) {
+            if (handle_udp_packet(udp_sock, client_sessions, &imp, 0, &latency_sleep) < 0) {
                 break;
             }
         }
@@ -371,6 +2324,7 @@ int main(int argc, char **argv) {
         }
     }
 
-    cleanup_resources(client_files, 65536, lostPositions, rejectCount, udp_sock, tcp_sock);
+    print_stats();
+    cleanup_resources(client_sessions, 65536, &imp, udp_sock, tcp_sock);
     return 0;
 }
@@ -0,0 +1,65 @@
+#ifndef TCP_LOG_H
+#define TCP_LOG_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+/*
+ * TCP log format shared by server.c, clients/tcp_client.c and logmerge.c.
+ *
+ * By default every record goes to TCP_LOG_FILE as sent. In acknowledged
+ * mode a connection starts with TCP_ACK_HELLO followed by "write" or
+ * "fsync" and a newline; records are then newline-terminated and every
+ * batch written is answered with "A <n>\n" for its n records.
+ *
+ * Sharded logs (server -S K) spread records over K files named by
+ * TCP_SHARD_FILE, routed by the client's address or by address and port.
+ * Each shard has a single writer, and every line carries a header
+ *
+ *   <sec>.<nsec> <ip>:<port> <record>
+ *
+ * with the wall-clock time the server queued it. Timestamps never go
+ * backwards within a shard, so shards merge into a time-ordered view with
+ * a streaming k-way merge (logmerge).
+ */
+
+#define TCP_LOG_FILE "tcp_messages.log"
+#define TCP_SHARD_FILE "tcp_messages.%d.log"
+#define TCP_ACK_HELLO "ACKMODE "
+#define TCP_MAX_SHARDS 256
+
+/* Shard of a client: by address only, so one host's records stay in one file, or by address and port. */
+static inline int tcp_log_shard(struct in_addr addr, uint16_t port, int by_peer, int shards) {
+    uint64_t key = ntohl(addr.s_addr);
+    if (by_peer) key = key << 16 | port;
+    key *= 0x9E3779B97F4A7C15ULL;
+    return (int)((key >> 32) % (uint64_t)shards);
+}
+
+struct tcp_log_record {
+    uint64_t sec;
+    uint32_t nsec;
+    const char *source;
+    size_t source_len;
+    const char *body;
+};
+
+/* Splits a sharded log line into its header fields; returns -1 if it has none. */
+static inline int tcp_log_parse(const char *line, struct tcp_log_record *r) {
+    char *end;
+    r->sec = strtoull(line, &end, 10);
+    if (end == line || *end != '.') return -1;
+    const char *p = end + 1;
+    r->nsec = (uint32_t)strtoul(p, &end, 10);
+    if (end == p || *end != ' ') return -1;
+    r->source = end + 1;
+    const char *space = strchr(r->source, ' ');
+    if (!space) return -1;
+    r->source_len = (size_t)(space - r->source);
+    r->body = space + 1;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,287 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/*
+ * Leveled tracing. Producers copy a fixed-size binary record into a
+ * per-thread single-producer ring; a background thread drains all rings,
+ * formats the records and writes them out in large batches. The hot path
+ * costs a clock read and a memcpy, never a syscall.
+ */
+
+#define TRACE_RING_SIZE 4096
+#define TRACE_STR_LEN 48
+#define TRACE_FLUSH_INTERVAL_MS 50
+
+enum trace_level {
+    TRACE_OFF = 0,
+    TRACE_ERROR,
+    TRACE_INFO,
+    TRACE_DEBUG
+};
+
+enum trace_event {
+    TEV_EMPTY_PACKET,
+    TEV_SHORT_PACKET,
+    TEV_BAD_HELLO,
+    TEV_NO_SESSION,
+    TEV_BAD_CHUNK,
+    TEV_BAD_TYPE,
+    TEV_SESSION_FAILED,
+    TEV_SESSION_STARTED,
+    TEV_FILE_OPENED,
+    TEV_FILE_RENAMED,
+    TEV_PACKET_REJECTED,
+    TEV_PACKET_DROPPED,
+    TEV_GROUP_RECOVERED,
+    TEV_ACK_SENT,
+    TEV_GROUP_ACK_SENT,
+    TEV_NACK_SENT,
+    TEV_TCP_CONNECTED,
+    TEV_GET_STARTED,
+    TEV_GET_REFUSED,
+    TEV_GET_FINISHED,
+    TEV_GET_FAILED,
+    TEV_RCVBUF_GROWN,
+    TEV_RCVBUF_LIMIT,
+    TEV_COUNT
+};
+
+struct trace_event_desc {
+    enum trace_level level;
+    int sampled;
+    const char *fmt;
+};
+
+/* Formats take up to three integer arguments followed by an optional string. */
+static const struct trace_event_desc trace_events[TEV_COUNT] = {
+    [TEV_EMPTY_PACKET]    = {TRACE_ERROR, 0, "Received empty packet\n"},
+    [TEV_SHORT_PACKET]    = {TRACE_ERROR, 0, "Packet too small (%lld bytes)\n"},
+    [TEV_BAD_HELLO]       = {TRACE_ERROR, 0, "Rejected HELLO from client port %lld (version %lld, chunk size %lld)\n"},
+    [TEV_NO_SESSION]      = {TRACE_ERROR, 0, "Data from client port %lld without a session\n"},
+    [TEV_BAD_CHUNK]       = {TRACE_ERROR, 0, "Malformed chunk from client port %lld (seq %lld)\n"},
+    [TEV_BAD_TYPE]        = {TRACE_ERROR, 0, "Unknown packet type 0x%llx from client port %lld\n"},
+    [TEV_SESSION_FAILED]  = {TRACE_ERROR, 0, "Dropped the session of client port %lld after an I/O error\n"},
+    [TEV_SESSION_STARTED] = {TRACE_INFO,  0, "Session for client port %lld: flags 0x%llx, chunk size %lld\n"},
+    [TEV_FILE_OPENED]     = {TRACE_INFO,  0, "Opened file .%lld.bin for client port %lld\n"},
+    [TEV_FILE_RENAMED]    = {TRACE_INFO,  0, "File for client port %lld renamed to %s\n"},
+    [TEV_PACKET_REJECTED] = {TRACE_INFO,  0, "Rejecting packet number %lld (%lld/%lld)\n"},
+    [TEV_PACKET_DROPPED]  = {TRACE_DEBUG, 1, "Dropping packet number %lld (random loss)\n"},
+    [TEV_GROUP_RECOVERED] = {TRACE_INFO,  0, "Recovered %lld chunks of group %lld for client port %lld\n"},
+    [TEV_ACK_SENT]        = {TRACE_DEBUG, 1, "Sent ACK for packet number %lld\n"},
+    [TEV_GROUP_ACK_SENT]  = {TRACE_DEBUG, 1, "Sent ACK for group %lld\n"},
+    [TEV_NACK_SENT]       = {TRACE_DEBUG, 0, "Sent NACK with %lld ranges (%lld chunks from %lld)\n"},
+    [TEV_TCP_CONNECTED]   = {TRACE_INFO,  0, "New TCP connection from %s:%lld\n"},
+    [TEV_GET_STARTED]     = {TRACE_INFO,  0, "Sending %s to client port %lld (%lld chunks)\n"},
+    [TEV_GET_REFUSED]     = {TRACE_ERROR, 0, "Refused GET of %s from client port %lld\n"},
+    [TEV_GET_FINISHED]    = {TRACE_INFO,  0, "Download to client port %lld complete, %lld chunks retransmitted\n"},
+    [TEV_GET_FAILED]      = {TRACE_ERROR, 0, "Download to client port %lld abandoned after %lld of %lld chunks\n"},
+    [TEV_RCVBUF_GROWN]    = {TRACE_INFO,  0, "Receive buffer grown to %lld bytes after %lld kernel drops\n"},
+    [TEV_RCVBUF_LIMIT]    = {TRACE_ERROR, 0, "Receive buffer stuck at %lld bytes (raise net.core.rmem_max)\n"},
+};
+
+struct trace_record {
+    uint64_t ts_ns;
+    uint16_t event;
+    uint16_t nargs;
+    uint32_t reserved;
+    long long args[3];
+    char str[TRACE_STR_LEN];
+};
+
+struct trace_ring {
+    struct trace_record records[TRACE_RING_SIZE];
+    _Atomic uint32_t head;
+    _Atomic uint32_t tail;
+    _Atomic uint64_t dropped;
+    _Atomic int dead;
+    struct trace_ring *next;
+};
+
+static _Atomic int trace_level = TRACE_INFO;
+static unsigned trace_sample_rate = 1;
+static FILE *trace_out = NULL;
+static struct trace_ring *trace_rings = NULL;
+static pthread_mutex_t trace_rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t trace_ring_key;
+static pthread_t trace_flusher;
+static _Atomic int trace_running = 0;
+static __thread struct trace_ring *trace_tls_ring = NULL;
+static __thread unsigned trace_tls_sample = 0;
+
+static int trace_parse_level(const char *str) {
+    static const char *names[] = {"off", "error", "info", "debug"};
+    for (int i = 0; i <= TRACE_DEBUG; i++) {
+        if (strcmp(str, names[i]) == 0) return i;
+    }
+    char *endptr;
+    long val = strtol(str, &endptr, 10);
+    if (*endptr != '\0' || val < TRACE_OFF || val > TRACE_DEBUG) return -1;
+    return (int)val;
+}
+
+static void trace_ring_release(void *arg) {
+    struct trace_ring *ring = arg;
+    atomic_store_explicit(&ring->dead, 1, memory_order_release);
+}
+
+static struct trace_ring *trace_ring_get(void) {
+    if (trace_tls_ring) return trace_tls_ring;
+
+    struct trace_ring *ring = calloc(1, sizeof(*ring));
+    if (!ring) return NULL;
+
+    pthread_mutex_lock(&trace_rings_mutex);
+    ring->next = trace_rings;
+    trace_rings = ring;
+    pthread_mutex_unlock(&trace_rings_mutex);
+
+    pthread_setspecific(trace_ring_key, ring);
+    trace_tls_ring = ring;
+    return ring;
+}
+
+static int trace_enabled(enum trace_event ev) {
+    return (int)trace_events[ev].level <= atomic_load_explicit(&trace_level, memory_order_relaxed);
+}
+
+static void trace_emit(enum trace_event ev, int nargs, long long a, long long b, long long c, const char *str) {
+    if (!trace_enabled(ev)) return;
+    if (trace_events[ev].sampled && trace_sample_rate > 1 && trace_tls_sample++ % trace_sample_rate != 0) return;
+
+    struct trace_ring *ring = trace_ring_get();
+    if (!ring) return;
+
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail >= TRACE_RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    struct trace_record *rec = &ring->records[head % TRACE_RING_SIZE];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec->ts_ns = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+    rec->event = (uint16_t)ev;
+    rec->nargs = (uint16_t)nargs;
+    rec->args[0] = a;
+    rec->args[1] = b;
+    rec->args[2] = c;
+    if (str) {
+        strncpy(rec->str, str, TRACE_STR_LEN - 1);
+        rec->str[TRACE_STR_LEN - 1] = '\0';
+    } else {
+        rec->str[0] = '\0';
+    }
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+#define TRACE0(ev, str)          trace_emit((ev), 0, 0, 0, 0, (str))
+#define TRACE1(ev, a, str)       trace_emit((ev), 1, (a), 0, 0, (str))
+#define TRACE2(ev, a, b, str)    trace_emit((ev), 2, (a), (b), 0, (str))
+#define TRACE3(ev, a, b, c, str) trace_emit((ev), 3, (a), (b), (c), (str))
+
+static void trace_format(const struct trace_record *rec) {
+    const char *fmt = trace_events[rec->event].fmt;
+    fprintf(trace_out, "[%llu.%06llu] ",
+            (unsigned long long)(rec->ts_ns / 1000000000ull),
+            (unsigned long long)(rec->ts_ns % 1000000000ull / 1000));
+
+    /* Events that carry a string put it where the format asks for it. */
+    switch (rec->event) {
+    case TEV_FILE_RENAMED:
+        fprintf(trace_out, fmt, rec->args[0], rec->str);
+        break;
+    case TEV_TCP_CONNECTED:
+    case TEV_GET_REFUSED:
+        fprintf(trace_out, fmt, rec->str, rec->args[0]);
+        break;
+    case TEV_GET_STARTED:
+        fprintf(trace_out, fmt, rec->str, rec->args[0], rec->args[1]);
+        break;
+    default:
+        fprintf(trace_out, fmt, rec->args[0], rec->args[1], rec->args[2]);
+        break;
+    }
+}
+
+static int trace_drain(void) {
+    int drained = 0;
+
+    pthread_mutex_lock(&trace_rings_mutex);
+    struct trace_ring **link = &trace_rings;
+    while (*link) {
+        struct trace_ring *ring = *link;
+        int dead = atomic_load_explicit(&ring->dead, memory_order_acquire);
+        uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+        for (; tail != head; tail++, drained++) {
+            trace_format(&ring->records[tail % TRACE_RING_SIZE]);
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+        uint64_t dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+        if (dropped) {
+            fprintf(trace_out, "trace: %llu records dropped\n", (unsigned long long)dropped);
+        }
+
+        if (dead) {
+            *link = ring->next;
+            free(ring);
+        } else {
+            link = &ring->next;
+        }
+    }
+    pthread_mutex_unlock(&trace_rings_mutex);
+
+    if (drained) fflush(trace_out);
+    return drained;
+}
+
+static void *trace_flush_thread(void *arg) {
+    (void)arg;
+    struct timespec interval = {0, TRACE_FLUSH_INTERVAL_MS * 1000000L};
+    while (atomic_load(&trace_running)) {
+        if (trace_drain() == 0) {
+            nanosleep(&interval, NULL);
+        }
+    }
+    trace_drain();
+    return NULL;
+}
+
+static int trace_init(int level, unsigned sample_rate, FILE *out) {
+    atomic_store(&trace_level, level);
+    trace_sample_rate = sample_rate ? sample_rate : 1;
+    trace_out = out;
+    setvbuf(trace_out, NULL, _IOFBF, 1 << 16);
+
+    if (pthread_key_create(&trace_ring_key, trace_ring_release) != 0) {
+        perror("pthread_key_create");
+        return -1;
+    }
+
+    atomic_store(&trace_running, 1);
+    if (pthread_create(&trace_flusher, NULL, trace_flush_thread, NULL) != 0) {
+        perror("pthread_create");
+        atomic_store(&trace_running, 0);
+        return -1;
+    }
+    return 0;
+}
+
+static void trace_shutdown(void) {
+    if (!atomic_exchange(&trace_running, 0)) return;
+    pthread_join(trace_flusher, NULL);
+}
+
+#endif
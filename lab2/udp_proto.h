@@ -0,0 +1,597 @@
+#ifndef UDP_PROTO_H
+#define UDP_PROTO_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Session protocol shared by server.c and clients/udp_client.c.
+ *
+ * Version 1 is the Lab1 format (0xFF 0xFF 0xFF, one data byte, a host-order
+ * packet number) and is still accepted, as is the bare filename packet that
+ * finishes every transfer. Version 2 packets start with PROTO_MAGIC and a
+ * type byte. Fields marked :v are unsigned LEB128 varints (7 bits per byte,
+ * least significant group first), everything else is a single byte or
+ * big-endian. Sequence numbers and counts are 64-bit, yet a chunk header
+ * stays 4-6 bytes for files up to a few gigabytes.
+ *
+ *   HELLO  FE 'H' version flags chunk_size:v [fec_k fec_m]
+ *   DATA   FE 'D' flags seq:v [raw_len:v, compressed chunks only] payload
+ *   PARITY FE 'P' group:v index count symbol
+ *   FIN    FE 'F' total_chunks:v
+ *   NACK   FE 'N' count (start:v length:v) * count          server -> client
+ *   INDEX  FE 'I' first:v count (len:v sha256[32]) * count
+ *   WANT   FE 'W' first:v count bitmap[(count + 7) / 8]     server -> client
+ *   GET    FE 'G' version flags chunk_size:v rate:v filename
+ *
+ * HELLO is answered with "ACK", the server's version and the flags it
+ * accepted, DATA with "ACK" followed by seq:v. A HELLO the server cannot
+ * accept (another version, a chunk size out of range) gets "ERR" and a
+ * reason instead. Chunk seq lands at byte
+ * offset seq * chunk_size, so chunks can be written in any order.
+ *
+ * With FEC, chunks are grouped k at a time (group = seq / k) and each group
+ * is followed by m parity packets. The server acknowledges whole groups
+ * with "ACKG" and group:v once every data chunk in the group has been
+ * received or reconstructed; data chunks are not acknowledged one by one.
+ *
+ * In NACK mode the client streams every chunk without waiting. The server
+ * tracks which chunks it holds and NACKs missing ranges as soon as it sees
+ * a gap; the client retransmits them between new chunks. FIN tells the
+ * server how many chunks to expect and is answered with "ACKF" and
+ * total_chunks:v once the file is complete, or with a NACK for whatever is
+ * missing.
+ *
+ * In dedup mode the client cuts the file into content-defined chunks of
+ * up to chunk_size bytes, so an insertion only changes the chunks around
+ * it, and describes them with INDEX packets before sending any data. The
+ * server fills every chunk it already holds in its content-addressed store
+ * (one file per SHA-256) and answers with WANT, bit i set if chunk
+ * first + i still has to be sent. DATA then carries only those chunks; seq
+ * is the chunk index and the offset comes from the index. FEC is not used
+ * in this mode.
+ *
+ * GET reverses the roles. The server answers from a port of its own that
+ * serves only this download, with "ACK", its version, the flags it
+ * accepted and the file size:v, or refuses from the main port with "ERR"
+ * and a reason. The client starts the stream by sending "ACK" next:v to
+ * that port. The server sends DATA for chunks below next plus a window of
+ * GET_WINDOW_BYTES, paced to rate KiB/s unless rate is 0, and then FIN.
+ * The client keeps next up to date (every chunk below it has arrived),
+ * NACKs gaps exactly as the server does for uploads and answers FIN with
+ * "ACKF" once it holds the whole file.
+ */
+
+#define PROTO_MAGIC 0xFE
+#define PROTO_VERSION 2
+
+#define PROTO_HELLO 'H'
+#define PROTO_DATA  'D'
+#define PROTO_PARITY 'P'
+#define PROTO_FIN   'F'
+#define PROTO_NACK  'N'
+#define PROTO_INDEX 'I'
+#define PROTO_WANT  'W'
+#define PROTO_GET   'G'
+
+#define VARINT_MAX_LEN 10
+
+#define PROTO_HELLO_MAX (4 + VARINT_MAX_LEN + 2)
+#define PROTO_HELLO_REPLY_LEN 5
+#define PROTO_DATA_HDR_MAX (3 + 2 * VARINT_MAX_LEN)
+#define PROTO_PARITY_HDR_MAX (4 + VARINT_MAX_LEN)
+#define PROTO_FIN_MAX (2 + VARINT_MAX_LEN)
+#define PROTO_NACK_HDR_LEN 3
+#define PROTO_INDEX_HDR_MAX (3 + VARINT_MAX_LEN)
+#define PROTO_WANT_MAX (PROTO_INDEX_HDR_MAX + INDEX_MAX_ENTRIES / 8)
+#define PROTO_GET_HDR_MAX (4 + 2 * VARINT_MAX_LEN)
+#define PROTO_GET_REPLY_MAX (5 + VARINT_MAX_LEN)
+#define PROTO_REPLY_MAX 16
+
+#define NACK_MAX_RANGES 64
+#define INDEX_MAX_ENTRIES 32
+#define SHA256_LEN 32
+#define NACK_RETRY_MS 100
+#define GET_WINDOW_BYTES (256 << 10)
+
+#define GROUP_ACK "ACKG"
+#define FIN_ACK "ACKF"
+#define PROTO_ERROR "ERR"
+
+#define SESSION_COMPRESS 0x01
+#define SESSION_FEC_XOR  0x02
+#define SESSION_FEC_RS   0x04
+#define SESSION_NACK     0x08
+#define SESSION_DEDUP    0x10
+#define SESSION_FEC (SESSION_FEC_XOR | SESSION_FEC_RS)
+#define SESSION_FLAGS_SUPPORTED (SESSION_COMPRESS | SESSION_FEC | SESSION_NACK | SESSION_DEDUP)
+
+#define CHUNK_COMPRESSED 0x01
+#define CHUNK_LAST       0x02
+
+#define DEFAULT_CHUNK_SIZE 1024
+#define MAX_CHUNK_SIZE 8192
+
+static inline void put_u16(uint8_t *p, uint16_t v) {
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+static inline void put_u32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+static inline uint16_t get_u16(const uint8_t *p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t get_u32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline size_t put_varint(uint8_t *p, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (uint8_t)v;
+    return n;
+}
+
+/* Returns the number of bytes consumed, or 0 if the varint is truncated or too long. */
+static inline size_t get_varint(const uint8_t *p, size_t avail, uint64_t *v) {
+    uint64_t r = 0;
+    for (size_t i = 0; i < avail && i < VARINT_MAX_LEN; i++) {
+        r |= (uint64_t)(p[i] & 0x7F) << (7 * i);
+        if (!(p[i] & 0x80)) {
+            *v = r;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+/* Builds a reply such as "ACK" or "ACKG" followed by value:v. */
+static inline size_t encode_reply(uint8_t *p, const char *prefix, uint64_t value) {
+    size_t n = strlen(prefix);
+    memcpy(p, prefix, n);
+    return n + put_varint(p + n, value);
+}
+
+struct data_header {
+    uint8_t flags;
+    uint64_t seq;
+    uint16_t raw_len;
+    size_t len;
+};
+
+static inline size_t encode_data_header(uint8_t *p, uint8_t flags, uint64_t seq, uint16_t raw_len) {
+    size_t n = 0;
+    p[n++] = PROTO_MAGIC;
+    p[n++] = PROTO_DATA;
+    p[n++] = flags;
+    n += put_varint(p + n, seq);
+    if (flags & CHUNK_COMPRESSED) n += put_varint(p + n, raw_len);
+    return n;
+}
+
+/* Returns 0 if the header is malformed. An uncompressed chunk's raw_len is its payload length. */
+static inline int decode_data_header(const uint8_t *p, size_t n, struct data_header *h) {
+    size_t off = 3, used;
+    uint64_t raw_len;
+
+    if (n < off) return 0;
+    h->flags = p[2];
+    if (!(used = get_varint(p + off, n - off, &h->seq))) return 0;
+    off += used;
+    if (h->flags & CHUNK_COMPRESSED) {
+        if (!(used = get_varint(p + off, n - off, &raw_len))) return 0;
+        off += used;
+    } else {
+        raw_len = n - off;
+    }
+    if (raw_len > MAX_CHUNK_SIZE) return 0;
+    h->raw_len = (uint16_t)raw_len;
+    h->len = off;
+    return 1;
+}
+
+static inline size_t encode_parity_header(uint8_t *p, uint64_t group, int index, int count) {
+    size_t n = 0;
+    p[n++] = PROTO_MAGIC;
+    p[n++] = PROTO_PARITY;
+    n += put_varint(p + n, group);
+    p[n++] = (uint8_t)index;
+    p[n++] = (uint8_t)count;
+    return n;
+}
+
+/* Returns the header length, or 0 if it is malformed. */
+static inline size_t decode_parity_header(const uint8_t *p, size_t n, uint64_t *group, int *index, int *count) {
+    size_t used = n > 2 ? get_varint(p + 2, n - 2, group) : 0;
+    if (!used || n < 2 + used + 2) return 0;
+    *index = p[2 + used];
+    *count = p[3 + used];
+    return 4 + used;
+}
+
+/* Returns the header length of an INDEX or WANT packet, or 0 if it is malformed. */
+static inline size_t decode_index_header(const uint8_t *p, size_t n, uint64_t *first, int *count) {
+    size_t used = n > 2 ? get_varint(p + 2, n - 2, first) : 0;
+    if (!used || n < 3 + used || p[2 + used] > INDEX_MAX_ENTRIES) return 0;
+    *count = p[2 + used];
+    return 3 + used;
+}
+
+static inline size_t encode_index_header(uint8_t *p, uint8_t type, uint64_t first, int count) {
+    size_t n = 0;
+    p[n++] = PROTO_MAGIC;
+    p[n++] = type;
+    n += put_varint(p + n, first);
+    p[n++] = (uint8_t)count;
+    return n;
+}
+
+/* SHA-256 (FIPS 180-4), one-shot: chunk fingerprints for dedup. */
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t sha256_rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+static inline void sha256_block(uint32_t h[8], const uint8_t *block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) w[i] = get_u32(block + 4 * i);
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = sha256_rotr(w[i - 15], 7) ^ sha256_rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = sha256_rotr(w[i - 2], 17) ^ sha256_rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = hh + (sha256_rotr(e, 6) ^ sha256_rotr(e, 11) ^ sha256_rotr(e, 25)) + ((e & f) ^ (~e & g))
+                      + sha256_k[i] + w[i];
+        uint32_t t2 = (sha256_rotr(a, 2) ^ sha256_rotr(a, 13) ^ sha256_rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        hh = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+}
+
+static inline void sha256(const uint8_t *data, size_t len, uint8_t out[SHA256_LEN]) {
+    uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    uint8_t tail[128];
+    size_t full = len & ~(size_t)63;
+
+    for (size_t off = 0; off < full; off += 64) sha256_block(h, data + off);
+
+    size_t rest = len - full;
+    size_t tail_len = rest < 56 ? 64 : 128;
+    memset(tail, 0, sizeof(tail));
+    memcpy(tail, data + full, rest);
+    tail[rest] = 0x80;
+    put_u32(tail + tail_len - 8, (uint32_t)((uint64_t)len >> 29));
+    put_u32(tail + tail_len - 4, (uint32_t)(len << 3));
+    for (size_t off = 0; off < tail_len; off += 64) sha256_block(h, tail + off);
+
+    for (int i = 0; i < 8; i++) put_u32(out + 4 * i, h[i]);
+}
+
+/*
+ * LZ4-style block codec. Each chunk is compressed on its own so it can be
+ * decoded without its neighbours. Sequences are a token (literal length in
+ * the high nibble, match length - 4 in the low one), optional length
+ * extension bytes, the literals and a 16-bit little-endian match offset.
+ * The block ends with a literal-only sequence.
+ */
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_LAST_LITERALS 5
+#define LZ_MF_LIMIT 12
+
+static inline uint32_t lz_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static inline uint8_t *lz_put_length(uint8_t *op, const uint8_t *oend, size_t len) {
+    while (len >= 255) {
+        if (op >= oend) return NULL;
+        *op++ = 255;
+        len -= 255;
+    }
+    if (op >= oend) return NULL;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+static inline uint8_t *lz_put_sequence(uint8_t *op, const uint8_t *oend, const uint8_t *lit, size_t lit_len,
+                                       size_t offset, size_t match_len) {
+    if (op >= oend) return NULL;
+    uint8_t *token = op++;
+    *token = (uint8_t)((lit_len >= 15 ? 15 : lit_len) << 4);
+    if (lit_len >= 15 && !(op = lz_put_length(op, oend, lit_len - 15))) return NULL;
+
+    if ((size_t)(oend - op) < lit_len) return NULL;
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+
+    if (match_len == 0) return op;
+
+    if (oend - op < 2) return NULL;
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+
+    size_t ml = match_len - LZ_MIN_MATCH;
+    *token |= (uint8_t)(ml >= 15 ? 15 : ml);
+    if (ml >= 15 && !(op = lz_put_length(op, oend, ml - 15))) return NULL;
+    return op;
+}
+
+/* Returns the compressed size, or 0 if the result would not fit in dst_cap. */
+static inline size_t lz_compress(const uint8_t *src, size_t src_len, uint8_t *dst, size_t dst_cap) {
+    uint16_t table[1 << LZ_HASH_BITS];
+    const uint8_t *ip = src;
+    const uint8_t *anchor = src;
+    const uint8_t *iend = src + src_len;
+    uint8_t *op = dst;
+    const uint8_t *oend = dst + dst_cap;
+
+    if (src_len > 0xFFFF) return 0;
+    memset(table, 0, sizeof(table));
+
+    if (src_len >= LZ_MF_LIMIT) {
+        const uint8_t *mflimit = iend - LZ_MF_LIMIT;
+        const uint8_t *mlimit = iend - LZ_LAST_LITERALS;
+
+        ip++;
+        while (ip < mflimit) {
+            uint32_t h = lz_hash(lz_read32(ip));
+            const uint8_t *ref = src + table[h];
+            table[h] = (uint16_t)(ip - src);
+
+            if (ref >= ip || lz_read32(ref) != lz_read32(ip)) {
+                ip++;
+                continue;
+            }
+
+            const uint8_t *mp = ip + LZ_MIN_MATCH;
+            const uint8_t *rp = ref + LZ_MIN_MATCH;
+            while (mp < mlimit && *mp == *rp) {
+                mp++;
+                rp++;
+            }
+
+            op = lz_put_sequence(op, oend, anchor, (size_t)(ip - anchor), (size_t)(ip - ref), (size_t)(mp - ip));
+            if (!op) return 0;
+
+            ip = anchor = mp;
+        }
+    }
+
+    op = lz_put_sequence(op, oend, anchor, (size_t)(iend - anchor), 0, 0);
+    if (!op) return 0;
+    return (size_t)(op - dst);
+}
+
+/* Returns the decompressed size, or -1 on malformed input. */
+static inline long lz_decompress(const uint8_t *src, size_t src_len, uint8_t *dst, size_t dst_cap) {
+    const uint8_t *ip = src;
+    const uint8_t *iend = src + src_len;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + dst_cap;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+
+        size_t lit_len = token >> 4;
+        if (lit_len == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                lit_len += b;
+            } while (b == 255);
+        }
+        if ((size_t)(iend - ip) < lit_len || (size_t)(oend - op) < lit_len) return -1;
+        memcpy(op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        if (ip == iend) break;
+
+        if (iend - ip < 2) return -1;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) return -1;
+
+        size_t match_len = token & 0x0F;
+        if (match_len == 15) {
+            uint8_t b;
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                match_len += b;
+            } while (b == 255);
+        }
+        match_len += LZ_MIN_MATCH;
+        if ((size_t)(oend - op) < match_len) return -1;
+
+        const uint8_t *ref = op - offset;
+        for (size_t i = 0; i < match_len; i++) {
+            op[i] = ref[i];
+        }
+        op += match_len;
+    }
+
+    return (long)(op - dst);
+}
+
+/*
+ * Erasure coding over GF(2^8). A FEC symbol is a data chunk as it appears
+ * on the wire (flags, raw_len, payload_len, payload) zero-padded to a fixed
+ * size, so a reconstructed symbol is handled exactly like a received DATA
+ * packet. XOR mode has one parity symbol per group; Reed-Solomon mode uses
+ * a Cauchy matrix, any k of the k + m symbols recover the group.
+ */
+
+#define FEC_SYMBOL_HDR_LEN 5
+#define FEC_MAX_SYMBOLS 64
+
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+static int gf_ready = 0;
+
+static inline void gf_init(void) {
+    if (gf_ready) return;
+    unsigned x = 1;
+    for (int i = 0; i < 255; i++) {
+        gf_exp[i] = (uint8_t)x;
+        gf_log[x] = (uint8_t)i;
+        x <<= 1;
+        if (x & 0x100) x ^= 0x11D;
+    }
+    for (int i = 255; i < 512; i++) {
+        gf_exp[i] = gf_exp[i - 255];
+    }
+    gf_ready = 1;
+}
+
+static inline uint8_t gf_mul(uint8_t a, uint8_t b) {
+    if (a == 0 || b == 0) return 0;
+    return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static inline uint8_t gf_inv(uint8_t a) {
+    return gf_exp[255 - gf_log[a]];
+}
+
+/* dst ^= c * src */
+static inline void gf_mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) {
+    if (c == 0) return;
+    if (c == 1) {
+        for (size_t i = 0; i < len; i++) dst[i] ^= src[i];
+        return;
+    }
+    unsigned lc = gf_log[c];
+    for (size_t i = 0; i < len; i++) {
+        if (src[i]) dst[i] ^= gf_exp[lc + gf_log[src[i]]];
+    }
+}
+
+static inline size_t fec_symbol_size(uint16_t chunk_size) {
+    return FEC_SYMBOL_HDR_LEN + chunk_size;
+}
+
+static inline int fec_params_valid(uint8_t flags, int k, int m) {
+    if (k < 1 || m < 1 || k + m > FEC_MAX_SYMBOLS) return 0;
+    if ((flags & SESSION_FEC) == SESSION_FEC_XOR) return m == 1;
+    return (flags & SESSION_FEC) == SESSION_FEC_RS;
+}
+
+static inline uint8_t fec_coef(uint8_t flags, int k, int j, int i) {
+    if (flags & SESSION_FEC_XOR) return 1;
+    return gf_inv((uint8_t)((k + j) ^ i));
+}
+
+/* Data symbols at index >= count are implicit zero padding of a short group. */
+static inline void fec_encode(uint8_t flags, int k, int m, int count, uint8_t *const *data, uint8_t **parity, size_t len) {
+    gf_init();
+    for (int j = 0; j < m; j++) {
+        memset(parity[j], 0, len);
+        for (int i = 0; i < count; i++) {
+            gf_mul_add(parity[j], data[i], fec_coef(flags, k, j, i), len);
+        }
+    }
+}
+
+/*
+ * Rebuilds missing data symbols in place. present[] covers k data entries
+ * followed by m parity entries. Returns the number of symbols recovered, or
+ * -1 if too few symbols are present.
+ */
+static inline int fec_decode(uint8_t flags, int k, int m, int count, uint8_t **symbols, const uint8_t *present, size_t len) {
+    int missing[FEC_MAX_SYMBOLS], rows[FEC_MAX_SYMBOLS];
+    int e = 0, r = 0;
+
+    gf_init();
+    for (int i = 0; i < count; i++) {
+        if (!present[i]) missing[e++] = i;
+    }
+    if (e == 0) return 0;
+    for (int j = 0; j < m && r < e; j++) {
+        if (present[k + j]) rows[r++] = j;
+    }
+    if (r < e) return -1;
+
+    /* Syndromes: parity minus the contribution of the data we already have. */
+    uint8_t a[FEC_MAX_SYMBOLS][FEC_MAX_SYMBOLS];
+    uint8_t inv[FEC_MAX_SYMBOLS][FEC_MAX_SYMBOLS];
+    for (int x = 0; x < e; x++) {
+        uint8_t *syn = symbols[k + rows[x]];
+        for (int i = 0; i < count; i++) {
+            if (present[i]) gf_mul_add(syn, symbols[i], fec_coef(flags, k, rows[x], i), len);
+        }
+        for (int y = 0; y < e; y++) {
+            a[x][y] = fec_coef(flags, k, rows[x], missing[y]);
+            inv[x][y] = (uint8_t)(x == y);
+        }
+    }
+
+    for (int col = 0; col < e; col++) {
+        int pivot = col;
+        while (pivot < e && a[pivot][col] == 0) pivot++;
+        if (pivot == e) return -1;
+        if (pivot != col) {
+            for (int y = 0; y < e; y++) {
+                uint8_t t = a[col][y]; a[col][y] = a[pivot][y]; a[pivot][y] = t;
+                t = inv[col][y]; inv[col][y] = inv[pivot][y]; inv[pivot][y] = t;
+            }
+        }
+        uint8_t scale = gf_inv(a[col][col]);
+        for (int y = 0; y < e; y++) {
+            a[col][y] = gf_mul(a[col][y], scale);
+            inv[col][y] = gf_mul(inv[col][y], scale);
+        }
+        for (int x = 0; x < e; x++) {
+            uint8_t f = a[x][col];
+            if (x == col || f == 0) continue;
+            for (int y = 0; y < e; y++) {
+                a[x][y] ^= gf_mul(f, a[col][y]);
+                inv[x][y] ^= gf_mul(f, inv[col][y]);
+            }
+        }
+    }
+
+    for (int y = 0; y < e; y++) {
+        uint8_t *out = symbols[missing[y]];
+        memset(out, 0, len);
+        for (int x = 0; x < e; x++) {
+            gf_mul_add(out, symbols[k + rows[x]], inv[y][x], len);
+        }
+    }
+    return e;
+}
+
+#endif
@@ -1,71 +1,202 @@
+#define _FILE_OFFSET_BITS 64
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <poll.h>
+#include <time.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <errno.h>
 #include <ctype.h>
 #include <netdb.h>
-
-#define TFTP_PORT 69
-#define BUFFER_SIZE 516
-#define DATA_SIZE 512
-#define TIMEOUT 5
-#define MAX_RETRIES 3
+#include <getopt.h>
+
+#include "tftp_proto.h"
+
+#define DEFAULT_BLKSIZE 1468
+#define DEFAULT_WINDOWSIZE 16
+#define DEFAULT_PARALLEL 8
+#define MAX_PARALLEL 256
+#define MAX_BATCH_FILES 256
+#define INITIAL_RTO_US 1000000
+#define MIN_RTO_US 50000
+#define MAX_BACKOFF 16
+#define RING_MAX_BYTES (32 << 20)
+#define IO_BATCH_BYTES (256 << 10)
+#define IO_MAX_BLOCKS 64
 #define MAX_FILENAME 256
 #define MAX_HOSTNAME 256
+#define MCAST_BLOCKS 65536
+
+/*
+ * Параметры передачи (RFC 2347-2349). blksize и timeout запрашиваются,
+ * только если отличаются от значений по умолчанию; если сервер не прислал
+ * OACK, передача идет блоками по 512 байт.
+ */
+struct tftp_options {
+	int blksize;
+	int timeout;
+	int windowsize;
+	long long tsize;
+	int multicast;
+	struct sockaddr_in group;
+	int master;
+};
 
-#define TFTP_RRQ   1
-#define TFTP_WRQ   2
-#define TFTP_DATA  3
-#define TFTP_ACK   4
-#define TFTP_ERROR 5
+/*
+ * Статистика передачи. retransmits для put - повторно отправленные блоки
+ * DATA, для get - повторные ACK, которыми запрошен повтор. duplicates -
+ * лишние пакеты: для get отброшенные блоки DATA, для put ACK без
+ * продвижения окна.
+ */
+struct transfer_stats {
+	long long start_us;
+	long long end_us;
+	long long bytes;
+	long long blocks;
+	long long retransmits;
+	long long duplicates;
+	long long timeouts;
+	long long rtt_min_us;
+	long long rtt_max_us;
+	long long rtt_sum_us;
+	long long rtt_samples;
+};
 
-struct tftp_packet {
+/* Итог одной передачи последней команды get/put/mget/mput. */
+struct transfer_record {
+	char file[MAX_FILENAME];
 	uint16_t opcode;
-	union {
-		struct {
-			uint16_t block_num;
-			uint8_t data[DATA_SIZE];
-		} data;
-		struct {
-			uint16_t block_num;
-		} ack;
-		struct {
-			uint16_t error_code;
-			char error_msg[BUFFER_SIZE];
-		} error;
-		char raw[BUFFER_SIZE];
-	};
+	int ok;
+	struct transfer_stats stats;
+};
+
+enum transfer_state {
+	XFER_IDLE,
+	XFER_REQUEST,
+	XFER_DATA,
+	XFER_FLUSH,
+	XFER_DONE,
+	XFER_FAILED
+};
+
+/*
+ * Одна передача get или put. У каждой свой сокет, то есть свой TID, и
+ * продвигается она событиями: пришел пакет или истек таймаут. Поэтому
+ * несколько передач обслуживаются одним циклом poll.
+ */
+struct transfer {
+	uint16_t opcode;
+	char remote_file[MAX_FILENAME];
+	char local_file[MAX_FILENAME];
+	int single;
+	int verbose;
+
+	int fd;
+	int file_fd;
+	struct block_ring *ring;
+	int io_stalled;
+	enum transfer_state state;
+	int with_options;
+	struct tftp_options opts;
+	int backoff;
+	long long deadline;
+	long long progress_at;
+	long long timed_at;
+	int sends;
+	long long file_size;
+	long long total_bytes;
+	struct transfer_stats stats;
+
+	/* get */
+	long long expected_block;
+	int in_window;
+	int out_of_order;
+
+	/* get в multicast: блоки приходят в группу в любом порядке */
+	int mfd;
+	unsigned char *have;
+	long long first_missing;
+
+	/* put */
+	long long acked;
+	long long sent;
+	long long last_block;
+	int last_len;
 };
 
 struct tftp_client_state {
 	char server_host[MAX_HOSTNAME];
 	struct sockaddr_in server_addr;
 	int connected;
-	int sockfd;
+	int blksize;
+	int timeout;
+	int windowsize;
+	int tsize;
+	int parallel;
+	int quiet;
+	int multicast;
+	int json;
+	long long srtt_us;
+	long long rttvar_us;
+	struct transfer_record *records;
+	int record_count;
 };
 
 struct tftp_client_state client_state = {
 	.connected = 0,
-	.sockfd = -1
+	.blksize = DEFAULT_BLKSIZE,
+	.timeout = 0,
+	.windowsize = DEFAULT_WINDOWSIZE,
+	.tsize = 1,
+	.parallel = DEFAULT_PARALLEL
 };
 
 void print_help(void);
 void print_status(void);
 int connect_server(const char *hostname);
 int disconnect_server(void);
-int tftp_get(const char *remote_file, const char *local_file);
-int tftp_put(const char *local_file, const char *remote_file);
+long long tftp_get(const char *remote_file, const char *local_file);
+long long tftp_put(const char *local_file, const char *remote_file);
+int tftp_transfer_files(uint16_t opcode, char **files, int count);
 void interactive_mode(void);
 void parse_command(char *command);
 void trim_newline(char *str);
 
-int create_rrq_packet(struct tftp_packet *packet, const char *filename) {
+/* tsize < 0 означает запрос без опций. */
+char *append_options(char *ptr, long long tsize) {
+	if (tsize < 0) {
+		return ptr;
+	}
+	if (client_state.blksize != DATA_SIZE) {
+		ptr = append_option(ptr, "blksize", client_state.blksize);
+	}
+	if (client_state.timeout) {
+		ptr = append_option(ptr, "timeout", client_state.timeout);
+	}
+	if (client_state.windowsize > 1) {
+		ptr = append_option(ptr, "windowsize", client_state.windowsize);
+	}
+	if (client_state.tsize) {
+		ptr = append_option(ptr, "tsize", tsize);
+	}
+	return ptr;
+}
+
+int create_rrq_packet(struct tftp_packet *packet, const char *filename, int with_options) {
 	packet->opcode = htons(TFTP_RRQ);
 
 	char *ptr = packet->raw;
@@ -80,11 +211,21 @@ int create_rrq_packet(struct tftp_packet *packet, const char *filename) {
 	ptr += strlen("octet");
 
 	*ptr = '\0';
+	ptr++;
 
-	return (ptr - packet->raw) + sizeof(uint16_t) + 1;
+	ptr = append_options(ptr, with_options ? 0 : -1);
+
+	/* RFC 2090: значение пустое, адрес группы назначает сервер. */
+	if (with_options && client_state.multicast) {
+		strcpy(ptr, "multicast");
+		ptr += strlen("multicast") + 1;
+		*ptr++ = '\0';
+	}
+
+	return (ptr - packet->raw) + sizeof(uint16_t);
 }
 
-int create_wrq_packet(struct tftp_packet *packet, const char *filename) {
+int create_wrq_packet(struct tftp_packet *packet, const char *filename, long long tsize) {
 	packet->opcode = htons(TFTP_WRQ);
 
 	char *ptr = packet->raw;
@@ -99,259 +240,1517 @@ int create_wrq_packet(struct tftp_packet *packet, const char *filename) {
 	ptr += strlen("octet");
 
 	*ptr = '\0';
+	ptr++;
 
-	return (ptr - packet->raw) + sizeof(uint16_t) + 1;
-}
+	ptr = append_options(ptr, tsize);
 
-int create_ack_packet(struct tftp_packet *packet, uint16_t block_num) {
-	packet->opcode = htons(TFTP_ACK);
-	packet->ack.block_num = htons(block_num);
-	return 4;
+	return (ptr - packet->raw) + sizeof(uint16_t);
 }
 
-int tftp_get(const char *remote_file, const char *local_file) {
-	if (!client_state.connected) {
-		printf("Не подключен к серверу. Используйте 'connect <hostname>'\n");
-        	return -1;
-	}
-
-	struct tftp_packet send_packet, recv_packet;
-	struct sockaddr_in from_addr;
-	socklen_t addr_len;
-	FILE *output_file;
-
-	printf("Скачивание файла '%s' как '%s'\n", remote_file, local_file);
-
-	int packet_len = create_rrq_packet(&send_packet, remote_file);
-
-	if (sendto(client_state.sockfd, &send_packet, packet_len, 
-                        0, (struct sockaddr *)&client_state.server_addr, 
-                            sizeof(client_state.server_addr)) < 0) {
-		perror("Ошибка отправки RRQ");
+/*
+ * Значение опции multicast: "адрес,порт,mc". Адрес и порт могут быть
+ * пустыми в повторных OACK, тогда остаются прежние.
+ */
+int parse_multicast(const char *value, struct tftp_options *opts) {
+	char addr[INET_ADDRSTRLEN];
+	const char *port = strchr(value, ',');
+	const char *mc = port ? strchr(port + 1, ',') : NULL;
+	long long v;
+
+	if (!mc || port - value >= (long)sizeof(addr)) {
 		return -1;
 	}
-
-	addr_len = sizeof(from_addr);
-
-	struct timeval tv;
-	tv.tv_sec = TIMEOUT;
-	tv.tv_usec = 0;
-	setsockopt(client_state.sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-
-	int recv_len = recvfrom(client_state.sockfd, &recv_packet, BUFFER_SIZE, 
-        0, (struct sockaddr *)&from_addr, &addr_len);
-
-	if (recv_len < 0) {
-		perror("Таймаут при ожидании ответа");
+	memcpy(addr, value, port - value);
+	addr[port - value] = '\0';
+	if (addr[0] && inet_pton(AF_INET, addr, &opts->group.sin_addr) <= 0) {
 		return -1;
 	}
-
-	uint16_t opcode = ntohs(recv_packet.opcode);
-
-	if (opcode == TFTP_ERROR) {
-		uint16_t error_code = ntohs(recv_packet.error.error_code);
-		printf("Ошибка TFTP: %d - %s\n", error_code, recv_packet.error.error_msg);
+	if (port + 1 < mc) {
+		char digits[8];
+		if (mc - port - 1 >= (long)sizeof(digits)) {
+			return -1;
+		}
+		memcpy(digits, port + 1, mc - port - 1);
+		digits[mc - port - 1] = '\0';
+		if (parse_option_value(digits, &v) < 0 || v < 1 || v > 65535) {
+			return -1;
+		}
+		opts->group.sin_port = htons((uint16_t)v);
+	}
+	if (parse_option_value(mc + 1, &v) < 0 || v > 1) {
 		return -1;
 	}
-
-	if (opcode != TFTP_DATA) {
-		printf("Неожиданный ответ: opcode=%d (ожидался DATA)\n", opcode);
+	if (!opts->group.sin_addr.s_addr || !opts->group.sin_port) {
 		return -1;
 	}
+	opts->group.sin_family = AF_INET;
+	opts->multicast = 1;
+	opts->master = (int)v;
+	return 0;
+}
 
-	output_file = fopen(local_file, "wb");
-    if (!output_file) {
-		perror("Ошибка создания файла");
+/* Разбирает OACK. Сервер может только уменьшить blksize и должен вернуть timeout как есть. */
+int parse_oack(const struct tftp_packet *packet, int len, struct tftp_options *opts) {
+	const char *ptr = packet->raw;
+	const char *end = packet->raw + len - sizeof(uint16_t);
+	const char *name, *value;
+	int r;
+
+	while ((r = next_option(&ptr, end, &name, &value)) > 0) {
+		long long v;
+		if (strcasecmp(name, "multicast") == 0) {
+			if (!client_state.multicast || parse_multicast(value, opts) < 0) {
+				return -1;
+			}
+			continue;
+		}
+		if (parse_option_value(value, &v) < 0) {
+			return -1;
+		}
+
+		if (strcasecmp(name, "blksize") == 0) {
+			if (client_state.blksize == DATA_SIZE || v < MIN_BLKSIZE || v > client_state.blksize) {
+				return -1;
+			}
+			opts->blksize = (int)v;
+		} else if (strcasecmp(name, "timeout") == 0) {
+			if (v != client_state.timeout) {
+				return -1;
+			}
+			opts->timeout = (int)v;
+		} else if (strcasecmp(name, "windowsize") == 0) {
+			if (v < 1 || v > client_state.windowsize) {
+				return -1;
+			}
+			opts->windowsize = (int)v;
+		} else if (strcasecmp(name, "tsize") == 0) {
+			if (!client_state.tsize) {
+				return -1;
+			}
+			opts->tsize = v;
+		} else {
+			return -1;
+		}
+	}
+	/* Номер блока 16-битный, в группу раздаются только файлы до 65535 блоков, как и в tftpd. */
+	if (opts->multicast && opts->tsize >= 0 && opts->tsize / opts->blksize + 1 > MCAST_BLOCKS - 1) {
 		return -1;
 	}
+	return r;
+}
 
-	uint16_t expected_block = 1;
-    int total_bytes = 0;
-    int retry_count = 0;
+/*
+ * Дисковый ввод-вывод передач идет в отдельном потоке, чтобы диск и сеть
+ * работали одновременно. У каждой передачи свое кольцо из cap блоков:
+ * для put поток читает файл с опережением на окно вперед, для get
+ * дописывает в файл уже принятые блоки. Один поток обслуживает все
+ * кольца; главный цикл узнает о его прогрессе через io_event, который
+ * опрашивается вместе с сокетами, но только если сам ждет поток.
+ *
+ * put: блоки [base, io_next) прочитаны и лежат в кольце до подтверждения.
+ * get: блоки [io_next, queued) приняты и ждут записи.
+ */
+struct block_ring {
+    int fd;
+    int writer;
+    int blksize;
+    int cap;
+    char *buf;
+    int *len;
+    long long base;
+    long long io_next;
+    long long queued;
+    int eof;
+    int error;
+    int busy;
+    int waiting;
+    struct block_ring *next;
+};
 
-    while (1) {
-        uint16_t block_num = ntohs(recv_packet.data.block_num);
+static pthread_mutex_t io_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_cond = PTHREAD_COND_INITIALIZER;
+static struct block_ring *io_rings;
+static int io_event = -1;
+
+static int ring_has_work(const struct block_ring *r) {
+    if (r->error || r->busy) {
+        return 0;
+    }
+    if (r->writer) {
+        return r->io_next < r->queued;
+    }
+    return !r->eof && r->io_next < r->base + r->cap;
+}
 
-        if (block_num == expected_block) {
-            int data_len = recv_len - 4;
-            fwrite(recv_packet.data.data, 1, data_len, output_file);
-            total_bytes += data_len;
+/* Вызывается под io_mutex. */
+static void ring_notify(struct block_ring *r) {
+    if (r->waiting || r->error) {
+        uint64_t one = 1;
+        r->waiting = 0;
+        if (write(io_event, &one, sizeof(one)) < 0) {
+            perror("Ошибка записи в eventfd");
+        }
+    }
+    pthread_cond_broadcast(&io_cond);
+}
 
-            printf("Получен блок %d (%d байт)\n", block_num, data_len);
+static void *io_thread(void *arg) {
+    struct iovec iov[IO_MAX_BLOCKS];
+    (void)arg;
+
+    pthread_mutex_lock(&io_mutex);
+    while (1) {
+        struct block_ring *r = io_rings;
+        while (r && !ring_has_work(r)) {
+            r = r->next;
+        }
+        if (!r) {
+            pthread_cond_wait(&io_cond, &io_mutex);
+            continue;
+        }
 
-            create_ack_packet(&send_packet, block_num);
-            sendto(client_state.sockfd, &send_packet, 4, 0, 
-                (struct sockaddr *)&from_addr, addr_len);
+        /* Непрерывный кусок кольца, без перехода через его конец. */
+        long long first = r->io_next;
+        int slot = (int)(first % r->cap);
+        long long n = (r->writer ? r->queued : r->base + r->cap) - first;
+        int max_blocks = IO_BATCH_BYTES / r->blksize;
+        if (max_blocks < 1) {
+            max_blocks = 1;
+        }
+        if (max_blocks > IO_MAX_BLOCKS) {
+            max_blocks = IO_MAX_BLOCKS;
+        }
+        if (n > r->cap - slot) {
+            n = r->cap - slot;
+        }
+        if (n > max_blocks) {
+            n = max_blocks;
+        }
 
-            if (data_len < DATA_SIZE) {
-                printf("Скачивание завершено. Всего байт: %d\n", total_bytes);
-                break;
+        size_t total = 0;
+        for (int i = 0; i < n; i++) {
+            iov[i].iov_base = r->buf + (size_t)(slot + i) * r->blksize;
+            iov[i].iov_len = r->writer ? (size_t)r->len[slot + i] : (size_t)r->blksize;
+            total += iov[i].iov_len;
+        }
+        r->busy = 1;
+        pthread_mutex_unlock(&io_mutex);
+
+        off_t offset = (off_t)(first - 1) * r->blksize;
+        ssize_t done = r->writer ? pwritev(r->fd, iov, (int)n, offset) : preadv(r->fd, iov, (int)n, offset);
+        int err = errno;
+
+        pthread_mutex_lock(&io_mutex);
+        r->busy = 0;
+        if (done < 0) {
+            r->error = err;
+        } else if (r->writer) {
+            if ((size_t)done != total) {
+                r->error = ENOSPC;
+            } else {
+                r->io_next += n;
             }
+        } else {
+            /* Короткое чтение - конец файла, последний блок короче blksize. */
+            long long full = done / r->blksize;
+            for (int i = 0; i < full; i++) {
+                r->len[slot + i] = r->blksize;
+            }
+            r->io_next += full;
+            if (full < n) {
+                r->len[slot + full] = (int)(done % r->blksize);
+                r->io_next++;
+                r->eof = 1;
+            }
+        }
+        ring_notify(r);
+    }
+    return NULL;
+}
 
-            expected_block++;
-            retry_count = 0;
+struct block_ring *ring_open(int fd, int writer, int blksize, int windowsize) {
+    static int started;
+
+    pthread_mutex_lock(&io_mutex);
+    if (!started) {
+        pthread_t tid;
+        io_event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (io_event < 0 || pthread_create(&tid, NULL, io_thread, NULL) != 0) {
+            pthread_mutex_unlock(&io_mutex);
+            return NULL;
         }
+        pthread_detach(tid);
+        started = 1;
+    }
+    pthread_mutex_unlock(&io_mutex);
 
-        tv.tv_sec = TIMEOUT;
-        tv.tv_usec = 0;
-        setsockopt(client_state.sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    /* Два окна: пока одно в сети, поток готовит следующее. */
+    long long cap = 2LL * windowsize;
+    long long max_cap = RING_MAX_BYTES / blksize;
+    if (max_cap < windowsize + 1LL) {
+        max_cap = windowsize + 1LL;
+    }
+    if (cap > max_cap) {
+        cap = max_cap;
+    }
+    if (cap < 4) {
+        cap = 4;
+    }
 
-        recv_len = recvfrom(client_state.sockfd, &recv_packet, 
-            BUFFER_SIZE, 0, (struct sockaddr *)&from_addr, &addr_len);
+    struct block_ring *r = calloc(1, sizeof(*r));
+    if (!r) {
+        return NULL;
+    }
+    r->buf = malloc((size_t)cap * blksize);
+    r->len = calloc((size_t)cap, sizeof(*r->len));
+    if (!r->buf || !r->len) {
+        free(r->buf);
+        free(r->len);
+        free(r);
+        return NULL;
+    }
+    r->fd = fd;
+    r->writer = writer;
+    r->blksize = blksize;
+    r->cap = (int)cap;
+    r->base = 1;
+    r->io_next = 1;
+    r->queued = 1;
+
+    pthread_mutex_lock(&io_mutex);
+    r->next = io_rings;
+    io_rings = r;
+    pthread_cond_broadcast(&io_cond);
+    pthread_mutex_unlock(&io_mutex);
+    return r;
+}
 
-        if (recv_len < 0) {
-            retry_count++;
-            if (retry_count > MAX_RETRIES) {
-                printf("Таймаут: превышено количество попыток\n");
-                break;
-            }
+void ring_close(struct block_ring *r) {
+    pthread_mutex_lock(&io_mutex);
+    while (r->busy) {
+        pthread_cond_wait(&io_cond, &io_mutex);
+    }
+    struct block_ring **p = &io_rings;
+    while (*p != r) {
+        p = &(*p)->next;
+    }
+    *p = r->next;
+    pthread_mutex_unlock(&io_mutex);
 
-            create_ack_packet(&send_packet, expected_block - 1);
-            sendto(client_state.sockfd, &send_packet, 4, 0, 
-                (struct sockaddr *)&from_addr, addr_len);
+    free(r->buf);
+    free(r->len);
+    free(r);
+}
 
-            recv_len = recvfrom(client_state.sockfd, &recv_packet, 
-                BUFFER_SIZE, 0, (struct sockaddr *)&from_addr, &addr_len);
-        } else {
-            retry_count = 0;
-        }
+int ring_error(struct block_ring *r) {
+    pthread_mutex_lock(&io_mutex);
+    int err = r->error;
+    pthread_mutex_unlock(&io_mutex);
+    return err;
+}
+
+/*
+ * put: блок из кольца. Возвращает 1 и данные, 0 если поток его еще не
+ * прочитал (тогда главный цикл будет разбужен), -1 при ошибке чтения.
+ */
+int ring_block(struct block_ring *r, long long block, const char **data, int *len) {
+    int ready = 0;
+
+    pthread_mutex_lock(&io_mutex);
+    if (r->error) {
+        ready = -1;
+    } else if (block < r->io_next) {
+        int slot = (int)(block % r->cap);
+        *data = r->buf + (size_t)slot * r->blksize;
+        *len = r->len[slot];
+        ready = 1;
+    } else {
+        r->waiting = 1;
     }
-    
-    fclose(output_file);
-    return total_bytes;
+    pthread_mutex_unlock(&io_mutex);
+    return ready;
 }
 
-int tftp_put(const char *local_file, const char *remote_file) {
-    if (!client_state.connected) {
-        printf("Не подключен к серверу. Используйте 'connect <hostname>'\n");
+/* put: блоки до base подтверждены, их место можно читать заново. */
+void ring_release(struct block_ring *r, long long base) {
+    pthread_mutex_lock(&io_mutex);
+    r->base = base;
+    pthread_cond_broadcast(&io_cond);
+    pthread_mutex_unlock(&io_mutex);
+}
+
+/*
+ * get: ставит следующий по порядку блок в очередь на запись. Возвращает
+ * 0, если кольцо заполнено и блок придется принять еще раз.
+ */
+int ring_write(struct block_ring *r, const void *data, int len) {
+    pthread_mutex_lock(&io_mutex);
+    if (r->error) {
+        pthread_mutex_unlock(&io_mutex);
         return -1;
     }
+    if (r->queued - r->io_next >= r->cap) {
+        r->waiting = 1;
+        pthread_mutex_unlock(&io_mutex);
+        return 0;
+    }
+    int slot = (int)(r->queued % r->cap);
+    pthread_mutex_unlock(&io_mutex);
+
+    /* Слот за queued поток не трогает, копировать можно без блокировки. */
+    memcpy(r->buf + (size_t)slot * r->blksize, data, len);
+    r->len[slot] = len;
+
+    pthread_mutex_lock(&io_mutex);
+    r->queued++;
+    pthread_cond_broadcast(&io_cond);
+    pthread_mutex_unlock(&io_mutex);
+    return 1;
+}
 
-    struct tftp_packet send_packet, recv_packet;
-    struct sockaddr_in from_addr;
-    socklen_t addr_len;
-    FILE *input_file;
+/* get: 1, когда все принятое записано; иначе поток разбудит главный цикл. */
+int ring_flushed(struct block_ring *r) {
+    pthread_mutex_lock(&io_mutex);
+    int flushed = r->error ? -1 : r->io_next == r->queued;
+    if (!flushed) {
+        r->waiting = 1;
+    }
+    pthread_mutex_unlock(&io_mutex);
+    return flushed;
+}
 
-    printf("Загрузка файла '%s' как '%s'\n", local_file, remote_file);
+long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int transfer_live(const struct transfer *t) {
+    return t->state == XFER_REQUEST || t->state == XFER_DATA || t->state == XFER_FLUSH;
+}
+
+void transfer_finish(struct transfer *t, enum transfer_state state) {
+    if (t->fd >= 0) {
+        close(t->fd);
+        t->fd = -1;
+    }
+    if (t->ring) {
+        ring_close(t->ring);
+        t->ring = NULL;
+    }
+    if (t->file_fd >= 0) {
+        close(t->file_fd);
+        t->file_fd = -1;
+    }
+    if (t->mfd >= 0) {
+        close(t->mfd);
+        t->mfd = -1;
+    }
+    free(t->have);
+    t->have = NULL;
+    if (t->stats.start_us && !t->stats.end_us) {
+        t->stats.end_us = now_us();
+    }
+    t->stats.bytes = t->total_bytes;
+    t->state = state;
+}
 
-    input_file = fopen(local_file, "rb");
-    if (!input_file) {
-        printf("Ошибка: файл '%s' не существует\n", local_file);
-        fclose(input_file);
+/* Сообщения параллельных передач помечаются именем файла. */
+void transfer_print(const struct transfer *t, const char *fmt, ...) {
+    va_list ap;
+    if (!t->single) {
+        printf("%s: ", t->opcode == TFTP_RRQ ? t->remote_file : t->local_file);
+    }
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+}
+
+void transfer_fail(struct transfer *t, const char *fmt, ...) {
+    va_list ap;
+    if (!t->single) {
+        printf("%s: ", t->opcode == TFTP_RRQ ? t->remote_file : t->local_file);
+    }
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+    transfer_finish(t, XFER_FAILED);
+}
+
+int transfer_init(struct transfer *t, uint16_t opcode, const char *remote_file, const char *local_file) {
+    if (strlen(remote_file) >= MAX_FILENAME || strlen(local_file) >= MAX_FILENAME) {
+        printf("Слишком длинное имя файла: %s\n", strlen(remote_file) >= MAX_FILENAME ? remote_file : local_file);
         return -1;
     }
+    memset(t, 0, sizeof(*t));
+    t->opcode = opcode;
+    strcpy(t->remote_file, remote_file);
+    strcpy(t->local_file, local_file);
+    t->fd = -1;
+    t->file_fd = -1;
+    t->mfd = -1;
+    t->state = XFER_IDLE;
+    return 0;
+}
+
+/* После первого ответа сокет подключен к TID сервера, адрес не нужен. */
+int transfer_send(struct transfer *t, const void *packet, int len) {
+    t->sends++;
+    return send(t->fd, packet, len, 0);
+}
+
+/* DATA уходит прямо из кольца, без копирования в пакет. */
+int send_data(struct transfer *t, long long block, const char *data, int len) {
+    uint16_t hdr[2] = { htons(TFTP_DATA), htons((uint16_t)block) };
+    struct iovec iov[2];
+    struct msghdr msg;
+
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = 4;
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    t->sends++;
+    return sendmsg(t->fd, &msg, 0);
+}
+
+void send_ack(struct transfer *t, uint16_t block_num) {
+    struct tftp_packet packet;
+    transfer_send(t, &packet, create_ack_packet(&packet, block_num));
+}
+
+/*
+ * Таймаут повтора считается по RFC 6298 из измеренного RTT. Оценка общая
+ * для всех передач к серверу, а удвоение после таймаута у каждой передачи
+ * свое. Согласованный timeout - верхняя граница RTO, а передача
+ * прерывается, если прогресса нет дольше MAX_RETRIES + 1 таких таймаутов.
+ */
+void rtt_sample(long long rtt_us) {
+    if (rtt_us < 1) {
+        rtt_us = 1;
+    }
+    if (client_state.srtt_us == 0) {
+        client_state.srtt_us = rtt_us;
+        client_state.rttvar_us = rtt_us / 2;
+    } else {
+        long long err = rtt_us - client_state.srtt_us;
+        client_state.rttvar_us += ((err < 0 ? -err : err) - client_state.rttvar_us) / 4;
+        client_state.srtt_us += err / 8;
+    }
+}
 
-    int packet_len = create_wrq_packet(&send_packet, remote_file);
+long long max_rto_us(const struct transfer *t) {
+    if (t->state == XFER_REQUEST) {
+        return (client_state.timeout ? client_state.timeout : TIMEOUT) * 1000000LL;
+    }
+    return t->opts.timeout * 1000000LL;
+}
 
-    if (sendto(client_state.sockfd, &send_packet, packet_len, 
-            0, (struct sockaddr *)&client_state.server_addr, 
-                sizeof(client_state.server_addr)) < 0) {
-        perror("Ошибка отправки WRQ");
+void arm_timer(struct transfer *t) {
+    long long rto = client_state.srtt_us ? client_state.srtt_us + 4 * client_state.rttvar_us : INITIAL_RTO_US;
+    long long max_rto = max_rto_us(t);
+    if (rto < MIN_RTO_US) {
+        rto = MIN_RTO_US;
+    }
+    rto <<= t->backoff;
+    t->deadline = now_us() + (rto < max_rto ? rto : max_rto);
+}
+
+/* Прогресс сбрасывает удвоение RTO и отсчет до отказа. */
+void transfer_progress(struct transfer *t) {
+    t->backoff = 0;
+    t->progress_at = now_us();
+}
+
+void rtt_stop(struct transfer *t) {
+    if (t->timed_at) {
+        long long rtt = now_us() - t->timed_at;
+        struct transfer_stats *st = &t->stats;
+        rtt_sample(rtt);
+        if (st->rtt_samples == 0 || rtt < st->rtt_min_us) {
+            st->rtt_min_us = rtt;
+        }
+        if (rtt > st->rtt_max_us) {
+            st->rtt_max_us = rtt;
+        }
+        st->rtt_sum_us += rtt;
+        st->rtt_samples++;
+        t->timed_at = 0;
+    }
+}
+
+/*
+ * Отправляет RRQ или WRQ на порт 69 сервера. Ответ (DATA, ACK, OACK
+ * или ERROR) разбирает handle_reply.
+ */
+int send_request(struct transfer *t) {
+    struct tftp_packet packet;
+    int packet_len;
+
+    t->opts.blksize = DATA_SIZE;
+    t->opts.timeout = TIMEOUT;
+    t->opts.windowsize = 1;
+    t->opts.tsize = -1;
+    t->opts.multicast = 0;
+
+    if (t->opcode == TFTP_RRQ) {
+        packet_len = create_rrq_packet(&packet, t->remote_file, t->with_options);
+    } else {
+        packet_len = create_wrq_packet(&packet, t->remote_file, t->with_options ? t->file_size : -1);
+    }
+
+    if (sendto(t->fd, &packet, packet_len, 0, (struct sockaddr *)&client_state.server_addr,
+            sizeof(client_state.server_addr)) < 0) {
+        transfer_fail(t, "%s: %s\n", t->opcode == TFTP_RRQ ? "Ошибка отправки RRQ" : "Ошибка отправки WRQ",
+                      strerror(errno));
         return -1;
     }
 
-    addr_len = sizeof(from_addr);
-    struct timeval tv;
-    tv.tv_sec = TIMEOUT;
-    tv.tv_usec = 0;
-    setsockopt(client_state.sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    t->state = XFER_REQUEST;
+    t->timed_at = t->backoff ? 0 : now_us();
+    arm_timer(t);
+    return 0;
+}
 
-    int recv_len = recvfrom(client_state.sockfd, &recv_packet, 
-        BUFFER_SIZE, 0, (struct sockaddr *)&from_addr, &addr_len);
+int transfer_start(struct transfer *t) {
+    if (t->opcode == TFTP_WRQ) {
+        struct stat st;
+        t->file_fd = open(t->local_file, O_RDONLY | O_CLOEXEC);
+        if (t->file_fd < 0) {
+            transfer_fail(t, "Ошибка: файл '%s' не существует\n", t->local_file);
+            return -1;
+        }
+        if (fstat(t->file_fd, &st) == 0) {
+            t->file_size = st.st_size;
+        }
+    }
 
-    if (recv_len < 0) {
-        perror("Таймаут при ожидании ответа на WRQ");
+    t->fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (t->fd < 0) {
+        transfer_fail(t, "Ошибка создания сокета: %s\n", strerror(errno));
         return -1;
     }
 
-    uint16_t opcode = ntohs(recv_packet.opcode);
+    t->with_options = 1;
+    t->progress_at = now_us();
+    t->stats.start_us = t->progress_at;
+    return send_request(t);
+}
+
+void put_send_window(struct transfer *t, long long from);
+
+/* Поток ввода-вывода продвинулся: продолжаем то, что его ждало. */
+void transfer_io(struct transfer *t) {
+    if (!t->ring || !transfer_live(t)) {
+        return;
+    }
+    if (t->state == XFER_FLUSH) {
+        int flushed = ring_flushed(t->ring);
+        if (flushed < 0) {
+            transfer_fail(t, "Ошибка записи файла: %s\n", strerror(ring_error(t->ring)));
+        } else if (flushed) {
+            transfer_finish(t, XFER_DONE);
+        }
+        return;
+    }
+
+    int err = ring_error(t->ring);
+    if (err) {
+        transfer_fail(t, "Ошибка %s файла: %s\n", t->opcode == TFTP_RRQ ? "записи" : "чтения", strerror(err));
+        return;
+    }
+    if (!t->io_stalled) {
+        return;
+    }
+    if (t->opcode == TFTP_WRQ) {
+        put_send_window(t, t->sent + 1);
+    } else {
+        /* Место в кольце освободилось: просим сервер повторить с пропущенного блока. */
+        t->io_stalled = 0;
+        t->stats.retransmits++;
+        send_ack(t, (uint16_t)(t->expected_block - 1));
+        t->in_window = 0;
+        arm_timer(t);
+    }
+}
+
+/*
+ * Окно RFC 7440: блоки подтверждаются одним ACK на windowsize блоков.
+ * Номера блоков внутри считаются 64-битными, в пакет уходят младшие
+ * 16 бит, так что файлы больше 65535 блоков проходят через переполнение.
+ */
+void get_handle_packet(struct transfer *t, const struct tftp_packet *packet, int len) {
+    uint16_t opcode = ntohs(packet->opcode);
+    uint16_t block_num = ntohs(packet->data.block_num);
+
+    if (t->state == XFER_FLUSH) {
+        /* Последний ACK потерялся, сервер повторил последний блок. */
+        if (opcode == TFTP_DATA && block_num == (uint16_t)t->expected_block) {
+            t->stats.duplicates++;
+            send_ack(t, block_num);
+        }
+        return;
+    }
 
     if (opcode == TFTP_ERROR) {
-        uint16_t error_code = ntohs(recv_packet.error.error_code);
-        printf("Ошибка TFTP: %d - %s\n", error_code, recv_packet.error.error_msg);
-        return -1;
+        transfer_fail(t, "Ошибка TFTP: %d - %s\n", ntohs(packet->error.error_code), packet->error.error_msg);
+        return;
     }
 
-    if (opcode != TFTP_ACK || ntohs(recv_packet.ack.block_num) != 0) {
-        printf("Неожиданный ответ на WRQ\n");
-        return -1;
+    if (opcode == TFTP_OACK && t->expected_block == 1) {
+        send_ack(t, 0);
+    } else if (opcode == TFTP_DATA && block_num != (uint16_t)t->expected_block) {
+        /*
+         * Пропуск в окне: подтверждаем последний блок по порядку, сервер
+         * откатится к нему. Если и повтор пришел с пропуском, ACK
+         * повторяется раз в окно, а не на каждый лишний блок.
+         */
+        t->stats.duplicates++;
+        if (t->out_of_order++ % t->opts.windowsize == 0) {
+            t->stats.retransmits++;
+            send_ack(t, (uint16_t)(t->expected_block - 1));
+            t->in_window = 0;
+            t->timed_at = 0;
+        }
+    } else if (opcode == TFTP_DATA) {
+        int data_len = len - 4;
+        if (data_len > t->opts.blksize) {
+            transfer_fail(t, "Блок %d длиннее согласованного blksize (%d байт)\n", block_num, data_len);
+            return;
+        }
+        int queued = ring_write(t->ring, packet->data.data, data_len);
+        if (queued < 0) {
+            transfer_fail(t, "Ошибка записи файла: %s\n", strerror(ring_error(t->ring)));
+            return;
+        }
+        if (queued == 0) {
+            /* Диск не успевает: блок отброшен, после записи запросим его снова. */
+            t->io_stalled = 1;
+            return;
+        }
+        t->total_bytes += data_len;
+        t->stats.blocks++;
+        rtt_stop(t);
+        transfer_progress(t);
+
+        if (t->verbose) {
+            printf("Получен блок %lld (%d байт)\n", t->expected_block, data_len);
+        }
+
+        /* Время от ACK окна до первого блока следующего - замер RTT. */
+        t->in_window++;
+        if (t->in_window == t->opts.windowsize || data_len < t->opts.blksize) {
+            send_ack(t, block_num);
+            t->in_window = 0;
+            t->timed_at = now_us();
+        }
+
+        if (data_len < t->opts.blksize) {
+            if (t->verbose) {
+                printf("Скачивание завершено. Всего байт: %lld\n", t->total_bytes);
+            }
+            if (t->opts.tsize >= 0 && t->opts.tsize != t->total_bytes) {
+                transfer_print(t, "Внимание: сервер объявил %lld байт, получено %lld\n",
+                               t->opts.tsize, t->total_bytes);
+            }
+            t->state = XFER_FLUSH;
+            transfer_io(t);
+            return;
+        }
+
+        t->expected_block++;
+        t->out_of_order = 0;
+    }
+    arm_timer(t);
+}
+
+/*
+ * Multicast get (RFC 2090). Блоки приходят в группу и пишутся в файл
+ * сразу на свое место, полученные отмечаются в битовой карте. ACK
+ * отправляет только master: последний блок, полученный подряд, и сервер
+ * повторяет с пропуска. Остальные клиенты принимают то, что идет в
+ * группу, пока сервер не назначит master их. Кольцо записи здесь не
+ * используется: блоки приходят не по порядку.
+ */
+void mcast_send_ack(struct transfer *t) {
+    send_ack(t, (uint16_t)(t->first_missing - 1));
+    t->in_window = 0;
+    arm_timer(t);
+}
+
+void mcast_handle_data(struct transfer *t, const struct tftp_packet *packet, int len) {
+    long long block = ntohs(packet->data.block_num);
+    int data_len = len - 4;
+
+    if (ntohs(packet->opcode) != TFTP_DATA || block == 0 || data_len > t->opts.blksize
+            || (t->last_block && block > t->last_block)) {
+        return;
+    }
+    if (t->have[block / 8] & (1 << (block % 8))) {
+        t->stats.duplicates++;
+        t->in_window++;
+    } else {
+        if (pwrite(t->file_fd, packet->data.data, data_len, (off_t)(block - 1) * t->opts.blksize) != data_len) {
+            transfer_fail(t, "Ошибка записи файла: %s\n", strerror(errno));
+            return;
+        }
+        t->have[block / 8] |= 1 << (block % 8);
+        t->total_bytes += data_len;
+        t->stats.blocks++;
+        t->in_window++;
+        transfer_progress(t);
+        if (data_len < t->opts.blksize) {
+            t->last_block = block;
+        }
+        while (t->first_missing < MCAST_BLOCKS
+                && t->have[t->first_missing / 8] & (1 << (t->first_missing % 8))) {
+            t->first_missing++;
+        }
+        if (t->verbose) {
+            printf("Получен блок %lld (%d байт)\n", block, data_len);
+        }
     }
 
-    uint16_t block_num = 1;
-    int total_bytes = 0;
-    int retry_count = 0;
+    if (t->last_block && t->first_missing > t->last_block) {
+        /* ACK последнего блока сообщает серверу, что файл получен. */
+        send_ack(t, (uint16_t)t->last_block);
+        if (t->verbose) {
+            printf("Скачивание завершено. Всего байт: %lld\n", t->total_bytes);
+        }
+        transfer_finish(t, XFER_DONE);
+        return;
+    }
+    if (t->opts.master && (t->in_window >= t->opts.windowsize || block == t->last_block)) {
+        rtt_stop(t);
+        mcast_send_ack(t);
+        t->timed_at = t->backoff ? 0 : now_us();
+    }
+}
 
-    while (1) {
-        send_packet.opcode = htons(TFTP_DATA);
-        send_packet.data.block_num = htons(block_num);
+/* Пакеты на unicast-сокете: повторный OACK (в том числе назначение master) или ошибка. */
+void mcast_handle_packet(struct transfer *t, const struct tftp_packet *packet, int len) {
+    uint16_t opcode = ntohs(packet->opcode);
+
+    if (opcode == TFTP_ERROR) {
+        transfer_fail(t, "Ошибка TFTP: %d - %s\n", ntohs(packet->error.error_code), packet->error.error_msg);
+        return;
+    }
+    struct tftp_options opts = t->opts;
+    if (opcode != TFTP_OACK || parse_oack(packet, len, &opts) < 0 || !opts.master) {
+        return;
+    }
+    if (!t->opts.master && t->verbose) {
+        printf("Сервер назначил клиента master, с блока %lld\n", t->first_missing);
+    }
+    t->opts.master = 1;
+    transfer_progress(t);
+    mcast_send_ack(t);
+}
 
-        int bytes_read = fread(send_packet.data.data, 1, DATA_SIZE, input_file);
-        total_bytes += bytes_read;
+void mcast_get_start(struct transfer *t) {
+    struct sockaddr_in local;
+    socklen_t local_len = sizeof(local);
+    struct ip_mreq mreq;
+    int one = 1;
+
+    t->have = calloc(MCAST_BLOCKS / 8, 1);
+    t->mfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (!t->have || t->mfd < 0) {
+        transfer_fail(t, "Ошибка создания multicast сокета\n");
+        return;
+    }
+    /* Группу слушают все клиенты на этом хосте, поэтому порт общий. */
+    setsockopt(t->mfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(t->mfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+
+    /* В группу вступаем через интерфейс, которым идет связь с сервером. */
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.imr_multiaddr = t->opts.group.sin_addr;
+    if (getsockname(t->fd, (struct sockaddr *)&local, &local_len) == 0) {
+        mreq.imr_interface = local.sin_addr;
+    }
+    if (bind(t->mfd, (const struct sockaddr *)&t->opts.group, sizeof(t->opts.group)) < 0
+            || setsockopt(t->mfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+        transfer_fail(t, "Ошибка подключения к группе %s:%d: %s\n", inet_ntoa(t->opts.group.sin_addr),
+                      ntohs(t->opts.group.sin_port), strerror(errno));
+        return;
+    }
+    size_socket_buffer(t->mfd, SO_RCVBUF, t->opts.blksize, t->opts.windowsize);
 
-        int data_packet_len = 4 + bytes_read;
+    t->first_missing = 1;
+    t->last_block = t->opts.tsize >= 0 ? t->opts.tsize / t->opts.blksize + 1 : 0;
+    if (t->verbose) {
+        printf("Multicast группа %s:%d, %s\n", inet_ntoa(t->opts.group.sin_addr), ntohs(t->opts.group.sin_port),
+               t->opts.master ? "master" : "ожидание очереди");
+    }
+    if (t->opts.master) {
+        mcast_send_ack(t);
+        t->timed_at = now_us();
+    } else {
+        arm_timer(t);
+    }
+}
 
-        printf("Отправляем блок %d (%d байт)\n", block_num, bytes_read);
+void get_start(struct transfer *t, const struct tftp_packet *packet, int len) {
+    uint16_t opcode = ntohs(packet->opcode);
 
-        if (sendto(client_state.sockfd, &send_packet, data_packet_len, 
-                0, (struct sockaddr *)&from_addr, addr_len) < 0) {
-            perror("Ошибка отправки данных");
+    if (opcode != TFTP_DATA && opcode != TFTP_OACK) {
+        transfer_fail(t, "Неожиданный ответ: opcode=%d (ожидался DATA)\n", opcode);
+        return;
+    }
+
+    t->file_fd = open(t->local_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (t->file_fd < 0) {
+        transfer_fail(t, "Ошибка создания файла: %s\n", strerror(errno));
+        return;
+    }
+    if (t->opts.multicast) {
+        mcast_get_start(t);
+        return;
+    }
+    t->ring = ring_open(t->file_fd, 1, t->opts.blksize, t->opts.windowsize);
+    if (!t->ring) {
+        transfer_fail(t, "Ошибка запуска потока записи\n");
+        return;
+    }
+
+    t->expected_block = 1;
+    size_socket_buffer(t->fd, SO_RCVBUF, t->opts.blksize, t->opts.windowsize);
+
+    if (opcode == TFTP_OACK) {
+        /* ACK 0 подтверждает OACK, после него сервер шлет первый блок. */
+        send_ack(t, 0);
+        t->timed_at = now_us();
+        arm_timer(t);
+    } else {
+        get_handle_packet(t, packet, len);
+    }
+}
+
+/*
+ * Отправляет блоки окна, начиная с from. Окно всегда начинается сразу за
+ * последним подтвержденным блоком; если поток чтения еще не подготовил
+ * очередной блок, отправка продолжится с него, когда блок будет прочитан.
+ */
+void put_send_window(struct transfer *t, long long from) {
+    long long block = from;
+    long long window_end = t->acked + t->opts.windowsize;
+
+    t->io_stalled = 0;
+    for (; block <= window_end && (!t->last_block || block <= t->last_block); block++) {
+        const char *data;
+        int len;
+        int ready = ring_block(t->ring, block, &data, &len);
+        if (ready < 0) {
+            transfer_fail(t, "Ошибка чтения файла: %s\n", strerror(ring_error(t->ring)));
+            return;
+        }
+        if (ready == 0) {
+            t->io_stalled = 1;
             break;
         }
+        if (len < t->opts.blksize && !t->last_block) {
+            t->last_block = block;
+            t->last_len = len;
+        }
+
+        if (t->verbose) {
+            printf("Отправляем блок %lld (%d байт)\n", block, len);
+        }
+
+        if (send_data(t, block, data, len) < 0) {
+            transfer_fail(t, "Ошибка отправки данных: %s\n", strerror(errno));
+            return;
+        }
+        if (block <= t->sent) {
+            t->stats.retransmits++;
+        } else {
+            t->stats.blocks++;
+        }
+    }
+    if (block > from) {
+        t->sent = block - 1;
+    }
+    /* Окно, задержанное диском, для замера RTT не годится. */
+    t->timed_at = from == t->acked + 1 && !t->backoff && !t->io_stalled ? now_us() : 0;
+    arm_timer(t);
+}
 
-        tv.tv_sec = TIMEOUT;
-        tv.tv_usec = 0;
-        setsockopt(client_state.sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+/* Принимается только ACK, относящийся к только что отправленному окну. */
+void put_handle_packet(struct transfer *t, const struct tftp_packet *packet) {
+    uint16_t opcode = ntohs(packet->opcode);
 
-        recv_len = recvfrom(client_state.sockfd, &recv_packet, 
-            BUFFER_SIZE, 0, (struct sockaddr *)&from_addr, &addr_len);
+    if (opcode == TFTP_ERROR) {
+        transfer_fail(t, "Ошибка TFTP: %d - %s\n", ntohs(packet->error.error_code), packet->error.error_msg);
+        return;
+    }
+    if (opcode != TFTP_ACK) {
+        return;
+    }
+
+    uint16_t delta = (uint16_t)(ntohs(packet->ack.block_num) - (uint16_t)t->acked);
+    if (delta > t->sent - t->acked) {
+        t->stats.duplicates++;
+        return;
+    }
+    if (delta == 0) {
+        t->stats.duplicates++;
+    }
+    long long new_acked = t->acked + delta;
 
-        if (recv_len < 0) {
-            retry_count++;
-            if (retry_count > MAX_RETRIES) {
-                printf("Таймаут: превышено количество попыток\n");
-                break;
+    /* По алгоритму Карна замеряется только окно, подтвержденное целиком. */
+    if (new_acked == t->sent) {
+        rtt_stop(t);
+    }
+    if (delta > 0) {
+        transfer_progress(t);
+    }
+    if (t->verbose) {
+        if (new_acked < t->sent) {
+            printf("Получен ACK для блока %lld, повтор с блока %lld\n", new_acked, new_acked + 1);
+        } else {
+            printf("Получен ACK для блока %lld\n", new_acked);
+        }
+    }
+    t->acked = new_acked;
+
+    ring_release(t->ring, t->acked + 1);
+
+    if (t->last_block && t->acked == t->last_block) {
+        t->total_bytes = (t->last_block - 1) * t->opts.blksize + t->last_len;
+        if (t->verbose) {
+            printf("Загрузка завершена. Всего байт: %lld\n", t->total_bytes);
+        }
+        transfer_finish(t, XFER_DONE);
+        return;
+    }
+    put_send_window(t, t->acked + 1);
+}
+
+void put_start(struct transfer *t, const struct tftp_packet *packet) {
+    uint16_t opcode = ntohs(packet->opcode);
+
+    if (opcode != TFTP_OACK && (opcode != TFTP_ACK || ntohs(packet->ack.block_num) != 0)) {
+        transfer_fail(t, "Неожиданный ответ на WRQ\n");
+        return;
+    }
+
+    size_socket_buffer(t->fd, SO_SNDBUF, t->opts.blksize, t->opts.windowsize);
+    t->ring = ring_open(t->file_fd, 0, t->opts.blksize, t->opts.windowsize);
+    if (!t->ring) {
+        transfer_fail(t, "Ошибка запуска потока чтения\n");
+        return;
+    }
+    put_send_window(t, 1);
+}
+
+/*
+ * Первый ответ сервера приходит с нового порта, он становится TID
+ * передачи. Если сервер отклонил опции ошибкой 8, запрос повторяется
+ * без них.
+ */
+void handle_reply(struct transfer *t, struct tftp_packet *packet, int len, const struct sockaddr_in *from) {
+    if (len < 4) {
+        transfer_fail(t, "Слишком короткий ответ сервера (%d байт)\n", len);
+        return;
+    }
+
+    uint16_t opcode = ntohs(packet->opcode);
+
+    if (opcode == TFTP_ERROR) {
+        uint16_t error_code = ntohs(packet->error.error_code);
+        if (error_code == TFTP_EOPTNEG && t->with_options) {
+            transfer_print(t, "Сервер отклонил опции, повтор запроса без них\n");
+            t->with_options = 0;
+            t->backoff = 0;
+            send_request(t);
+            return;
+        }
+        transfer_fail(t, "Ошибка TFTP: %d - %s\n", error_code, packet->error.error_msg);
+        return;
+    }
+
+    /* Дальше ядро само отбрасывает пакеты с чужих портов. */
+    if (connect(t->fd, (const struct sockaddr *)from, sizeof(*from)) < 0) {
+        transfer_fail(t, "Ошибка подключения сокета: %s\n", strerror(errno));
+        return;
+    }
+    rtt_stop(t);
+    transfer_progress(t);
+
+    if (opcode == TFTP_OACK) {
+        if (!t->with_options || parse_oack(packet, len, &t->opts) < 0) {
+            int err_len = create_error_packet(packet, TFTP_EOPTNEG, "Invalid option");
+            transfer_send(t, packet, err_len);
+            transfer_fail(t, "Некорректный OACK от сервера\n");
+            return;
+        }
+        if (t->verbose) {
+            printf("Согласованы опции: blksize=%d, timeout=%d, windowsize=%d",
+                   t->opts.blksize, t->opts.timeout, t->opts.windowsize);
+            if (t->opts.tsize >= 0) {
+                printf(", tsize=%lld", t->opts.tsize);
             }
+            printf("\n");
+        }
+    }
+
+    t->state = XFER_DATA;
+    if (t->opcode == TFTP_RRQ) {
+        get_start(t, packet, len);
+    } else {
+        put_start(t, packet);
+    }
+}
+
+void transfer_timeout(struct transfer *t) {
+    if (t->state == XFER_FLUSH) {
+        arm_timer(t);
+        return;
+    }
+    /* Клиент, ждущий очереди в multicast, ждет и таймауты чужого master. */
+    int patience = t->opts.multicast && !t->opts.master ? 2 * (MAX_RETRIES + 1) : MAX_RETRIES + 1;
+    if (now_us() - t->progress_at >= patience * max_rto_us(t)) {
+        transfer_fail(t, t->state == XFER_REQUEST ? "Таймаут при ожидании ответа\n"
+                                                  : "Таймаут: превышено количество попыток\n");
+        return;
+    }
+    if (t->opts.multicast && !t->opts.master) {
+        arm_timer(t);
+        return;
+    }
+    if (t->backoff < MAX_BACKOFF) {
+        t->backoff++;
+    }
+    t->timed_at = 0;
+    t->stats.timeouts++;
+
+    if (t->state == XFER_REQUEST) {
+        send_request(t);
+    } else if (t->opts.multicast) {
+        t->stats.retransmits++;
+        mcast_send_ack(t);
+    } else if (t->opcode == TFTP_RRQ) {
+        t->stats.retransmits++;
+        send_ack(t, (uint16_t)(t->expected_block - 1));
+        t->in_window = 0;
+        arm_timer(t);
+    } else {
+        if (t->verbose) {
+            printf("Таймаут, повторная отправка с блока %lld\n", t->acked + 1);
+        }
+        put_send_window(t, t->acked + 1);
+    }
+}
+
+/*
+ * Забирает пакеты из сокета, не блокируясь. Как только передача сама
+ * что-то отправила, ответ еще в пути: пусть его дождется poll, а не
+ * лишний пустой recv.
+ */
+void transfer_receive(struct transfer *t, struct tftp_packet *packet) {
+    while (transfer_live(t)) {
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        int sends = t->sends;
+        int len;
+
+        if (t->state == XFER_REQUEST) {
+            len = recvfrom(t->fd, packet, sizeof(*packet) - 1, MSG_DONTWAIT,
+                           (struct sockaddr *)&from, &from_len);
+        } else {
+            len = recv(t->fd, packet, sizeof(*packet) - 1, MSG_DONTWAIT);
+        }
+        if (len < 0) {
+            /* Файл уже принят целиком, а сервер закрыл передачу по нашему последнему ACK. */
+            if (errno == ECONNREFUSED && t->state != XFER_FLUSH) {
+                transfer_fail(t, "Сервер закрыл передачу\n");
+            }
+            return;
+        }
+        if (len >= 2) {
+            packet->raw[len - sizeof(uint16_t)] = '\0';
+        }
+
+        if (t->state == XFER_REQUEST) {
+            handle_reply(t, packet, len, &from);
+        } else if (len >= 4) {
+            if (t->opts.multicast) {
+                mcast_handle_packet(t, packet, len);
+            } else if (t->opcode == TFTP_RRQ) {
+                get_handle_packet(t, packet, len);
+            } else {
+                put_handle_packet(t, packet);
+            }
+        }
+        if (t->sends != sends) {
+            return;
+        }
+    }
+}
+
+/* Блоки из группы; забираются все, что есть, отвечает на них только master. */
+void mcast_receive(struct transfer *t, struct tftp_packet *packet) {
+    while (transfer_live(t)) {
+        int len = recv(t->mfd, packet, sizeof(*packet) - 1, MSG_DONTWAIT);
+        if (len < 0) {
+            return;
+        }
+        if (len >= 4) {
+            mcast_handle_data(t, packet, len);
+        }
+    }
+}
+
+/*
+ * Ведет передачи ts[0..count) одним циклом poll, не больше parallel
+ * одновременно: как только одна заканчивается, стартует следующая.
+ * Возвращает число неудачных передач.
+ */
+int run_transfers(struct transfer *ts, int count, int parallel) {
+    static struct tftp_packet packet;
+    int slots = parallel > 0 ? parallel : 1;
+    struct transfer **active = malloc(slots * sizeof(*active));
+    /* У multicast get два сокета: unicast с сервером и группа. */
+    struct pollfd *fds = malloc((2 * slots + 1) * sizeof(*fds));
+    struct transfer **owner = malloc(2 * slots * sizeof(*owner));
+    int next = 0;
+    int n = 0;
+    int failed = 0;
+
+    if (!active || !fds || !owner) {
+        perror("Ошибка выделения памяти");
+        free(active);
+        free(fds);
+        free(owner);
+        return count;
+    }
 
-            printf("Таймаут, повторная отправка блока %d\n", block_num);
+    while (next < count || n > 0) {
+        while (n < slots && next < count) {
+            struct transfer *t = &ts[next++];
+            if (transfer_start(t) == 0) {
+                active[n++] = t;
+            }
+        }
+        if (n == 0) {
             continue;
         }
 
-        retry_count = 0;
-        opcode = ntohs(recv_packet.opcode);
+        long long now = now_us();
+        long long wait = -1;
+        int nfds = 0;
+        for (int i = 0; i < n; i++) {
+            fds[nfds].fd = active[i]->fd;
+            fds[nfds].events = POLLIN;
+            fds[nfds].revents = 0;
+            owner[nfds++] = active[i];
+            if (active[i]->mfd >= 0) {
+                fds[nfds].fd = active[i]->mfd;
+                fds[nfds].events = POLLIN;
+                fds[nfds].revents = 0;
+                owner[nfds++] = active[i];
+            }
+            long long left = active[i]->deadline - now;
+            if (wait < 0 || left < wait) {
+                wait = left > 0 ? left : 0;
+            }
+        }
+        int socket_fds = nfds;
+        if (io_event >= 0) {
+            fds[nfds].fd = io_event;
+            fds[nfds].events = POLLIN;
+            fds[nfds].revents = 0;
+            nfds++;
+        }
 
-        if (opcode == TFTP_ACK) {
-            uint16_t ack_block = ntohs(recv_packet.ack.block_num);
-            if (ack_block == block_num) {
-                printf("Получен ACK для блока %d\n", block_num);
-                block_num++;
+        if (poll(fds, (nfds_t)nfds, (int)((wait + 999) / 1000)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Ошибка poll");
+            for (int i = 0; i < n; i++) {
+                transfer_finish(active[i], XFER_FAILED);
+            }
+            break;
+        }
 
-                if (bytes_read < DATA_SIZE) {
-                    printf("Загрузка завершена. Всего байт: %d\n", total_bytes);
-                    break;
+        for (int i = 0; i < socket_fds; i++) {
+            if (!fds[i].revents) {
+                continue;
+            }
+            if (fds[i].fd == owner[i]->mfd) {
+                mcast_receive(owner[i], &packet);
+            } else {
+                transfer_receive(owner[i], &packet);
+            }
+        }
+        if (nfds > socket_fds && fds[socket_fds].revents) {
+            uint64_t events;
+            if (read(io_event, &events, sizeof(events)) == sizeof(events)) {
+                for (int i = 0; i < n; i++) {
+                    transfer_io(active[i]);
                 }
             }
-        } else if (opcode == TFTP_ERROR) {
-            printf("Ошибка TFTP: %d - %s\n", 
-            ntohs(recv_packet.error.error_code), 
-            recv_packet.error.error_msg);
-            break;
         }
+
+        now = now_us();
+        int live = 0;
+        for (int i = 0; i < n; i++) {
+            struct transfer *t = active[i];
+            if (transfer_live(t) && t->deadline <= now) {
+                transfer_timeout(t);
+            }
+            if (transfer_live(t)) {
+                active[live++] = t;
+            } else if (!t->single && t->state == XFER_DONE) {
+                transfer_print(t, "%lld байт\n", t->total_bytes);
+            }
+        }
+        n = live;
     }
 
-    fclose(input_file);
-    return total_bytes;
+    for (int i = 0; i < count; i++) {
+        if (ts[i].state != XFER_DONE) {
+            failed++;
+        }
+    }
+    free(active);
+    free(fds);
+    free(owner);
+    return failed;
 }
 
-int connect_server(const char *hostname) {
-    if (client_state.connected) {
-        disconnect_server();
+void stats_merge(struct transfer_stats *total, const struct transfer_stats *st) {
+    if (st->start_us && (!total->start_us || st->start_us < total->start_us)) {
+        total->start_us = st->start_us;
+    }
+    if (st->end_us > total->end_us) {
+        total->end_us = st->end_us;
+    }
+    if (st->rtt_samples && (!total->rtt_samples || st->rtt_min_us < total->rtt_min_us)) {
+        total->rtt_min_us = st->rtt_min_us;
+    }
+    if (st->rtt_max_us > total->rtt_max_us) {
+        total->rtt_max_us = st->rtt_max_us;
     }
+    total->bytes += st->bytes;
+    total->blocks += st->blocks;
+    total->retransmits += st->retransmits;
+    total->duplicates += st->duplicates;
+    total->timeouts += st->timeouts;
+    total->rtt_sum_us += st->rtt_sum_us;
+    total->rtt_samples += st->rtt_samples;
+}
+
+double stats_seconds(const struct transfer_stats *st) {
+    return st->end_us > st->start_us ? (st->end_us - st->start_us) / 1e6 : 0;
+}
+
+/* Скорость по полезным байтам, без заголовков и повторов. */
+double stats_goodput(const struct transfer_stats *st) {
+    double seconds = stats_seconds(st);
+    return seconds > 0 ? st->bytes / seconds : 0;
+}
+
+void print_stats_text(const struct transfer_stats *st) {
+    printf("%lld байт за %.3f с (%.2f МБ/с), блоков %lld, повторов %lld, дубликатов %lld, таймаутов %lld",
+           st->bytes, stats_seconds(st), stats_goodput(st) / 1e6, st->blocks, st->retransmits,
+           st->duplicates, st->timeouts);
+    if (st->rtt_samples) {
+        printf(", RTT мин/сред/макс %.3f/%.3f/%.3f мс", st->rtt_min_us / 1000.0,
+               st->rtt_sum_us / 1000.0 / st->rtt_samples, st->rtt_max_us / 1000.0);
+    }
+    printf("\n");
+}
+
+void print_stats_json(const struct transfer_stats *st) {
+    printf("\"bytes\":%lld,\"seconds\":%.6f,\"goodput_bps\":%.0f,\"blocks\":%lld,\"retransmits\":%lld,"
+           "\"duplicates\":%lld,\"timeouts\":%lld,",
+           st->bytes, stats_seconds(st), stats_goodput(st), st->blocks, st->retransmits,
+           st->duplicates, st->timeouts);
+    if (st->rtt_samples) {
+        printf("\"rtt_min_ms\":%.3f,\"rtt_avg_ms\":%.3f,\"rtt_max_ms\":%.3f", st->rtt_min_us / 1000.0,
+               st->rtt_sum_us / 1000.0 / st->rtt_samples, st->rtt_max_us / 1000.0);
+    } else {
+        printf("\"rtt_min_ms\":null,\"rtt_avg_ms\":null,\"rtt_max_ms\":null");
+    }
+}
+
+void print_json_string(const char *str) {
+    putchar('"');
+    for (; *str; str++) {
+        unsigned char c = (unsigned char)*str;
+        if (c == '"' || c == '\\') {
+            printf("\\%c", c);
+        } else if (c < 0x20) {
+            printf("\\u%04x", c);
+        } else {
+            putchar(c);
+        }
+    }
+    putchar('"');
+}
+
+/* Запоминает итоги передач команды для status и отчета batch-режима. */
+void save_records(const struct transfer *ts, int count) {
+    free(client_state.records);
+    client_state.records = count ? calloc(count, sizeof(*client_state.records)) : NULL;
+    client_state.record_count = client_state.records ? count : 0;
+    for (int i = 0; i < client_state.record_count; i++) {
+        struct transfer_record *r = &client_state.records[i];
+        strcpy(r->file, ts[i].opcode == TFTP_RRQ ? ts[i].remote_file : ts[i].local_file);
+        r->opcode = ts[i].opcode;
+        r->ok = ts[i].state == XFER_DONE;
+        r->stats = ts[i].stats;
+    }
+}
 
-    client_state.sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (client_state.sockfd < 0) {
-        perror("Ошибка создания сокета");
+/* Отчет по последней команде: итог, а с detailed - и каждая передача. */
+void print_report(int detailed) {
+    struct transfer_stats total;
+    int failed = 0;
+
+    if (client_state.record_count == 0) {
+        return;
+    }
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < client_state.record_count; i++) {
+        stats_merge(&total, &client_state.records[i].stats);
+        failed += !client_state.records[i].ok;
+    }
+
+    if (client_state.json) {
+        printf("{");
+        if (detailed) {
+            printf("\"transfers\":[");
+            for (int i = 0; i < client_state.record_count; i++) {
+                const struct transfer_record *r = &client_state.records[i];
+                printf("%s{\"file\":", i ? "," : "");
+                print_json_string(r->file);
+                printf(",\"op\":\"%s\",\"ok\":%s,", r->opcode == TFTP_RRQ ? "get" : "put", r->ok ? "true" : "false");
+                print_stats_json(&r->stats);
+                printf("}");
+            }
+            printf("],");
+        }
+        printf("\"total\":{\"files\":%d,\"failed\":%d,", client_state.record_count, failed);
+        print_stats_json(&total);
+        printf("}}\n");
+        return;
+    }
+
+    if (detailed && client_state.record_count > 1) {
+        for (int i = 0; i < client_state.record_count; i++) {
+            const struct transfer_record *r = &client_state.records[i];
+            printf("  %s %s%s: ", r->opcode == TFTP_RRQ ? "get" : "put", r->file, r->ok ? "" : " (ошибка)");
+            print_stats_text(&r->stats);
+        }
+    }
+    if (client_state.record_count == 1) {
+        printf("  %s %s%s: ", client_state.records[0].opcode == TFTP_RRQ ? "get" : "put",
+               client_state.records[0].file, failed ? " (ошибка)" : "");
+    } else {
+        printf("  Итого %d файлов, ошибок %d: ", client_state.record_count, failed);
+    }
+    print_stats_text(&total);
+}
+
+long long tftp_get(const char *remote_file, const char *local_file) {
+    struct transfer t;
+
+    if (!client_state.connected) {
+        printf("Не подключен к серверу. Используйте 'connect <hostname>'\n");
+        return -1;
+    }
+    if (transfer_init(&t, TFTP_RRQ, remote_file, local_file) < 0) {
         return -1;
     }
+    t.single = 1;
+    t.verbose = !client_state.quiet;
+
+    printf("Скачивание файла '%s' как '%s'\n", remote_file, local_file);
+    run_transfers(&t, 1, 1);
+    save_records(&t, 1);
+    return t.state == XFER_DONE ? t.total_bytes : -1;
+}
+
+long long tftp_put(const char *local_file, const char *remote_file) {
+    struct transfer t;
+
+    if (!client_state.connected) {
+        printf("Не подключен к серверу. Используйте 'connect <hostname>'\n");
+        return -1;
+    }
+    if (transfer_init(&t, TFTP_WRQ, remote_file, local_file) < 0) {
+        return -1;
+    }
+    t.single = 1;
+    t.verbose = !client_state.quiet;
+
+    printf("Загрузка файла '%s' как '%s'\n", local_file, remote_file);
+    run_transfers(&t, 1, 1);
+    save_records(&t, 1);
+    return t.state == XFER_DONE ? t.total_bytes : -1;
+}
+
+/*
+ * mget/mput: файлы передаются параллельно, до client_state.parallel
+ * одновременно, каждый через свой сокет. На другой стороне файл
+ * получает имя без каталога. Возвращает число неудачных передач.
+ */
+int tftp_transfer_files(uint16_t opcode, char **files, int count) {
+    if (!client_state.connected) {
+        printf("Не подключен к серверу. Используйте 'connect <hostname>'\n");
+        return count;
+    }
+
+    struct transfer *ts = calloc(count, sizeof(*ts));
+    if (!ts) {
+        perror("Ошибка выделения памяти");
+        return count;
+    }
+
+    int valid = 0;
+    for (int i = 0; i < count; i++) {
+        const char *base = strrchr(files[i], '/');
+        base = base ? base + 1 : files[i];
+        int r = opcode == TFTP_RRQ ? transfer_init(&ts[valid], opcode, files[i], base)
+                                   : transfer_init(&ts[valid], opcode, base, files[i]);
+        if (r == 0) {
+            valid++;
+        }
+    }
+
+    int parallel = client_state.parallel < valid ? client_state.parallel : valid;
+    printf("%s %d файлов, до %d одновременно\n",
+           opcode == TFTP_RRQ ? "Скачивание" : "Загрузка", valid, parallel);
+
+    long long start = now_us();
+    int failed = valid ? run_transfers(ts, valid, parallel) : 0;
+    long long elapsed = now_us() - start;
+
+    long long total_bytes = 0;
+    for (int i = 0; i < valid; i++) {
+        if (ts[i].state == XFER_DONE) {
+            total_bytes += ts[i].total_bytes;
+        }
+    }
+    printf("Готово: %d из %d файлов, %lld байт за %.3f с\n",
+           valid - failed, count, total_bytes, elapsed / 1e6);
+
+    save_records(ts, valid);
+    free(ts);
+    return failed + (count - valid);
+}
+
+int connect_server(const char *hostname) {
+    if (client_state.connected) {
+        disconnect_server();
+    }
 
     memset(&client_state.server_addr, 0, sizeof(client_state.server_addr));
     client_state.server_addr.sin_family = AF_INET;
@@ -361,14 +1760,14 @@ int connect_server(const char *hostname) {
         struct hostent *host = gethostbyname(hostname);
         if (!host) {
             printf("Не удалось разрешить hostname: %s\n", hostname);
-            close(client_state.sockfd);
-            client_state.sockfd = -1;
             return -1;
         }
-        memcpy(&client_state.server_addr.sin_addr, 
+        memcpy(&client_state.server_addr.sin_addr,
         host->h_addr_list[0], host->h_length);
     }
 
+    client_state.srtt_us = 0;
+    client_state.rttvar_us = 0;
     strncpy(client_state.server_host, hostname, MAX_HOSTNAME - 1);
     client_state.server_host[MAX_HOSTNAME - 1] = '\0';
     client_state.connected = 1;
@@ -378,10 +1777,6 @@ int connect_server(const char *hostname) {
 }
 
 int disconnect_server(void) {
-    if (client_state.sockfd >= 0) {
-        close(client_state.sockfd);
-        client_state.sockfd = -1;
-    }
     client_state.connected = 0;
     printf("Отключено от сервера\n");
     return 0;
@@ -393,8 +1788,19 @@ void print_help(void) {
     printf("connect     подключиться к удаленному TFTP серверу\n");
     printf("put         отправить файл на сервер\n");
     printf("get         получить файл с сервера\n");
+    printf("mput        отправить несколько файлов параллельно\n");
+    printf("mget        получить несколько файлов параллельно\n");
     printf("quit        выйти из TFTP клиента\n");
     printf("status      показать текущий статус\n");
+    printf("blksize     размер блока для следующих передач (%d-%d, %d - без согласования)\n",
+           MIN_BLKSIZE, MAX_BLKSIZE, DATA_SIZE);
+    printf("timeout     предел таймаута повтора в секундах, согласуемый с сервером (0 - не согласовывать)\n");
+    printf("windowsize  число блоков на один ACK (1-%d, 1 - без согласования)\n", MAX_WINDOWSIZE);
+    printf("tsize       включить/выключить согласование размера файла\n");
+    printf("parallel    число одновременных передач в mget/mput (1-%d)\n", MAX_PARALLEL);
+    printf("quiet       включить/выключить вывод по каждому блоку\n");
+    printf("multicast   включить/выключить запрос multicast для get (RFC 2090)\n");
+    printf("json        включить/выключить вывод статистики в JSON\n");
     printf("?           показать эту справку\n");
     printf("help        показать эту справку\n");
 }
@@ -404,6 +1810,66 @@ void print_status(void) {
     printf("  Подключение: %s\n", 
            client_state.connected ? client_state.server_host : "не подключено");
     printf("  Режим: octet (бинарный)\n");
+    printf("  blksize: %d%s\n", client_state.blksize,
+           client_state.blksize == DATA_SIZE ? " (без согласования)" : "");
+    if (client_state.timeout) {
+        printf("  timeout: %d с\n", client_state.timeout);
+    } else {
+        printf("  timeout: %d с (без согласования)\n", TIMEOUT);
+    }
+    printf("  windowsize: %d%s\n", client_state.windowsize,
+           client_state.windowsize == 1 ? " (без согласования)" : "");
+    printf("  tsize: %s\n", client_state.tsize ? "вкл" : "выкл");
+    printf("  parallel: %d\n", client_state.parallel);
+    printf("  quiet: %s\n", client_state.quiet ? "вкл" : "выкл");
+    printf("  multicast: %s\n", client_state.multicast ? "вкл" : "выкл");
+    if (client_state.srtt_us) {
+        printf("  RTT: %.3f мс (разброс %.3f мс)\n", client_state.srtt_us / 1000.0, client_state.rttvar_us / 1000.0);
+    }
+    if (client_state.record_count) {
+        printf("  Последняя команда:\n");
+        print_report(0);
+    }
+}
+
+int set_blksize(const char *arg) {
+    char *endptr;
+    long val = strtol(arg, &endptr, 10);
+    if (*endptr != '\0' || val < MIN_BLKSIZE || val > MAX_BLKSIZE) {
+        return -1;
+    }
+    client_state.blksize = (int)val;
+    return 0;
+}
+
+int set_timeout(const char *arg) {
+    char *endptr;
+    long val = strtol(arg, &endptr, 10);
+    if (*endptr != '\0' || val < 0 || val > MAX_TIMEOUT) {
+        return -1;
+    }
+    client_state.timeout = (int)val;
+    return 0;
+}
+
+int set_windowsize(const char *arg) {
+    char *endptr;
+    long val = strtol(arg, &endptr, 10);
+    if (*endptr != '\0' || val < 1 || val > MAX_WINDOWSIZE) {
+        return -1;
+    }
+    client_state.windowsize = (int)val;
+    return 0;
+}
+
+int set_parallel(const char *arg) {
+    char *endptr;
+    long val = strtol(arg, &endptr, 10);
+    if (*endptr != '\0' || val < 1 || val > MAX_PARALLEL) {
+        return -1;
+    }
+    client_state.parallel = (int)val;
+    return 0;
 }
 
 void trim_newline(char *str) {
@@ -424,7 +1890,21 @@ void parse_command(char *command) {
         cmd[i] = tolower(cmd[i]);
     }
     
-    if (strcmp(cmd, "?") == 0 || strcmp(cmd, "help") == 0) {
+    if (strcmp(cmd, "mget") == 0 || strcmp(cmd, "mput") == 0) {
+        char *files[MAX_BATCH_FILES];
+        int count = 0;
+        strtok(command, " \t");
+        char *tok;
+        while (count < MAX_BATCH_FILES && (tok = strtok(NULL, " \t")) != NULL) {
+            files[count++] = tok;
+        }
+        if (count == 0) {
+            printf("Использование: %s <файл1> [файл2 ...]\n", cmd);
+        } else {
+            tftp_transfer_files(cmd[1] == 'g' ? TFTP_RRQ : TFTP_WRQ, files, count);
+        }
+    }
+    else if (strcmp(cmd, "?") == 0 || strcmp(cmd, "help") == 0) {
         print_help();
     }
     else if (strcmp(cmd, "connect") == 0 || strcmp(cmd, "c") == 0) {
@@ -458,6 +1938,42 @@ void parse_command(char *command) {
     else if (strcmp(cmd, "status") == 0 || strcmp(cmd, "st") == 0) {
         print_status();
     }
+    else if (strcmp(cmd, "blksize") == 0) {
+        if (strlen(arg1) == 0 || set_blksize(arg1) < 0) {
+            printf("Использование: blksize <%d-%d>\n", MIN_BLKSIZE, MAX_BLKSIZE);
+        }
+    }
+    else if (strcmp(cmd, "timeout") == 0) {
+        if (strlen(arg1) == 0 || set_timeout(arg1) < 0) {
+            printf("Использование: timeout <0-%d>\n", MAX_TIMEOUT);
+        }
+    }
+    else if (strcmp(cmd, "windowsize") == 0) {
+        if (strlen(arg1) == 0 || set_windowsize(arg1) < 0) {
+            printf("Использование: windowsize <1-%d>\n", MAX_WINDOWSIZE);
+        }
+    }
+    else if (strcmp(cmd, "parallel") == 0) {
+        if (strlen(arg1) == 0 || set_parallel(arg1) < 0) {
+            printf("Использование: parallel <1-%d>\n", MAX_PARALLEL);
+        }
+    }
+    else if (strcmp(cmd, "quiet") == 0) {
+        client_state.quiet = !client_state.quiet;
+        printf("Тихий режим %s\n", client_state.quiet ? "включен" : "выключен");
+    }
+    else if (strcmp(cmd, "multicast") == 0) {
+        client_state.multicast = !client_state.multicast;
+        printf("Запрос multicast %s\n", client_state.multicast ? "включен" : "выключен");
+    }
+    else if (strcmp(cmd, "json") == 0) {
+        client_state.json = !client_state.json;
+        printf("Статистика в JSON %s\n", client_state.json ? "включена" : "выключена");
+    }
+    else if (strcmp(cmd, "tsize") == 0) {
+        client_state.tsize = !client_state.tsize;
+        printf("Согласование tsize %s\n", client_state.tsize ? "включено" : "выключено");
+    }
     else if (strlen(cmd) > 0) {
         printf("Неизвестная команда: '%s'. Введите 'help' для списка команд.\n", cmd);
     }
@@ -490,12 +2006,36 @@ void interactive_mode(void) {
     disconnect_server();
 }
 
+/* Batch-режим завершается отчетом по передачам; JSON - последняя строка вывода. */
+void batch_exit(int code) {
+    disconnect_server();
+    if (client_state.record_count) {
+        if (!client_state.json) {
+            printf("Статистика:\n");
+        }
+        print_report(1);
+    }
+    exit(code);
+}
+
 void batch_mode(int argc, char *argv[]) {
-    if (argc != 5) {
-        printf("Использование: %s <сервер> <get|put> <файл1> <файл2>\n", argv[0]);
+    int multi = argc >= 4 && (strcmp(argv[2], "mget") == 0 || strcmp(argv[2], "mput") == 0);
+
+    if (argc != 5 && !multi) {
+        printf("Использование: %s [-b blksize] [-t timeout] [-w windowsize] [-T] [-q] [-M] [-J] <сервер> <get|put> <файл1> <файл2>\n", argv[0]);
+        printf("       %s [-j parallel] [опции] <сервер> <mget|mput> <файл>...\n", argv[0]);
+        printf("  -b  размер блока, %d-%d (по умолчанию %d)\n", MIN_BLKSIZE, MAX_BLKSIZE, DEFAULT_BLKSIZE);
+        printf("  -t  таймаут повтора в секундах, согласуемый с сервером\n");
+        printf("  -w  число блоков на один ACK, 1-%d (по умолчанию %d)\n", MAX_WINDOWSIZE, DEFAULT_WINDOWSIZE);
+        printf("  -T  не согласовывать tsize\n");
+        printf("  -q  не печатать строку на каждый блок\n");
+        printf("  -M  запрашивать multicast для get/mget (RFC 2090)\n");
+        printf("  -J  итоговая статистика одной строкой JSON\n");
+        printf("  -j  число одновременных передач в mget/mput, 1-%d (по умолчанию %d)\n", MAX_PARALLEL, DEFAULT_PARALLEL);
         printf("Примеры:\n");
         printf("  %s 127.0.0.1 get server.txt local.txt\n", argv[0]);
         printf("  %s 127.0.0.1 put local.txt server.txt\n", argv[0]);
+        printf("  %s -j 16 127.0.0.1 mget a.txt b.txt c.txt\n", argv[0]);
         exit(1);
     }
     
@@ -506,20 +2046,22 @@ void batch_mode(int argc, char *argv[]) {
         exit(1);
     }
     
-    if (strcmp(command, "get") == 0) {
+    if (multi) {
+        int failed = tftp_transfer_files(command[1] == 'g' ? TFTP_RRQ : TFTP_WRQ, argv + 3, argc - 3);
+        batch_exit(failed ? 1 : 0);
+    } else if (strcmp(command, "get") == 0) {
         const char *remote_file = argv[3];
         const char *local_file = argv[4];
         
         printf("Скачивание файла '%s' с сервера %s как '%s'\n", 
                remote_file, server_ip, local_file);
         
-        int result = tftp_get(remote_file, local_file);
+        long long result = tftp_get(remote_file, local_file);
         if (result > 0) {
-            printf("Файл успешно скачан (%d байт)\n", result);
+            printf("Файл успешно скачан (%lld байт)\n", result);
         } else {
             printf("Ошибка скачивания файла\n");
-            disconnect_server();
-            exit(1);
+            batch_exit(1);
         }
         
     } else if (strcmp(command, "put") == 0) {
@@ -529,13 +2071,12 @@ void batch_mode(int argc, char *argv[]) {
         printf("Загрузка файла '%s' на сервер %s как '%s'\n", 
                local_file, server_ip, remote_file);
         
-        int result = tftp_put(local_file, remote_file);
+        long long result = tftp_put(local_file, remote_file);
         if (result > 0) {
-            printf("Файл успешно загружен (%d байт)\n", result);
+            printf("Файл успешно загружен (%lld байт)\n", result);
         } else {
             printf("Ошибка загрузки файла\n");
-            disconnect_server();
-            exit(1);
+            batch_exit(1);
         }
         
     } else {
@@ -545,17 +2086,69 @@ void batch_mode(int argc, char *argv[]) {
         exit(1);
     }
     
-    disconnect_server();
+    batch_exit(0);
 }
 
 int main(int argc, char *argv[]) {
-    if (argc == 1) {
-        interactive_mode();
-    } else if (argc == 2 && (strcmp(argv[1], "-i") == 0 || 
-                            strcmp(argv[1], "--interactive") == 0)) {
+    static const struct option long_options[] = {
+        {"interactive", no_argument, NULL, 'i'},
+        {NULL, 0, NULL, 0}
+    };
+    int interactive = 0;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "ib:t:w:Tj:qMJ", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'i':
+            interactive = 1;
+            break;
+        case 'b':
+            if (set_blksize(optarg) < 0) {
+                printf("Некорректный blksize: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 't':
+            if (set_timeout(optarg) < 0) {
+                printf("Некорректный timeout: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'w':
+            if (set_windowsize(optarg) < 0) {
+                printf("Некорректный windowsize: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'T':
+            client_state.tsize = 0;
+            break;
+        case 'q':
+            client_state.quiet = 1;
+            break;
+        case 'M':
+            client_state.multicast = 1;
+            break;
+        case 'J':
+            client_state.json = 1;
+            break;
+        case 'j':
+            if (set_parallel(optarg) < 0) {
+                printf("Некорректное число передач: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        default:
+            exit(1);
+        }
+    }
+
+    if (interactive || optind == argc) {
         interactive_mode();
     } else {
-        batch_mode(argc, argv);
+        /* batch_mode ждет имя программы в argv[0] и аргументы после него. */
+        argv[optind - 1] = argv[0];
+        batch_mode(argc - optind + 1, argv + optind - 1);
     }
     
     return 0;
@@ -0,0 +1,133 @@
+#ifndef TFTP_PROTO_H
+#define TFTP_PROTO_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+/*
+ * Пакеты TFTP (RFC 1350) и опции RFC 2347-2349, 7440, общие для клиента
+ * tftp.c и сервера tftpd.c.
+ */
+
+#define TFTP_PORT 69
+#define DATA_SIZE 512
+#define MIN_BLKSIZE 8
+#define MAX_BLKSIZE 65464
+#define BUFFER_SIZE (MAX_BLKSIZE + 4)
+#define TIMEOUT 5
+#define MAX_TIMEOUT 255
+#define MAX_WINDOWSIZE 65535
+#define MAX_RETRIES 3
+#define MAX_SOCKET_BUFFER (16 << 20)
+
+#define TFTP_RRQ   1
+#define TFTP_WRQ   2
+#define TFTP_DATA  3
+#define TFTP_ACK   4
+#define TFTP_ERROR 5
+#define TFTP_OACK  6
+
+#define TFTP_EUNDEF    0
+#define TFTP_ENOTFOUND 1
+#define TFTP_EACCESS   2
+#define TFTP_ENOSPACE  3
+#define TFTP_EBADOP    4
+#define TFTP_EBADID    5
+#define TFTP_EEXISTS   6
+#define TFTP_ENOUSER   7
+#define TFTP_EOPTNEG   8
+
+struct tftp_packet {
+	uint16_t opcode;
+	union {
+		struct {
+			uint16_t block_num;
+			uint8_t data[MAX_BLKSIZE];
+		} data;
+		struct {
+			uint16_t block_num;
+		} ack;
+		struct {
+			uint16_t error_code;
+			char error_msg[BUFFER_SIZE];
+		} error;
+		char raw[BUFFER_SIZE];
+	};
+};
+
+static inline char *append_option(char *ptr, const char *name, long long value) {
+	strcpy(ptr, name);
+	ptr += strlen(name) + 1;
+	ptr += sprintf(ptr, "%lld", value) + 1;
+	return ptr;
+}
+
+static inline int create_ack_packet(struct tftp_packet *packet, uint16_t block_num) {
+	packet->opcode = htons(TFTP_ACK);
+	packet->ack.block_num = htons(block_num);
+	return 4;
+}
+
+static inline int create_error_packet(struct tftp_packet *packet, uint16_t error_code, const char *msg) {
+	packet->opcode = htons(TFTP_ERROR);
+	packet->error.error_code = htons(error_code);
+	strcpy(packet->error.error_msg, msg);
+	return 4 + strlen(msg) + 1;
+}
+
+/*
+ * Окно целиком приходит пачкой, поэтому буфер сокета должен вмещать его,
+ * иначе хвост окна теряется и каждое окно ждет таймаута. Ядро само
+ * урежет размер до net.core.rmem_max / wmem_max.
+ */
+static inline void size_socket_buffer(int fd, int optname, int blksize, int windowsize) {
+	long long want = (long long)windowsize * (blksize + 512);
+	if (want <= 0 || windowsize <= 1) {
+		return;
+	}
+	int size = want < MAX_SOCKET_BUFFER ? (int)want : MAX_SOCKET_BUFFER;
+	setsockopt(fd, SOL_SOCKET, optname, &size, sizeof(size));
+}
+
+/*
+ * Достает следующую пару имя/значение из списка опций [*ptr, end).
+ * Возвращает 1, если пара прочитана, 0 в конце списка, -1 если список
+ * поврежден. Обе строки лежат внутри пакета и оканчиваются нулем.
+ */
+static inline int next_option(const char **ptr, const char *end, const char **name, const char **value) {
+	if (*ptr >= end) {
+		return 0;
+	}
+	const char *name_end = memchr(*ptr, '\0', end - *ptr);
+	if (!name_end) {
+		return -1;
+	}
+	const char *value_end = memchr(name_end + 1, '\0', end - name_end - 1);
+	if (!value_end) {
+		return -1;
+	}
+	*name = *ptr;
+	*value = name_end + 1;
+	*ptr = value_end + 1;
+	return 1;
+}
+
+/* Значения всех поддерживаемых опций - неотрицательные десятичные числа. */
+static inline int parse_option_value(const char *value, long long *out) {
+	char *endptr;
+	if (*value == '\0' || *value == '-') {
+		return -1;
+	}
+	long long v = strtoll(value, &endptr, 10);
+	if (*endptr != '\0') {
+		return -1;
+	}
+	*out = v;
+	return 0;
+}
+
+#endif
@@ -0,0 +1,1293 @@
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "tftp_proto.h"
+
+#define MAX_EVENTS 64
+#define SEND_BATCH 64
+#define MAX_PATH 512
+#define DEFAULT_MAX_TRANSFERS 1024
+#define DEFAULT_CACHE_MB 256
+#define MCAST_PORT 1758
+#define MCAST_PORTS 64
+#define MCAST_MAX_BLOCKS 65535
+
+/*
+ * Файлы для RRQ отображаются в память один раз и раздаются всем клиентам
+ * из одного отображения. Записи упорядочены от недавно использованных к
+ * давним; неиспользуемые вытесняются с хвоста, когда кэш больше лимита.
+ * Файл, измененный на диске, получает новую запись, а старая живет, пока
+ * ее не отпустит последняя передача.
+ */
+struct cache_entry {
+    char name[MAX_PATH];
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    uint8_t *data;
+    int refs;
+    int stale;
+    struct cache_entry *prev;
+    struct cache_entry *next;
+};
+
+/* Опции запроса с учетом ограничений сервера; 0 - опция не запрошена. */
+struct request_options {
+    int blksize;
+    int timeout;
+    int windowsize;
+    int tsize;
+    long long tsize_value;
+    int multicast;
+};
+
+struct mcast_member {
+    struct sockaddr_in addr;
+    struct request_options opts;
+    struct mcast_member *next;
+};
+
+/*
+ * Одна передача - один сокет, подключенный к TID клиента. Multicast-сессия
+ * (RFC 2090) - тоже передача, но ее сокет не подключен: блоки уходят в
+ * группу, а ACK принимаются только от master-клиента, первого в очереди
+ * members.
+ */
+struct transfer {
+    int fd;
+    int opcode;
+    struct sockaddr_in peer;
+    char name[MAX_PATH];
+    int blksize;
+    int windowsize;
+    int timeout;
+    char oack[128];
+    int oack_len;
+    int oack_pending;
+    int retries;
+    long long deadline_ms;
+    long long bytes;
+
+    /* RRQ */
+    struct cache_entry *entry;
+    long long acked;
+    long long sent;
+    long long last_block;
+
+    /* WRQ */
+    int out_fd;
+    char tmp_name[MAX_PATH + 16];
+    long long expected;
+    int in_window;
+    int out_of_order;
+    int done;
+
+    /* multicast */
+    int mcast;
+    struct sockaddr_in group;
+    struct mcast_member *members;
+    int members_total;
+    int members_done;
+
+    int closed;
+    int ok;
+    struct transfer *prev;
+    struct transfer *next;
+};
+
+struct tftp_server_state {
+    int listen_fd;
+    int epfd;
+    int read_only;
+    int quiet;
+    int max_blksize;
+    int max_windowsize;
+    int max_transfers;
+    int active;
+    struct transfer *transfers;
+    int mcast_enabled;
+    struct in_addr mcast_group;
+    int mcast_port;
+    int mcast_next;
+
+    struct cache_entry *cache_head;
+    struct cache_entry *cache_tail;
+    size_t cache_bytes;
+    size_t cache_limit;
+
+    unsigned long long rrq_count;
+    unsigned long long wrq_count;
+    unsigned long long completed;
+    unsigned long long failed;
+    unsigned long long bytes_sent;
+    unsigned long long bytes_received;
+    unsigned long long cache_hits;
+    unsigned long long cache_misses;
+    unsigned long long mcast_sessions;
+    unsigned long long mcast_clients;
+};
+
+struct tftp_server_state server_state = {
+    .listen_fd = -1,
+    .epfd = -1,
+    .max_blksize = MAX_BLKSIZE,
+    .max_windowsize = MAX_WINDOWSIZE,
+    .max_transfers = DEFAULT_MAX_TRANSFERS,
+    .mcast_port = MCAST_PORT,
+    .cache_limit = (size_t)DEFAULT_CACHE_MB << 20
+};
+
+static volatile sig_atomic_t stop_requested = 0;
+static volatile sig_atomic_t stats_requested = 0;
+
+static void request_stop(int sig) {
+    (void)sig;
+    stop_requested = 1;
+}
+
+static void request_stats(int sig) {
+    (void)sig;
+    stats_requested = 1;
+}
+
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void print_stats(void) {
+    printf("Запросов: %llu RRQ, %llu WRQ; завершено %llu, прервано %llu, активно %d\n"
+           "Отправлено %llu байт, принято %llu байт\n"
+           "Кэш: %zu байт, попаданий %llu, промахов %llu\n"
+           "Multicast: сессий %llu, клиентов %llu\n",
+           server_state.rrq_count, server_state.wrq_count, server_state.completed,
+           server_state.failed, server_state.active,
+           server_state.bytes_sent, server_state.bytes_received,
+           server_state.cache_bytes, server_state.cache_hits, server_state.cache_misses,
+           server_state.mcast_sessions, server_state.mcast_clients);
+    fflush(stdout);
+}
+
+/* Только относительные пути без "..", чтобы не выйти за корневой каталог. */
+static int valid_filename(const char *name) {
+    if (name[0] == '\0' || name[0] == '/') {
+        return 0;
+    }
+    for (const char *p = name; *p; ) {
+        if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0')) {
+            return 0;
+        }
+        const char *slash = strchr(p, '/');
+        if (!slash) {
+            break;
+        }
+        p = slash + 1;
+    }
+    return 1;
+}
+
+static void cache_unlink(struct cache_entry *e) {
+    if (e->prev) e->prev->next = e->next;
+    else server_state.cache_head = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else server_state.cache_tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void cache_push_front(struct cache_entry *e) {
+    e->prev = NULL;
+    e->next = server_state.cache_head;
+    if (server_state.cache_head) server_state.cache_head->prev = e;
+    server_state.cache_head = e;
+    if (!server_state.cache_tail) server_state.cache_tail = e;
+}
+
+static void cache_free(struct cache_entry *e) {
+    if (e->data) {
+        munmap(e->data, e->size);
+    }
+    server_state.cache_bytes -= e->size;
+    free(e);
+}
+
+/* Вытесняет давно не использованные файлы, пока кэш больше лимита. */
+static void cache_trim(void) {
+    struct cache_entry *e = server_state.cache_tail;
+    while (e && server_state.cache_bytes > server_state.cache_limit) {
+        struct cache_entry *prev = e->prev;
+        if (e->refs == 0) {
+            cache_unlink(e);
+            cache_free(e);
+        }
+        e = prev;
+    }
+}
+
+static void cache_mark_stale(struct cache_entry *e) {
+    e->stale = 1;
+    cache_unlink(e);
+    if (e->refs == 0) {
+        cache_free(e);
+    }
+}
+
+static struct cache_entry *cache_find(const char *name) {
+    for (struct cache_entry *e = server_state.cache_head; e; e = e->next) {
+        if (strcmp(e->name, name) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/* Возвращает отображение файла со ссылкой на него или NULL с errno. */
+static struct cache_entry *cache_get(const char *name) {
+    struct stat st;
+    if (stat(name, &st) < 0) {
+        return NULL;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        errno = EACCES;
+        return NULL;
+    }
+
+    struct cache_entry *e = cache_find(name);
+    if (e && e->dev == st.st_dev && e->ino == st.st_ino && e->size == st.st_size
+            && e->mtime.tv_sec == st.st_mtim.tv_sec && e->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        cache_unlink(e);
+        cache_push_front(e);
+        e->refs++;
+        server_state.cache_hits++;
+        return e;
+    }
+    if (e) {
+        cache_mark_stale(e);
+    }
+    server_state.cache_misses++;
+
+    int fd = open(name, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+
+    e = calloc(1, sizeof(*e));
+    if (!e) {
+        close(fd);
+        return NULL;
+    }
+    if (st.st_size > 0) {
+        e->data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (e->data == MAP_FAILED) {
+            int saved = errno;
+            close(fd);
+            free(e);
+            errno = saved;
+            return NULL;
+        }
+        madvise(e->data, st.st_size, MADV_WILLNEED);
+    }
+    close(fd);
+
+    memcpy(e->name, name, strlen(name) + 1);
+    e->dev = st.st_dev;
+    e->ino = st.st_ino;
+    e->size = st.st_size;
+    e->mtime = st.st_mtim;
+    e->refs = 1;
+    server_state.cache_bytes += e->size;
+    cache_push_front(e);
+    cache_trim();
+    return e;
+}
+
+static void cache_put(struct cache_entry *e) {
+    e->refs--;
+    if (e->refs == 0 && e->stale) {
+        cache_free(e);
+    } else {
+        cache_trim();
+    }
+}
+
+static void send_error(int fd, const struct sockaddr_in *peer, uint16_t code, const char *msg) {
+    struct tftp_packet packet;
+    int len = create_error_packet(&packet, code, msg);
+    sendto(fd, &packet, len, 0, (const struct sockaddr *)peer, sizeof(*peer));
+}
+
+static void transfer_free(struct transfer *t) {
+    if (t->prev) t->prev->next = t->next;
+    else server_state.transfers = t->next;
+    if (t->next) t->next->prev = t->prev;
+
+    if (t->entry) {
+        cache_put(t->entry);
+    }
+    if (t->out_fd >= 0) {
+        close(t->out_fd);
+        unlink(t->tmp_name);
+    }
+    while (t->members) {
+        struct mcast_member *m = t->members;
+        t->members = m->next;
+        free(m);
+    }
+    close(t->fd);
+    server_state.active--;
+
+    if (t->ok) {
+        server_state.completed++;
+    } else {
+        server_state.failed++;
+    }
+    if (t->mcast) {
+        if (!server_state.quiet) {
+            printf("Multicast RRQ %s (группа %s:%d) завершен: получили %d из %d клиентов\n", t->name,
+                   inet_ntoa(t->group.sin_addr), ntohs(t->group.sin_port), t->members_done, t->members_total);
+        }
+    } else if (!server_state.quiet) {
+        printf("%s %s для %s:%d %s: %lld байт\n", t->opcode == TFTP_RRQ ? "RRQ" : "WRQ", t->name,
+               inet_ntoa(t->peer.sin_addr), ntohs(t->peer.sin_port), t->ok ? "завершен" : "прерван", t->bytes);
+    }
+    free(t);
+}
+
+/*
+ * Завершенная передача освобождается только после обработки всех событий
+ * цикла: на нее еще могут ссылаться события из того же epoll_wait.
+ */
+static void transfer_close(struct transfer *t, int ok) {
+    if (t->closed) {
+        return;
+    }
+    t->closed = 1;
+    t->ok = ok;
+    epoll_ctl(server_state.epfd, EPOLL_CTL_DEL, t->fd, NULL);
+}
+
+static void reap_transfers(void) {
+    struct transfer *t = server_state.transfers;
+    while (t) {
+        struct transfer *next = t->next;
+        if (t->closed) {
+            transfer_free(t);
+        }
+        t = next;
+    }
+}
+
+static struct transfer *transfer_find(const struct sockaddr_in *peer) {
+    for (struct transfer *t = server_state.transfers; t; t = t->next) {
+        if (!t->closed && !t->mcast && t->peer.sin_addr.s_addr == peer->sin_addr.s_addr
+                && t->peer.sin_port == peer->sin_port) {
+            return t;
+        }
+    }
+    return NULL;
+}
+
+static struct transfer *transfer_new(int opcode, const struct sockaddr_in *peer, const char *name, int connected) {
+    struct sockaddr_in local;
+    socklen_t local_len = sizeof(local);
+    if (getsockname(server_state.listen_fd, (struct sockaddr *)&local, &local_len) < 0) {
+        perror("getsockname");
+        return NULL;
+    }
+    local.sin_port = 0;
+
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("socket");
+        return NULL;
+    }
+    if (bind(fd, (struct sockaddr *)&local, sizeof(local)) < 0
+            || (connected && connect(fd, (const struct sockaddr *)peer, sizeof(*peer)) < 0)) {
+        perror("bind/connect");
+        close(fd);
+        return NULL;
+    }
+
+    struct transfer *t = calloc(1, sizeof(*t));
+    if (!t) {
+        close(fd);
+        return NULL;
+    }
+    t->fd = fd;
+    t->opcode = opcode;
+    t->peer = *peer;
+    memcpy(t->name, name, strlen(name) + 1);
+    t->blksize = DATA_SIZE;
+    t->windowsize = 1;
+    t->timeout = TIMEOUT;
+    t->out_fd = -1;
+    t->expected = 1;
+
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = t};
+    if (epoll_ctl(server_state.epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl");
+        close(fd);
+        free(t);
+        return NULL;
+    }
+
+    t->next = server_state.transfers;
+    if (t->next) t->next->prev = t;
+    server_state.transfers = t;
+    server_state.active++;
+    return t;
+}
+
+static void arm_timer(struct transfer *t) {
+    t->deadline_ms = now_ms() + (long long)t->timeout * 1000;
+}
+
+/* Отправляет окно блоков из отображения файла, начиная с блока acked + 1 (multicast - в группу). */
+static void rrq_send_window(struct transfer *t) {
+    struct mmsghdr msgs[SEND_BATCH];
+    struct iovec iov[SEND_BATCH][2];
+    uint16_t hdr[SEND_BATCH][2];
+    long long block = t->acked + 1;
+    long long end = t->acked + t->windowsize;
+    if (end > t->last_block) {
+        end = t->last_block;
+    }
+
+    while (block <= end) {
+        int n = 0;
+        for (; n < SEND_BATCH && block <= end; n++, block++) {
+            off_t offset = (off_t)(block - 1) * t->blksize;
+            off_t remaining = t->entry->size - offset;
+            size_t len = remaining < t->blksize ? (size_t)remaining : (size_t)t->blksize;
+            hdr[n][0] = htons(TFTP_DATA);
+            hdr[n][1] = htons((uint16_t)block);
+            iov[n][0].iov_base = hdr[n];
+            iov[n][0].iov_len = sizeof(hdr[n]);
+            iov[n][1].iov_base = t->entry->data + offset;
+            iov[n][1].iov_len = len;
+            memset(&msgs[n], 0, sizeof(msgs[n]));
+            if (t->mcast) {
+                msgs[n].msg_hdr.msg_name = &t->group;
+                msgs[n].msg_hdr.msg_namelen = sizeof(t->group);
+            }
+            msgs[n].msg_hdr.msg_iov = iov[n];
+            msgs[n].msg_hdr.msg_iovlen = len ? 2 : 1;
+        }
+        int sent = sendmmsg(t->fd, msgs, n, 0);
+        if (sent < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("sendmmsg");
+            }
+            /* Ни один блок пачки не ушел, и t->sent не должен их учитывать. */
+            block -= n;
+            break;
+        }
+        for (int i = 0; i < sent; i++) {
+            server_state.bytes_sent += msgs[i].msg_len;
+        }
+        if (sent < n) {
+            /* Буфер сокета полон; недошедшие блоки восстановятся по ACK или таймауту. */
+            block -= n - sent;
+            break;
+        }
+    }
+    t->sent = block - 1;
+    arm_timer(t);
+}
+
+static void send_ack(struct transfer *t, long long block) {
+    struct tftp_packet packet;
+    create_ack_packet(&packet, (uint16_t)block);
+    send(t->fd, &packet, 4, 0);
+}
+
+static void send_oack(struct transfer *t) {
+    send(t->fd, t->oack, t->oack_len, 0);
+    arm_timer(t);
+}
+
+/*
+ * Разбирает опции, которые сервер понимает. Неизвестные и некорректные
+ * опции игнорируются, как требует RFC 2347.
+ */
+static void parse_options(const char *ptr, const char *end, struct request_options *o) {
+    const char *name, *value;
+    long long v;
+
+    memset(o, 0, sizeof(*o));
+    while (next_option(&ptr, end, &name, &value) > 0) {
+        if (strcasecmp(name, "multicast") == 0) {
+            o->multicast = 1;
+            continue;
+        }
+        if (parse_option_value(value, &v) < 0) {
+            continue;
+        }
+        if (strcasecmp(name, "blksize") == 0 && v >= MIN_BLKSIZE) {
+            o->blksize = v < server_state.max_blksize ? (int)v : server_state.max_blksize;
+        } else if (strcasecmp(name, "timeout") == 0 && v >= 1 && v <= MAX_TIMEOUT) {
+            o->timeout = (int)v;
+        } else if (strcasecmp(name, "windowsize") == 0 && v >= 1 && v <= MAX_WINDOWSIZE) {
+            o->windowsize = v < server_state.max_windowsize ? (int)v : server_state.max_windowsize;
+        } else if (strcasecmp(name, "tsize") == 0) {
+            o->tsize = 1;
+            o->tsize_value = v;
+        }
+    }
+}
+
+/* Собирает OACK из запрошенных опций; 0, если подтверждать нечего. */
+static int build_oack(char *buf, const struct request_options *o, int blksize, int windowsize,
+                      long long tsize, const char *multicast) {
+    char *out = buf + sizeof(uint16_t);
+
+    *(uint16_t *)buf = htons(TFTP_OACK);
+    if (o->blksize) {
+        out = append_option(out, "blksize", blksize);
+    }
+    if (o->timeout) {
+        out = append_option(out, "timeout", o->timeout);
+    }
+    if (o->windowsize) {
+        out = append_option(out, "windowsize", windowsize);
+    }
+    if (o->tsize) {
+        out = append_option(out, "tsize", tsize);
+    }
+    if (multicast) {
+        strcpy(out, "multicast");
+        out += strlen("multicast") + 1;
+        strcpy(out, multicast);
+        out += strlen(multicast) + 1;
+    }
+    return out - buf == sizeof(uint16_t) ? 0 : out - buf;
+}
+
+static void negotiate(struct transfer *t, const struct request_options *o, long long file_size) {
+    if (o->blksize) {
+        t->blksize = o->blksize;
+    }
+    if (o->timeout) {
+        t->timeout = o->timeout;
+    }
+    if (o->windowsize) {
+        t->windowsize = o->windowsize;
+    }
+    t->oack_len = build_oack(t->oack, o, t->blksize, t->windowsize,
+                             t->opcode == TFTP_RRQ ? file_size : o->tsize_value, NULL);
+}
+
+/*
+ * Multicast (RFC 2090). Клиенты, запросившие один и тот же файл с
+ * совместимыми опциями, получают его одной раздачей в группу. Окном
+ * управляет master-клиент: его ACK сообщает последний блок, полученный
+ * подряд, и сервер продолжает с блока за ним. Когда master получил файл,
+ * OACK с mc=1 назначает master следующего клиента, и тот запрашивает
+ * пропущенные блоки. Номера блоков не переполняются, поэтому файлы
+ * больше 65535 блоков раздаются обычным способом.
+ */
+static void mcast_send_oack(struct transfer *t, const struct mcast_member *m, int master) {
+    char value[64];
+    char oack[160];
+
+    snprintf(value, sizeof(value), "%s,%d,%d", inet_ntoa(t->group.sin_addr), ntohs(t->group.sin_port), master);
+    int len = build_oack(oack, &m->opts, t->blksize, t->windowsize, t->entry->size, value);
+    sendto(t->fd, oack, len, 0, (const struct sockaddr *)&m->addr, sizeof(m->addr));
+}
+
+static struct mcast_member *mcast_find_member(struct transfer *t, const struct sockaddr_in *peer) {
+    for (struct mcast_member *m = t->members; m; m = m->next) {
+        if (m->addr.sin_addr.s_addr == peer->sin_addr.s_addr && m->addr.sin_port == peer->sin_port) {
+            return m;
+        }
+    }
+    return NULL;
+}
+
+/* Повторный RRQ участника: его OACK потерялся. */
+static int mcast_resend_oack(const struct sockaddr_in *peer) {
+    for (struct transfer *t = server_state.transfers; t; t = t->next) {
+        if (t->mcast && !t->closed) {
+            struct mcast_member *m = mcast_find_member(t, peer);
+            if (m) {
+                mcast_send_oack(t, m, m == t->members);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void mcast_promote(struct transfer *t) {
+    t->peer = t->members->addr;
+    t->oack_pending = 1;
+    t->retries = 0;
+    mcast_send_oack(t, t->members, 1);
+    arm_timer(t);
+}
+
+/* Убирает участника; если это был master, его место занимает следующий. */
+static void mcast_drop(struct transfer *t, struct mcast_member *m, int ok) {
+    int was_master = m == t->members;
+    struct mcast_member **p = &t->members;
+    while (*p != m) {
+        p = &(*p)->next;
+    }
+    *p = m->next;
+    free(m);
+    if (ok) {
+        t->members_done++;
+    }
+
+    if (!t->members) {
+        transfer_close(t, t->members_done > 0);
+    } else if (was_master) {
+        mcast_promote(t);
+    }
+}
+
+static void mcast_add_member(struct transfer *t, const struct sockaddr_in *peer, const struct request_options *o) {
+    struct mcast_member *m = calloc(1, sizeof(*m));
+    if (!m) {
+        send_error(server_state.listen_fd, peer, TFTP_EUNDEF, "Server error");
+        return;
+    }
+    m->addr = *peer;
+    m->opts = *o;
+
+    struct mcast_member **p = &t->members;
+    while (*p) {
+        p = &(*p)->next;
+    }
+    *p = m;
+    t->members_total++;
+    server_state.mcast_clients++;
+
+    if (m == t->members) {
+        mcast_promote(t);
+    } else {
+        mcast_send_oack(t, m, 0);
+    }
+    if (!server_state.quiet) {
+        char group[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &t->group.sin_addr, group, sizeof(group));
+        printf("Multicast RRQ %s от %s:%d: группа %s:%d, %s\n", t->name, inet_ntoa(peer->sin_addr),
+               ntohs(peer->sin_port), group, ntohs(t->group.sin_port),
+               m == t->members ? "master" : "ожидает");
+    }
+}
+
+/* Идущая раздача того же файла, которую клиент может принять со своими опциями. */
+static struct transfer *mcast_find_session(const struct cache_entry *entry, const struct request_options *o) {
+    int blksize = o->blksize ? o->blksize : DATA_SIZE;
+    int windowsize = o->windowsize ? o->windowsize : 1;
+
+    for (struct transfer *t = server_state.transfers; t; t = t->next) {
+        if (t->mcast && !t->closed && t->entry == entry && t->blksize <= blksize && t->windowsize <= windowsize) {
+            return t;
+        }
+    }
+    return NULL;
+}
+
+static int mcast_port_in_use(int port) {
+    for (struct transfer *t = server_state.transfers; t; t = t->next) {
+        if (t->mcast && !t->closed && ntohs(t->group.sin_port) == port) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static struct transfer *mcast_session_new(const struct sockaddr_in *peer, const char *name,
+                                          struct cache_entry *entry, const struct request_options *o) {
+    int port = -1;
+    for (int i = 0; i < MCAST_PORTS; i++) {
+        int candidate = server_state.mcast_port + (server_state.mcast_next++ % MCAST_PORTS);
+        if (!mcast_port_in_use(candidate)) {
+            port = candidate;
+            break;
+        }
+    }
+    if (port < 0) {
+        return NULL;
+    }
+
+    struct transfer *t = transfer_new(TFTP_RRQ, peer, name, 0);
+    if (!t) {
+        return NULL;
+    }
+    t->mcast = 1;
+    t->entry = entry;
+    t->group.sin_family = AF_INET;
+    t->group.sin_addr = server_state.mcast_group;
+    t->group.sin_port = htons(port);
+    negotiate(t, o, entry->size);
+    t->last_block = entry->size / t->blksize + 1;
+
+    /* Раздача идет через интерфейс, на котором слушает сервер. */
+    struct sockaddr_in local;
+    socklen_t local_len = sizeof(local);
+    unsigned char ttl = 1;
+    unsigned char loop = 1;
+    if (getsockname(t->fd, (struct sockaddr *)&local, &local_len) == 0 && local.sin_addr.s_addr != htonl(INADDR_ANY)) {
+        setsockopt(t->fd, IPPROTO_IP, IP_MULTICAST_IF, &local.sin_addr, sizeof(local.sin_addr));
+    }
+    setsockopt(t->fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    setsockopt(t->fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+    size_socket_buffer(t->fd, SO_SNDBUF, t->blksize, t->windowsize);
+    server_state.mcast_sessions++;
+    return t;
+}
+
+/* ACK от участников сессии. Окно двигает только master; ACK последнего блока - клиент получил файл. */
+static void mcast_handle(struct transfer *t) {
+    struct tftp_packet packet;
+    struct sockaddr_in from;
+
+    while (!t->closed) {
+        socklen_t from_len = sizeof(from);
+        int len = recvfrom(t->fd, &packet, sizeof(packet) - 1, 0, (struct sockaddr *)&from, &from_len);
+        if (len < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("recvfrom");
+            }
+            return;
+        }
+        if (len < 4) {
+            continue;
+        }
+
+        struct mcast_member *m = mcast_find_member(t, &from);
+        if (!m) {
+            send_error(t->fd, &from, TFTP_EBADID, "Unknown transfer ID");
+            continue;
+        }
+        uint16_t opcode = ntohs(packet.opcode);
+        uint16_t block_num = ntohs(packet.ack.block_num);
+
+        if (opcode == TFTP_ERROR) {
+            mcast_drop(t, m, 0);
+        } else if (opcode != TFTP_ACK) {
+            send_error(t->fd, &from, TFTP_EBADOP, "Illegal TFTP operation");
+            mcast_drop(t, m, 0);
+        } else if (block_num == t->last_block) {
+            t->bytes = t->entry->size;
+            mcast_drop(t, m, 1);
+        } else if (m == t->members && block_num < t->last_block) {
+            t->oack_pending = 0;
+            t->acked = block_num;
+            t->retries = 0;
+            rrq_send_window(t);
+        }
+    }
+}
+
+static void handle_rrq(const struct sockaddr_in *peer, const char *name, const char *options, const char *end) {
+    server_state.rrq_count++;
+
+    struct cache_entry *entry = cache_get(name);
+    if (!entry) {
+        if (errno == ENOENT) {
+            send_error(server_state.listen_fd, peer, TFTP_ENOTFOUND, "File not found");
+        } else {
+            send_error(server_state.listen_fd, peer, TFTP_EACCESS, "Access violation");
+        }
+        return;
+    }
+
+    struct request_options o;
+    parse_options(options, end, &o);
+
+    if (o.multicast && server_state.mcast_enabled) {
+        struct transfer *session = mcast_find_session(entry, &o);
+        if (session) {
+            cache_put(entry);
+            mcast_add_member(session, peer, &o);
+            return;
+        }
+        if (entry->size / (o.blksize ? o.blksize : DATA_SIZE) + 1 <= MCAST_MAX_BLOCKS) {
+            session = mcast_session_new(peer, name, entry, &o);
+            if (session) {
+                mcast_add_member(session, peer, &o);
+                return;
+            }
+        }
+        /* Раздать в группу не получилось: обычная передача без опции multicast. */
+    }
+
+    struct transfer *t = transfer_new(TFTP_RRQ, peer, name, 1);
+    if (!t) {
+        cache_put(entry);
+        send_error(server_state.listen_fd, peer, TFTP_EUNDEF, "Server error");
+        return;
+    }
+    t->entry = entry;
+
+    negotiate(t, &o, entry->size);
+    t->last_block = entry->size / t->blksize + 1;
+    size_socket_buffer(t->fd, SO_SNDBUF, t->blksize, t->windowsize);
+    if (!server_state.quiet) {
+        printf("RRQ %s от %s:%d: %lld байт, blksize %d, windowsize %d\n", name,
+               inet_ntoa(peer->sin_addr), ntohs(peer->sin_port), (long long)entry->size,
+               t->blksize, t->windowsize);
+    }
+
+    if (t->oack_len) {
+        t->oack_pending = 1;
+        send_oack(t);
+    } else {
+        rrq_send_window(t);
+    }
+}
+
+static void handle_wrq(const struct sockaddr_in *peer, const char *name, const char *options, const char *end) {
+    server_state.wrq_count++;
+
+    if (server_state.read_only) {
+        send_error(server_state.listen_fd, peer, TFTP_EACCESS, "Server is read-only");
+        return;
+    }
+
+    struct transfer *t = transfer_new(TFTP_WRQ, peer, name, 1);
+    if (!t) {
+        send_error(server_state.listen_fd, peer, TFTP_EUNDEF, "Server error");
+        return;
+    }
+
+    /* Файл пишется во временный и подменяется rename, чтобы не испортить отображения RRQ. */
+    snprintf(t->tmp_name, sizeof(t->tmp_name), "%s.XXXXXX", name);
+    t->out_fd = mkstemp(t->tmp_name);
+    if (t->out_fd < 0) {
+        send_error(t->fd, peer, errno == ENOSPC ? TFTP_ENOSPACE : TFTP_EACCESS, "Cannot create file");
+        transfer_close(t, 0);
+        return;
+    }
+    fchmod(t->out_fd, 0644);
+
+    struct request_options o;
+    parse_options(options, end, &o);
+    negotiate(t, &o, 0);
+    size_socket_buffer(t->fd, SO_RCVBUF, t->blksize, t->windowsize);
+    if (!server_state.quiet) {
+        printf("WRQ %s от %s:%d: blksize %d, windowsize %d\n", name,
+               inet_ntoa(peer->sin_addr), ntohs(peer->sin_port), t->blksize, t->windowsize);
+    }
+
+    if (t->oack_len) {
+        t->oack_pending = 1;
+        send_oack(t);
+    } else {
+        send_ack(t, 0);
+        arm_timer(t);
+    }
+}
+
+static void handle_request(const struct tftp_packet *packet, int len, const struct sockaddr_in *peer) {
+    const char *ptr = packet->raw;
+    const char *end = packet->raw + len - sizeof(uint16_t);
+    const char *name, *mode;
+    uint16_t opcode = ntohs(packet->opcode);
+
+    if (opcode != TFTP_RRQ && opcode != TFTP_WRQ) {
+        send_error(server_state.listen_fd, peer, TFTP_EBADOP, "Illegal TFTP operation");
+        return;
+    }
+    if (next_option(&ptr, end, &name, &mode) <= 0) {
+        send_error(server_state.listen_fd, peer, TFTP_EBADOP, "Malformed request");
+        return;
+    }
+    if (strcasecmp(mode, "octet") != 0) {
+        send_error(server_state.listen_fd, peer, TFTP_EBADOP, "Only octet mode is supported");
+        return;
+    }
+    if (!valid_filename(name) || strlen(name) >= MAX_PATH) {
+        send_error(server_state.listen_fd, peer, TFTP_EACCESS, "Access violation");
+        return;
+    }
+    /* Повтор запроса, на который уже идет передача: ответит таймер передачи. */
+    if (transfer_find(peer) || mcast_resend_oack(peer)) {
+        return;
+    }
+    if (server_state.active >= server_state.max_transfers) {
+        send_error(server_state.listen_fd, peer, TFTP_EUNDEF, "Server busy");
+        return;
+    }
+
+    if (opcode == TFTP_RRQ) {
+        handle_rrq(peer, name, ptr, end);
+    } else {
+        handle_wrq(peer, name, ptr, end);
+    }
+}
+
+static void rrq_handle_ack(struct transfer *t, uint16_t block_num) {
+    if (t->oack_pending) {
+        if (block_num != 0) {
+            return;
+        }
+        t->oack_pending = 0;
+        t->retries = 0;
+        rrq_send_window(t);
+        return;
+    }
+
+    /* ACK на любой блок окна сдвигает окно; ACK на acked - откат после потери. */
+    uint16_t delta = (uint16_t)(block_num - (uint16_t)t->acked);
+    if (delta > t->sent - t->acked) {
+        return;
+    }
+    t->acked += delta;
+    t->bytes = t->acked * t->blksize < t->entry->size ? t->acked * t->blksize : t->entry->size;
+    t->retries = 0;
+    if (t->acked == t->last_block) {
+        transfer_close(t, 1);
+        return;
+    }
+    rrq_send_window(t);
+}
+
+static void wrq_handle_data(struct transfer *t, uint16_t block_num, const uint8_t *data, int len) {
+    if (t->done) {
+        /* Клиент не получил последний ACK. */
+        if (block_num == (uint16_t)(t->expected - 1)) {
+            send_ack(t, t->expected - 1);
+        }
+        return;
+    }
+    if (block_num != (uint16_t)t->expected) {
+        if (t->out_of_order++ % t->windowsize == 0) {
+            send_ack(t, t->expected - 1);
+            t->in_window = 0;
+        }
+        return;
+    }
+    if (len > t->blksize) {
+        send_error(t->fd, &t->peer, TFTP_EBADOP, "Block larger than blksize");
+        transfer_close(t, 0);
+        return;
+    }
+    if (write(t->out_fd, data, len) != len) {
+        send_error(t->fd, &t->peer, errno == ENOSPC ? TFTP_ENOSPACE : TFTP_EACCESS, "Write failed");
+        transfer_close(t, 0);
+        return;
+    }
+
+    t->oack_pending = 0;
+    t->bytes += len;
+    server_state.bytes_received += len;
+    t->expected++;
+    t->out_of_order = 0;
+    t->retries = 0;
+    t->in_window++;
+    if (t->in_window == t->windowsize || len < t->blksize) {
+        send_ack(t, t->expected - 1);
+        t->in_window = 0;
+    }
+    arm_timer(t);
+
+    if (len < t->blksize) {
+        close(t->out_fd);
+        t->out_fd = -1;
+        if (rename(t->tmp_name, t->name) < 0) {
+            perror("rename");
+            unlink(t->tmp_name);
+        }
+        struct cache_entry *e = cache_find(t->name);
+        if (e) {
+            cache_mark_stale(e);
+        }
+        /* Ждем еще один таймаут на случай повтора последнего блока. */
+        t->done = 1;
+    }
+}
+
+static void handle_transfer(struct transfer *t) {
+    struct tftp_packet packet;
+
+    if (t->closed) {
+        return;
+    }
+    if (t->mcast) {
+        mcast_handle(t);
+        return;
+    }
+    while (1) {
+        int len = recv(t->fd, &packet, sizeof(packet) - 1, 0);
+        if (len < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED) {
+                perror("recv");
+            }
+            return;
+        }
+        if (len < 4) {
+            continue;
+        }
+
+        uint16_t opcode = ntohs(packet.opcode);
+        uint16_t block_num = ntohs(packet.data.block_num);
+
+        if (opcode == TFTP_ERROR) {
+            transfer_close(t, 0);
+            return;
+        }
+        if (t->opcode == TFTP_RRQ && opcode == TFTP_ACK) {
+            rrq_handle_ack(t, block_num);
+        } else if (t->opcode == TFTP_WRQ && opcode == TFTP_DATA) {
+            wrq_handle_data(t, block_num, packet.data.data, len - 4);
+        } else {
+            send_error(t->fd, &t->peer, TFTP_EBADOP, "Illegal TFTP operation");
+            transfer_close(t, 0);
+            return;
+        }
+        if (t->closed) {
+            return;
+        }
+    }
+}
+
+static void handle_timeouts(void) {
+    long long now = now_ms();
+    struct transfer *t = server_state.transfers;
+
+    while (t) {
+        struct transfer *next = t->next;
+        if (!t->closed && now >= t->deadline_ms) {
+            if (t->done) {
+                transfer_close(t, 1);
+            } else if (t->mcast && t->retries >= MAX_RETRIES) {
+                /* master пропал: раздачу продолжает следующий клиент. */
+                mcast_drop(t, t->members, 0);
+            } else if (t->mcast && t->oack_pending) {
+                t->retries++;
+                mcast_send_oack(t, t->members, 1);
+                arm_timer(t);
+            } else if (++t->retries > MAX_RETRIES) {
+                send_error(t->fd, &t->peer, TFTP_EUNDEF, "Timeout");
+                transfer_close(t, 0);
+            } else if (t->oack_pending) {
+                send_oack(t);
+            } else if (t->opcode == TFTP_RRQ) {
+                rrq_send_window(t);
+            } else {
+                send_ack(t, t->expected - 1);
+                t->in_window = 0;
+                arm_timer(t);
+            }
+        }
+        t = next;
+    }
+}
+
+static int next_timeout_ms(void) {
+    long long now = now_ms();
+    long long nearest = -1;
+    for (struct transfer *t = server_state.transfers; t; t = t->next) {
+        if (nearest < 0 || t->deadline_ms < nearest) {
+            nearest = t->deadline_ms;
+        }
+    }
+    if (nearest < 0) {
+        return 1000;
+    }
+    return nearest <= now ? 0 : (int)(nearest - now);
+}
+
+static void handle_listen(void) {
+    struct tftp_packet packet;
+    struct sockaddr_in peer;
+
+    while (1) {
+        socklen_t peer_len = sizeof(peer);
+        int len = recvfrom(server_state.listen_fd, &packet, sizeof(packet) - 1, 0,
+                           (struct sockaddr *)&peer, &peer_len);
+        if (len < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("recvfrom");
+            }
+            return;
+        }
+        if (len < 4) {
+            continue;
+        }
+        packet.raw[len - sizeof(uint16_t)] = '\0';
+        handle_request(&packet, len, &peer);
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Использование: %s [-p порт] [-a адрес] [-r] [-q] [-b blksize] [-w windowsize] [-n передач] [-c МБ] [-m группа[:порт]] [каталог]\n"
+                    "  -p  UDP порт (по умолчанию %d)\n"
+                    "  -a  адрес для прослушивания (по умолчанию все)\n"
+                    "  -r  только чтение, WRQ отклоняются\n"
+                    "  -q  не печатать начало и конец каждой передачи\n"
+                    "  -b  максимальный blksize, %d-%d\n"
+                    "  -w  максимальный windowsize, 1-%d\n"
+                    "  -n  максимум одновременных передач (по умолчанию %d)\n"
+                    "  -c  размер кэша файлов в МБ (по умолчанию %d)\n"
+                    "  -m  раздавать по запросу multicast (RFC 2090) в группу, порты с %d\n",
+            prog, TFTP_PORT, MIN_BLKSIZE, MAX_BLKSIZE, MAX_WINDOWSIZE, DEFAULT_MAX_TRANSFERS, DEFAULT_CACHE_MB,
+            MCAST_PORT);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    struct sockaddr_in addr;
+    int port = TFTP_PORT;
+    int opt;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    while ((opt = getopt(argc, argv, "p:a:rqb:w:n:c:m:")) != -1) {
+        switch (opt) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'a':
+            if (inet_pton(AF_INET, optarg, &addr.sin_addr) <= 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'r':
+            server_state.read_only = 1;
+            break;
+        case 'q':
+            server_state.quiet = 1;
+            break;
+        case 'b':
+            server_state.max_blksize = atoi(optarg);
+            if (server_state.max_blksize < MIN_BLKSIZE || server_state.max_blksize > MAX_BLKSIZE) {
+                usage(argv[0]);
+            }
+            break;
+        case 'w':
+            server_state.max_windowsize = atoi(optarg);
+            if (server_state.max_windowsize < 1 || server_state.max_windowsize > MAX_WINDOWSIZE) {
+                usage(argv[0]);
+            }
+            break;
+        case 'n':
+            server_state.max_transfers = atoi(optarg);
+            if (server_state.max_transfers < 1) {
+                usage(argv[0]);
+            }
+            break;
+        case 'c':
+            server_state.cache_limit = (size_t)atol(optarg) << 20;
+            break;
+        case 'm': {
+            char *colon = strchr(optarg, ':');
+            if (colon) {
+                *colon = '\0';
+                server_state.mcast_port = atoi(colon + 1);
+                if (server_state.mcast_port < 1 || server_state.mcast_port > 65535 - MCAST_PORTS) {
+                    usage(argv[0]);
+                }
+            }
+            if (inet_pton(AF_INET, optarg, &server_state.mcast_group) <= 0
+                    || !IN_MULTICAST(ntohl(server_state.mcast_group.s_addr))) {
+                usage(argv[0]);
+            }
+            server_state.mcast_enabled = 1;
+            break;
+        }
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind < argc && chdir(argv[optind]) < 0) {
+        perror("Ошибка перехода в каталог");
+        return 1;
+    }
+    addr.sin_port = htons(port);
+
+    server_state.listen_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server_state.listen_fd < 0) {
+        perror("Ошибка создания сокета");
+        return 1;
+    }
+    if (bind(server_state.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("Ошибка bind");
+        return 1;
+    }
+
+    server_state.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (server_state.epfd < 0) {
+        perror("epoll_create1");
+        return 1;
+    }
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epoll_ctl(server_state.epfd, EPOLL_CTL_ADD, server_state.listen_fd, &ev) < 0) {
+        perror("epoll_ctl");
+        return 1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = request_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sa.sa_handler = request_stats;
+    sigaction(SIGUSR1, &sa, NULL);
+
+    printf("TFTP сервер слушает порт %d\n", port);
+    fflush(stdout);
+
+    struct epoll_event events[MAX_EVENTS];
+    while (!stop_requested) {
+        int n = epoll_wait(server_state.epfd, events, MAX_EVENTS, next_timeout_ms());
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                handle_listen();
+            } else {
+                handle_transfer(events[i].data.ptr);
+            }
+        }
+        handle_timeouts();
+        reap_transfers();
+        if (stats_requested) {
+            stats_requested = 0;
+            print_stats();
+        }
+        fflush(stdout);
+    }
+
+    for (struct transfer *t = server_state.transfers; t; t = t->next) {
+        transfer_close(t, 0);
+    }
+    reap_transfers();
+    print_stats();
+    close(server_state.epfd);
+    close(server_state.listen_fd);
+    return 0;
+}
@@ -0,0 +1,1234 @@
+#define NETSIM_IMPL
+#include "netsim.h"
+
+#include <errno.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/udp.h>
+
+/*
+ * Scheduler. Every simulated thread (a program's main or a thread it
+ * starts) is a real thread that runs only while it holds the baton
+ * (current == itself). A thread that blocks records what it waits for and
+ * passes the baton on: round-robin to the next thread that can run, and
+ * if there is none, the clock first jumps to the earliest delivery or
+ * timeout. The main thread of the process gets the baton back when the
+ * harness calls sim_stop or nothing will ever happen again.
+ */
+
+#define SIM_MAX_PROCS 4096
+#define SIM_FIRST_PORT 40000
+#define SIM_NEVER UINT64_MAX
+#define SIM_SKB_OVERHEAD 256
+#define SIM_DEFAULT_RCVBUF 212992
+#define SIM_MAX_RCVBUF (2 * 212992)
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+/* Descriptor kinds besides the two socket types. */
+#define SIM_EVENTFD 0x100
+#define SIM_EPOLL 0x101
+
+enum proc_state { PROC_RUNNABLE, PROC_RUNNING, PROC_WAITING, PROC_DONE, PROC_ABANDONED };
+
+struct sim_proc {
+    int id;
+    int group;
+    int state;
+    int exit_code;
+    pthread_cond_t cond;
+    char dir[256];
+
+    void *(*fn)(void *);
+    void *arg;
+    int (*main_fn)(int, char **);
+    int argc;
+    char **argv;
+
+    uint64_t deadline;
+    uint64_t abandon_at;
+    const int *wait_fds;
+    int wait_fd_count;
+    const int *wait_procs;
+    int wait_proc_count;
+    const pthread_cond_t *wait_cond;
+    int signalled;
+};
+
+struct sim_dgram {
+    struct sim_dgram *next;
+    uint64_t at;
+    uint64_t seq;
+    struct sockaddr_in from;
+    size_t len;
+    unsigned char data[];
+};
+
+struct sim_epoll_item {
+    int fd;
+    uint32_t events;
+    epoll_data_t data;
+};
+
+/* Every descriptor the sim owns: a socket, an eventfd or an epoll set. */
+struct sim_sock {
+    int open;
+    int type;
+    int group;
+    int nonblock;
+    int bound;
+    int connected;
+    struct sockaddr_in local;
+    struct sockaddr_in peer;
+    uint64_t rcvtimeo;
+    size_t rcvbuf;
+    int report_drops;
+    uint32_t drops;
+    size_t ready_bytes;
+    uint64_t link_busy_until;
+    struct sim_dgram *inflight;
+    struct sim_dgram *ready;
+    struct sim_dgram *ready_tail;
+    uint64_t count;
+    struct sim_epoll_item *items;
+    int item_count;
+    int item_cap;
+};
+
+static pthread_mutex_t sim_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t main_cond = PTHREAD_COND_INITIALIZER;
+static struct sim_proc *procs[SIM_MAX_PROCS];
+static int proc_count;
+static int rr_next;
+static struct sim_proc *current;
+static int stopped;
+
+static struct sim_sock socks[FD_SETSIZE];
+static int dgram_port_fd[65536];
+static int stream_port_fd[65536];
+static uint16_t next_port = SIM_FIRST_PORT;
+
+static struct sim_params params;
+static struct sim_counters counters;
+static uint64_t now_ns;
+static uint64_t rng_state;
+static uint64_t dgram_seq;
+
+static __thread struct sim_proc *self;
+
+static uint64_t sim_random(void) {
+    uint64_t x = rng_state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return rng_state = x;
+}
+
+void sim_init(const struct sim_params *p) {
+    params = *p;
+    /* splitmix64, so nearby seeds still start far apart */
+    uint64_t z = p->seed + 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    rng_state = (z ^ (z >> 31)) | 1;
+}
+
+uint64_t sim_now(void) {
+    return now_ns;
+}
+
+const struct sim_counters *sim_counters(void) {
+    return &counters;
+}
+
+static struct sim_sock *sock_of(int fd) {
+    if (fd < 0 || fd >= FD_SETSIZE || !socks[fd].open) return NULL;
+    return &socks[fd];
+}
+
+/* Moves datagrams whose time has come into the receive queue, dropping those that overflow it. */
+static void deliver_due(struct sim_sock *s) {
+    while (s->inflight && s->inflight->at <= now_ns) {
+        struct sim_dgram *d = s->inflight;
+        s->inflight = d->next;
+        d->next = NULL;
+        if (s->ready_bytes + d->len + SIM_SKB_OVERHEAD > s->rcvbuf) {
+            counters.overflowed++;
+            s->drops++;
+            free(d);
+            continue;
+        }
+        s->ready_bytes += d->len + SIM_SKB_OVERHEAD;
+        if (s->ready_tail) {
+            s->ready_tail->next = d;
+        } else {
+            s->ready = d;
+        }
+        s->ready_tail = d;
+        counters.delivered++;
+    }
+}
+
+static int fd_readable(struct sim_sock *s);
+
+static int fd_writable(const struct sim_sock *s) {
+    return s->type == SOCK_DGRAM || s->type == SIM_EVENTFD;
+}
+
+/* Fills up to max events from the ready members of an epoll set; with no events array only says if one is ready. */
+static int epoll_ready(struct sim_sock *ep, struct epoll_event *events, int max) {
+    int n = 0;
+    for (int i = 0; i < ep->item_count && n < max; i++) {
+        struct sim_sock *s = sock_of(ep->items[i].fd);
+        uint32_t got = 0;
+        if (!s) continue;
+        if ((ep->items[i].events & EPOLLIN) && fd_readable(s)) got |= EPOLLIN;
+        if ((ep->items[i].events & EPOLLOUT) && fd_writable(s)) got |= EPOLLOUT;
+        if (!got) continue;
+        if (!events) return 1;
+        events[n].events = got;
+        events[n].data = ep->items[i].data;
+        n++;
+    }
+    return n;
+}
+
+static int fd_readable(struct sim_sock *s) {
+    switch (s->type) {
+    case SOCK_DGRAM:
+        deliver_due(s);
+        return s->ready != NULL;
+    case SIM_EVENTFD:
+        return s->count > 0;
+    case SIM_EPOLL:
+        return epoll_ready(s, NULL, 1);
+    default:
+        return 0;
+    }
+}
+
+static int proc_finished(int id) {
+    return id >= 0 && id < proc_count && (procs[id]->state == PROC_DONE || procs[id]->state == PROC_ABANDONED);
+}
+
+static int proc_can_run(struct sim_proc *p) {
+    if (p->state == PROC_RUNNABLE) return 1;
+    if (p->state != PROC_WAITING) return 0;
+    if (p->deadline <= now_ns || p->signalled) return 1;
+    for (int i = 0; i < p->wait_fd_count; i++) {
+        struct sim_sock *s = sock_of(p->wait_fds[i]);
+        if (s && fd_readable(s)) return 1;
+    }
+    for (int i = 0; i < p->wait_proc_count; i++) {
+        if (proc_finished(p->wait_procs[i])) return 1;
+    }
+    return 0;
+}
+
+static void close_sock(int fd) {
+    struct sim_sock *s = &socks[fd];
+    for (struct sim_dgram *d = s->inflight, *next; d; d = next) {
+        next = d->next;
+        free(d);
+    }
+    for (struct sim_dgram *d = s->ready, *next; d; d = next) {
+        next = d->next;
+        free(d);
+    }
+    if (s->bound) {
+        int *table = s->type == SOCK_DGRAM ? dgram_port_fd : stream_port_fd;
+        uint16_t port = ntohs(s->local.sin_port);
+        if (table[port] == fd + 1) table[port] = 0;
+    }
+    free(s->items);
+    memset(s, 0, sizeof(*s));
+    /* Like the kernel, a closed descriptor leaves every epoll set it was in. */
+    for (int i = 0; i < FD_SETSIZE; i++) {
+        struct sim_sock *ep = &socks[i];
+        if (!ep->open || ep->type != SIM_EPOLL) continue;
+        for (int j = 0; j < ep->item_count; j++) {
+            if (ep->items[j].fd == fd) {
+                memmove(&ep->items[j], &ep->items[j + 1], (size_t)(ep->item_count - j - 1) * sizeof(ep->items[0]));
+                ep->item_count--;
+                break;
+            }
+        }
+    }
+    close(fd);
+}
+
+/* A program that exits or hangs takes its sockets with it. */
+static void close_group(int group) {
+    for (int fd = 0; fd < FD_SETSIZE; fd++) {
+        if (socks[fd].open && socks[fd].group == group) close_sock(fd);
+    }
+}
+
+static uint64_t next_event(void) {
+    uint64_t t = SIM_NEVER;
+    for (int i = 0; i < proc_count; i++) {
+        struct sim_proc *p = procs[i];
+        if (p->state != PROC_WAITING && p->state != PROC_RUNNABLE) continue;
+        if (p->state == PROC_WAITING && p->deadline < t) t = p->deadline;
+        if (p->abandon_at < t) t = p->abandon_at;
+    }
+    for (int fd = 0; fd < FD_SETSIZE; fd++) {
+        if (socks[fd].open && socks[fd].inflight && socks[fd].inflight->at < t) t = socks[fd].inflight->at;
+    }
+    return t;
+}
+
+static void abandon_overdue(void) {
+    for (int i = 0; i < proc_count; i++) {
+        struct sim_proc *p = procs[i];
+        if ((p->state == PROC_WAITING || p->state == PROC_RUNNABLE) && p->abandon_at <= now_ns) {
+            p->state = PROC_ABANDONED;
+            p->exit_code = SIM_HUNG;
+            close_group(p->group);
+        }
+    }
+}
+
+/* Called with sim_mutex held. NULL hands control back to the main thread. */
+static struct sim_proc *pick_next(void) {
+    while (!stopped) {
+        for (int i = 0; i < proc_count; i++) {
+            struct sim_proc *p = procs[(rr_next + i) % proc_count];
+            if (proc_can_run(p)) {
+                rr_next = (p->id + 1) % proc_count;
+                return p;
+            }
+        }
+        uint64_t t = next_event();
+        if (t == SIM_NEVER) return NULL;
+        if (t > now_ns) now_ns = t;
+        abandon_overdue();
+    }
+    return NULL;
+}
+
+/* Passes the baton on and, unless the caller is finished, waits until it comes back. */
+static void sim_switch(struct sim_proc *me) {
+    struct sim_proc *next = pick_next();
+    counters.switches++;
+    if (next == me) {
+        me->state = PROC_RUNNING;
+        return;
+    }
+    current = next;
+    if (next) {
+        next->state = PROC_RUNNING;
+        pthread_cond_signal(&next->cond);
+    } else {
+        pthread_cond_signal(&main_cond);
+    }
+    if (me->state == PROC_DONE) return;
+    while (current != me) {
+        pthread_cond_wait(&me->cond, &sim_mutex);
+    }
+}
+
+/*
+ * Blocks the calling thread until a watched descriptor is readable, a
+ * watched proc ends, the thread is signalled or the deadline. The arrays
+ * stay the caller's and must live until it returns.
+ */
+static void sim_block(const int *fds, int fd_count, const int *wait_procs, int proc_wait_count, uint64_t deadline) {
+    self->wait_fds = fds;
+    self->wait_fd_count = fd_count;
+    self->wait_procs = wait_procs;
+    self->wait_proc_count = proc_wait_count;
+    self->deadline = deadline;
+    self->state = PROC_WAITING;
+    sim_switch(self);
+    self->wait_fd_count = 0;
+    self->wait_proc_count = 0;
+    self->deadline = SIM_NEVER;
+}
+
+static void proc_finish(int code) {
+    self->state = PROC_DONE;
+    self->exit_code = code;
+    if (self->id == self->group) close_group(self->group);
+    sim_switch(self);
+}
+
+static void *proc_start(void *arg) {
+    struct sim_proc *p = arg;
+    pthread_mutex_lock(&sim_mutex);
+    while (current != p) {
+        pthread_cond_wait(&p->cond, &sim_mutex);
+    }
+    pthread_mutex_unlock(&sim_mutex);
+    self = p;
+
+    int code = 0;
+    if (p->main_fn) {
+        /* Every program parses its options from scratch. */
+        optind = 0;
+        code = p->main_fn(p->argc, p->argv);
+    } else {
+        p->fn(p->arg);
+    }
+
+    pthread_mutex_lock(&sim_mutex);
+    proc_finish(code);
+    pthread_mutex_unlock(&sim_mutex);
+    return NULL;
+}
+
+static int add_proc(struct sim_proc *p, const char *dir, int group) {
+    pthread_mutex_lock(&sim_mutex);
+    if (proc_count == SIM_MAX_PROCS) {
+        pthread_mutex_unlock(&sim_mutex);
+        free(p);
+        errno = EAGAIN;
+        return -1;
+    }
+    p->id = proc_count;
+    p->group = group < 0 ? p->id : group;
+    p->state = PROC_RUNNABLE;
+    p->deadline = SIM_NEVER;
+    if (!p->abandon_at) p->abandon_at = SIM_NEVER;
+    snprintf(p->dir, sizeof(p->dir), "%s", dir ? dir : "");
+    pthread_cond_init(&p->cond, NULL);
+    procs[proc_count++] = p;
+    pthread_mutex_unlock(&sim_mutex);
+
+    pthread_t tid;
+    int err = pthread_create(&tid, NULL, proc_start, p);
+    if (err) {
+        pthread_mutex_lock(&sim_mutex);
+        p->state = PROC_DONE;
+        pthread_mutex_unlock(&sim_mutex);
+        errno = err;
+        return -1;
+    }
+    pthread_detach(tid);
+    return p->id;
+}
+
+int sim_spawn(const char *name, const char *dir, int (*main_fn)(int, char **), int argc, char **argv,
+              uint64_t timeout_ns) {
+    struct sim_proc *p = calloc(1, sizeof(*p));
+    if (!p) return -1;
+    (void)name;
+    p->main_fn = main_fn;
+    p->argc = argc;
+    p->argv = argv;
+    p->abandon_at = timeout_ns ? now_ns + timeout_ns : SIM_NEVER;
+    return add_proc(p, dir, -1);
+}
+
+int sim_spawn_thread(void *(*fn)(void *), void *arg, const char *dir) {
+    struct sim_proc *p = calloc(1, sizeof(*p));
+    if (!p) return -1;
+    p->fn = fn;
+    p->arg = arg;
+    return add_proc(p, dir, -1);
+}
+
+void sim_run(void) {
+    pthread_mutex_lock(&sim_mutex);
+    struct sim_proc *next = pick_next();
+    if (next) {
+        current = next;
+        next->state = PROC_RUNNING;
+        pthread_cond_signal(&next->cond);
+        while (current != NULL) {
+            pthread_cond_wait(&main_cond, &sim_mutex);
+        }
+    }
+    pthread_mutex_unlock(&sim_mutex);
+}
+
+void sim_stop(void) {
+    pthread_mutex_lock(&sim_mutex);
+    stopped = 1;
+    pthread_mutex_unlock(&sim_mutex);
+}
+
+int sim_wait_exit(const int *ids, int count, int *status) {
+    pthread_mutex_lock(&sim_mutex);
+    while (1) {
+        for (int i = 0; i < count; i++) {
+            if (proc_finished(ids[i])) {
+                if (status) *status = procs[ids[i]]->exit_code;
+                pthread_mutex_unlock(&sim_mutex);
+                return i;
+            }
+        }
+        sim_block(NULL, 0, ids, count, SIM_NEVER);
+    }
+}
+
+uint16_t sim_proc_port(int id) {
+    uint16_t port = 0;
+    pthread_mutex_lock(&sim_mutex);
+    for (int fd = 0; fd < FD_SETSIZE && !port; fd++) {
+        if (socks[fd].open && socks[fd].group == id && socks[fd].type == SOCK_DGRAM && socks[fd].bound) {
+            port = ntohs(socks[fd].local.sin_port);
+        }
+    }
+    pthread_mutex_unlock(&sim_mutex);
+    return port;
+}
+
+void sim_sleep(uint64_t ns) {
+    pthread_mutex_lock(&sim_mutex);
+    uint64_t until = now_ns + ns;
+    while (now_ns < until) {
+        sim_block(NULL, 0, NULL, 0, until);
+    }
+    pthread_mutex_unlock(&sim_mutex);
+}
+
+/* Each call costs a little virtual time, so a thread polling in a loop still sees the clock move. */
+static void charge_call(void) {
+    now_ns += params.call_ns;
+}
+
+/* Sockets */
+
+static int new_fd(int type, int nonblock) {
+    /* A real descriptor reserves the number, so it never collides with files. */
+    int fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    if (fd >= FD_SETSIZE) {
+        close(fd);
+        errno = EMFILE;
+        return -1;
+    }
+    pthread_mutex_lock(&sim_mutex);
+    struct sim_sock *s = &socks[fd];
+    memset(s, 0, sizeof(*s));
+    s->open = 1;
+    s->type = type;
+    s->group = self ? self->group : -1;
+    s->nonblock = nonblock;
+    s->rcvbuf = SIM_DEFAULT_RCVBUF;
+    pthread_mutex_unlock(&sim_mutex);
+    return fd;
+}
+
+int sim_socket(int domain, int type, int protocol) {
+    (void)protocol;
+    int base = type & ~(SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (domain != AF_INET || (base != SOCK_DGRAM && base != SOCK_STREAM)) {
+        errno = EAFNOSUPPORT;
+        return -1;
+    }
+    return new_fd(base, (type & SOCK_NONBLOCK) != 0);
+}
+
+static int bind_port(struct sim_sock *s, int fd, uint16_t port) {
+    int *table = s->type == SOCK_DGRAM ? dgram_port_fd : stream_port_fd;
+    if (port == 0) {
+        for (int tries = 0; tries < 65536 - SIM_FIRST_PORT; tries++) {
+            uint16_t p = next_port++;
+            if (next_port == 0) next_port = SIM_FIRST_PORT;
+            if (!table[p]) {
+                port = p;
+                break;
+            }
+        }
+        if (port == 0) {
+            errno = EADDRINUSE;
+            return -1;
+        }
+    } else if (table[port]) {
+        errno = EADDRINUSE;
+        return -1;
+    }
+    table[port] = fd + 1;
+    s->bound = 1;
+    s->local.sin_family = AF_INET;
+    s->local.sin_port = htons(port);
+    if (s->local.sin_addr.s_addr == 0) s->local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return 0;
+}
+
+int sim_bind(int fd, const struct sockaddr *addr, socklen_t len) {
+    pthread_mutex_lock(&sim_mutex);
+    struct sim_sock *s = sock_of(fd);
+    int r = -1;
+    if (!s) {
+        errno = EBADF;
+    } else if (s->bound || len < sizeof(struct sockaddr_in)) {
+        errno = EINVAL;
+    } else {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)addr;
+        s->local.sin_addr = in->sin_addr;
+        r = bind_port(s, fd, ntohs(in->sin_port));
+    }
+    pthread_mutex_unlock(&sim_mutex);
+    return r;
+}
+
+int sim_connect(int fd, const struct sockaddr *addr, socklen_t len) {
+    pthread_mutex_lock(&sim_mutex);
+    struct sim_sock *s = sock_of(fd);
+    int r = -1;
+    if (!s) {
+        errno = EBADF;
+    } else if (s->type != SOCK_DGRAM) {
+        errno = ECONNREFUSED;
+    } else if (len < sizeof(struct sockaddr_in)) {
+        errno = EINVAL;
+    } else if (s->bound || bind_port(s, fd, 0) == 0) {
+        s->peer = *(const struct sockaddr_in *)addr;
+        s->connected = 1;
+        r = 0;
+    }
+    pthread_mutex_unlock(&sim_mutex);
+    return r;
+}
+
+int sim_listen(int fd, int backlog) {
+    (void)backlog;
+    if (!sock_of(fd)) {
+        errno = EBADF;
+        return -1;
+    }
+    return 0;
+}
+
+int sim_accept(int fd, struct sockaddr *addr, socklen_t *len) {
+    (void)fd;
+    (void)addr;
+    (void)len;
+    errno = EAGAIN;
+    return -1;
+}
+
+int sim_getsockname(int fd, struct sockaddr *addr, socklen_t *len) {
+    pthread_mutex_lock(&sim_mutex);
+    struct sim_sock *s = sock_of(fd);
+    int r = -1;
+    if (!s) {
+        errno = EBADF;
+    } else {
+        socklen_t n = *len < sizeof(s->local) ? *len : sizeof(s->local);
+        memcpy(addr, &s->local, n);
+        *len = sizeof(s->local);
+        r = 0;
+    }
+    pthread_mutex_unlock(&sim_mutex);
+    return r;
+}
+
+int sim_setsockopt(int fd, int level, int name, const void *value, socklen_t len) {
+    pthread_mutex_lock(&sim_mutex);
+    struct sim_sock *s = sock_of(fd);
+    int r = 0;
+    if (!s) {
+        errno = EBADF;
+        r = -1;
+    } else if (level == SOL_SOCKET && name == SO_RCVTIMEO && len >= sizeof(struct timeval)) {
+        const struct timeval *tv = value;
+        s->rcvtimeo = (uint64_t)tv->tv_sec * 1000000000ULL + (uint64_t)tv->tv_usec * 1000ULL;
+    } else if (level == SOL_SOCKET && name == SO_RCVBUF && len >= sizeof(int)) {
+        /* Like Linux: doubled for bookkeeping and capped by rmem_max. */
+        size_t want = (size_t)*(const int *)value * 2;
+        s->rcvbuf = want > SIM_MAX_RCVBUF ? SIM_MAX_RCVBUF : want;
+    } else if (level == SOL_SOCKET && name == SO_RCVBUFFORCE) {
+        /* The programs are not privileged. */
+        errno = EPERM;
+        r = -1;
+    } else if (level == SOL_SOCKET && name == SO_RXQ_OVFL && len >= sizeof(int)) {
+        s->report_drops = *(const int *)value != 0;
+    } else if (level == SOL_UDP) {
+        errno = ENOPROTOOPT;
+        r = -1;
+    }
+    pthread_mutex_unlock(&sim_mutex);
+    return r;
+}
+
+int sim_getsockopt(int fd, int level, int name, void *value, socklen_t *len) {
+    pthread_mutex_lock(&sim_mutex);
+    struct sim_sock *s = sock_of(fd);
+    int r = 0;
+    if (!s) {
+        errno = EBADF;
+        r = -1;
+    } else if (level == SOL_SOCKET && (name == SO_RCVBUF || name == SO_ERROR) && *len >= sizeof(int)) {
+        *(int *)value = name == SO_RCVBUF ? (int)s->rcvbuf : 0;
+        *len = sizeof(int);
+    } else {
+        /* No GSO, GRO or anything else the programs probe for. */
+        errno = ENOPROTOOPT;
+        r = -1;
+    }
+    pthread_mutex_unlock(&sim_mutex);
+    return r;
+}
+
+/* Puts one datagram on the wire: loss, duplication, corruption, serialization, delay and jitter. */
+static void transmit(struct sim_sock *s, const struct sockaddr_in *to, const unsigned char *data, size_t len) {
+    counters.datagrams++;
+    counters.bytes += len;
+
+    int fd = dgram_port_fd[ntohs(to->sin_port)] - 1;
+    struct sim_sock *dst = fd >= 0 ? &socks[fd] : NULL;
+    if (!dst || (dst->connected && (dst->peer.sin_port != s->local.sin_port))) {
+        counters.unroutable++;
+        return;
+    }
+    if (params.loss_percent && sim_random() % 100 < params.loss_percent) {
+        counters.lost++;
+        return;
+    }
+
+    uint64_t start = s->link_busy_until > now_ns ? s->link_busy_until : now_ns;
+    if (params.bandwidth_bps) {
+        start += (uint64_t)len * 8 * 1000000000ULL / params.bandwidth_bps;
+    }
+    s->link_busy_until = start;
+
+    int copies = params.dup_percent && sim_random() % 100 < params.dup_percent ? 2 : 1;
+    if (copies == 2) counters.duplicated++;
+    for (int c = 0; c < copies; c++) {
+        struct sim_dgram *d = malloc(sizeof(*d) + len);
+        if (!d) return;
+        memcpy(d->data, data, len);
+        d->len = len;
+        d->from = s->local;
+        d->seq = dgram_seq++;
+        d->at = start + params.delay_ns + (params.jitter_ns ? sim_random() % (params.jitter_ns + 1) : 0);
+        if (len && params.corrupt_percent && sim_random() % 100 < params.corrupt_percent) {
+            d->data[sim_random() % len] ^= (unsigned char)(1 + sim_random() % 255);
+            counters.corrupted++;
+        }
+
+        /* Ordered by arrival time, then by send order. */
+        struct sim_dgram **pos = &dst->inflight;
+        while (*pos && (*pos)->at <= d->at) {
+            pos = &(*pos)->next;
+        }
+        d->next = *pos;
+        *pos = d;
+    }
+}
+
+static ssize_t send_common(int fd, const struct sockaddr_in *to, const unsigned char *data, size_t len,
+                           size_t segment) {
+    pthread_mutex_lock(&sim_mutex);
+    charge_call();
+    struct sim_sock *s = sock_of(fd);
+    ssize_t r = -1;
+    if (!s) {
+        errno = EBADF;
+    } else if (s->type != SOCK_DGRAM) {
+        errno = ENOTCONN;
+    } else if (!to && !s->connected) {
+        errno = EDESTADDRREQ;
+    } else if (len > 65507 && !segment) {
+        errno = EMSGSIZE;
+    } else if (!s->bound && bind_port(s, fd, 0) < 0) {
+        /* errno set */
+    } else {
+        if (!to) to = &s->peer;
+        size_t off = 0;
+        do {
+            size_t n = segment && len - off > segment ? segment : len - off;
+            transmit(s, to, data + off, n);
+            off += n;
+        } while (off < len);
+        r = (ssize_t)len;
+    }
+    pthread_mutex_unlock(&sim_mutex);
+    return r;
+}
+
+ssize_t sim_sendto(int fd, const void *buf, size_t len, int flags, const struct sockaddr *to, socklen_t to_len) {
+    (void)flags;
+    (void)to_len;
+    return send_common(fd, (const struct sockaddr_in *)to, buf, len, 0);
+}
+
+ssize_t sim_send(int fd, const void *buf, size_t len, int flags) {
+    (void)flags;
+    return send_common(fd, NULL, buf, len, 0);
+}
+
+ssize_t sim_sendmsg(int fd, const struct msghdr *msg, int flags) {
+    (void)flags;
+    size_t total = 0;
+    for (size_t i = 0; i < msg->msg_iovlen; i++) {
+        total += msg->msg_iov[i].iov_len;
+    }
+    unsigned char *buf = malloc(total ? total : 1);
+    if (!buf) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    size_t off = 0;
+    for (size_t i = 0; i < msg->msg_iovlen; i++) {
+        memcpy(buf + off, msg->msg_iov[i].iov_base, msg->msg_iov[i].iov_len);
+        off += msg->msg_iov[i].iov_len;
+    }
+
+    size_t segment = 0;
+    if (msg->msg_control) {
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR((struct msghdr *)msg, cm)) {
+            if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_SEGMENT) {
+                uint16_t size;
+                memcpy(&size, CMSG_DATA(cm), sizeof(size));
+                segment = size;
+            }
+        }
+    }
+    ssize_t r = send_common(fd, (const struct sockaddr_in *)msg->msg_name, buf, total, segment);
+    free(buf);
+    return r;
+}
+
+int sim_sendmmsg(int fd, struct mmsghdr *msgs, unsigned int count, int flags) {
+    for (unsigned int i = 0; i < count; i++) {
+        ssize_t r = sim_sendmsg(fd, &msgs[i].msg_hdr, flags);
+        if (r < 0) return i ? (int)i : -1;
+        msgs[i].msg_len = (unsigned int)r;
+    }
+    return (int)count;
+}
+
+/* Takes the next datagram, blocking (up to SO_RCVTIMEO) unless MSG_DONTWAIT or the socket is non-blocking. */
+static struct sim_dgram *receive_common(int fd, int flags, int64_t *drops) {
+    pthread_mutex_lock(&sim_mutex);
+    charge_call();
+    struct sim_sock *s = sock_of(fd);
+    if (!s) {
+        pthread_mutex_unlock(&sim_mutex);
+        errno = EBADF;
+        return NULL;
+    }
+    uint64_t deadline = s->rcvtimeo ? now_ns + s->rcvtimeo : SIM_NEVER;
+    while (!fd_readable(s)) {
+        if ((flags & MSG_DONTWAIT) || s->nonblock || (!self) || now_ns >= deadline) {
+            pthread_mutex_unlock(&sim_mutex);
+            errno = EAGAIN;
+            return NULL;
+        }
+        sim_block(&fd, 1, NULL, 0, deadline);
+        if (!sock_of(fd)) {
+            pthread_mutex_unlock(&sim_mutex);
+            errno = EBADF;
+            return NULL;
+        }
+    }
+    struct sim_dgram *d = s->ready;
+    if (drops) *drops = s->report_drops ? (int64_t)s->drops : -1;
+    s->ready = d->next;
+    if (!s->ready) s->ready_tail = NULL;
+    s->ready_bytes -= d->len + SIM_SKB_OVERHEAD;
+    pthread_mutex_unlock(&sim_mutex);
+    return d;
+}
+
+static void fill_from(const struct sim_dgram *d, struct sockaddr *from, socklen_t *from_len) {
+    if (!from || !from_len) return;
+    socklen_t n = *from_len < sizeof(d->from) ? *from_len : sizeof(d->from);
+    memcpy(from, &d->from, n);
+    *from_len = sizeof(d->from);
+}
+
+ssize_t sim_recvfrom(int fd, void *buf, size_t len, int flags, struct sockaddr *from, socklen_t *from_len) {
+    struct sim_dgram *d = receive_common(fd, flags, NULL);
+    if (!d) return -1;
+    size_t n = d->len < len ? d->len : len;
+    memcpy(buf, d->data, n);
+    fill_from(d, from, from_len);
+    free(d);
+    return (ssize_t)n;
+}
+
+ssize_t sim_recv(int fd, void *buf, size_t len, int flags) {
+    return sim_recvfrom(fd, buf, len, flags, NULL, NULL);
+}
+
+ssize_t sim_recvmsg(int fd, struct msghdr *msg, int flags) {
+    int64_t drops;
+    struct sim_dgram *d = receive_common(fd, flags, &drops);
+    if (!d) return -1;
+    size_t off = 0;
+    for (size_t i = 0; i < msg->msg_iovlen && off < d->len; i++) {
+        size_t n = d->len - off < msg->msg_iov[i].iov_len ? d->len - off : msg->msg_iov[i].iov_len;
+        memcpy(msg->msg_iov[i].iov_base, d->data + off, n);
+        off += n;
+    }
+    fill_from(d, msg->msg_name, &msg->msg_namelen);
+    /* Only the drop count (SO_RXQ_OVFL) is reported; no timestamps or GRO sizes. */
+    if (drops >= 0 && msg->msg_control && msg->msg_controllen >= CMSG_SPACE(sizeof(uint32_t))) {
+        struct cmsghdr *cm = CMSG_FIRSTHDR(msg);
+        uint32_t count = (uint32_t)drops;
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SO_RXQ_OVFL;
+        cm->cmsg_len = CMSG_LEN(sizeof(count));
+        memcpy(CMSG_DATA(cm), &count, sizeof(count));
+        msg->msg_controllen = CMSG_SPACE(sizeof(count));
+    } else {
+        msg->msg_controllen = 0;
+    }
+    msg->msg_flags = off < d->len ? MSG_TRUNC : 0;
+    free(d);
+    return (ssize_t)off;
+}
+
+static uint64_t deadline_after_ms(int timeout_ms) {
+    return timeout_ms < 0 ? SIM_NEVER : now_ns + (uint64_t)timeout_ms * 1000000ULL;
+}
+
+int sim_poll(struct pollfd *fds, nfds_t count, int timeout_ms) {
+    int *watch = malloc((count ? count : 1) * sizeof(int));
+    int watch_count = 0;
+    if (!watch) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    pthread_mutex_lock(&sim_mutex);
+    charge_call();
+    uint64_t deadline = deadline_after_ms(timeout_ms);
+    while (1) {
+        int ready = 0;
+        watch_count = 0;
+        for (nfds_t i = 0; i < count; i++) {
+            struct sim_sock *s = sock_of(fds[i].fd);
+            fds[i].revents = 0;
+            if (!s) continue;
+            if ((fds[i].events & POLLIN) && fd_readable(s)) fds[i].revents |= POLLIN;
+            if ((fds[i].events & POLLOUT) && fd_writable(s)) fds[i].revents |= POLLOUT;
+            if (fds[i].revents) ready++;
+            watch[watch_count++] = fds[i].fd;
+        }
+        if (ready || !self || now_ns >= deadline) {
+            pthread_mutex_unlock(&sim_mutex);
+            free(watch);
+            return ready;
+        }
+        sim_block(watch, watch_count, NULL, 0, deadline);
+    }
+}
+
+int sim_select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, struct timeval *timeout) {
+    int watch[FD_SETSIZE];
+    fd_set want_read, want_write;
+    FD_ZERO(&want_read);
+    FD_ZERO(&want_write);
+    if (readfds) want_read = *readfds;
+    if (writefds) want_write = *writefds;
+    if (exceptfds) FD_ZERO(exceptfds);
+
+    pthread_mutex_lock(&sim_mutex);
+    charge_call();
+    uint64_t deadline = timeout ? now_ns + (uint64_t)timeout->tv_sec * 1000000000ULL + (uint64_t)timeout->tv_usec * 1000ULL
+                                : SIM_NEVER;
+    while (1) {
+        int ready = 0, watch_count = 0;
+        if (readfds) FD_ZERO(readfds);
+        if (writefds) FD_ZERO(writefds);
+        for (int fd = 0; fd < nfds && fd < FD_SETSIZE; fd++) {
+            struct sim_sock *s = sock_of(fd);
+            if (!s) continue;
+            if (FD_ISSET(fd, &want_read)) {
+                if (fd_readable(s)) {
+                    FD_SET(fd, readfds);
+                    ready++;
+                }
+                watch[watch_count++] = fd;
+            }
+            if (FD_ISSET(fd, &want_write) && fd_writable(s)) {
+                FD_SET(fd, writefds);
+                ready++;
+            }
+        }
+        if (ready || !self || now_ns >= deadline) {
+            pthread_mutex_unlock(&sim_mutex);
+            return ready;
+        }
+        sim_block(watch, watch_count, NULL, 0, deadline);
+    }
+}
+
+/* epoll and eventfd, level-triggered only */
+
+int sim_epoll_create1(int flags) {
+    (void)flags;
+    return new_fd(SIM_EPOLL, 0);
+}
+
+int sim_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event) {
+    pthread_mutex_lock(&sim_mutex);
+    struct sim_sock *ep = sock_of(epfd);
+    int r = -1, at = -1;
+    if (ep && ep->type == SIM_EPOLL) {
+        for (int i = 0; i < ep->item_count; i++) {
+            if (ep->items[i].fd == fd) at = i;
+        }
+    }
+    if (!ep || ep->type != SIM_EPOLL) {
+        errno = EBADF;
+    } else if (!sock_of(fd) || fd == epfd) {
+        /* Regular files cannot be watched, as in the kernel. */
+        errno = EPERM;
+    } else if (op == EPOLL_CTL_ADD) {
+        struct sim_epoll_item *items = ep->items;
+        int cap = ep->item_count < ep->item_cap ? ep->item_cap : ep->item_cap * 2 + 8;
+        if (at >= 0) {
+            errno = EEXIST;
+        } else if (cap != ep->item_cap && !(items = realloc(ep->items, (size_t)cap * sizeof(*items)))) {
+            errno = ENOMEM;
+        } else {
+            ep->items = items;
+            ep->item_cap = cap;
+            ep->items[ep->item_count++] = (struct sim_epoll_item){fd, event->events, event->data};
+            r = 0;
+        }
+    } else if (at < 0) {
+        errno = op == EPOLL_CTL_MOD || op == EPOLL_CTL_DEL ? ENOENT : EINVAL;
+    } else if (op == EPOLL_CTL_MOD) {
+        ep->items[at].events = event->events;
+        ep->items[at].data = event->data;
+        r = 0;
+    } else if (op == EPOLL_CTL_DEL) {
+        memmove(&ep->items[at], &ep->items[at + 1], (size_t)(ep->item_count - at - 1) * sizeof(ep->items[0]));
+        ep->item_count--;
+        r = 0;
+    } else {
+        errno = EINVAL;
+    }
+    pthread_mutex_unlock(&sim_mutex);
+    return r;
+}
+
+int sim_epoll_wait(int epfd, struct epoll_event *events, int max, int timeout_ms) {
+    if (max <= 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&sim_mutex);
+    charge_call();
+    uint64_t deadline = deadline_after_ms(timeout_ms);
+    while (1) {
+        struct sim_sock *ep = sock_of(epfd);
+        if (!ep || ep->type != SIM_EPOLL) {
+            pthread_mutex_unlock(&sim_mutex);
+            errno = EBADF;
+            return -1;
+        }
+        int ready = epoll_ready(ep, events, max);
+        if (ready || !self || now_ns >= deadline) {
+            pthread_mutex_unlock(&sim_mutex);
+            return ready;
+        }
+        sim_block(&epfd, 1, NULL, 0, deadline);
+    }
+}
+
+int sim_eventfd(unsigned int count, int flags) {
+    int fd = new_fd(SIM_EVENTFD, (flags & EFD_NONBLOCK) != 0);
+    if (fd < 0) return -1;
+    pthread_mutex_lock(&sim_mutex);
+    socks[fd].count = count;
+    pthread_mutex_unlock(&sim_mutex);
+    return fd;
+}
+
+/* Reads and writes on anything but an eventfd go to the real descriptor. */
+ssize_t sim_read(int fd, void *buf, size_t len) {
+    pthread_mutex_lock(&sim_mutex);
+    struct sim_sock *s = sock_of(fd);
+    if (!s || s->type != SIM_EVENTFD) {
+        pthread_mutex_unlock(&sim_mutex);
+        return read(fd, buf, len);
+    }
+    charge_call();
+    ssize_t r = -1;
+    while (r < 0) {
+        if (!sock_of(fd)) {
+            errno = EBADF;
+            break;
+        }
+        if (len < sizeof(s->count)) {
+            errno = EINVAL;
+            break;
+        }
+        if (s->count) {
+            memcpy(buf, &s->count, sizeof(s->count));
+            s->count = 0;
+            r = sizeof(s->count);
+            break;
+        }
+        if (s->nonblock || !self) {
+            errno = EAGAIN;
+            break;
+        }
+        sim_block(&fd, 1, NULL, 0, SIM_NEVER);
+    }
+    pthread_mutex_unlock(&sim_mutex);
+    return r;
+}
+
+ssize_t sim_write(int fd, const void *buf, size_t len) {
+    pthread_mutex_lock(&sim_mutex);
+    struct sim_sock *s = sock_of(fd);
+    if (!s || s->type != SIM_EVENTFD) {
+        pthread_mutex_unlock(&sim_mutex);
+        return write(fd, buf, len);
+    }
+    charge_call();
+    uint64_t add;
+    ssize_t r = -1;
+    if (len < sizeof(add)) {
+        errno = EINVAL;
+    } else {
+        /* The counter never gets near overflow here, so a write never blocks. */
+        memcpy(&add, buf, sizeof(add));
+        s->count += add;
+        r = sizeof(add);
+    }
+    pthread_mutex_unlock(&sim_mutex);
+    return r;
+}
+
+int sim_close(int fd) {
+    pthread_mutex_lock(&sim_mutex);
+    if (sock_of(fd)) {
+        close_sock(fd);
+        pthread_mutex_unlock(&sim_mutex);
+        return 0;
+    }
+    pthread_mutex_unlock(&sim_mutex);
+    return close(fd);
+}
+
+/* Time */
+
+int sim_clock_gettime(clockid_t clock, struct timespec *ts) {
+    if (!self) return clock_gettime(clock, ts);
+    /* Wall-clock time starts at a fixed date, monotonic time at one second. */
+    uint64_t t = now_ns + (clock == CLOCK_REALTIME ? 1700000000ULL * 1000000000ULL : 1000000000ULL);
+    ts->tv_sec = (time_t)(t / 1000000000ULL);
+    ts->tv_nsec = (long)(t % 1000000000ULL);
+    return 0;
+}
+
+int sim_nanosleep(const struct timespec *req, struct timespec *rem) {
+    if (!self) return nanosleep(req, rem);
+    sim_sleep((uint64_t)req->tv_sec * 1000000000ULL + (uint64_t)req->tv_nsec);
+    if (rem) rem->tv_sec = rem->tv_nsec = 0;
+    return 0;
+}
+
+int sim_usleep(useconds_t us) {
+    if (!self) return usleep(us);
+    sim_sleep((uint64_t)us * 1000ULL);
+    return 0;
+}
+
+/* Fixed, so programs that seed from their pid stay deterministic. */
+pid_t sim_getpid(void) {
+    return self ? 1000 + self->group : getpid();
+}
+
+/* Threads and exit */
+
+int sim_pthread_create(pthread_t *thread, const pthread_attr_t *attr, void *(*fn)(void *), void *arg) {
+    if (!self) return pthread_create(thread, attr, fn, arg);
+
+    struct sim_proc *p = calloc(1, sizeof(*p));
+    if (!p) return ENOMEM;
+    p->fn = fn;
+    p->arg = arg;
+    int id = add_proc(p, self->dir, self->group);
+    if (id < 0) return errno;
+    /* The handle is only good for pthread_detach, which the sim threads already are. */
+    *thread = pthread_self();
+    return 0;
+}
+
+/*
+ * A thread waiting on a condition variable is blocked like any other and
+ * runs again once signalled; it then takes the mutex back for real, which
+ * nobody can be holding while the baton is with it.
+ */
+int sim_pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex) {
+    if (!self) return pthread_cond_wait(cond, mutex);
+    pthread_mutex_lock(&sim_mutex);
+    self->wait_cond = cond;
+    self->signalled = 0;
+    pthread_mutex_unlock(mutex);
+    while (!self->signalled) {
+        sim_block(NULL, 0, NULL, 0, SIM_NEVER);
+    }
+    self->wait_cond = NULL;
+    self->signalled = 0;
+    pthread_mutex_unlock(&sim_mutex);
+    pthread_mutex_lock(mutex);
+    return 0;
+}
+
+static void cond_wake(const pthread_cond_t *cond, int all) {
+    pthread_mutex_lock(&sim_mutex);
+    for (int i = 0; i < proc_count; i++) {
+        struct sim_proc *p = procs[i];
+        if (p->state == PROC_WAITING && p->wait_cond == cond && !p->signalled) {
+            p->signalled = 1;
+            if (!all) break;
+        }
+    }
+    pthread_mutex_unlock(&sim_mutex);
+}
+
+int sim_pthread_cond_signal(pthread_cond_t *cond) {
+    if (!self) return pthread_cond_signal(cond);
+    cond_wake(cond, 0);
+    return 0;
+}
+
+int sim_pthread_cond_broadcast(pthread_cond_t *cond) {
+    if (!self) return pthread_cond_broadcast(cond);
+    cond_wake(cond, 1);
+    return 0;
+}
+
+/* Handlers stay out of the real process; the old action is still reported. */
+int sim_sigaction(int sig, const struct sigaction *act, struct sigaction *old) {
+    if (!self) return sigaction(sig, act, old);
+    return sigaction(sig, NULL, old);
+}
+
+void sim_exit(int status) {
+    if (!self) exit(status);
+    pthread_mutex_lock(&sim_mutex);
+    fflush(NULL);
+    proc_finish(status);
+    pthread_mutex_unlock(&sim_mutex);
+    pthread_exit(NULL);
+}
+
+/* Relative paths land in the calling program's own directory. */
+const char *sim_path(const char *path) {
+    static __thread char buffers[4][4096];
+    static __thread int next;
+    if (!self || !self->dir[0] || path[0] == '/') return path;
+    char *buf = buffers[next];
+    next = (next + 1) % 4;
+    snprintf(buf, sizeof(buffers[0]), "%s/%s", self->dir, path);
+    return buf;
+}
+
+/* mkstemp fills in the caller's template, so the rooted copy is written back. */
+int sim_mkstemp(char *template) {
+    const char *path = sim_path(template);
+    if (path == template) return mkstemp(template);
+    char full[4096];
+    snprintf(full, sizeof(full), "%s", path);
+    int fd = mkstemp(full);
+    size_t len = strlen(template), full_len = strlen(full);
+    if (fd >= 0 && len >= 6) memcpy(template + len - 6, full + full_len - 6, 6);
+    return fd;
+}
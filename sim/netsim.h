@@ -0,0 +1,168 @@
+#ifndef NETSIM_H
+#define NETSIM_H
+
+/*
+ * Deterministic network simulation for the lab programs.
+ *
+ * The programs are compiled unchanged with this header forced in front of
+ * them (gcc -include netsim.h -Dmain=<name>_main), which reroutes their
+ * socket, poll/select/epoll, eventfd, clock, sleep, thread, condition
+ * variable and exit calls to the sim_* functions below and roots their
+ * relative paths in a directory of their own. netsim.c runs all of them in one process on a virtual clock:
+ * every program thread is a real thread, but only one runs at a time, and
+ * when all are blocked the clock jumps to the next datagram delivery or
+ * timeout. A 3-second retransmission timeout therefore costs no wall time,
+ * and the same seed always gives the same run.
+ *
+ * Only UDP is simulated. Stream sockets can be created, bound and listened
+ * on, but never connect or become readable. Mutexes stay real: only one
+ * thread runs at a time, so one is never found locked unless its holder
+ * blocked on something other than a condition variable while holding it,
+ * which none of the programs do. Signal handlers are not installed, so
+ * Ctrl-C still stops the whole run.
+ */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+
+#define SIM_HUNG -1000
+
+/* Network model, applied to every datagram in the order it is sent. */
+struct sim_params {
+    unsigned loss_percent;
+    unsigned dup_percent;
+    unsigned corrupt_percent;
+    uint64_t delay_ns;
+    uint64_t jitter_ns;
+    uint64_t bandwidth_bps;
+    uint64_t call_ns;
+    uint64_t seed;
+};
+
+struct sim_counters {
+    uint64_t datagrams;
+    uint64_t bytes;
+    uint64_t lost;
+    uint64_t duplicated;
+    uint64_t corrupted;
+    uint64_t overflowed;
+    uint64_t unroutable;
+    uint64_t delivered;
+    uint64_t switches;
+};
+
+/* Harness side, called from the process's main thread or from sim threads. */
+void sim_init(const struct sim_params *params);
+int sim_spawn(const char *name, const char *dir, int (*main_fn)(int, char **), int argc, char **argv,
+              uint64_t timeout_ns);
+int sim_spawn_thread(void *(*fn)(void *), void *arg, const char *dir);
+void sim_run(void);
+void sim_stop(void);
+uint64_t sim_now(void);
+int sim_wait_exit(const int *ids, int count, int *status);
+uint16_t sim_proc_port(int id);
+void sim_sleep(uint64_t ns);
+const struct sim_counters *sim_counters(void);
+
+/* Replacements for the calls the programs make. */
+int sim_socket(int domain, int type, int protocol);
+int sim_bind(int fd, const struct sockaddr *addr, socklen_t len);
+int sim_connect(int fd, const struct sockaddr *addr, socklen_t len);
+int sim_listen(int fd, int backlog);
+int sim_accept(int fd, struct sockaddr *addr, socklen_t *len);
+int sim_getsockname(int fd, struct sockaddr *addr, socklen_t *len);
+int sim_setsockopt(int fd, int level, int name, const void *value, socklen_t len);
+int sim_getsockopt(int fd, int level, int name, void *value, socklen_t *len);
+ssize_t sim_sendto(int fd, const void *buf, size_t len, int flags, const struct sockaddr *to, socklen_t to_len);
+ssize_t sim_send(int fd, const void *buf, size_t len, int flags);
+ssize_t sim_sendmsg(int fd, const struct msghdr *msg, int flags);
+int sim_sendmmsg(int fd, struct mmsghdr *msgs, unsigned int count, int flags);
+ssize_t sim_recvfrom(int fd, void *buf, size_t len, int flags, struct sockaddr *from, socklen_t *from_len);
+ssize_t sim_recv(int fd, void *buf, size_t len, int flags);
+ssize_t sim_recvmsg(int fd, struct msghdr *msg, int flags);
+int sim_poll(struct pollfd *fds, nfds_t count, int timeout_ms);
+int sim_select(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, struct timeval *timeout);
+int sim_epoll_create1(int flags);
+int sim_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+int sim_epoll_wait(int epfd, struct epoll_event *events, int max, int timeout_ms);
+int sim_eventfd(unsigned int count, int flags);
+ssize_t sim_read(int fd, void *buf, size_t len);
+ssize_t sim_write(int fd, const void *buf, size_t len);
+int sim_close(int fd);
+int sim_clock_gettime(clockid_t clock, struct timespec *ts);
+int sim_nanosleep(const struct timespec *req, struct timespec *rem);
+int sim_usleep(useconds_t us);
+pid_t sim_getpid(void);
+int sim_pthread_create(pthread_t *thread, const pthread_attr_t *attr, void *(*fn)(void *), void *arg);
+int sim_pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
+int sim_pthread_cond_signal(pthread_cond_t *cond);
+int sim_pthread_cond_broadcast(pthread_cond_t *cond);
+int sim_sigaction(int sig, const struct sigaction *act, struct sigaction *old);
+void sim_exit(int status) __attribute__((noreturn));
+const char *sim_path(const char *path);
+int sim_mkstemp(char *template);
+
+#ifndef NETSIM_IMPL
+#define socket(...) sim_socket(__VA_ARGS__)
+#define bind(...) sim_bind(__VA_ARGS__)
+#define connect(...) sim_connect(__VA_ARGS__)
+#define listen(...) sim_listen(__VA_ARGS__)
+#define accept(...) sim_accept(__VA_ARGS__)
+#define getsockname(...) sim_getsockname(__VA_ARGS__)
+#define setsockopt(...) sim_setsockopt(__VA_ARGS__)
+#define getsockopt(...) sim_getsockopt(__VA_ARGS__)
+#define sendto(...) sim_sendto(__VA_ARGS__)
+#define send(...) sim_send(__VA_ARGS__)
+#define sendmsg(...) sim_sendmsg(__VA_ARGS__)
+#define sendmmsg(...) sim_sendmmsg(__VA_ARGS__)
+#define recvfrom(...) sim_recvfrom(__VA_ARGS__)
+#define recv(...) sim_recv(__VA_ARGS__)
+#define recvmsg(...) sim_recvmsg(__VA_ARGS__)
+#define poll(...) sim_poll(__VA_ARGS__)
+#define select(...) sim_select(__VA_ARGS__)
+#define epoll_create1(...) sim_epoll_create1(__VA_ARGS__)
+#define epoll_ctl(...) sim_epoll_ctl(__VA_ARGS__)
+#define epoll_wait(...) sim_epoll_wait(__VA_ARGS__)
+#define eventfd(...) sim_eventfd(__VA_ARGS__)
+#define read(...) sim_read(__VA_ARGS__)
+#define write(...) sim_write(__VA_ARGS__)
+#define close(...) sim_close(__VA_ARGS__)
+#define clock_gettime(...) sim_clock_gettime(__VA_ARGS__)
+#define nanosleep(...) sim_nanosleep(__VA_ARGS__)
+#define usleep(...) sim_usleep(__VA_ARGS__)
+#define getpid() sim_getpid()
+#define pthread_create(...) sim_pthread_create(__VA_ARGS__)
+#define pthread_cond_wait(...) sim_pthread_cond_wait(__VA_ARGS__)
+#define pthread_cond_signal(...) sim_pthread_cond_signal(__VA_ARGS__)
+#define pthread_cond_broadcast(...) sim_pthread_cond_broadcast(__VA_ARGS__)
+#define sigaction(...) sim_sigaction(__VA_ARGS__)
+#define exit(...) sim_exit(__VA_ARGS__)
+
+#define fopen(path, mode) fopen(sim_path(path), mode)
+#define open(path, ...) open(sim_path(path), __VA_ARGS__)
+#define rename(from, to) rename(sim_path(from), sim_path(to))
+#define access(path, mode) access(sim_path(path), mode)
+#define mkdir(path, mode) mkdir(sim_path(path), mode)
+#define unlink(path) unlink(sim_path(path))
+#define stat(path, buf) stat(sim_path(path), buf)
+#define mkstemp(template) sim_mkstemp(template)
+#endif
+
+#endif
@@ -0,0 +1,456 @@
+#include "netsim.h"
+
+#include <errno.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "../lab2/tcp_log.h"
+
+/*
+ * Runs many file transfers between the unmodified lab programs over the
+ * simulated network and checks that every file arrived intact.
+ *
+ * Build (from this directory):
+ *   gcc -O2 -pthread -c -include netsim.h -Dmain=lab2_server_main ../lab2/server.c -o lab2_server.o
+ *   gcc -O2 -pthread -c -include netsim.h -Dmain=udp_client_main ../lab2/clients/udp_client.c -o udp_client.o
+ *   gcc -O2 -pthread -c -include netsim.h -Dmain=lab1_server_main ../lab1/server.c -o lab1_server.o
+ *   gcc -O2 -pthread -c -include netsim.h -Dmain=lab1_client_main ../lab1/client/client.c -o lab1_client.o
+ *   gcc -O2 -pthread -c -include netsim.h -Dmain=tftpd_main ../rgr/tftpd.c -o tftpd.o
+ *   gcc -O2 -pthread -c -include netsim.h -Dmain=tftp_main ../rgr/tftp.c -o tftp.o
+ *   gcc -O2 -pthread simrun.c netsim.c lab2_server.o udp_client.o lab1_server.o lab1_client.o tftpd.o tftp.o -o simrun
+ *
+ * Every program instance runs in the same process, so parallel clients
+ * share the client's file-scope counters; only the totals they print are
+ * affected. The TFTP client keeps its settings and disk thread in globals,
+ * so it is started once and moves all the files itself with mput or mget.
+ */
+
+int lab2_server_main(int argc, char **argv);
+int udp_client_main(int argc, char **argv);
+int lab1_server_main(int argc, char **argv);
+int lab1_client_main(int argc, char **argv);
+int tftpd_main(int argc, char **argv);
+int tftp_main(int argc, char **argv);
+
+#define MAX_PARALLEL 1024
+#define MAX_CLIENT_ARGS 32
+
+enum program { PROGRAM_LAB2, PROGRAM_LAB1, PROGRAM_TFTP };
+
+struct run_config {
+    int program;
+    int get;
+    int transfers;
+    int parallel;
+    size_t size;
+    uint64_t seed;
+    uint64_t timeout_ns;
+    int keep;
+    int client_argc;
+    char **client_argv;
+    char dir[64];
+    int server;
+};
+
+struct run_result {
+    int ok;
+    int failed;
+    int corrupt;
+    int hung;
+};
+
+static struct run_config cfg;
+static struct run_result result;
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-p lab1|lab2|tftp] [-g] [-n transfers] [-c parallel] [-s size] [-l loss%%] [-u dup%%] "
+                    "[-x corrupt%%] [-d delay_us] [-j jitter_us] [-b mbit] [-S seed] [-T timeout_s] [-v] [-k] "
+                    "[-- client options]\n"
+                    "  -p  which server and client to run (default lab2)\n"
+                    "  -g  download: files start on the server and the client fetches them (lab2, tftp)\n"
+                    "  -n  number of transfers (default 100)\n"
+                    "  -c  transfers running at the same time (default 8)\n"
+                    "  -s  file size in bytes; sizes vary down to half of it (default 65536, lab1 2048)\n"
+                    "  -l/-u/-x  percent of datagrams lost, duplicated, corrupted\n"
+                    "  -d/-j  one-way delay and random extra delay (reorders datagrams)\n"
+                    "  -b  link rate per socket in Mbit/s (default unlimited)\n"
+                    "  -T  virtual seconds before a client counts as hung (default 3600; tftp: the one client)\n"
+                    "  -v  show the programs' output, -k keep the files\n"
+                    "Example: %s -n 1000 -l 5 -j 200 -- -n -f rs:8+2\n", prog, prog);
+    exit(1);
+}
+
+static uint64_t xorshift(uint64_t *s) {
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+static int write_source(const char *path, size_t size, uint64_t seed) {
+    FILE *f = fopen(path, "wb");
+    if (!f) return -1;
+    uint64_t s = seed | 1;
+    unsigned char buf[4096];
+    for (size_t done = 0; done < size;) {
+        size_t n = size - done < sizeof(buf) ? size - done : sizeof(buf);
+        for (size_t i = 0; i < n; i++) {
+            buf[i] = (unsigned char)xorshift(&s);
+        }
+        if (fwrite(buf, 1, n, f) != n) {
+            fclose(f);
+            return -1;
+        }
+        done += n;
+    }
+    return fclose(f);
+}
+
+static int same_content(const char *a, const char *b) {
+    FILE *fa = fopen(a, "rb");
+    FILE *fb = fopen(b, "rb");
+    int same = fa && fb;
+    unsigned char ba[4096], bb[4096];
+    while (same) {
+        size_t na = fread(ba, 1, sizeof(ba), fa);
+        size_t nb = fread(bb, 1, sizeof(bb), fb);
+        if (na != nb || memcmp(ba, bb, na) != 0) same = 0;
+        if (na < sizeof(ba)) break;
+    }
+    if (fa) fclose(fa);
+    if (fb) fclose(fb);
+    return same;
+}
+
+struct transfer {
+    int index;
+    char name[32];
+    char port[8];
+    char *argv[MAX_CLIENT_ARGS + 8];
+};
+
+/* The file starts on the client, or on the server for a download. */
+static const char *source_dir(void) {
+    return cfg.get ? "srv" : "cli";
+}
+
+static const char *target_dir(void) {
+    return cfg.get ? "cli" : "srv";
+}
+
+static int prepare_file(struct transfer *t, int index) {
+    char path[128];
+    t->index = index;
+    snprintf(t->name, sizeof(t->name), "f%d.bin", index);
+    snprintf(path, sizeof(path), "%s/%s/%s", cfg.dir, source_dir(), t->name);
+
+    size_t size = cfg.size - (size_t)index * 7919 % (cfg.size / 2 + 1);
+    if (write_source(path, size, cfg.seed * 1000003 + (uint64_t)index) < 0) {
+        perror(path);
+        result.failed++;
+        return -1;
+    }
+    return 0;
+}
+
+static int start_transfer(struct transfer *t, int index, uint16_t port) {
+    if (prepare_file(t, index) < 0) return -1;
+    snprintf(t->port, sizeof(t->port), "%u", port);
+
+    int argc = 0;
+    t->argv[argc++] = cfg.program == PROGRAM_LAB1 ? "client" : "udp_client";
+    if (cfg.get) t->argv[argc++] = "-g";
+    for (int i = 0; i < cfg.client_argc; i++) {
+        t->argv[argc++] = cfg.client_argv[i];
+    }
+    t->argv[argc++] = "127.0.0.1";
+    t->argv[argc++] = t->port;
+    t->argv[argc++] = t->name;
+    t->argv[argc] = NULL;
+
+    char dir[128];
+    snprintf(dir, sizeof(dir), "%s/cli", cfg.dir);
+    int id = sim_spawn(t->argv[0], dir, cfg.program == PROGRAM_LAB1 ? lab1_client_main : udp_client_main, argc,
+                       t->argv, cfg.timeout_ns);
+    if (id < 0) result.failed++;
+    return id;
+}
+
+static void finish_transfer(const struct transfer *t, int status) {
+    char sent[128], received[128];
+    snprintf(sent, sizeof(sent), "%s/%s/%s", cfg.dir, source_dir(), t->name);
+    snprintf(received, sizeof(received), "%s/%s/%s", cfg.dir, target_dir(), t->name);
+
+    if (status == SIM_HUNG) {
+        result.hung++;
+    } else if (status != 0) {
+        result.failed++;
+    } else if (!same_content(sent, received)) {
+        result.corrupt++;
+    } else {
+        result.ok++;
+    }
+    if (!cfg.keep) {
+        unlink(sent);
+        unlink(received);
+    }
+}
+
+/*
+ * TFTP: one client with every file on its command line, cfg.parallel at a
+ * time. Its exit status covers the whole batch, so a file that arrived
+ * intact counts as ok whatever the status says.
+ */
+static void run_tftp_batch(void) {
+    struct transfer *ts = calloc((size_t)cfg.transfers, sizeof(*ts));
+    char **argv = calloc((size_t)(cfg.client_argc + cfg.transfers + 8), sizeof(*argv));
+    char parallel[16], dir[128];
+    int argc = 0, count = 0;
+    if (!ts || !argv) {
+        perror("calloc");
+        result.failed = cfg.transfers;
+        free(ts);
+        free(argv);
+        return;
+    }
+
+    snprintf(parallel, sizeof(parallel), "%d", cfg.parallel);
+    argv[argc++] = "tftp";
+    argv[argc++] = "-q";
+    argv[argc++] = "-j";
+    argv[argc++] = parallel;
+    for (int i = 0; i < cfg.client_argc; i++) {
+        argv[argc++] = cfg.client_argv[i];
+    }
+    argv[argc++] = "127.0.0.1";
+    argv[argc++] = cfg.get ? "mget" : "mput";
+    for (int i = 0; i < cfg.transfers; i++) {
+        if (prepare_file(&ts[count], i) == 0) argv[argc++] = ts[count++].name;
+    }
+    argv[argc] = NULL;
+
+    snprintf(dir, sizeof(dir), "%s/cli", cfg.dir);
+    int status = SIM_HUNG;
+    int id = sim_spawn(argv[0], dir, tftp_main, argc, argv, cfg.timeout_ns);
+    if (id < 0) {
+        result.failed += count;
+        count = 0;
+    } else {
+        sim_wait_exit(&id, 1, &status);
+    }
+    for (int i = 0; i < count; i++) {
+        char sent[128], received[128];
+        snprintf(sent, sizeof(sent), "%s/%s/%s", cfg.dir, source_dir(), ts[i].name);
+        snprintf(received, sizeof(received), "%s/%s/%s", cfg.dir, target_dir(), ts[i].name);
+        finish_transfer(&ts[i], same_content(sent, received) ? 0 : status);
+    }
+    free(ts);
+    free(argv);
+}
+
+/* Runs as a simulated thread: keeps cfg.parallel clients going until all transfers are done. */
+static void *driver(void *arg) {
+    (void)arg;
+    static struct transfer transfers[MAX_PARALLEL];
+    struct transfer *slots[MAX_PARALLEL];
+    int ids[MAX_PARALLEL];
+
+    /* Let the server bind its socket. */
+    sim_sleep(1000000);
+    uint16_t port = sim_proc_port(cfg.server);
+    if (port == 0) {
+        fprintf(stderr, "Server did not start\n");
+        result.failed = cfg.transfers;
+        sim_stop();
+        return NULL;
+    }
+    if (cfg.program == PROGRAM_TFTP) {
+        run_tftp_batch();
+        sim_stop();
+        return NULL;
+    }
+
+    int started = 0, running = 0;
+    while (started < cfg.transfers && running < cfg.parallel) {
+        slots[running] = &transfers[running];
+        ids[running] = start_transfer(slots[running], started++, port);
+        if (ids[running] < 0) break;
+        running++;
+    }
+    while (running > 0) {
+        int status;
+        int slot = sim_wait_exit(ids, running, &status);
+        finish_transfer(slots[slot], status);
+
+        if (started < cfg.transfers && (ids[slot] = start_transfer(slots[slot], started++, port)) >= 0) {
+            continue;
+        }
+        running--;
+        ids[slot] = ids[running];
+        slots[slot] = slots[running];
+    }
+    result.failed += cfg.transfers - started;
+    sim_stop();
+    return NULL;
+}
+
+static unsigned parse_percent(const char *s, const char *prog) {
+    char *end;
+    unsigned long v = strtoul(s, &end, 10);
+    if (*end || v > 100) usage(prog);
+    return (unsigned)v;
+}
+
+int main(int argc, char **argv) {
+    struct sim_params params = {0};
+    int verbose = 0;
+    int opt;
+
+    cfg.transfers = 100;
+    cfg.parallel = 8;
+    cfg.seed = 1;
+    cfg.timeout_ns = 3600ULL * 1000000000ULL;
+    params.call_ns = 1000;
+
+    while ((opt = getopt(argc, argv, "p:gn:c:s:l:u:x:d:j:b:S:T:vk")) != -1) {
+        switch (opt) {
+        case 'p':
+            if (strcmp(optarg, "lab1") == 0) {
+                cfg.program = PROGRAM_LAB1;
+            } else if (strcmp(optarg, "tftp") == 0) {
+                cfg.program = PROGRAM_TFTP;
+            } else if (strcmp(optarg, "lab2") != 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'g':
+            cfg.get = 1;
+            break;
+        case 'n':
+            cfg.transfers = atoi(optarg);
+            if (cfg.transfers < 1) usage(argv[0]);
+            break;
+        case 'c':
+            cfg.parallel = atoi(optarg);
+            if (cfg.parallel < 1 || cfg.parallel > MAX_PARALLEL) usage(argv[0]);
+            break;
+        case 's':
+            cfg.size = strtoul(optarg, NULL, 10);
+            if (cfg.size == 0) usage(argv[0]);
+            break;
+        case 'l':
+            params.loss_percent = parse_percent(optarg, argv[0]);
+            break;
+        case 'u':
+            params.dup_percent = parse_percent(optarg, argv[0]);
+            break;
+        case 'x':
+            params.corrupt_percent = parse_percent(optarg, argv[0]);
+            break;
+        case 'd':
+            params.delay_ns = strtoull(optarg, NULL, 10) * 1000;
+            break;
+        case 'j':
+            params.jitter_ns = strtoull(optarg, NULL, 10) * 1000;
+            break;
+        case 'b':
+            params.bandwidth_bps = strtoull(optarg, NULL, 10) * 1000000;
+            break;
+        case 'S':
+            cfg.seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'T':
+            cfg.timeout_ns = strtoull(optarg, NULL, 10) * 1000000000ULL;
+            if (cfg.timeout_ns == 0) usage(argv[0]);
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 'k':
+            cfg.keep = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind > MAX_CLIENT_ARGS || (cfg.get && cfg.program == PROGRAM_LAB1)) usage(argv[0]);
+    cfg.client_argc = argc - optind;
+    cfg.client_argv = argv + optind;
+    if (cfg.size == 0) cfg.size = cfg.program == PROGRAM_LAB1 ? 2048 : 65536;
+    params.seed = cfg.seed;
+
+    snprintf(cfg.dir, sizeof(cfg.dir), "/tmp/simrun.XXXXXX");
+    char srv[96], cli[96];
+    if (!mkdtemp(cfg.dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    snprintf(srv, sizeof(srv), "%s/srv", cfg.dir);
+    snprintf(cli, sizeof(cli), "%s/cli", cfg.dir);
+    if (mkdir(srv, 0755) < 0 || mkdir(cli, 0755) < 0) {
+        perror("mkdir");
+        return 1;
+    }
+
+    /* The programs print a line per packet; the report goes to the real stdout. */
+    FILE *report = fdopen(dup(STDOUT_FILENO), "w");
+    if (!report) {
+        perror("fdopen");
+        return 1;
+    }
+    if (!verbose) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd < 0 || dup2(null_fd, STDOUT_FILENO) < 0 || dup2(null_fd, STDERR_FILENO) < 0) {
+            perror("/dev/null");
+            return 1;
+        }
+        close(null_fd);
+    }
+
+    static char *lab2_argv[] = {"server", "-v", "off", "127.0.0.1", "[]", NULL};
+    static char *lab1_argv[] = {"server", "127.0.0.1", "[]", NULL};
+    /* The TFTP client always talks to port 69, which is free in the simulated network. */
+    static char *tftpd_argv[] = {"tftpd", "-q", NULL};
+    sim_init(&params);
+    if (cfg.program == PROGRAM_LAB1) {
+        cfg.server = sim_spawn("server", srv, lab1_server_main, 3, lab1_argv, 0);
+    } else if (cfg.program == PROGRAM_TFTP) {
+        cfg.server = sim_spawn("tftpd", srv, tftpd_main, 2, tftpd_argv, 0);
+    } else {
+        cfg.server = sim_spawn("server", srv, lab2_server_main, 5, lab2_argv, 0);
+    }
+    if (cfg.server < 0 || sim_spawn_thread(driver, NULL, "") < 0) {
+        perror("sim_spawn");
+        return 1;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    sim_run();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fflush(stdout);
+
+    double wall = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    const struct sim_counters *c = sim_counters();
+    int done = result.ok + result.failed + result.corrupt + result.hung;
+    fprintf(report, "Transfers: %d ok, %d failed, %d corrupt, %d hung\n", result.ok, result.failed, result.corrupt,
+            result.hung);
+    fprintf(report, "Virtual time: %.3f s, wall time %.3f s (%.1f transfers/s)\n", (double)sim_now() / 1e9, wall,
+            wall > 0 ? done / wall : 0.0);
+    fprintf(report, "Datagrams: %llu sent (%llu bytes), %llu lost, %llu duplicated, %llu corrupted, "
+                    "%llu overflowed, %llu unroutable, %llu delivered\n",
+            (unsigned long long)c->datagrams, (unsigned long long)c->bytes, (unsigned long long)c->lost,
+            (unsigned long long)c->duplicated, (unsigned long long)c->corrupted, (unsigned long long)c->overflowed,
+            (unsigned long long)c->unroutable, (unsigned long long)c->delivered);
+    fprintf(report, "Context switches: %llu\n", (unsigned long long)c->switches);
+
+    /* Files of failed transfers stay behind for a look. */
+    char path[128];
+    snprintf(path, sizeof(path), "%s/%s", srv, TCP_LOG_FILE);
+    if (cfg.keep || (unlink(path) < 0 && errno != ENOENT) || rmdir(srv) < 0 || rmdir(cli) < 0 || rmdir(cfg.dir) < 0) {
+        fprintf(report, "Files kept in %s\n", cfg.dir);
+    }
+    fclose(report);
+    /* The server never returns; its threads go down with the process. */
+    _exit(result.ok == cfg.transfers ? 0 : 1);
+}